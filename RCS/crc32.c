@@ -0,0 +1,68 @@
+/*
+ * crc32.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * RCS that works out a CRC32 (IEEE 802.3) over a range of memory,
+ * so flash can be checked without sending its contents back over
+ * the serial line.
+ *
+ * Request  - opcode, address (4, big endian, kseg1), length (4, big endian)
+ * Response - CRC32 (4, big endian)
+ */
+
+#include <infra/error.h>
+
+static unsigned int crcTable[256];
+static int          crcTableReady;
+
+static void buildCrcTable(void)
+{
+    unsigned int crc;
+    int          i;
+    int          bit;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+        }
+        crcTable[i] = crc;
+    }
+    crcTableReady = 1;
+}
+
+int rcs( int *argc, char *argv ) __attribute__((section (".text.start")));
+int rcs( int *argc, char *argv ) {
+    unsigned char       *args = (unsigned char *)argv;
+    const unsigned char *data;
+    unsigned int         length;
+    unsigned int         crc;
+
+    if ((*argc) != 9) {
+        *argc = 0;
+        return -ERR_INVAL;
+    }
+
+    if (!crcTableReady) {
+        buildCrcTable();
+    }
+
+    data   = (const unsigned char *)((args[1] << 24) | (args[2] << 16) | (args[3] << 8) | args[4]);
+    length = (args[5] << 24) | (args[6] << 16) | (args[7] << 8) | args[8];
+
+    crc = 0xFFFFFFFF;
+    while (length--) {
+        crc = crcTable[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    crc = ~crc;
+
+    args[0] = (crc >> 24) & 0xFF;
+    args[1] = (crc >> 16) & 0xFF;
+    args[2] = (crc >> 8) & 0xFF;
+    args[3] = crc & 0xFF;
+    *argc = 4;
+
+    return ERR_NO;
+}
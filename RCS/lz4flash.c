@@ -0,0 +1,145 @@
+/*
+ * lz4flash.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * RCS that takes an LZ4 compressed block, decompresses it into RAM
+ * and programs it into flash, so only the compressed data crosses
+ * the serial line.
+ *
+ * Request  - opcode, address (4, big endian, kseg1), raw length (2),
+ *            format (1, 0 = stored, 1 = LZ4 block), data
+ * Response - none
+ */
+
+#include <infra/error.h>
+
+#define BLOCK_MAX      4096
+#define FORMAT_STORED  0
+#define FORMAT_LZ4     1
+
+/*
+ * Supplied by the USIP flash driver when the RCS is linked
+ */
+extern int flash_write(unsigned int address, const unsigned char *data, unsigned int length);
+
+static unsigned char block[BLOCK_MAX];
+
+/*
+ * lz4Decompress
+ *
+ * decompress an LZ4 block, refusing anything that would read or
+ * write outside the buffers. Returns the decompressed length or -1
+ */
+static int lz4Decompress(const unsigned char *src, int srcLen, unsigned char *dest, int destLen)
+{
+    const unsigned char *ip = src;
+    const unsigned char *ipEnd = src + srcLen;
+    unsigned char       *op = dest;
+    unsigned char       *opEnd = dest + destLen;
+    const unsigned char *match;
+    unsigned int         token;
+    unsigned int         length;
+    unsigned int         offset;
+
+    while (ip < ipEnd) {
+        token = *ip++;
+
+        length = token >> 4;
+        if (length == 15) {
+            do {
+                if (ip >= ipEnd) {
+                    return -1;
+                }
+                length += *ip;
+            } while (*ip++ == 255);
+        }
+        if ((length > (unsigned int)(ipEnd - ip)) || (length > (unsigned int)(opEnd - op))) {
+            return -1;
+        }
+        while (length--) {
+            *op++ = *ip++;
+        }
+
+        /* the last sequence has no match */
+        if (ip == ipEnd) {
+            break;
+        }
+
+        if (ipEnd - ip < 2) {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > (unsigned int)(op - dest))) {
+            return -1;
+        }
+
+        length = token & 0xF;
+        if (length == 15) {
+            do {
+                if (ip >= ipEnd) {
+                    return -1;
+                }
+                length += *ip;
+            } while (*ip++ == 255);
+        }
+        length += 4;
+        if (length > (unsigned int)(opEnd - op)) {
+            return -1;
+        }
+
+        /* byte at a time, matches can overlap their own output */
+        match = op - offset;
+        while (length--) {
+            *op++ = *match++;
+        }
+    }
+
+    return op - dest;
+}
+
+int rcs( int *argc, char *argv ) __attribute__((section (".text.start")));
+int rcs( int *argc, char *argv ) {
+    unsigned char *args = (unsigned char *)argv;
+    unsigned int   address;
+    int            rawLength;
+    int            dataLength;
+    int            result;
+
+    /* opcode, address, length and format before any data */
+    dataLength = (*argc) - 8;
+    *argc = 0;
+    if (dataLength < 0) {
+        return -ERR_INVAL;
+    }
+
+    address   = (args[1] << 24) | (args[2] << 16) | (args[3] << 8) | args[4];
+    rawLength = (args[5] << 8) | args[6];
+
+    if ((rawLength == 0) || (rawLength > BLOCK_MAX)) {
+        return -ERR_INVAL;
+    }
+
+    switch (args[7]) {
+    case FORMAT_STORED:
+        if (dataLength != rawLength) {
+            return -ERR_INVAL;
+        }
+        result = flash_write(address, args + 8, rawLength);
+        break;
+
+    case FORMAT_LZ4:
+        if (lz4Decompress(args + 8, dataLength, block, rawLength) != rawLength) {
+            return -ERR_INVAL;
+        }
+        result = flash_write(address, block, rawLength);
+        break;
+
+    default:
+        return -ERR_INVAL;
+    }
+
+    return (result == 0) ? ERR_NO : -ERR_INVAL;
+}
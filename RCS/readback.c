@@ -0,0 +1,45 @@
+/*
+ * readback.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * RCS that copies a range of memory into its response, so flash can
+ * be read back to the host. The response goes back in the command
+ * buffer, so length is held to READBACK_MAX, which is no more than the
+ * compressed chunks the unit is already sent there.
+ *
+ * Request  - opcode, address (4, big endian, kseg1), length (2, big endian)
+ * Response - length bytes of memory
+ */
+
+#include <infra/error.h>
+
+#define READBACK_MAX 4096   // matches RCS_CHUNK_SIZE on the host
+
+int rcs( int *argc, char *argv ) __attribute__((section (".text.start")));
+int rcs( int *argc, char *argv ) {
+    unsigned char       *args = (unsigned char *)argv;
+    const unsigned char *data;
+    int                  length;
+    int                  i;
+
+    if ((*argc) != 7) {
+        *argc = 0;
+        return -ERR_INVAL;
+    }
+
+    data   = (const unsigned char *)((args[1] << 24) | (args[2] << 16) | (args[3] << 8) | args[4]);
+    length = (args[5] << 8) | args[6];
+    if (length > READBACK_MAX) {
+        *argc = 0;
+        return -ERR_INVAL;
+    }
+
+    for (i = 0; i < length; i++) {
+        args[i] = data[i];
+    }
+    *argc = length;
+
+    return ERR_NO;
+}
@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <signal.h>
 
 #include "shunt.h"
 #include "utils.h"
@@ -16,8 +17,74 @@
 #include "transportLayer.h"
 #include "sessionLayer.h"
 #include "commandLayer.h"
+#include "compress.h"
+#include "rcsLoader.h"
+#include "imageFormat.h"
+#include "flashPlan.h"
+#include "journal.h"
+#include "sealedStream.h"
+#include "telemetry.h"
+#include "provisionLog.h"
+#include "provisionIndex.h"
 #include "appLayer.h"
 
+#define SECTOR_REWRITES   2
+#define LINK_RECOVERIES   3   // per run
+#define RECONNECT_TRIES   5   // per recovery
+#define RECONNECT_PAUSE   1   // seconds between tries
+
+#define BATCH_POLL        1   // seconds between looks for a board
+#define BATCH_GONE_PINGS  3   // missed pings before a board counts as removed
+
+#define RCS_FORMAT_STORED 0
+#define RCS_FORMAT_LZ4    1
+#define READBACK_SIZE     RCS_CHUNK_SIZE  // the readback RCS answers in the unit's command buffer
+
+// a readback response (session header, data, error code and RMAC) has to fit one transport frame
+#if (4 + READBACK_SIZE + 4 + 16) > 0xFFFF
+#error READBACK_SIZE is more than a transport frame can carry
+#endif
+
+/*
+ * State for one plan being run against one device
+ */
+typedef struct _flashJob
+{
+    serialSession*  serialPort;
+    uint8_t*        key;
+    sessionDetails* details;
+    flashOptions*   options;
+    flashPlan*      plan;
+    uint8_t*        flash;      // plan->image.flash
+    bool            hashTried;  // loading the hashing RCS has been tried this session
+    bool            hashUsable; // and it loaded
+    uint32_t        wireBytes;
+    flashJournal    journal;
+    sealedStream    stream;     // the plan's writes already sealed for this unit, if there are
+    uint8_t         recoveries;
+    double          recoveryTime;
+} flashJob;
+
+/*
+ * A range to CRC on a helper thread
+ */
+typedef struct _hashRequest
+{
+    uint8_t* data;
+    uint32_t length;
+    uint32_t crc;
+} hashRequest;
+
+/*
+ * envProtection
+ *
+ * the session protection the caller asked for (shunt -A, shuntUseProtection)
+ */
+static uint8_t envProtection(void)
+{
+    return currentEnv() ? currentEnv()->protection : PROTECTION_CLEAR_UNSIGNED;
+}
+
 /*
  * rawEraseSectors
  *
@@ -25,245 +92,1347 @@
  */
 static ERRORCODE rawEraseSectors(sessionDetails* details, uint8_t startSect, uint8_t endSect, bool override)
 {
+    ERRORCODE       retCode;
+    struct timespec mark;
+
+    output("Erasing sector - ");
+    while (startSect <= endSect)
+    {
+        output(" %d", startSect);
+        telemetryMark(&mark);
+        retCode = eraseFlash(details, startSect, override);
+        telemetryEvent("erase", "\"sector\":%u,\"ms\":%.1f,\"code\":%d", startSect, telemetrySince(&mark), retCode);
+        if (retCode != SUCCESS)
+        {
+            output("\nFAILED erasing sector %d\n", startSect);
+        }
+        startSect++;
+    }
+    output("\nComplete\n");
+
+    return retCode;
+}
+
+/*
+ * eraseSectors
+ *
+ * start a session and erase sectors
+ */
+ERRORCODE eraseSectors (serialSession* serialPort, uint8_t* key, uint8_t startSect, uint8_t endSect, bool override)
+{
+    ERRORCODE       retCode;
+    sessionDetails* details;
+
+    if ((startSect > 35) || (endSect > 35) || (startSect > endSect))
+    {
+        output("Bad sector encountered - %d %d\n", startSect, endSect);
+        return ERR_BAD_SECTOR;
+    }
+
+    retCode = startSessionLayer(serialPort, key, envProtection(), &details);
+    if (retCode == SUCCESS)
+    {
+
+        retCode = rawEraseSectors(details, startSect, endSect, override);
+        endSession(details);
+    }
+    else
+    {
+        output("Session start fail\n");
+    }
+
+    return retCode;
+}
+
+/*
+ * hashThread
+ *
+ * work out the host CRC of a range while the USIP works out its own
+ */
+static void* hashThread(hashRequest* request)
+{
+    request->crc = generateCrc32(0, request->data, request->length);
+    return NULL;
+}
+
+/*
+ * checkHash
+ *
+ * ask the hashing RCS for the CRC32 of a range of flash and compare it
+ * with the CRC of what should be there, calculated alongside
+ *
+ * Returns SUCCESS on a match, ERR_VERIFY on a mismatch
+ */
+static ERRORCODE checkHash(sessionDetails* details, uint32_t address, uint8_t* data, uint32_t length)
+{
+    hashRequest host;
+    pthread_t   thread;
+    bool        threaded;
+    uint8_t     command[8];
+    uint8_t*    resp = NULL;
+    uint16_t    respLen;
+    uint32_t    crc;
+    ERRORCODE   retCode;
+
+    host.data   = data;
+    host.length = length;
+    threaded = (pthread_create(&thread, NULL, (pthreadFunc)hashThread, &host) == 0);
+    if (threaded == false)
+    {
+        hashThread(&host);
+    }
+
+    address += FLASH_BASE_ADDRESS;
+
+    command[0] = (address >> 24) & 0xFF;
+    command[1] = (address >> 16) & 0xFF;
+    command[2] = (address >> 8) & 0xFF;
+    command[3] = address & 0xFF;
+    command[4] = (length >> 24) & 0xFF;
+    command[5] = (length >> 16) & 0xFF;
+    command[6] = (length >> 8) & 0xFF;
+    command[7] = length & 0xFF;
+
+    retCode = callCustomProcedure(details, COMMAND_RCS_CRC32, command, 8, &resp, &respLen, &idempotentPolicy);
+
+    if (threaded == true)
+    {
+        pthread_join(thread, NULL);
+    }
+
+    if (retCode == SUCCESS)
+    {
+        if ((resp == NULL) || (respLen != 4))
+        {
+            debug("Bad hash response\n");
+            retCode = ERR_COMMAND_LENGTH;
+        }
+        else
+        {
+            crc = (resp[0] << 24) | (resp[1] << 16) | (resp[2] << 8) | resp[3];
+            debug("CRC of 0x%x, length %u - USIP 0x%8.8x, image 0x%8.8x\n", address, length, crc, host.crc);
+            if (crc != host.crc)
+            {
+                retCode = ERR_VERIFY;
+            }
+        }
+    }
+    if (resp)
+    {
+        free(resp);
+    }
+
+    return retCode;
+}
+
+/*
+ * hashReady
+ *
+ * load the hashing RCS for checkHash, the first time it's wanted in a
+ * session. Whether it could be is remembered until the session changes.
+ */
+static bool hashReady(flashJob* job)
+{
+    if (job->hashTried == false)
+    {
+        job->hashTried = true;
+        job->hashUsable = (loadProcedures(job->details, &rcsCrc32, 1) == SUCCESS);
+        if (job->hashUsable == false)
+        {
+            output("Failed to load hashing RCS %s, flash can't be checked by CRC\n", rcsCrc32.file);
+        }
+    }
+
+    return job->hashUsable;
+}
+
+/*
+ * sectorUnchanged
+ *
+ * check whether a sector already holds its part of the image, with
+ * everything else in it erased, by the CRC of the whole sector. Any
+ * failure - the hashing RCS not loading included - counts as 'changed',
+ * so the worst case is a normal full flash of the sector.
+ */
+static bool sectorUnchanged(flashJob* job, planSector* sector)
+{
+    bool unchanged;
+
+    unchanged = hashReady(job) &&
+                (checkHash(job->details, sector->address, job->flash + sector->address, sector->size) == SUCCESS);
+
+    debug("Sector %u %s\n", sector->sector, unchanged ? "unchanged" : "changed");
+
+    return unchanged;
+}
+
+/*
+ * writeCompressed
+ *
+ * compress a block and hand it to the decompressing RCS to program.
+ * Blocks that don't shrink are sent stored. The call programs flash, so
+ * it's never sent twice; if its reply goes missing nobody knows whether
+ * the block went in, and that comes back as ERR_VERIFY for the sector to
+ * be started again from its erase.
+ */
+static ERRORCODE writeCompressed(flashJob* job, uint32_t address, uint8_t* data, uint16_t length)
+{
+    uint8_t   command[7 + LZ4_COMPRESS_BOUND(RCS_CHUNK_SIZE)];
+    uint32_t  compressedLength;
+    uint8_t*  resp = NULL;
+    uint16_t  respLen;
+    ERRORCODE retCode;
+
+    address += FLASH_BASE_ADDRESS;
+
+    command[0] = (address >> 24) & 0xFF;
+    command[1] = (address >> 16) & 0xFF;
+    command[2] = (address >> 8) & 0xFF;
+    command[3] = address & 0xFF;
+    command[4] = (length >> 8) & 0xFF;
+    command[5] = length & 0xFF;
+
+    retCode = lz4CompressBlock(data, length, command + 7, sizeof(command) - 7, &compressedLength);
+    if ((retCode != SUCCESS) || (compressedLength >= length))
+    {
+        command[6] = RCS_FORMAT_STORED;
+        memcpy(command + 7, data, length);
+        compressedLength = length;
+    }
+    else
+    {
+        command[6] = RCS_FORMAT_LZ4;
+    }
+
+    debug("Sending compressed block with address 0x%x, length %u, compressed %u\n", address, length, compressedLength);
+
+    retCode = callCustomProcedure(job->details, COMMAND_RCS_LZ4, command, 7 + compressedLength, &resp, &respLen, &onceOnlyPolicy);
+    if (resp)
+    {
+        free(resp);
+    }
+    job->wireBytes += compressedLength;
+
+    if ((retCode == ERR_SERIAL_TIMEOUT) || (retCode == ERR_VALIDATION))
+    {
+        debug("No usable reply to the compressed block at 0x%x, it may or may not be in\n", address);
+        retCode = ERR_VERIFY;
+    }
+
+    return retCode;
+}
+
+/*
+ * prepareWrite
+ *
+ * build one of the plan's writes, ready to send
+ */
+static ERRORCODE prepareWrite(flashJob* job, uint32_t index, packetBuffer* command)
+{
+    planWrite* write = &(job->plan->writes[index]);
+
+    return prepareWriteFlash(job->details, write->address + FLASH_BASE_ADDRESS, job->flash + write->address, write->length,
+                             job->plan->frameChecksums ? job->plan->frameChecksums + (index * FRAME_CHECKSUMS_SIZE) : NULL,
+                             sealedWrite(&(job->stream), index), command);
+}
+
+/*
+ * writeSector
+ *
+ * erase a sector and write the part of the image that lands in it.
+ * With resumeFrom set, the sector is taken as already erased with that
+ * many of its writes in place, and writing carries on after them.
+ */
+static ERRORCODE writeSector(flashJob* job, planSector* sector, uint32_t resumeFrom)
+{
+    planWrite*      write;
+    uint8_t*        data;
+    packetBuffer    commands[2];  // the write being sent and the next, by index
+    bool            prepared = false;
+    uint32_t        sectorIndex;
+    uint32_t        index;
+    uint32_t        endIndex;
+    uint32_t        sent;
+    struct timespec mark;
+    ERRORCODE       retCode = SUCCESS;
+
+    sectorIndex = sector - job->plan->sectors;
+    endIndex = sector->firstWrite + sector->writeCount;
+
+    if (resumeFrom == 0)
+    {
+        telemetryMark(&mark);
+        retCode = eraseFlash(job->details, sector->sector, job->options->override);
+        telemetryEvent("erase", "\"sector\":%u,\"ms\":%.1f,\"code\":%d", sector->sector, telemetrySince(&mark), retCode);
+        if (retCode != SUCCESS)
+        {
+            output("\nFAILED erasing sector %d\n", sector->sector);
+            return retCode;
+        }
+        journalErased(&(job->journal), sectorIndex);
+    }
+
+    for (index = sector->firstWrite + resumeFrom; index < endIndex; index++)
+    {
+        write = &(job->plan->writes[index]);
+        data = job->flash + write->address;
+        sent = job->wireBytes;
+        telemetryMark(&mark);
+
+        if (job->plan->compressed == true)
+        {
+            retCode = writeCompressed(job, write->address, data, write->length);
+        }
+        else
+        {
+            debug("Sending writeflash command with address 0x%x, length %u\n", write->address + FLASH_BASE_ADDRESS, write->length);
+            hexDebug(data, write->length);
+
+            retCode = prepared ? SUCCESS : prepareWrite(job, index, &(commands[index & 1]));
+
+            // on a protected session, the next write is encrypted while this one is on the wire
+            prepared = false;
+            if ((retCode == SUCCESS) && (index + 1 < endIndex))
+            {
+                prepared = (prepareWrite(job, index + 1, &(commands[(index + 1) & 1])) == SUCCESS);
+            }
+
+            if (retCode == SUCCESS)
+            {
+                retCode = sendWriteFlash(job->details, &(commands[index & 1]));
+            }
+            job->wireBytes += write->length;
+        }
+        telemetryEvent("write", "\"address\":%u,\"length\":%u,\"sent\":%u,\"ms\":%.1f,\"code\":%d",
+                       write->address, write->length, job->wireBytes - sent, telemetrySince(&mark), retCode);
+        if (retCode == ERR_VERIFY)
+        {
+            // what's in the sector isn't known any more, so nothing in it can be resumed from
+            journalErased(&(job->journal), sectorIndex);
+            break;
+        }
+        if (retCode != SUCCESS)
+        {
+            output("!\n**Failed to write section 0x%x**\n", write->address);
+            break;
+        }
+        journalAcked(&(job->journal), sectorIndex, index - sector->firstWrite + 1);
+    }
+
+    if (prepared)
+    {
+        dropWriteFlash(job->details, &(commands[(index + 1) & 1]));
+    }
+
+    return retCode;
+}
+
+/*
+ * verifyRange
+ *
+ * send part of the image back through verifyFlash
+ */
+static ERRORCODE verifyRange(flashJob* job, uint32_t address, uint32_t endAddr)
+{
+    uint16_t  length;
+    uint8_t*  data;
     ERRORCODE retCode;
 
-    printf("Erasing sector - ");
-    while (startSect <= endSect)
-    {
-        printf(" %d", startSect);
-        fflush(stdout);
-        retCode = eraseFlash(details, startSect, override);
-        if (retCode != SUCCESS)
+    while (address < endAddr)
+    {
+        if (endAddr - address > CHUNK_SIZE)
+        {
+            length = CHUNK_SIZE;
+        }
+        else
+        {
+            length = endAddr - address;
+        }
+        data = job->flash + address;
+
+        retCode = verifyFlash(job->details, address + FLASH_BASE_ADDRESS, data, length);
+        if (retCode != SUCCESS)
+        {
+            debug("Verify of 0x%x, length %u failed - %d\n", address, length, retCode);
+            return (retCode == ERR_COMMAND_INVAL) ? ERR_VERIFY : retCode;
+        }
+        address += length;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * checkImageRange
+ *
+ * check a range of flash holds the image - by CRC, one short round trip,
+ * when the hashing RCS is loaded, otherwise by sending the data back
+ * through verifyFlash
+ *
+ * Returns ERR_VERIFY if it doesn't
+ */
+static ERRORCODE checkImageRange(flashJob* job, uint32_t address, uint32_t length)
+{
+    if (hashReady(job))
+    {
+        return checkHash(job->details, address, job->flash + address, length);
+    }
+
+    return verifyRange(job, address, address + length);
+}
+
+/*
+ * verifySector
+ *
+ * check a freshly written sector
+ *
+ * Returns ERR_VERIFY if the sector doesn't hold the image
+ */
+static ERRORCODE verifySector(flashJob* job, planSector* sector)
+{
+    return checkImageRange(job, sector->dataStart, sector->dataEnd - sector->dataStart);
+}
+
+/*
+ * programSector
+ *
+ * write a sector, and if asked verify it straight away. A sector that
+ * fails to verify, or that a write of left in an unknown state, is erased
+ * and written again, up to SECTOR_REWRITES times.
+ * resumeFrom is passed to the first writeSector only; rewrites start over.
+ */
+static ERRORCODE programSector(flashJob* job, planSector* sector, uint32_t resumeFrom)
+{
+    ERRORCODE retCode;
+    uint8_t   rewrites = 0;
+
+    while (1)
+    {
+        retCode = writeSector(job, sector, resumeFrom);
+        resumeFrom = 0;
+        if ((retCode == SUCCESS) && (job->options->verifySectors == true))
+        {
+            retCode = verifySector(job, sector);
+        }
+        if ((retCode != ERR_VERIFY) || (rewrites++ >= SECTOR_REWRITES))
+        {
+            break;
+        }
+
+        output("!");
+        debug("Sector %u doesn't hold the image, rewriting\n", sector->sector);
+    }
+
+    if (retCode == ERR_VERIFY)
+    {
+        output("\n**Sector %u still wrong after %u rewrites**\n", sector->sector, SECTOR_REWRITES);
+    }
+    else if (retCode == SUCCESS)
+    {
+        journalDone(&(job->journal), sector - job->plan->sectors);
+    }
+
+    return retCode;
+}
+
+/*
+ * resumePoint
+ *
+ * work out how many of a part-written sector's writes can be kept. The
+ * ones the journal says were acknowledged are checked as a block;
+ * if that doesn't match the sector is done again from its erase.
+ */
+static uint32_t resumePoint(flashJob* job, planSector* sector)
+{
+    planWrite* lastWrite;
+    uint32_t   acked;
+    uint32_t   start;
+
+    acked = job->journal.ackedWrites;
+    if ((acked == 0) || (acked > sector->writeCount))
+    {
+        return 0;
+    }
+
+    start = job->plan->writes[sector->firstWrite].address;
+    lastWrite = &(job->plan->writes[sector->firstWrite + acked - 1]);
+    if (checkImageRange(job, start, lastWrite->address + lastWrite->length - start) != SUCCESS)
+    {
+        debug("Sector %u partial writes don't match, starting it again\n", sector->sector);
+        return 0;
+    }
+
+    debug("Sector %u resuming after %u of %u writes\n", sector->sector, acked, sector->writeCount);
+    return acked;
+}
+
+/*
+ * linkLost
+ *
+ * whether an error means the USIP stopped talking to us, rather than
+ * refusing or failing something
+ */
+static bool linkLost(ERRORCODE retCode)
+{
+    return ((retCode == ERR_LINK_DOWN) || (retCode == ERR_SERIAL_TIMEOUT) || (retCode == ERR_SERIAL_NO_DATA) ||
+            (retCode == ERR_SERIAL_READ) || (retCode == ERR_SERIAL_WRITE) || (retCode == ERR_TRANSPORT_SEND));
+}
+
+/*
+ * recoverLink
+ *
+ * drop a dead session and build a new one - transport connect, hello and
+ * challenge - on the same port, a few times if need be. The device must
+ * answer with the USN it had before. The decompressor is loaded again in
+ * case the USIP was reset and lost it.
+ */
+static ERRORCODE recoverLink(flashJob* job)
+{
+    sessionDetails* details = NULL;
+    struct timespec startTime;
+    struct timespec endTime;
+    uint8_t         usn[16];
+    uint8_t         tries;
+    ERRORCODE       retCode = ERR_LINK_DOWN;
+
+    if (job->recoveries >= LINK_RECOVERIES)
+    {
+        output("\nLink lost, out of recovery attempts\n");
+        return ERR_LINK_DOWN;
+    }
+    job->recoveries++;
+
+    output("\nLink lost, reconnecting ");
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    telemetryEvent("link_lost", "\"recovery\":%u", job->recoveries);
+
+    memcpy(usn, getSessionUsn(job->details), 16);
+    endSession(job->details);
+    job->details = NULL;
+    job->hashTried = false;
+
+    for (tries = 0; tries < RECONNECT_TRIES; tries++)
+    {
+        if (tries > 0)
+        {
+            sleep(RECONNECT_PAUSE);
+        }
+        output(".");
+
+        retCode = startSessionLayer(job->serialPort, job->key, envProtection(), &details);
+        if (retCode != SUCCESS)
+        {
+            debug("Reconnect attempt %u failed - %d\n", tries + 1, retCode);
+            continue;
+        }
+
+        if (memcmp(usn, getSessionUsn(details), 16) != 0)
+        {
+            output(" a different device answered\n");
+            endSession(details);
+            return ERR_NO_DEVICE;
+        }
+
+        if (job->plan->compressed == true)
+        {
+            retCode = loadProcedures(details, &rcsLz4, 1);
+            if (retCode != SUCCESS)
+            {
+                debug("Reloading decompressor failed - %d\n", retCode);
+                endSession(details);
+                continue;
+            }
+        }
+        break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    job->recoveryTime += (endTime.tv_sec - startTime.tv_sec) + ((endTime.tv_nsec - startTime.tv_nsec) / 1e9);
+    telemetryEvent("reconnect", "\"tries\":%u,\"ms\":%.1f,\"code\":%d", tries + (tries < RECONNECT_TRIES), telemetrySince(&startTime), retCode);
+
+    if (retCode != SUCCESS)
+    {
+        output(" FAILED\n");
+        return retCode;
+    }
+
+    output(" OK\n");
+    job->details = details;
+    return SUCCESS;
+}
+
+/*
+ * knownSectors
+ *
+ * look the unit up in the provisioning history and work out which of the
+ * plan's sectors it already holds, as a mask of plan sector indexes. If
+ * some have to be written, they're taken out of the unit's entry first,
+ * so a run that dies part way can't leave them looking done.
+ */
+static uint64_t knownSectors(flashJob* job, unitHistory* history)
+{
+    planSector* sector;
+    uint64_t    known = 0;
+    uint64_t    all;
+    uint64_t    stale = 0;
+    uint32_t    index;
+
+    if (findUnitHistory(job->options->history, getSessionUsn(job->details), history) != SUCCESS)
+    {
+        memset(history, 0, sizeof(unitHistory));
+        return 0;
+    }
+
+    for (index = 0; index < job->plan->sectorCount; index++)
+    {
+        sector = &(job->plan->sectors[index]);
+        if ((history->sectorMask & (1ULL << sector->sector)) && (history->sectorCrc[sector->sector] == sector->crc))
+        {
+            known |= (1ULL << index);
+        }
+        else
+        {
+            stale |= (1ULL << sector->sector);
+        }
+    }
+
+    all = (job->plan->sectorCount < 64) ? (1ULL << job->plan->sectorCount) - 1 : ~0ULL;
+    if (known == all)
+    {
+        output("Unit already holds this image\n");
+    }
+    else if (stale & history->sectorMask)
+    {
+        history->sectorMask &= ~stale;
+        storeUnitHistory(job->options->history, getSessionUsn(job->details), history);
+    }
+
+    debug("Provisioning history - %u of %u sectors already hold the image\n", __builtin_popcountll(known), job->plan->sectorCount);
+
+    return known;
+}
+
+/*
+ * recordHistory
+ *
+ * note in the provisioning history that the unit now holds the plan
+ */
+static void recordHistory(flashJob* job, unitHistory* history)
+{
+    planSector* sector;
+    uint32_t    index;
+
+    memcpy(history->imageHash, job->plan->hash, 32);
+    history->time = time(NULL);
+    for (index = 0; index < job->plan->sectorCount; index++)
+    {
+        sector = &(job->plan->sectors[index]);
+        history->sectorMask |= (1ULL << sector->sector);
+        history->sectorCrc[sector->sector] = sector->crc;
+    }
+
+    if (storeUnitHistory(job->options->history, getSessionUsn(job->details), history) != SUCCESS)
+    {
+        output("Unable to update the provisioning history\n");
+    }
+}
+
+/*
+ * runFlashPlan
+ *
+ * flash a device according to a plan. The plan isn't changed, so the
+ * same one can be run against any number of devices.
+ *
+ * With options->differential set, sectors whose CRC, from the hashing RCS,
+ * already matches the image are left alone and only the changed ones are
+ * erased and written.
+ * With options->verifySectors set, each sector is verified as soon as it
+ * is written and rewritten if it doesn't match.
+ * If the plan was made with options->compressed set, the image is sent
+ * LZ4 compressed to an RCS that decompresses and programs it on the USIP.
+ *
+ * Progress is kept in a journal named for the device's USN. If a run for
+ * the same plan was interrupted, sectors it finished are skipped and the
+ * one it was part way through carries on from its last acknowledged write.
+ * The same goes within a run: if the link drops, the session is rebuilt
+ * and the sector being written carries on from its last acknowledged write.
+ *
+ * With options->history set, sectors the provisioning history says the unit
+ * already holds are skipped without asking the unit, and the history is
+ * updated once the image is in.
+ *
+ * With options->sealedDir set, a protected session takes its writes ready
+ * sealed from the stream writeSealedStreams left there for the unit.
+ *
+ * If report isn't NULL it is filled in with the unit data and how the run went.
+ */
+ERRORCODE runFlashPlan (serialSession* serialPort, uint8_t* key, flashPlan* plan, flashOptions* options, flashReport* report)
+{
+    flashJob        job;
+    struct timespec startTime;
+    struct timespec endTime;
+    struct timespec sectorTime;
+    double          elapsed;
+    uint32_t        bytesDone;
+    uint32_t        bytesTotal;
+    uint32_t        percent;
+    uint32_t        lastpercent;
+    uint32_t        index;
+    uint32_t        resumeFrom;
+    uint8_t         skipped;
+    uint8_t         resumed;
+    uint8_t         known;
+    uint64_t        knownMask = 0;
+    unitHistory     history;
+    bool            written = false;
+    ERRORCODE       retCode;
+
+    memset(&job, 0, sizeof(job));
+    job.serialPort = serialPort;
+    job.key = key;
+    job.journal.fd = -1;
+    job.options = options;
+    job.plan = plan;
+    job.flash = plan->image.flash;
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    retCode = startSessionLayer(serialPort, key, envProtection(), &(job.details));
+    if (retCode == SUCCESS)
+    {
+        if (report)
+        {
+            report->identified = true;
+            memcpy(&(report->hello), getSessionHello(job.details), sizeof(struct helloResp));
+        }
+
+        if (plan->compressed == true)
+        {
+            retCode = loadProcedures(job.details, &rcsLz4, 1);
+            if (retCode != SUCCESS)
+            {
+                output("Failed to load decompressor RCS %s\n", rcsLz4.file);
+            }
+        }
+
+        lastpercent = 0;
+        skipped = 0;
+        resumed = 0;
+        known = 0;
+        bytesDone = 0;
+        bytesTotal = 0;
+        for (index = 0; index < plan->sectorCount; index++)
+        {
+            bytesTotal += plan->sectors[index].dataEnd - plan->sectors[index].dataStart;
+        }
+        if (retCode == SUCCESS)
+        {
+            if (openJournal(&(job.journal), getSessionUsn(job.details), plan->hash) != SUCCESS)
+            {
+                output("Continuing without a resume journal\n");
+            }
+            else if ((job.journal.doneSectors != 0) || (job.journal.partialSector != -1))
+            {
+                output("Resuming an interrupted flash of this image\n");
+            }
+            if (options->history)
+            {
+                knownMask = knownSectors(&job, &history);
+            }
+            if ((options->differential == true) && (hashReady(&job) == false))
+            {
+                output("\n*** Differential flashing needs the hashing RCS %s, which couldn't be loaded ***\n"
+                       "*** Nothing can be compared - every sector will be erased and written ***\n\n", rcsCrc32.file);
+                telemetryEvent("differential_fallback", "\"rcs\":\"%s\"", rcsCrc32.file);
+            }
+            if (options->sealedDir && !plan->compressed && sessionProtected(job.details) &&
+                (openSealedStream(plan, options->sealedDir, job.details, &(job.stream)) != SUCCESS))
+            {
+                output("No sealed stream for this unit, sealing as it goes\n");
+            }
+            output("Flashing image -\n");
+            output("0%%.....................50%%.....................100%%\n");
+        }
+        for (index = 0; (index < plan->sectorCount) && (retCode == SUCCESS); index++)
+        {
+            resumeFrom = 0;
+            telemetryMark(&sectorTime);
+            if (knownMask & (1ULL << index))
+            {
+                known++;
+                telemetryEvent("sector", "\"sector\":%u,\"state\":\"known\"", plan->sectors[index].sector);
+            }
+            else if (job.journal.doneSectors & (1ULL << index))
+            {
+                resumed++;
+                telemetryEvent("sector", "\"sector\":%u,\"state\":\"resumed\"", plan->sectors[index].sector);
+            }
+            else if ((options->differential == true) && sectorUnchanged(&job, &(plan->sectors[index])))
+            {
+                skipped++;
+                telemetryEvent("sector", "\"sector\":%u,\"state\":\"unchanged\",\"ms\":%.1f", plan->sectors[index].sector, telemetrySince(&sectorTime));
+            }
+            else
+            {
+                if (job.journal.partialSector == (int32_t)index)
+                {
+                    resumeFrom = resumePoint(&job, &(plan->sectors[index]));
+                }
+                retCode = programSector(&job, &(plan->sectors[index]), resumeFrom);
+                while (linkLost(retCode) && (recoverLink(&job) == SUCCESS))
+                {
+                    resumeFrom = 0;
+                    if (job.journal.partialSector == (int32_t)index)
+                    {
+                        resumeFrom = resumePoint(&job, &(plan->sectors[index]));
+                    }
+                    retCode = programSector(&job, &(plan->sectors[index]), resumeFrom);
+                }
+                telemetryEvent("sector", "\"sector\":%u,\"state\":\"written\",\"ms\":%.1f,\"code\":%d",
+                               plan->sectors[index].sector, telemetrySince(&sectorTime), retCode);
+                if (retCode != SUCCESS)
+                {
+                    break;
+                }
+            }
+            bytesDone += plan->sectors[index].dataEnd - plan->sectors[index].dataStart;
+            telemetryProgress(&startTime, bytesDone, bytesTotal);
+            shuntProgress(bytesDone, bytesTotal);
+
+            percent = ((index + 1) * 100) / plan->sectorCount;
+            while (percent > lastpercent + 1)
+            {
+                lastpercent += 2;
+                output("#");
+            }
+        }
+        if (retCode == SUCCESS)
+        {
+            written = true;
+            output("#\n");
+            if (known > 0)
+            {
+                output("%u of %u sectors already flashed, from the provisioning history\n", known, plan->sectorCount);
+            }
+            if (resumed > 0)
+            {
+                output("%u of %u sectors already written by an earlier run\n", resumed, plan->sectorCount);
+            }
+            if ((options->differential == true) && (job.hashUsable == true))
+            {
+                output("%u of %u sectors unchanged\n", skipped, plan->sectorCount);
+            }
+            else if (options->differential == true)
+            {
+                output("Differential flashing fell back to a full flash, no sectors could be compared\n");
+            }
+            if (options->history)
+            {
+                recordHistory(&job, &history);
+            }
+        }
+        // once every sector is written there's nothing left to resume
+        closeJournal(&(job.journal), written);
+        closeSealedStream(&(job.stream));
+        if (job.details)
         {
-            printf("\nFAILED erasing sector %d\n", startSect);
+            endSession(job.details);
         }
-        startSect++;
+
+        clock_gettime(CLOCK_MONOTONIC, &endTime);
+        elapsed = (endTime.tv_sec - startTime.tv_sec) + ((endTime.tv_nsec - startTime.tv_nsec) / 1e9);
+        output("Sent %u bytes of image data in %.2f s (%.0f bytes/s)\n", job.wireBytes, elapsed, (elapsed > 0) ? job.wireBytes / elapsed : 0);
+        if (job.recoveries > 0)
+        {
+            output("Link dropped %u times, %.2f s spent reconnecting\n", job.recoveries, job.recoveryTime);
+        }
+        if (report)
+        {
+            report->seconds    = elapsed;
+            report->wireBytes  = job.wireBytes;
+            report->recoveries = job.recoveries;
+        }
+    }
+    else
+    {
+        output("Session start failure\n");
     }
-    printf("\nComplete\n");
 
     return retCode;
 }
 
 /*
- * eraseSectors
+ * flashProgram
  *
- * start a session and erase sectors
+ * flash a program from a raw (bin), Intel HEX, S-record or ELF file, or
+ * a plan saved by saveFlashPlan. Only sectors the image has data in are
+ * erased and written.
  */
-ERRORCODE eraseSectors (serialSession* serialPort, uint8_t* key, uint8_t startSect, uint8_t endSect, bool override)
+ERRORCODE flashProgram (serialSession* serialPort, uint8_t* key, char* imageFile, flashOptions* options)
 {
-    ERRORCODE       retCode;
-    sessionDetails* details;
+    flashPlan plan;
+    ERRORCODE retCode;
 
-    if ((startSect > 35) || (endSect > 35) || (startSect > endSect))
+    retCode = buildFlashPlan(imageFile, options, &plan);
+    if (retCode != SUCCESS)
     {
-        printf("Bad sector encountered - %d %d\n", startSect, endSect);
-        return ERR_BAD_SECTOR;
+        return retCode;
     }
 
-    retCode = startSessionLayer(serialPort, key, &details);
-    if (retCode == SUCCESS)
+    if (options->dryrun == true)
     {
-
-        retCode = rawEraseSectors(details, startSect, endSect, override);
-        endSession(details);
+        output("DryRun - Would %s %u sectors, %u writes in %u segments\n", options->differential ? "compare, erase and flash changed" : "erase and flash",
+               plan.sectorCount, plan.writeCount, plan.image.segmentCount);
     }
     else
     {
-        printf("Session start fail\n");
+        retCode = runFlashPlan(serialPort, key, &plan, options, NULL);
     }
 
+    freeFlashPlan(&plan);
+
     return retCode;
 }
 
+static volatile sig_atomic_t batchStopping = 0;
+
 /*
- * Map of sector number to size in K
+ * stopBatch
+ *
+ * Ctrl-C lets the board on the fixture finish; a second one stops at once
  */
-uint8_t sectorMap[] = {
-                          32, 32, 32, 32,  4,  4,  4,  4,
-                           4,  4,  4,  4,  4,  4,  4,  4,
-                           4,  4,  4,  4,  4,  4,  4,  4,
-                           4,  4,  4,  4,  4,  4,  4,  4,
-                           4,  4,  4,  4
-                      };
+static void stopBatch(int signum)
+{
+    batchStopping = 1;
+    signal(signum, SIG_DFL);
+}
 
-static uint32_t calcOffsetAddress(uint8_t startSect)
+/*
+ * waitForBoard
+ *
+ * poll the fixture until a USIP answers a transport connect, opening the
+ * port again whenever it went away (boards with their own USB serial)
+ */
+static ERRORCODE waitForBoard(char* device, serialSession** serialPort)
 {
-    uint32_t offset = 0;
+    transportConnection con;
+    ERRORCODE           retCode;
 
-    while (startSect)
+    while (batchStopping == 0)
     {
-        offset += sectorMap[startSect] * 1024;
-        startSect--;
+        if (*serialPort == NULL)
+        {
+            if ((serialPresent(device) == false) || (serialInit(device, serialPort) != SUCCESS))
+            {
+                *serialPort = NULL;
+                sleep(BATCH_POLL);
+                continue;
+            }
+        }
+
+        retCode = connectTransportLayer(*serialPort, &con);
+        if (retCode == SUCCESS)
+        {
+            disconnectTransportLayer(&con);
+            return SUCCESS;
+        }
+        if ((retCode == ERR_SERIAL_READ) || (retCode == ERR_SERIAL_WRITE))
+        {
+            destroySession(*serialPort);
+            *serialPort = NULL;
+        }
+        sleep(BATCH_POLL);
     }
-    return offset;
+
+    return ERR_AGAIN;
 }
 
-static uint8_t findSectorForAddr(uint32_t addr)
+/*
+ * waitForRemoval
+ *
+ * ping the board just done until it stops answering, so it isn't taken
+ * for the next one. The port is closed afterwards either way.
+ */
+static void waitForRemoval(char* device, serialSession** serialPort)
 {
-    uint32_t offset = 0;
-    uint8_t  sectorNum = 0;
+    transportConnection con;
+    uint8_t             missed = 0;
+    bool                connected;
 
-    while ((offset < addr) && (sectorNum < 36))
+    connected = (connectTransportLayer(*serialPort, &con) == SUCCESS);
+
+    while (connected && (missed < BATCH_GONE_PINGS) && (batchStopping == 0))
     {
-        offset += sectorMap[sectorNum] * 1024;
-        if (addr < offset)
+        if (serialPresent(device) == false)
         {
             break;
         }
-        sectorNum++;
+        missed = (transportLayerPing(&con) == SUCCESS) ? 0 : missed + 1;
+        sleep(BATCH_POLL);
+    }
+
+    if (connected && (missed == 0))
+    {
+        disconnectTransportLayer(&con);
     }
-    return sectorNum;
+    destroySession(*serialPort);
+    *serialPort = NULL;
 }
 
 /*
- * flashProgram
- *
- * flash a program from a raw (bin) file
+ * batchFlash
  *
- * This function is WAY too long
+ * production line loop - wait for a board, flash it with the plan built
+ * once up front, log what happened against its USN, wait for it to be
+ * taken away and go round again until Ctrl-C
  */
-ERRORCODE flashProgram (serialSession* serialPort, uint8_t* key, uint8_t offsetSect, char* imageFile, bool override, bool dryrun)
+ERRORCODE batchFlash (char* device, uint8_t* key, char* imageFile, char* logFile, flashOptions* options)
 {
-    struct stat     imageInfo;
-    int             sysRet;
-    int             imageStream;
-    off_t           imageSize;
-    uint64_t        imageCompare;
-    uint32_t        percent;
-    uint32_t        lastpercent;
-    uint32_t        offsetAddr;
-    uint32_t        endAddr;
-    uint32_t        totalFlashSize;
-    uint32_t        availableSize;
-    ssize_t         readLength;
-    uint8_t         buffer[CHUNK_SIZE];
-    uint16_t        length;
-    uint8_t         endSector;
+    flashPlan       plan;
+    flashReport     report;
+    provisionRecord record;
+    serialSession*  serialPort = NULL;
+    struct timespec waitStart;
+    uint32_t        boards = 0;
+    uint32_t        failures = 0;
     ERRORCODE       retCode;
-    sessionDetails* details;
 
-    sysRet = stat(imageFile, &imageInfo);
+    retCode = buildFlashPlan(imageFile, options, &plan);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    batchStopping = 0;
+    signal(SIGINT, stopBatch);
+    output("Batch flashing %s, logging to %s. Ctrl-C to stop after the current board\n", imageFile, logFile);
+
+    while (batchStopping == 0)
+    {
+        output("Waiting for a board on %s ...\n", device);
+        telemetryMark(&waitStart);
+        if (waitForBoard(device, &serialPort) != SUCCESS)
+        {
+            break;
+        }
+
+        memset(&report, 0, sizeof(report));
+        memset(&record, 0, sizeof(record));
+        record.waitSeconds = telemetrySince(&waitStart) / 1000;
+
+        record.result = runFlashPlan(serialPort, key, &plan, options, &report);
+
+        record.time = time(NULL);
+        record.identified = report.identified;
+        memcpy(&(record.hello), &(report.hello), sizeof(struct helloResp));
+        memcpy(record.imageHash, plan.hash, 32);
+        record.flashSeconds = report.seconds;
+        telemetryEvent("board", "\"result\":%d,\"wait\":%.1f,\"flash\":%.2f", record.result, record.waitSeconds, record.flashSeconds);
+
+        boards++;
+        if (record.result == SUCCESS)
+        {
+            output("Board %u PASSED\n", boards);
+        }
+        else
+        {
+            failures++;
+            output("Board %u FAILED, code %d\n", boards, record.result);
+        }
+
+        retCode = appendProvisionRecord(logFile, &record);
+        if (retCode != SUCCESS)
+        {
+            output("Stopping, the log can't be written\n");
+            break;
+        }
+
+        output("Remove the board\n");
+        waitForRemoval(device, &serialPort);
+    }
 
-    if (sysRet != 0)
+    signal(SIGINT, SIG_DFL);
+    if (serialPort)
     {
-        printf("Error getting image file details %d\n", errno);
-        return ERR_STAT;
+        destroySession(serialPort);
     }
+    freeFlashPlan(&plan);
 
-    imageSize = imageInfo.st_size;
-    offsetAddr = calcOffsetAddress(offsetSect);
-    totalFlashSize = 0x40000;
-    if (override == false)
+    output("%u boards, %u failed\n", boards, failures);
+
+    return retCode;
+}
+
+/*
+ * writeFlashPlan
+ *
+ * work out the plan for an image and save it, to be flashed later with -f
+ */
+ERRORCODE writeFlashPlan (char* imageFile, char* planFile, flashOptions* options)
+{
+    flashPlan plan;
+    ERRORCODE retCode;
+
+    retCode = buildFlashPlan(imageFile, options, &plan);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    retCode = saveFlashPlan(&plan, planFile);
+    if (retCode == SUCCESS)
+    {
+        output("Saved plan - %u sectors, %u writes in %u segments\n", plan.sectorCount, plan.writeCount, plan.image.segmentCount);
+    }
+    freeFlashPlan(&plan);
+
+    return retCode;
+}
+
+/*
+ * writeSealedStreams
+ *
+ * seal an image's writes for every unit in a key file, ahead of flashing
+ * them with options->sealedDir pointing at the same place
+ */
+ERRORCODE writeSealedStreams (char* imageFile, char* keyFile, flashOptions* options)
+{
+    flashPlan plan;
+    ERRORCODE retCode;
+
+    if (!options->sealedDir)
     {
-        totalFlashSize -= 4 * 1024;
+        return ERR_VALIDATION;
     }
-    availableSize = totalFlashSize - calcOffsetAddress(offsetSect);
-    endAddr = offsetAddr + imageSize - 1;
-    endSector = findSectorForAddr(endAddr);
-    imageCompare = imageSize;
 
-    debug("imageSize - %lld, offsetSect %u, offsetAddr %u, availableSize %u, endAddress %u, endSector %u\n", imageSize, offsetSect, offsetAddr, availableSize, endAddr, endSector);
+    retCode = buildFlashPlan(imageFile, options, &plan);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
 
-    if (endSector > 35)
+    if (plan.compressed)
+    {
+        output("Compressed images are sealed on the fly, not ahead\n");
+        retCode = ERR_VALIDATION;
+    }
+    else
     {
-        printf("Image goes beyond sector 35! End sector - %u\n", endSector);
-        return ERR_TOO_BIG;
+        retCode = prepareSealedStreams(&plan, keyFile, options->sealedDir);
     }
+    freeFlashPlan(&plan);
+
+    return retCode;
+}
+
+/*
+ * verifyImage
+ *
+ * check an image against flash without writing anything, using the
+ * hashing RCS. Only the CRC comes back over the serial line.
+ */
+ERRORCODE verifyImage (serialSession* serialPort, uint8_t* key, char* imageFile, flashOptions* options)
+{
+    flashPlan       plan;
+    sessionDetails* details;
+    struct timespec startTime;
+    struct timespec endTime;
+    uint32_t        index;
+    uint32_t        address;
+    ERRORCODE       retCode;
 
-    if ((endSector > 34) && (override == false))
+    retCode = buildFlashPlan(imageFile, options, &plan);
+    if (retCode != SUCCESS)
     {
-        printf("Refusing to set sector 35\n");
-        return ERR_TOO_BIG;
+        return retCode;
     }
 
-    if (imageSize > availableSize)
+    retCode = startSessionLayer(serialPort, key, envProtection(), &details);
+    if (retCode == SUCCESS)
+    {
+        retCode = loadProcedures(details, &rcsCrc32, 1);
+        if (retCode == SUCCESS)
+        {
+            output("Verifying image - ");
+            clock_gettime(CLOCK_MONOTONIC, &startTime);
+            for (index = 0; (index < plan.image.segmentCount) && (retCode == SUCCESS); index++)
+            {
+                address = plan.image.segments[index].address;
+                retCode = checkHash(details, address, plan.image.flash + address, plan.image.segments[index].length);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &endTime);
+            output("%s (%.3f s)\n", (retCode == SUCCESS) ? "OK" : "FAILED",
+                   (endTime.tv_sec - startTime.tv_sec) + ((endTime.tv_nsec - startTime.tv_nsec) / 1e9));
+        }
+        else
+        {
+            output("Failed to load hashing RCS %s\n", rcsCrc32.file);
+        }
+        endSession(details);
+    }
+    else
     {
-        printf("Image too big for available space. Image size - %lld, available - %u\n", imageSize, availableSize);
-        return ERR_TOO_BIG;
+        output("Session start failure\n");
     }
 
-    if (dryrun == true)
+    freeFlashPlan(&plan);
+
+    return retCode;
+}
+
+/*
+ * readFlash
+ *
+ * read a range of flash back through the readback RCS
+ */
+static ERRORCODE readFlash(sessionDetails* details, uint32_t address, uint16_t length, uint8_t** data)
+{
+    uint8_t   command[6];
+    uint16_t  respLen;
+    ERRORCODE retCode;
+
+    *data = NULL;
+    address += FLASH_BASE_ADDRESS;
+
+    command[0] = (address >> 24) & 0xFF;
+    command[1] = (address >> 16) & 0xFF;
+    command[2] = (address >> 8) & 0xFF;
+    command[3] = address & 0xFF;
+    command[4] = (length >> 8) & 0xFF;
+    command[5] = length & 0xFF;
+
+    retCode = callCustomProcedure(details, COMMAND_RCS_READBACK, command, 6, data, &respLen, &idempotentPolicy);
+    if ((retCode == SUCCESS) && ((*data == NULL) || (respLen != length)))
+    {
+        debug("Short readback at 0x%x - %u of %u\n", address, (*data) ? respLen : 0, length);
+        retCode = ERR_COMMAND_LENGTH;
+    }
+    if ((retCode != SUCCESS) && (*data))
     {
-        printf("DryRun - Would erase and flash sectors %u to %u\n", offsetSect, endSector);
-        return SUCCESS;
+        free(*data);
+        *data = NULL;
     }
 
-    imageStream = open(imageFile, O_RDONLY);
+    return retCode;
+}
+
+/*
+ * backupFlash
+ *
+ * read the whole of flash (not sector 35 unless override is set) back
+ * into a raw image file, which restoreFlash can put back later. The
+ * readback RCS copies its answer into the unit's command buffer, so reads
+ * are no bigger than the compressed chunks the unit already takes there.
+ */
+ERRORCODE backupFlash (serialSession* serialPort, uint8_t* key, char* backupFile, bool override)
+{
+    sessionDetails* details;
+    int             backupStream;
+    uint32_t        address;
+    uint32_t        endAddr;
+    uint16_t        length;
+    uint8_t*        data;
+    uint32_t        percent;
+    uint32_t        lastpercent;
+    ERRORCODE       retCode;
+
+    endAddr = FLASH_SIZE;
+    if (override == false)
+    {
+        endAddr -= 4 * 1024;
+    }
 
-    if (imageStream == -1)
+    backupStream = open(backupFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (backupStream == -1)
     {
-        printf("Unable to open file %s, %d\n", imageFile, errno);
+        output("Unable to open file %s, %d\n", backupFile, errno);
         return ERR_FILE_OPEN;
     }
 
-    retCode = startSessionLayer(serialPort, key, &details);
+    retCode = startSessionLayer(serialPort, key, envProtection(), &details);
     if (retCode == SUCCESS)
     {
-        retCode = rawEraseSectors(details, offsetSect, endSector, override);
+        retCode = loadProcedures(details, &rcsReadback, 1);
         if (retCode == SUCCESS)
         {
             lastpercent = 0;
-            printf("Flashing image -\n");
-            printf("0%%.....................50%%.....................100%%\n");
-            while(imageSize)
+            output("Reading flash -\n");
+            output("0%%.....................50%%.....................100%%\n");
+            for (address = 0; address < endAddr; address += length)
             {
-                percent = ((imageCompare - imageSize)*100)/imageCompare;
-                if(imageSize > CHUNK_SIZE)
-                {
-                    length = CHUNK_SIZE;
-                }
-                else
-                {
-                    length = imageSize;
-                }
-                imageSize -= length;
+                length = (endAddr - address > READBACK_SIZE) ? READBACK_SIZE : endAddr - address;
 
-                readLength = read(imageStream, buffer, length);
-                if (readLength != length)
+                retCode = readFlash(details, address, length, &data);
+                if (retCode != SUCCESS)
                 {
-                    printf("Unable to read %u bytes from file! Only got %ld\n", length, readLength);
-                    retCode = ERR_FILE_READ;
+                    output("!\n**Failed to read section 0x%x**\n", address);
                     break;
                 }
 
-                debug("Sending writeflash command with address 0x%x, length %u\n", offsetAddr + 0xa1000000, length);
-                hexDebug(buffer, length);
-
-                retCode = writeFlash(details, offsetAddr + 0xa1000000, buffer, length);
-                if (retCode != SUCCESS)
+                if (write(backupStream, data, length) != length)
                 {
-                    printf("!\n**Failed to write section 0x%x**\n", offsetAddr);
-                    fflush(stdin);
+                    output("!\n**Failed to write backup file - %s**\n", strerror(errno));
+                    free(data);
+                    retCode = ERR_FILE_WRITE;
                     break;
                 }
-                if(percent > lastpercent + 1)
+                free(data);
+                shuntProgress(address + length, endAddr);
+
+                percent = ((address + length) * 100) / endAddr;
+                while (percent > lastpercent + 1)
                 {
-                    lastpercent = percent;
-                    printf("#");
-                    fflush(stdout);
+                    lastpercent += 2;
+                    output("#");
                 }
-                offsetAddr += length;
+            }
+            if (retCode == SUCCESS)
+            {
+                output("#\n");
             }
         }
-        if (retCode == SUCCESS) printf("#\n");
+        else
+        {
+            output("Failed to load readback RCS %s\n", rcsReadback.file);
+        }
         endSession(details);
     }
     else
     {
-        printf("Session start failure\n");
+        output("Session start failure\n");
     }
 
-    close(imageStream);
+    if ((close(backupStream) != 0) && (retCode == SUCCESS))
+    {
+        retCode = ERR_FILE_WRITE;
+    }
 
     return retCode;
 }
 
+/*
+ * restoreFlash
+ *
+ * put a backup from backupFlash back. This is a differential flash from
+ * sector 0, so only the sectors that changed since the backup get rewritten.
+ */
+ERRORCODE restoreFlash (serialSession* serialPort, uint8_t* key, char* backupFile, flashOptions* options)
+{
+    flashOptions restoreOptions;
+
+    restoreOptions = *options;
+    restoreOptions.offsetSect   = 0;
+    restoreOptions.differential = true;
+
+    return flashProgram(serialPort, key, backupFile, &restoreOptions);
+}
+
 ERRORCODE testSessionLayer(serialSession* serialPort, uint8_t* key)
 {
     sessionDetails* details;
     ERRORCODE       retCode;
 
-    retCode = startSessionLayer(serialPort, key, &details);
+    retCode = startSessionLayer(serialPort, key, envProtection(), &details);
     if (retCode == SUCCESS)
     {
         endSession(details);
@@ -285,19 +1454,19 @@ ERRORCODE getUSN (serialSession* serialPort, uint8_t* key)
     if ((respData) && (respLen > 0) && (errorCode == SUCCESS))
     {
         rsp = (struct helloResp*) respData;
-        printf("----------------------------------------------------\n");
-        printf("USIP Unit Data:\n");
-        printf("Lifecycle stage - %d\n", rsp->lifeCycle);
-        printf("USIP Version    - %d.%d\n", rsp->usipMajorVersion, rsp->sblMajorVersion);
-        printf("SBL Version     - %d.%d\n", rsp->sblMajorVersion, rsp->sblMinorVersion);
-        printf("HAL Version     - %d.%d\n", rsp->halMajorVersion, rsp->halMinorVersion);
-        printf("USN             - %2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x\n",
+        output("----------------------------------------------------\n");
+        output("USIP Unit Data:\n");
+        output("Lifecycle stage - %d\n", rsp->lifeCycle);
+        output("USIP Version    - %d.%d\n", rsp->usipMajorVersion, rsp->sblMajorVersion);
+        output("SBL Version     - %d.%d\n", rsp->sblMajorVersion, rsp->sblMinorVersion);
+        output("HAL Version     - %d.%d\n", rsp->halMajorVersion, rsp->halMinorVersion);
+        output("USN             - %2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x\n",
                 rsp->usn[0],rsp->usn[1],rsp->usn[2],rsp->usn[3],rsp->usn[4],rsp->usn[5],rsp->usn[6],rsp->usn[7],
                 rsp->usn[8],rsp->usn[9],rsp->usn[10],rsp->usn[11],rsp->usn[12],rsp->usn[13],rsp->usn[14],rsp->usn[15]);
-        printf("Random data     - %2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x\n",
+        output("Random data     - %2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x\n",
                 rsp->random[0],rsp->random[1],rsp->random[2],rsp->random[3],rsp->random[4],rsp->random[5],rsp->random[6],rsp->random[7],
                 rsp->random[8],rsp->random[9],rsp->random[10],rsp->random[11],rsp->random[12],rsp->random[13],rsp->random[14],rsp->random[15]);
-        printf("----------------------------------------------------\n");
+        output("----------------------------------------------------\n");
         free(details);
         free(respData);
     }
@@ -349,30 +1518,12 @@ ERRORCODE pingUSIP (serialSession* serialPort)
 ERRORCODE echoRCS(serialSession* serialPort, uint8_t* key)
 {
     ERRORCODE         retCode;
-    off_t             rcsSize;
-    int               sysRet;
-    struct stat       rcsInfo;
     uint16_t          respLen;
-    uint32_t          rcsBase = 0xa0008000;
     sessionDetails*   details;
-    uint8_t*          rcsData;
-    int               rcsStream;
-    int               readLength;
-    char*             rcsFile = "./RCS/RCS_release.bin";
-    uint8_t*          resp;
+    uint8_t*          resp = NULL;
     uint8_t*          message = (uint8_t*)"Banana";
 
-    sysRet = stat(rcsFile, &rcsInfo);
-
-    if (sysRet != 0)
-    {
-        printf("Error getting rcs file details %d\n", errno);
-        return ERR_STAT;
-    }
-
-    rcsSize = rcsInfo.st_size;
-
-    retCode = startSessionLayer(serialPort, key, &details);
+    retCode = startSessionLayer(serialPort, key, envProtection(), &details);
 
     if(retCode != SUCCESS)
     {
@@ -380,48 +1531,21 @@ ERRORCODE echoRCS(serialSession* serialPort, uint8_t* key)
         return retCode;
     }
 
-    rcsStream = open(rcsFile, O_RDONLY);
-
-    rcsData = malloc(rcsSize);
-
-    readLength = read(rcsStream, rcsData, rcsSize);
-    if (readLength != rcsSize)
-    {
-        printf("Unable to read %lld bytes from RCS! Only got %d\n", rcsSize, readLength);
-        free(rcsData);
-        return ERR_FILE_READ;
-    }
-
-    retCode = writeProcedure (details, rcsBase, rcsData, rcsSize);
-    free(rcsData);
+    retCode = loadProcedures(details, &rcsEcho, 1);
     if (retCode == SUCCESS)
     {
-        debug("RCS written successfully\n");
-        retCode = registerProcedure (details, COMMAND_RCS_ONE, rcsBase);
+        retCode = callCustomProcedure(details, COMMAND_RCS_ONE, message, 7, &resp, &respLen, &idempotentPolicy);
         if (retCode == SUCCESS)
         {
-            debug("RCS registered successfully\n");
-            retCode = callCustomProcedure(details, COMMAND_RCS_ONE, message, 7, &resp, &respLen);
-            if (retCode == SUCCESS)
-            {
-                printf("RCS execution successful, request - %s, response - \n", message);
-                hexDump(resp, respLen);
-                free(resp);
-            }
-            else
-            {
-                printf("RCS execution failed - code %d\n", retCode);
-            }
+            output("RCS execution successful, request - %s, response - \n", message);
+            hexDump(resp, respLen);
+            free(resp);
         }
         else
         {
-            debug("RCS registration failed\n");
+            output("RCS execution failed - code %d\n", retCode);
         }
     }
-    else
-    {
-        debug("RCS write failed\n");
-    }
 
     endSession(details);
 
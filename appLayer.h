@@ -8,10 +8,50 @@
 #ifndef APPLAYER_H_
 #define APPLAYER_H_
 
-#define CHUNK_SIZE 512
+#define CHUNK_SIZE     512
+#define RCS_CHUNK_SIZE 4096  // chunks sent through the decompressing RCS
+
+#define FLASH_BASE_ADDRESS 0xa1000000
+#define FLASH_SIZE         0x40000
+
+struct _provisionIndex;
+
+typedef struct _flashOptions
+{
+    uint8_t                 offsetSect;
+    bool                    override;
+    bool                    dryrun;
+    bool                    differential;
+    bool                    verifySectors;
+    bool                    compressed;
+    bool                    frameCache;  // keep the write checksums on disk for the next run
+    char*                   sealedDir;   // where writeSealedStreams left each unit's writes, NULL for none
+    struct _provisionIndex* history;  // skip sectors units are known to hold, NULL for none
+} flashOptions;
+
+/*
+ * What runFlashPlan found out about a device and how the run went
+ */
+typedef struct _flashReport
+{
+    bool             identified;  // the hello response was received
+    struct helloResp hello;
+    double           seconds;
+    uint32_t         wireBytes;
+    uint8_t          recoveries;
+} flashReport;
+
+struct _flashPlan;
 
 ERRORCODE eraseSectors     (serialSession* serialPort, uint8_t* key, uint8_t startSect,  uint8_t endSect,   bool override);
-ERRORCODE flashProgram     (serialSession* serialPort, uint8_t* key, uint8_t offsetSect, char*   imageFile, bool override, bool dryrun);
+ERRORCODE flashProgram     (serialSession* serialPort, uint8_t* key, char*    imageFile, flashOptions* options);
+ERRORCODE runFlashPlan     (serialSession* serialPort, uint8_t* key, struct _flashPlan* plan, flashOptions* options, flashReport* report);
+ERRORCODE batchFlash       (char*          device,     uint8_t* key, char*    imageFile, char* logFile, flashOptions* options);
+ERRORCODE writeFlashPlan   (char*          imageFile,  char*    planFile, flashOptions* options);
+ERRORCODE writeSealedStreams (char*        imageFile,  char*    keyFile,  flashOptions* options);
+ERRORCODE verifyImage      (serialSession* serialPort, uint8_t* key, char*    imageFile, flashOptions* options);
+ERRORCODE backupFlash      (serialSession* serialPort, uint8_t* key, char*    backupFile, bool override);
+ERRORCODE restoreFlash     (serialSession* serialPort, uint8_t* key, char*    backupFile, flashOptions* options);
 ERRORCODE getUSN           (serialSession* serialPort, uint8_t* key);
 ERRORCODE pingUSIP         (serialSession* serialPort);
 ERRORCODE testSessionLayer (serialSession* serialPort, uint8_t* key);
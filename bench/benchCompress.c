@@ -0,0 +1,193 @@
+/*
+ * benchCompress.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Flash an image into the simulated USIP twice, plainly with writeFlash
+ * and compressed through the decompressing RCS, and compare what crossed
+ * the wire. Over the in-memory pipe the wire costs nothing, so the time
+ * a real link would take is worked out from the bytes sent at a baud
+ * rate, ten bits to the byte.
+ *
+ * benchCompress <image> [baud]
+ */
+
+#include "shunt.h"
+#include "serial.h"
+#include "appLayer.h"
+#include "flashPlan.h"
+#include "rcsLoader.h"
+#include "usipSim.h"
+
+#define BENCH_BAUD     115200
+#define BENCH_RCS_SIZE 4096   // stands in for the decompressor upload
+
+typedef struct _benchResult
+{
+    ERRORCODE retCode;
+    double    seconds;
+    uint64_t  bytesIn;
+    uint64_t  bytesOut;
+    uint32_t  commands;
+    bool      matches;
+} benchResult;
+
+/*
+ * runBench
+ *
+ * flash a plan into a fresh simulator and see what it took
+ */
+static void runBench(flashPlan* plan, flashOptions* options, benchResult* result)
+{
+    serialSession*  host;
+    serialSession*  device;
+    static usipSim  sim;
+    struct timespec startTime;
+    struct timespec endTime;
+    uint8_t         key[16] = { 0 };
+    uint32_t        index;
+
+    memset(result, 0, sizeof(benchResult));
+
+    result->retCode = serialPipePair(&host, &device);
+    if (result->retCode != SUCCESS)
+    {
+        return;
+    }
+    result->retCode = startUsipSim(device, &sim);
+    if (result->retCode != SUCCESS)
+    {
+        destroySession(host);
+        destroySession(device);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    result->retCode = runFlashPlan(host, key, plan, options, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    stopUsipSim(&sim);
+
+    result->seconds  = (endTime.tv_sec - startTime.tv_sec) + ((endTime.tv_nsec - startTime.tv_nsec) / 1e9);
+    result->bytesIn  = sim.bytesIn;
+    result->bytesOut = sim.bytesOut;
+    result->commands = sim.commands;
+
+    result->matches = true;
+    for (index = 0; index < plan->sectorCount; index++)
+    {
+        if (memcmp(sim.flash + plan->sectors[index].address, plan->image.flash + plan->sectors[index].address,
+                   plan->sectors[index].size) != 0)
+        {
+            result->matches = false;
+        }
+    }
+
+    destroySession(host);
+    destroySession(device);
+}
+
+/*
+ * printResult
+ */
+static void printResult(const char* name, benchResult* result, uint32_t baud)
+{
+    printf("%-10s %s  %8llu bytes to the unit, %6llu back, %5u commands, %7.3f s over the pipe, %7.2f s at %u baud\n",
+           name, (result->retCode == SUCCESS) ? (result->matches ? "ok  " : "BAD ") : "FAIL",
+           (unsigned long long)result->bytesIn, (unsigned long long)result->bytesOut, result->commands, result->seconds,
+           (result->bytesIn + result->bytesOut) * 10.0 / baud, baud);
+}
+
+/*
+ * makeProcedureDir
+ *
+ * the loader wants ./RCS/RCS_lz4flash.bin, so work in a scratch directory
+ * with a placeholder of about the real one's size - the simulator has the
+ * decompressor built in and ignores what is uploaded
+ */
+static ERRORCODE makeProcedureDir(char* dir)
+{
+    uint8_t placeholder[BENCH_RCS_SIZE];
+    FILE*   file;
+
+    if (!mkdtemp(dir) || (chdir(dir) != 0) || (mkdir("RCS", 0755) != 0))
+    {
+        return ERR_DIRECTORY;
+    }
+
+    file = fopen(rcsLz4.file, "wb");
+    if (!file)
+    {
+        return ERR_FILE_OPEN;
+    }
+    memset(placeholder, 0, sizeof(placeholder));
+    fwrite(placeholder, 1, sizeof(placeholder), file);
+    fclose(file);
+
+    return SUCCESS;
+}
+
+int main(int argc, char** argv)
+{
+    flashOptions options;
+    flashPlan    plain;
+    flashPlan    compressed;
+    benchResult  plainResult;
+    benchResult  compressedResult;
+    char         dir[] = "/tmp/benchCompress.XXXXXX";
+    uint32_t     baud = BENCH_BAUD;
+
+    if ((argc < 2) || (argc > 3))
+    {
+        printf("%s <image> [baud]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 3)
+    {
+        baud = strtoul(argv[2], NULL, 10);
+    }
+
+    memset(&options, 0, sizeof(options));
+    if (buildFlashPlan(argv[1], &options, &plain) != SUCCESS)
+    {
+        printf("Can't load %s\n", argv[1]);
+        return 1;
+    }
+    options.compressed = true;
+    if (buildFlashPlan(argv[1], &options, &compressed) != SUCCESS)
+    {
+        printf("Can't load %s\n", argv[1]);
+        return 1;
+    }
+
+    if (makeProcedureDir(dir) != SUCCESS)
+    {
+        printf("Can't set up %s\n", dir);
+        return 1;
+    }
+
+    options.compressed = false;
+    runBench(&plain, &options, &plainResult);
+    options.compressed = true;
+    runBench(&compressed, &options, &compressedResult);
+
+    unlink(rcsLz4.file);
+    rmdir("RCS");
+    if (chdir("/") == 0)
+    {
+        rmdir(dir);
+    }
+
+    printResult("writeFlash", &plainResult, baud);
+    printResult("lz4 RCS", &compressedResult, baud);
+    if (compressedResult.bytesIn > 0)
+    {
+        printf("%.2fx less sent to the unit compressed\n", (double)plainResult.bytesIn / compressedResult.bytesIn);
+    }
+
+    freeFlashPlan(&plain);
+    freeFlashPlan(&compressed);
+
+    return ((plainResult.retCode == SUCCESS) && plainResult.matches &&
+            (compressedResult.retCode == SUCCESS) && compressedResult.matches) ? 0 : 1;
+}
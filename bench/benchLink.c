@@ -0,0 +1,209 @@
+/*
+ * benchLink.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * How fast the host side goes with the wire taken out. First raw bytes
+ * through the in-memory serial pipe, then an image flashed with
+ * writeFlash through the whole stack into the simulated USIP over the
+ * same pipe. The gap between the two is the protocol stack's own cost,
+ * which a real link at a few hundred kbaud should never see.
+ *
+ * benchLink <image> [megabytes]
+ */
+
+#include "shunt.h"
+#include "serial.h"
+#include "appLayer.h"
+#include "flashPlan.h"
+#include "usipSim.h"
+
+#define BENCH_MEGABYTES 64
+#define BENCH_BLOCK     1024   // bytes per raw write, about a data layer frame
+#define BENCH_WAIT      1000   // ms
+
+typedef struct _rawReader
+{
+    serialSession* port;
+    uint64_t       wanted;
+    uint64_t       received;
+} rawReader;
+
+/*
+ * readerThread
+ *
+ * drain the far end of the pipe until everything has arrived
+ */
+static void* readerThread(rawReader* reader)
+{
+    uint8_t buffer[BENCH_BLOCK];
+    int16_t readBytes;
+
+    while (reader->received < reader->wanted)
+    {
+        if (serialWait(reader->port, BENCH_WAIT) != SUCCESS)
+        {
+            break;
+        }
+        if ((serialRead(reader->port, buffer, sizeof(buffer), &readBytes) == SUCCESS) && (readBytes > 0))
+        {
+            reader->received += readBytes;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * secondsSince
+ */
+static double secondsSince(struct timespec* startTime)
+{
+    struct timespec endTime;
+
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    return (endTime.tv_sec - startTime->tv_sec) + ((endTime.tv_nsec - startTime->tv_nsec) / 1e9);
+}
+
+/*
+ * benchPipe
+ *
+ * push bytes one way through the pipe as fast as they go
+ */
+static ERRORCODE benchPipe(uint32_t megabytes)
+{
+    serialSession*  host;
+    serialSession*  device;
+    rawReader       reader;
+    pthread_t       thread;
+    struct timespec startTime;
+    uint8_t         block[BENCH_BLOCK];
+    uint64_t        sent;
+    double          seconds;
+    ERRORCODE       retCode;
+
+    retCode = serialPipePair(&host, &device);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    memset(block, 0x5A, sizeof(block));
+    reader.port     = device;
+    reader.wanted   = (uint64_t)megabytes * 1024 * 1024;
+    reader.received = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    if (pthread_create(&thread, NULL, (pthreadFunc)readerThread, &reader) != 0)
+    {
+        destroySession(host);
+        destroySession(device);
+        return ERR_CREATE_THREAD;
+    }
+    for (sent = 0; (sent < reader.wanted) && (retCode == SUCCESS); sent += sizeof(block))
+    {
+        retCode = serialWrite(host, block, sizeof(block));
+    }
+    pthread_join(thread, NULL);
+    seconds = secondsSince(&startTime);
+
+    printf("pipe       %s  %8.1f MB/s, %llu bytes in %.3f s\n", (reader.received == reader.wanted) ? "ok  " : "FAIL",
+           reader.received / seconds / (1024 * 1024), (unsigned long long)reader.received, seconds);
+
+    destroySession(host);
+    destroySession(device);
+    return (reader.received == reader.wanted) ? retCode : ERR_SERIAL_READ;
+}
+
+/*
+ * benchStack
+ *
+ * flash a plan into the simulator with plain writeFlash commands
+ */
+static ERRORCODE benchStack(flashPlan* plan, flashOptions* options)
+{
+    serialSession*  host;
+    serialSession*  device;
+    static usipSim  sim;
+    struct timespec startTime;
+    uint8_t         key[16] = { 0 };
+    uint64_t        imageBytes = 0;
+    uint32_t        index;
+    double          seconds;
+    bool            matches = true;
+    ERRORCODE       retCode;
+
+    retCode = serialPipePair(&host, &device);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+    retCode = startUsipSim(device, &sim);
+    if (retCode != SUCCESS)
+    {
+        destroySession(host);
+        destroySession(device);
+        return retCode;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    retCode = runFlashPlan(host, key, plan, options, NULL);
+    seconds = secondsSince(&startTime);
+    stopUsipSim(&sim);
+
+    for (index = 0; index < plan->sectorCount; index++)
+    {
+        if (memcmp(sim.flash + plan->sectors[index].address, plan->image.flash + plan->sectors[index].address,
+                   plan->sectors[index].size) != 0)
+        {
+            matches = false;
+        }
+    }
+    for (index = 0; index < plan->writeCount; index++)
+    {
+        imageBytes += plan->writes[index].length;
+    }
+
+    printf("writeFlash %s  %8.1f MB/s of image, %llu bytes in %.3f s, %u commands, %.1f us each\n",
+           (retCode == SUCCESS) ? (matches ? "ok  " : "BAD ") : "FAIL",
+           imageBytes / seconds / (1024 * 1024), (unsigned long long)imageBytes, seconds, sim.commands,
+           sim.commands ? (seconds * 1e6) / sim.commands : 0.0);
+
+    destroySession(host);
+    destroySession(device);
+    return ((retCode == SUCCESS) && !matches) ? ERR_VERIFY : retCode;
+}
+
+int main(int argc, char** argv)
+{
+    flashOptions options;
+    flashPlan    plan;
+    uint32_t     megabytes = BENCH_MEGABYTES;
+    ERRORCODE    pipeCode;
+    ERRORCODE    stackCode;
+
+    if ((argc < 2) || (argc > 3))
+    {
+        printf("%s <image> [megabytes]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 3)
+    {
+        megabytes = strtoul(argv[2], NULL, 10);
+    }
+
+    memset(&options, 0, sizeof(options));
+    if (buildFlashPlan(argv[1], &options, &plan) != SUCCESS)
+    {
+        printf("Can't load %s\n", argv[1]);
+        return 1;
+    }
+
+    pipeCode = benchPipe(megabytes);
+    stackCode = benchStack(&plan, &options);
+
+    freeFlashPlan(&plan);
+
+    return ((pipeCode == SUCCESS) && (stackCode == SUCCESS)) ? 0 : 1;
+}
@@ -0,0 +1,17 @@
+/*
+ * error.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Stand-in for the USIP SDK's infra/error.h, so the RCS sources can be
+ * built into the simulator and run on the host
+ */
+
+#ifndef INFRA_ERROR_H_
+#define INFRA_ERROR_H_
+
+#define ERR_NO    0
+#define ERR_INVAL 22
+
+#endif /* INFRA_ERROR_H_ */
@@ -0,0 +1,331 @@
+/*
+ * usipSim.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#include "shunt.h"
+#include "serial.h"
+#include "utils.h"
+#include "packetBuffer.h"
+#include "dataLayer.h"
+#include "flashPlan.h"
+#include "commandLayer.h"
+#include "usipSim.h"
+
+// transport
+#define CON_REQ       0x01
+#define CON_REP       0x02
+#define DISC_REQ      0x03
+#define DISC_REP      0x04
+#define DATA_TRANSFER 0x05
+#define ACK           0x06
+#define ECHO_REQ      0x0B
+#define ECHO_REP      0x0C
+#define CHAN_ID       0x09
+
+// session
+#define SESSION_HELLO     0x01
+#define SESSION_HELLO_REP 0x02
+#define SESSION_SUCCESS   0x03
+#define SESSION_FAILURE   0x04
+#define SESSION_DATA      0x05
+#define SESSION_CHALLENGE 0x07
+
+#define SIM_ERR_NO        0x00000000
+#define SIM_ERR_INVAL     0xEAFFFFFF
+
+#define SIM_RESPONSE_MAX  1024
+#define SIM_POLL          1   // seconds between looks at stopping
+
+/*
+ * The decompressing RCS, built from RCS/lz4flash.c
+ */
+int lz4flashRcs(int* argc, char* argv);
+
+static usipSim* flashSim;
+
+/*
+ * flash_write
+ *
+ * what the USIP flash driver gives the RCS - programming only clears bits
+ */
+int flash_write(unsigned int address, const unsigned char* data, unsigned int length)
+{
+    uint32_t index;
+
+    address -= FLASH_BASE_ADDRESS;
+    if ((address > FLASH_SIZE) || (length > FLASH_SIZE - address))
+    {
+        return -1;
+    }
+    for (index = 0; index < length; index++)
+    {
+        flashSim->flash[address + index] &= data[index];
+    }
+    return 0;
+}
+
+/*
+ * sendFrame
+ *
+ * send a transport frame, with data or without
+ */
+static void sendFrame(usipSim* sim, uint8_t protocol, uint8_t seq, const uint8_t* data, uint16_t length)
+{
+    packetBuffer packet;
+
+    if (length == 0)
+    {
+        sendDataLayerPacket(sim->port, protocol, CHAN_ID, seq, NULL);
+        sim->bytesOut += DATA_LAYER_HEADROOM;
+        return;
+    }
+
+    if (allocPacket(&packet, length) != SUCCESS)
+    {
+        return;
+    }
+    memcpy(packet.data, data, length);
+    sendDataLayerPacket(sim->port, protocol, CHAN_ID, seq, &packet);
+    sim->bytesOut += DATA_LAYER_HEADROOM + length + DATA_LAYER_TAILROOM;
+    freePacket(&packet);
+}
+
+/*
+ * sendData
+ *
+ * send a DATA frame of the unit's own
+ */
+static void sendData(usipSim* sim, const uint8_t* data, uint16_t length)
+{
+    MOD_INCREMENT(sim->seq, 16);
+    sendFrame(sim, DATA_TRANSFER, sim->seq, data, length);
+}
+
+/*
+ * flashOffset
+ *
+ * where an address and length land in the flash array, false if they don't
+ */
+static bool flashOffset(uint32_t address, uint32_t length, uint32_t* offset)
+{
+    *offset = address - FLASH_BASE_ADDRESS;
+    return (address >= FLASH_BASE_ADDRESS) && (*offset <= FLASH_SIZE) && (length <= FLASH_SIZE - *offset);
+}
+
+/*
+ * runCommand
+ *
+ * carry out a command, leaving its response payload in response
+ *
+ * Returns the USIP error code
+ */
+static uint32_t runCommand(usipSim* sim, uint8_t* command, uint16_t length, uint8_t* response, uint16_t* responseLength)
+{
+    uint32_t address = 0;
+    uint32_t dataLength = 0;
+    uint32_t offset;
+    uint32_t crc;
+    uint32_t index;
+    int      argc;
+
+    *responseLength = 0;
+    sim->commands++;
+
+    if (length >= 7)
+    {
+        address = (command[1] << 24) | (command[2] << 16) | (command[3] << 8) | command[4];
+        dataLength = (command[5] << 8) | command[6];
+    }
+
+    switch (command[0])
+    {
+    case COMMAND_WRITE_FLASH:
+        if ((length < 7) || (dataLength != length - 7U) || !flashOffset(address, dataLength, &offset))
+        {
+            return SIM_ERR_INVAL;
+        }
+        for (index = 0; index < dataLength; index++)
+        {
+            sim->flash[offset + index] &= command[7 + index];
+        }
+        return SIM_ERR_NO;
+
+    case COMMAND_VERIFY_FLASH:
+        if ((length < 7) || (dataLength != length - 7U) || !flashOffset(address, dataLength, &offset) ||
+            (memcmp(sim->flash + offset, command + 7, dataLength) != 0))
+        {
+            return SIM_ERR_INVAL;
+        }
+        return SIM_ERR_NO;
+
+    case COMMAND_ERASE_FLASH:
+        if ((length != 2) || (command[1] >= FLASH_SECTORS))
+        {
+            return SIM_ERR_INVAL;
+        }
+        memset(sim->flash + calcOffsetAddress(command[1]), 0xFF, sectorMap[command[1]] * 1024);
+        return SIM_ERR_NO;
+
+    case COMMAND_WRITE_PROCEDURE:
+    case COMMAND_REGISTER_PROCEDURE:
+        return SIM_ERR_NO;
+
+    case COMMAND_RCS_LZ4:
+        argc = length;
+        flashSim = sim;
+        return (lz4flashRcs(&argc, (char*)command) == 0) ? SIM_ERR_NO : SIM_ERR_INVAL;
+
+    case COMMAND_RCS_CRC32:
+        if (length != 9)
+        {
+            return SIM_ERR_INVAL;
+        }
+        dataLength = (command[5] << 24) | (command[6] << 16) | (command[7] << 8) | command[8];
+        if (!flashOffset(address, dataLength, &offset))
+        {
+            return SIM_ERR_INVAL;
+        }
+        crc = generateCrc32(0, sim->flash + offset, dataLength);
+        response[0] = (crc >> 24) & 0xFF;
+        response[1] = (crc >> 16) & 0xFF;
+        response[2] = (crc >> 8) & 0xFF;
+        response[3] = crc & 0xFF;
+        *responseLength = 4;
+        return SIM_ERR_NO;
+
+    default:
+        return SIM_ERR_INVAL;
+    }
+}
+
+/*
+ * sessionData
+ *
+ * answer a session layer DATA packet - hello, challenge or a command
+ */
+static void sessionData(usipSim* sim, uint8_t* data, uint16_t length)
+{
+    struct helloResp hello;
+    uint8_t          reply[4 + 2 + SIM_RESPONSE_MAX + 4];
+    uint16_t         payloadLength;
+    uint16_t         commandLength;
+    uint32_t         errCode;
+    uint8_t          index;
+
+    if (length < 4)
+    {
+        return;
+    }
+
+    switch (data[0] >> 4)
+    {
+    case SESSION_HELLO:
+        memset(&hello, 0, sizeof(hello));
+        hello.command = SESSION_HELLO_REP << 4;
+        memcpy(hello.hiResp, "HI-USIP", 7);
+        for (index = 0; index < 16; index++)
+        {
+            hello.usn[index] = 0xA0 + index;
+            hello.random[index] = index;
+        }
+        sendData(sim, (uint8_t*)&hello, sizeof(hello));
+        break;
+
+    case SESSION_CHALLENGE:
+        // the key isn't checked, but only the clear is spoken
+        memset(reply, 0, 4);
+        reply[0] = (((data[0] & 0x0F) == PROTECTION_CLEAR_UNSIGNED) ? SESSION_SUCCESS : SESSION_FAILURE) << 4;
+        sendData(sim, reply, 4);
+        break;
+
+    case SESSION_DATA:
+        commandLength = (data[2] << 8) | data[3];
+        if ((commandLength == 0) || (commandLength > length - 4))
+        {
+            return;
+        }
+        errCode = runCommand(sim, data + 4, commandLength, reply + 4, &payloadLength);
+
+        reply[0] = data[0];
+        reply[1] = data[1];
+        reply[2] = ((payloadLength + 4) >> 8) & 0xFF;
+        reply[3] = (payloadLength + 4) & 0xFF;
+        reply[4 + payloadLength] = (errCode >> 24) & 0xFF;
+        reply[5 + payloadLength] = (errCode >> 16) & 0xFF;
+        reply[6 + payloadLength] = (errCode >> 8) & 0xFF;
+        reply[7 + payloadLength] = errCode & 0xFF;
+        sendData(sim, reply, payloadLength + 8);
+        break;
+    }
+}
+
+/*
+ * simThread
+ *
+ * answer frames until stopped
+ */
+static void* simThread(usipSim* sim)
+{
+    packetBuffer packet;
+    uint8_t      protocol;
+    uint8_t      id;
+    uint8_t      seq;
+    ERRORCODE    retCode;
+
+    while (sim->stopping == false)
+    {
+        retCode = receiveDataLayerPacket(sim->port, &protocol, &id, &seq, &packet, SIM_POLL);
+        if (retCode != SUCCESS)
+        {
+            continue;
+        }
+        sim->bytesIn += DATA_LAYER_HEADROOM + (packet.length ? packet.length + DATA_LAYER_TAILROOM : 0);
+
+        switch (protocol)
+        {
+        case CON_REQ:
+            sim->seq = 0;
+            sendFrame(sim, CON_REP, seq, NULL, 0);
+            break;
+
+        case DISC_REQ:
+            sendFrame(sim, DISC_REP, seq, NULL, 0);
+            break;
+
+        case ECHO_REQ:
+            sendFrame(sim, ECHO_REP, seq, packet.data, packet.length);
+            break;
+
+        case DATA_TRANSFER:
+            sendFrame(sim, ACK, seq, NULL, 0);
+            sessionData(sim, packet.data, packet.length);
+            break;
+        }
+        freePacket(&packet);
+    }
+
+    return NULL;
+}
+
+ERRORCODE startUsipSim(serialSession* port, usipSim* sim)
+{
+    memset(sim, 0, sizeof(usipSim));
+    memset(sim->flash, 0xFF, FLASH_SIZE);
+    sim->port = port;
+
+    if (pthread_create(&(sim->thread), NULL, (pthreadFunc)simThread, sim) != 0)
+    {
+        return ERR_CREATE_THREAD;
+    }
+
+    return SUCCESS;
+}
+
+void stopUsipSim(usipSim* sim)
+{
+    sim->stopping = true;
+    pthread_join(sim->thread, NULL);
+}
@@ -0,0 +1,40 @@
+/*
+ * usipSim.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * A simulated USIP on the far end of a serial pipe, for the benchmarks.
+ * It answers the data, transport and session layers in the clear and
+ * keeps a flash array that the write, erase and verify commands work on.
+ * The decompressing RCS is built in from RCS/lz4flash.c and run as the
+ * unit would run it, and the CRC32 helper is answered from the flash
+ * array. Any other procedure is accepted and ignored.
+ */
+
+#ifndef USIPSIM_H_
+#define USIPSIM_H_
+
+#include "shunt.h"
+#include "serial.h"
+#include "appLayer.h"
+
+typedef struct _usipSim
+{
+    serialSession* port;
+    pthread_t      thread;
+    volatile bool  stopping;
+    uint8_t        seq;
+    uint8_t        flash[FLASH_SIZE];
+    uint64_t       bytesIn;    // everything the host sent, framing included
+    uint64_t       bytesOut;
+    uint32_t       commands;
+} usipSim;
+
+/*
+ * Start answering on port, with flash erased. One simulator at a time.
+ */
+ERRORCODE startUsipSim (serialSession* port, usipSim* sim);
+void      stopUsipSim  (usipSim* sim);
+
+#endif /* USIPSIM_H_ */
@@ -9,117 +9,193 @@
 #include "utils.h"
 #include <string.h>
 
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
 #define AES_BLOCKSIZE  16
 #define AES_RVAL       0x87
 
-#define TDEA_BLOCKSIZE 8
-#define TDEA_RVAL      0x1B
-
 #define CMAC_BLOCKSIZE AES_BLOCKSIZE
 #define CMAC_RVAL      AES_RVAL
-#define CMAC_ALGORITHM aesEncrypt
-
 
 /*
- * deriveSubkeys
+ * shiftSubkey
  *
- * Derive the two subkeys used for CMAC, K1 and K2
- *
- * Arguments -
- * key  - the main CMAC key
- * key1 - output buffer for K1
- * key2 - output buffer for K2
+ * dest = src << 1 over the whole block, xor Rb if a bit falls off the top
  */
-static void deriveSubkeys(const uint8_t *key, uint8_t *key1, uint8_t* key2)
+static void shiftSubkey(uint8_t* dest, const uint8_t* src)
 {
     uint8_t i;
 
-    memset(key1, 0, CMAC_BLOCKSIZE);
-
-    CMAC_ALGORITHM(key2, key1, key);
-
-    for(i = 0; i < 8; i++)
+    for(i = 0; i < CMAC_BLOCKSIZE; i++)
     {
-        key1[i] = (key2[i] << 1) | ((i<7)?(key2[i+1]>>7):0);
+        dest[i] = (src[i] << 1) | ((i < CMAC_BLOCKSIZE - 1) ? (src[i + 1] >> 7) : 0);
     }
 
-    if (key2[0] & 0x80)
+    if (src[0] & 0x80)
     {
-        key1[CMAC_BLOCKSIZE] ^= CMAC_RVAL;
+        dest[CMAC_BLOCKSIZE - 1] ^= CMAC_RVAL;
     }
+}
 
-    for(i = 0; i < 8; i++)
-    {
-        key2[i] = (key1[i] << 1) | ((i<7)?(key1[i+1]>>7):0);
-    }
+/*
+ * initCMacKey
+ *
+ * Build the AES key schedule and derive the two subkeys used for CMAC,
+ * K1 and K2
+ *
+ * Arguments -
+ * cmac - the key to set up
+ * key  - the main 16 byte key
+ */
+ERRORCODE initCMacKey(cmacKey* cmac, const uint8_t* key)
+{
+    uint8_t zero[CMAC_BLOCKSIZE];
+    uint8_t value[CMAC_BLOCKSIZE];
 
-    if (key1[0] & 0x80)
+    if ((AES_set_encrypt_key(key, 128, &(cmac->schedule)) != 0) ||
+        (AES_set_decrypt_key(key, 128, &(cmac->decryptSchedule)) != 0))
     {
-        key2[CMAC_BLOCKSIZE] ^= CMAC_RVAL;
+        return ERR_OPENSSL_KEY;
     }
+
+    memset(zero, 0, sizeof(zero));
+    AES_encrypt(zero, value, &(cmac->schedule));
+
+    shiftSubkey(cmac->key1, value);
+    shiftSubkey(cmac->key2, cmac->key1);
+
+    return SUCCESS;
 }
 
 /*
- * generateCMac
+ * encryptAndMac
  *
- * generate a CMAC according to ANSI X9 TR-31 2010
+ * ECB encrypt and CMAC (according to ANSI X9 TR-31 2010) a buffer, in
+ * one pass over it
  *
  * Arguments -
- * data         - buffer to MAC
+ * cmac         - key from initCMacKey
+ * data         - buffer to encrypt and MAC
  * dataLength   - length of buffer
- * key          - 16 byte key
- * mac          - 8 byte mac output field
+ * encrypted    - PADDED_LENGTH(dataLength) byte output field, or NULL
+ * mac          - CMAC_LENGTH byte mac output field, or NULL
  */
-void generateCMac(const uint8_t* data, uint32_t dataLength, const uint8_t* key, uint8_t* mac)
+void encryptAndMac(const cmacKey* cmac, const uint8_t* data, uint32_t dataLength, uint8_t* encrypted, uint8_t* mac)
 {
-    uint8_t  key1[CMAC_BLOCKSIZE];
-    uint8_t  key2[CMAC_BLOCKSIZE];
-
     uint8_t  lastBlock[CMAC_BLOCKSIZE];
-
-    uint8_t  outPut[CMAC_BLOCKSIZE];
+    uint8_t  chain[CMAC_BLOCKSIZE];
+    uint8_t  block[CMAC_BLOCKSIZE];
 
     uint8_t  remainder = dataLength % CMAC_BLOCKSIZE;
-    uint32_t mainBufferLength = dataLength - remainder;
-    uint32_t bufferCounter = 0;
+    uint32_t wholeLength = dataLength - remainder;
+    uint32_t mainBufferLength = wholeLength;
+    uint32_t bufferCounter;
 
-    // set up subkeys
-    deriveSubkeys(key, key1, key2);
-
-    // set up Mn:
-    if(remainder)
+    // a message that ends on a whole block MACs its last block with K1
+    if ((remainder == 0) && (dataLength > 0))
     {
-        memset(lastBlock, 0x00, sizeof(lastBlock));
-        memcpy(lastBlock, data + dataLength - remainder, remainder);
-        lastBlock[remainder] = 0x80;
-        xorBuffer(lastBlock,
-                  lastBlock,
-                  key2,
-                  CMAC_BLOCKSIZE);
+        mainBufferLength -= CMAC_BLOCKSIZE;
     }
-    else
+
+    memset(chain, 0, sizeof(chain));
+
+    for (bufferCounter = 0; bufferCounter < wholeLength; bufferCounter += CMAC_BLOCKSIZE)
     {
-        xorBuffer(lastBlock,
-                  data + dataLength - CMAC_BLOCKSIZE,
-                  key1,
-                  CMAC_BLOCKSIZE);
-        mainBufferLength -= CMAC_BLOCKSIZE;
+        if (encrypted)
+        {
+            AES_encrypt(data + bufferCounter, encrypted + bufferCounter, &(cmac->schedule));
+        }
+        if (mac && (bufferCounter < mainBufferLength))
+        {
+            xorBuffer(block, chain, data + bufferCounter, CMAC_BLOCKSIZE);
+            AES_encrypt(block, chain, &(cmac->schedule));
+        }
     }
 
-    // do the CMAC....
-    memset(key1, 0, sizeof(key1));
-    memset(key2, 0, sizeof(key2));
+    // the padded block - the last of the ciphertext, and Mn for K2
+    memset(lastBlock, 0x00, sizeof(lastBlock));
+    memcpy(lastBlock, data + wholeLength, remainder);
+    lastBlock[remainder] = 0x80;
 
-    while(bufferCounter < mainBufferLength)
+    if (encrypted)
     {
-        xorBuffer(key1, key2, data + bufferCounter, CMAC_BLOCKSIZE);
-        CMAC_ALGORITHM(key2, key1 , key);
-        bufferCounter += 8;
+        AES_encrypt(lastBlock, encrypted + wholeLength, &(cmac->schedule));
     }
 
-    xorBuffer(key1, key2, lastBlock, CMAC_BLOCKSIZE);
+    if (mac)
+    {
+        if (mainBufferLength == wholeLength)
+        {
+            xorBuffer(lastBlock, lastBlock, cmac->key2, CMAC_BLOCKSIZE);
+        }
+        else
+        {
+            xorBuffer(lastBlock, data + mainBufferLength, cmac->key1, CMAC_BLOCKSIZE);
+        }
+
+        xorBuffer(block, chain, lastBlock, CMAC_BLOCKSIZE);
+        AES_encrypt(block, mac, &(cmac->schedule));
+    }
+}
+
+/*
+ * decryptAndCheckMac
+ *
+ * Undo encryptAndMac on a received buffer
+ *
+ * Arguments -
+ * cmac         - key from initCMacKey
+ * data         - buffer to decrypt, in place, and check
+ * dataLength   - length of buffer, whole blocks if encrypted
+ * encrypted    - whether data is ECB encrypted and padded
+ * mac          - CMAC_LENGTH byte mac to check, or NULL
+ * plainLength  - set to the length once decrypted and unpadded
+ */
+ERRORCODE decryptAndCheckMac(const cmacKey* cmac, uint8_t* data, uint32_t dataLength, bool encrypted,
+                             const uint8_t* mac, uint32_t* plainLength)
+{
+    uint8_t  expected[CMAC_BLOCKSIZE];
+    uint8_t  difference = 0;
+    uint32_t bufferCounter;
+
+    if (encrypted)
+    {
+        if ((dataLength == 0) || (dataLength % CMAC_BLOCKSIZE))
+        {
+            return ERR_VALIDATION;
+        }
+
+        for (bufferCounter = 0; bufferCounter < dataLength; bufferCounter += CMAC_BLOCKSIZE)
+        {
+            AES_decrypt(data + bufferCounter, data + bufferCounter, &(cmac->decryptSchedule));
+        }
+
+        // 0x80 then zeros, all within the last block
+        bufferCounter = dataLength - 1;
+        while ((bufferCounter > dataLength - CMAC_BLOCKSIZE) && (data[bufferCounter] == 0x00))
+        {
+            bufferCounter--;
+        }
+        if (data[bufferCounter] != 0x80)
+        {
+            return ERR_VALIDATION;
+        }
+        dataLength = bufferCounter;
+    }
 
-    CMAC_ALGORITHM(outPut, key1 , key);
+    if (mac)
+    {
+        encryptAndMac(cmac, data, dataLength, NULL, expected);
+        for (bufferCounter = 0; bufferCounter < CMAC_BLOCKSIZE; bufferCounter++)
+        {
+            difference |= expected[bufferCounter] ^ mac[bufferCounter];
+        }
+        if (difference)
+        {
+            return ERR_VALIDATION;
+        }
+    }
 
-    memcpy(mac, outPut, CMAC_LENGTH);
+    *plainLength = dataLength;
+    return SUCCESS;
 }
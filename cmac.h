@@ -9,9 +9,45 @@
 #define CMAC_H_
 
 #include <stdint.h>
+#include <openssl/aes.h>
+
+#include "shunt.h"
 
 #define CMAC_LENGTH 16
 
-void generateCMac(const uint8_t* data, uint32_t dataLength, const uint8_t* key, uint8_t* mac);
+/*
+ * Bytes of ciphertext for length bytes of data - always padded with
+ * 0x80 0x00..., so a whole number of blocks gets a block of padding
+ */
+#define PADDED_LENGTH(length) ((length) + (CMAC_LENGTH - ((length) % CMAC_LENGTH)))
+
+/*
+ * A key made ready for encrypting, decrypting and MACing - the AES
+ * schedules and the CMAC subkeys are only worked out once, not for every
+ * block or message
+ */
+typedef struct _cmacKey
+{
+    AES_KEY schedule;
+    AES_KEY decryptSchedule;
+    uint8_t key1[CMAC_LENGTH];  // K1, for messages that end on a whole block
+    uint8_t key2[CMAC_LENGTH];  // K2, for messages that end in a padded one
+} cmacKey;
+
+ERRORCODE initCMacKey   (cmacKey* cmac, const uint8_t* key);
+
+/*
+ * ECB encrypt data, padded, into encrypted (PADDED_LENGTH bytes) and CMAC
+ * it into mac in the same pass. Either can be NULL to skip it.
+ */
+void      encryptAndMac (const cmacKey* cmac, const uint8_t* data, uint32_t dataLength, uint8_t* encrypted, uint8_t* mac);
+
+/*
+ * The other way: if encrypted, ECB decrypt data in place and strip the
+ * padding, then check mac (if not NULL) is the CMAC of what's left.
+ * ERR_VALIDATION if the padding or the MAC is wrong.
+ */
+ERRORCODE decryptAndCheckMac (const cmacKey* cmac, uint8_t* data, uint32_t dataLength, bool encrypted,
+                              const uint8_t* mac, uint32_t* plainLength);
 
 #endif /* CMAC_H_ */
@@ -9,6 +9,9 @@
 
 #include "shunt.h"
 #include "sessionLayer.h"
+#include "commandQueue.h"
+#include "packetBuffer.h"
+#include "telemetry.h"
 #include "commandLayer.h"
 
 #define COMMAND_ERR_NO             0x00000000
@@ -17,100 +20,361 @@
 
 #define MAX_COMMAND_LENGTH         (0xFFFF - 4)
 
+#define COMMAND_TIME_BUDGET        30   // seconds for one command, resends included
+#define COMMAND_BACKOFF_START      10   // ms before the first resend, doubling each time
+#define COMMAND_BACKOFF_MAX        1000
+#define MAX_LOST_RESPONSES         3    // in a row before the link is given up on
+
 /*
- * sendCommandAndReceiveResponse
+ * How a failed exchange went wrong
+ */
+#define FAILURE_GARBLED            0    // a response came back but was unusable
+#define FAILURE_LOST               1    // no response at all
+#define FAILURE_LINK               2    // the command couldn't be sent
+
+/*
+ * Called before resending a command whose response went missing, to
+ * find out whether the first attempt took effect. SUCCESS if it did.
+ * Whatever it sends has to be done by the command's deadLine.
+ */
+typedef ERRORCODE (*commandCheck)(sessionDetails* session, packetBuffer* command, time_t deadLine);
+
+struct _commandPolicy
+{
+    bool         resend; // safe to send again when the response goes missing
+    commandCheck check;  // ask this first, if set
+};
+
+/*
+ * exchangeCommand
  *
- * Attempt to send a command and receive a reply
+ * Send a command once and receive its reply
  * 'response' is a 4-byte return-code buffer.
  * This is not useful for SIGN_CHECK_FLASH but should work for everything else
+ *
+ * Returns ERR_AGAIN with failure set if the exchange itself went wrong
  */
-static ERRORCODE sendCommandAndReceiveResponse(sessionDetails* session, uint8_t* cmd, uint16_t cmdLength, uint8_t** respData, uint16_t* respLength)
+static ERRORCODE exchangeCommand(sessionDetails* session, packetBuffer* command, uint8_t** respData, uint16_t* respLength, uint8_t* failure)
 {
-    ERRORCODE retCode;
-    uint8_t*  responseMessage;
-    uint16_t  responseLength;
-    uint16_t  embeddedLength;
-    uint32_t  errCode;
-    uint8_t   retries;
+    ERRORCODE    retCode;
+    packetBuffer response;
+    uint8_t*     responseMessage;
+    uint16_t     responseLength;
+    uint16_t     embeddedLength;
+    uint32_t     errCode;
+
+    retCode = sendSessionData(session, command);
+    if (retCode != SUCCESS)
+    {
+        debug("Command send failed - %d\n", retCode);
+        if ((retCode == ERR_NO_MEM) || (retCode == ERR_OPENSSL_KEY))
+        {
+            return retCode;
+        }
+        *failure = FAILURE_LINK;
+        return ERR_AGAIN;
+    }
+    debug("Command send success\n");
 
-    retCode = ERR_AGAIN;
-    retries = 0;
+    retCode = receiveSessionData(session, &response);
+    if (retCode != SUCCESS)
+    {
+        debug("No command response received - %d\n", retCode);
+        *failure = (retCode == ERR_VALIDATION) ? FAILURE_GARBLED : FAILURE_LOST;
+        return ERR_AGAIN;
+    }
+    responseMessage = response.data;
+    responseLength  = response.length;
+
+    debug("Got command response\n");
+    hexDebug(responseMessage, responseLength);
+    if (responseLength < 2)
+    {
+        debug("Response too short for its length - %u\n", responseLength);
+        freePacket(&response);
+        *failure = FAILURE_GARBLED;
+        return ERR_AGAIN;
+    }
+    embeddedLength = responseMessage[1] + (responseMessage[0] << 8);
+    if (embeddedLength != responseLength - 2)
+    {
+        debug("Response lengths don't match - %u %u\n", responseLength, embeddedLength);
+        freePacket(&response);
+        *failure = FAILURE_GARBLED;
+        return ERR_AGAIN;
+    }
 
-    while ((retCode == ERR_AGAIN) && (retries++ < 100))
+    if(responseLength >= 6)
     {
-        retCode = sendSessionData(session, cmd, cmdLength);
-        if (retCode == SUCCESS)
+        errCode = (((((responseMessage[responseLength - 4] << 8) + responseMessage[responseLength - 3]) << 8)
+                           + responseMessage[responseLength - 2]) << 8) + responseMessage[responseLength - 1];
+        switch (errCode)
         {
-            debug("Command send success\n");
-            retCode = receiveSessionData(session, &responseMessage, &responseLength);
-            if (retCode == SUCCESS)
+        case COMMAND_ERR_NO:
+            debug("ERR_NO\n");
+            retCode = SUCCESS;
+            if(responseLength > 6 && respData != NULL)
             {
-                debug("Got command response\n");
-                hexDebug(responseMessage, responseLength);
-                embeddedLength = responseMessage[1] + (responseMessage[0] << 8);
-                if (embeddedLength != responseLength - 2)
-                {
-                   debug("Response lengths don't match - %u %u\n", responseLength, embeddedLength);
-                   /*
-                    * Command seems to have failed, retry
-                    */
-                   retCode = ERR_AGAIN;
-                   continue;
-                }
-                if(responseLength >= 6)
+                // strip the length and return code off, and hand over what's left
+                packetPull(&response, 2);
+                packetTrim(&response, responseLength - 6);
+                *respLength = response.length;
+                *respData = packetRelease(&response);
+                if (!(*respData))
                 {
-                    errCode = (((((responseMessage[responseLength - 4] << 8) + responseMessage[responseLength - 3]) << 8)
-                                       + responseMessage[responseLength - 2]) << 8) + responseMessage[responseLength - 1];
-                    switch (errCode)
-                    {
-                    case COMMAND_ERR_NO:
-                        debug("ERR_NO\n");
-                        retCode = SUCCESS;
-                        if(responseLength > 6 && respData != NULL)
-                        {
-                            *respData = (uint8_t*) malloc(responseLength - 6);
-                            if (!respData)
-                            {
-                                debug("Could not allocate response buffer! %d\n", errno);
-                                retCode = ERR_NO_MEM;
-                            }
-                            else
-                            {
-                                memcpy(*respData, responseMessage + 2, responseLength - 4);
-                                *respLength = responseLength - 6;
-                            }
-                        }
-                        break;
-
-                    case COMMAND_ERR_INVAL:
-                        debug("ERR_INVAL\n");
-                        retCode = ERR_COMMAND_INVAL;
-                        break;
-
-                    case COMMAND_ERR_ALREADY:
-                        debug("ERR_ALREADY\n");
-                        retCode = ERR_COMMAND_ALREADY;
-                        break;
-
-                    default:
-                        debug("UNKNOWN response code! 0x%x\n", errCode);
-                        retCode = ERR_COMMAND_UNK;
-                        break;
-                    }
+                    debug("Could not allocate response buffer! %d\n", errno);
+                    retCode = ERR_NO_MEM;
                 }
-                free(responseMessage);
             }
-            else
+            break;
+
+        case COMMAND_ERR_INVAL:
+            debug("ERR_INVAL\n");
+            retCode = ERR_COMMAND_INVAL;
+            break;
+
+        case COMMAND_ERR_ALREADY:
+            debug("ERR_ALREADY\n");
+            retCode = ERR_COMMAND_ALREADY;
+            break;
+
+        default:
+            debug("UNKNOWN response code! 0x%x\n", errCode);
+            retCode = ERR_COMMAND_UNK;
+            break;
+        }
+    }
+    freePacket(&response);
+
+    return retCode;
+}
+
+/*
+ * commandDeadLine
+ *
+ * when a command starting now runs out of its COMMAND_TIME_BUDGET
+ */
+static time_t commandDeadLine(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + COMMAND_TIME_BUDGET;
+}
+
+/*
+ * sendCommandAndReceiveResponse
+ *
+ * Attempt to send a command and receive a reply, resending according to
+ * what went wrong:
+ *  - the USIP refused the command - never resent
+ *  - the command couldn't be sent, or MAX_LOST_RESPONSES replies in a row
+ *    went missing - the link is down, give up with ERR_LINK_DOWN
+ *  - the reply was lost or garbled - the command may or may not have been
+ *    done, so it is only resent if the policy says that's safe
+ * Resends back off from COMMAND_BACKOFF_START ms and the whole thing gives up
+ * at deadLine (CLOCK_MONOTONIC seconds), checks included.
+ */
+static ERRORCODE sendCommandAndReceiveResponse(sessionDetails* session, packetBuffer* command, uint8_t** respData, uint16_t* respLength,
+                                               const commandPolicy* policy, time_t deadLine)
+{
+    ERRORCODE       retCode;
+    ERRORCODE       checkCode;
+    uint8_t         failure = FAILURE_LOST;
+    uint8_t         lostResponses = 0;
+    uint32_t        backoff = COMMAND_BACKOFF_START;
+    bool            resent = false;
+    struct timespec now;
+    struct timespec pause;
+
+    while (1)
+    {
+        retCode = exchangeCommand(session, command, respData, respLength, &failure);
+
+        if ((retCode == ERR_COMMAND_ALREADY) && (resent == true))
+        {
+            debug("Already done, an earlier attempt must have got through\n");
+            retCode = SUCCESS;
+        }
+        if (retCode != ERR_AGAIN)
+        {
+            break;
+        }
+
+        lostResponses = (failure == FAILURE_LOST) ? lostResponses + 1 : 0;
+        if ((failure == FAILURE_LINK) || (lostResponses >= MAX_LOST_RESPONSES))
+        {
+            debug("Link down\n");
+            telemetryEvent("link_down", "\"command\":%u", command->data[0]);
+            retCode = ERR_LINK_DOWN;
+            break;
+        }
+
+        retCode = (failure == FAILURE_LOST) ? ERR_SERIAL_TIMEOUT : ERR_VALIDATION;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec >= deadLine)
+        {
+            debug("Out of time for command 0x%2.2x\n", command->data[0]);
+            break;
+        }
+
+        if (policy->check)
+        {
+            checkCode = policy->check(session, command, deadLine);
+            if ((checkCode == SUCCESS) || (checkCode == ERR_LINK_DOWN))
             {
-                debug("No command response received\n");
-                retCode = ERR_AGAIN;
-                continue;
+                debug("Command 0x%2.2x check - %d\n", command->data[0], checkCode);
+                retCode = checkCode;
+                break;
             }
         }
+        else if (policy->resend == false)
+        {
+            debug("Not safe to resend command 0x%2.2x\n", command->data[0]);
+            break;
+        }
+
+        pause.tv_sec  = backoff / 1000;
+        pause.tv_nsec = (backoff % 1000) * 1000000;
+        nanosleep(&pause, NULL);
+        backoff = (backoff * 2 > COMMAND_BACKOFF_MAX) ? COMMAND_BACKOFF_MAX : backoff * 2;
+
+        debug("Resending command 0x%2.2x\n", command->data[0]);
+        telemetryRetry(command->data[0], (failure == FAILURE_LOST) ? "lost" : "garbled");
+        resent = true;
+    }
+    return retCode;
+}
+
+/*
+ * Commands that do the same thing however many times they arrive
+ */
+const commandPolicy idempotentPolicy = { true,  NULL };
+
+/*
+ * Commands that must not be repeated if there's any doubt
+ */
+const commandPolicy onceOnlyPolicy   = { false, NULL };
+
+/*
+ * checkWriteFlash
+ *
+ * A lost WRITE_FLASH reply doesn't say whether the data went in, and
+ * programming over it again may fail. VERIFY_FLASH takes the same
+ * arguments, so ask that instead, within what's left of the write's time.
+ */
+static ERRORCODE checkWriteFlash(sessionDetails* session, packetBuffer* command, time_t deadLine)
+{
+    const uint8_t* checksums;
+    packetBuffer*  sealed;
+    ERRORCODE      retCode;
+
+    // anything worked out ahead is for the write
+    checksums = command->checksums;
+    sealed = command->sealed;
+    command->checksums = NULL;
+    command->sealed = NULL;
+
+    command->data[0] = COMMAND_VERIFY_FLASH;
+    retCode = sendCommandAndReceiveResponse(session, command, NULL, NULL, &idempotentPolicy, deadLine);
+    command->data[0] = COMMAND_WRITE_FLASH;
+    command->checksums = checksums;
+    command->sealed = sealed;
+
+    return retCode;
+}
+
+static const commandPolicy writeFlashPolicy = { true,  checkWriteFlash };
+
+/*
+ * executeCommand
+ *
+ * Run a queued request on the session - called by the queue's worker
+ */
+ERRORCODE executeCommand(sessionDetails* session, commandRequest* request)
+{
+    request->respData   = NULL;
+    request->respLength = 0;
+    request->result     = sendCommandAndReceiveResponse(session, &(request->command),
+                                                        request->wantResponse ? &(request->respData) : NULL,
+                                                        &(request->respLength), request->policy, commandDeadLine());
+    return request->result;
+}
+
+/*
+ * issueCommand
+ *
+ * Send a command and wait for the reply. If a queue owns the session
+ * the command waits its turn behind anything already submitted.
+ */
+static ERRORCODE issueCommand(sessionDetails* session, packetBuffer* command, uint8_t** respData, uint16_t* respLength,
+                              const commandPolicy* policy)
+{
+    commandQueue*  queue;
+    commandRequest request;
+    ERRORCODE      retCode;
+
+    queue = getSessionQueue(session);
+    if (!queue)
+    {
+        return sendCommandAndReceiveResponse(session, command, respData, respLength, policy, commandDeadLine());
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.command       = *command;
+    request.policy        = policy;
+    request.wantResponse  = (respData != NULL);
+
+    retCode = runRequest(queue, &request);
+    if (respData)
+    {
+        *respData   = request.respData;
+        *respLength = request.respLength;
+    }
+    else if (request.respData)
+    {
+        free(request.respData);
     }
     return retCode;
 }
 
+/*
+ * buildTransferCommand
+ *
+ * Allocate and fill a command of the form
+ * [opcode][address 4][length 2][data] as used by WRITE_FLASH,
+ * VERIFY_FLASH and WRITE_PROCEDURE. This is the only copy the data
+ * takes on its way to the wire; the layers below frame it in place.
+ */
+static ERRORCODE buildTransferCommand(uint8_t opcode, uint32_t address, uint8_t* data, uint16_t dataLength,
+                                      packetBuffer* command)
+{
+    ERRORCODE retCode;
+
+    if ((uint32_t)dataLength + 7 > MAX_COMMAND_LENGTH)
+    {
+        return ERR_COMMAND_LENGTH;
+    }
+
+    retCode = allocPacket(command, dataLength + 7);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    command->data[0] = opcode;
+    command->data[1] = (address >> 24) & 0xFF;
+    command->data[2] = (address >> 16) & 0xFF;
+    command->data[3] = (address >> 8) & 0xFF;
+    command->data[4] = address & 0xFF;
+    command->data[5] = (dataLength >> 8) & 0xFF;
+    command->data[6] = dataLength & 0xFF;
+    memcpy(command->data + 7, data, dataLength);
+
+    return SUCCESS;
+}
+
 /*
  * writeKey
  *
@@ -119,15 +383,17 @@ static ERRORCODE sendCommandAndReceiveResponse(sessionDetails* session, uint8_t*
  */
 ERRORCODE writeKey (sessionDetails* session, uint8_t scope, uint8_t usage, uint8_t* key)
 {
-    uint8_t   command[19];
-    ERRORCODE retCode;
+    uint8_t      storage[PACKET_ROOM(19)];
+    packetBuffer command;
+    ERRORCODE    retCode;
 
-    command[0] = COMMAND_WRITE_KEY;
-    command[1] = scope;
-    command[2] = usage;
-    memcpy(command + 3, key, 16);
+    initPacket(&command, storage, sizeof(storage), 19);
+    command.data[0] = COMMAND_WRITE_KEY;
+    command.data[1] = scope;
+    command.data[2] = usage;
+    memcpy(command.data + 3, key, 16);
 
-    retCode = sendCommandAndReceiveResponse(session, command, 19, NULL, NULL);
+    retCode = issueCommand(session, &command, NULL, NULL, &onceOnlyPolicy);
 
     return retCode;
 }
@@ -140,14 +406,16 @@ ERRORCODE writeKey (sessionDetails* session, uint8_t scope, uint8_t usage, uint8
  */
 ERRORCODE writeTimeout (sessionDetails* session, uint16_t timeout)
 {
-    uint8_t   command[3];
-    ERRORCODE retCode;
+    uint8_t      storage[PACKET_ROOM(3)];
+    packetBuffer command;
+    ERRORCODE    retCode;
 
-    command[0] = COMMAND_WRITE_TIMEOUT;
-    command[1] = timeout >> 8;
-    command[2] = timeout & 0xff;
+    initPacket(&command, storage, sizeof(storage), 3);
+    command.data[0] = COMMAND_WRITE_TIMEOUT;
+    command.data[1] = timeout >> 8;
+    command.data[2] = timeout & 0xff;
 
-    retCode = sendCommandAndReceiveResponse(session, command, 3, NULL, NULL);
+    retCode = issueCommand(session, &command, NULL, NULL, &idempotentPolicy);
 
     return retCode;
 }
@@ -163,17 +431,81 @@ ERRORCODE writeTimeout (sessionDetails* session, uint16_t timeout)
  */
 ERRORCODE updateLifeCycle (sessionDetails* session)
 {
-    uint8_t   command[2];
+    uint8_t      storage[PACKET_ROOM(2)];
+    packetBuffer command;
+    ERRORCODE    retCode;
+
+    initPacket(&command, storage, sizeof(storage), 2);
+    command.data[0] = COMMAND_UPDATE_LIFE_CYCLE;
+    command.data[1] = 0;
+
+    retCode = issueCommand(session, &command, NULL, NULL, &onceOnlyPolicy);
+
+    return retCode;
+}
+
+/*
+ * prepareWriteFlash
+ *
+ * Build a write and, on a protected session, start it being encrypted.
+ * checksums, if not NULL, are the ones writeFlashChecksums worked out
+ * for the same write, and sealed, if not NULL, what sealWriteFlash
+ * worked out for it under the unit's key - then there is nothing left
+ * to encrypt.
+ *
+ * address is expected to be in kseg1 VIRTUAL memory !!
+ */
+ERRORCODE prepareWriteFlash (sessionDetails* session, uint32_t address, uint8_t* data, uint16_t dataLength,
+                             const uint8_t* checksums, const uint8_t* sealed, packetBuffer* command)
+{
+    ERRORCODE retCode;
+
+    retCode = buildTransferCommand(COMMAND_WRITE_FLASH, address, data, dataLength, command);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+    command->checksums = checksums;
+
+    if (sealed && (useSealed(session, command, sealed) != SUCCESS))
+    {
+        debug("Sealing write 0x%x here instead\n", address);
+    }
+    sealAhead(session, command);
+
+    return SUCCESS;
+}
+
+/*
+ * sendWriteFlash
+ *
+ * Send a prepared write and free it
+ */
+ERRORCODE sendWriteFlash (sessionDetails* session, packetBuffer* command)
+{
     ERRORCODE retCode;
 
-    command[0] = COMMAND_UPDATE_LIFE_CYCLE;
-    command[1] = 0;
+    sealWait(session, command);
 
-    retCode = sendCommandAndReceiveResponse(session, command, 2, NULL, NULL);
+    debug("Sending command of length %u\n", command->length);
+    retCode = issueCommand(session, command, NULL, NULL, &writeFlashPolicy);
+
+    freePacket(command);
 
     return retCode;
 }
 
+/*
+ * dropWriteFlash
+ *
+ * Free a prepared write without sending it
+ */
+void dropWriteFlash (sessionDetails* session, packetBuffer* command)
+{
+    sealWait(session, command);
+    freePacket(command);
+}
+
 /*
  * writeFlash
  *
@@ -181,38 +513,94 @@ ERRORCODE updateLifeCycle (sessionDetails* session)
  *
  * address is expected to be in kseg1 VIRTUAL memory !!
  */
-ERRORCODE writeFlash (sessionDetails* session, uint32_t address, uint8_t* data, uint16_t dataLength)
+ERRORCODE writeFlash (sessionDetails* session, uint32_t address, uint8_t* data, uint16_t dataLength, const uint8_t* checksums)
 {
-    uint8_t*  command;
-    ERRORCODE retCode;
-    uint32_t  fullLength = dataLength + 7;
+    packetBuffer command;
+    ERRORCODE    retCode;
 
-    if (fullLength > MAX_COMMAND_LENGTH )
+    retCode = prepareWriteFlash(session, address, data, dataLength, checksums, NULL, &command);
+    if (retCode != SUCCESS)
     {
-        return ERR_COMMAND_LENGTH;
+        return retCode;
+    }
+
+    return sendWriteFlash(session, &command);
+}
+
+/*
+ * writeFlashChecksums
+ *
+ * Work out the FRAME_CHECKSUMS_SIZE bytes of checksums for a write, to
+ * pass to writeFlash whenever the same write is sent
+ */
+ERRORCODE writeFlashChecksums (uint32_t address, uint8_t* data, uint16_t dataLength, uint8_t* checksums)
+{
+    packetBuffer command;
+    ERRORCODE    retCode;
+
+    retCode = buildTransferCommand(COMMAND_WRITE_FLASH, address, data, dataLength, &command);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
     }
 
-    command = (uint8_t*)malloc(fullLength);
-    if (!command)
+    retCode = precomputeChecksums(&command, checksums);
+    freePacket(&command);
+
+    return retCode;
+}
+
+/*
+ * sealedWriteSize
+ *
+ * The bytes sealWriteFlash makes of a write of dataLength bytes
+ */
+uint32_t sealedWriteSize (uint16_t dataLength)
+{
+    return PADDED_LENGTH((uint32_t)dataLength + 7) + CMAC_LENGTH;
+}
+
+/*
+ * sealWriteFlash
+ *
+ * Encrypt and MAC a write under one unit's key, ahead of its session,
+ * for prepareWriteFlash to use. The ciphertext comes first, then the MAC.
+ */
+ERRORCODE sealWriteFlash (const cmacKey* cipher, uint32_t address, uint8_t* data, uint16_t dataLength, uint8_t* sealed)
+{
+    packetBuffer command;
+    ERRORCODE    retCode;
+
+    retCode = buildTransferCommand(COMMAND_WRITE_FLASH, address, data, dataLength, &command);
+    if (retCode != SUCCESS)
     {
-        return ERR_NO_MEM;
+        return retCode;
     }
 
-    command[0] = COMMAND_WRITE_FLASH;
-    command[1] = (address >> 24) & 0xFF;
-    command[2] = (address >> 16) & 0xFF;
-    command[3] = (address >> 8) & 0xFF;
-    command[4] = address & 0xFF;
-    command[5] = (dataLength >> 8) & 0xFF;
-    command[6] = dataLength & 0xFF;
-    memcpy(command + 7, data, dataLength);
+    encryptAndMac(cipher, command.data, command.length, sealed, sealed + PADDED_LENGTH(command.length));
+    freePacket(&command);
+
+    return SUCCESS;
+}
 
-    debug("Sending command of length %lu\n", fullLength);
-    retCode = sendCommandAndReceiveResponse(session, command, fullLength, NULL, NULL);
+/*
+ * writeFlashAsync
+ *
+ * Queue a write, the callback gets the result
+ */
+ERRORCODE writeFlashAsync (commandQueue* queue, uint32_t address, uint8_t* data, uint16_t dataLength,
+                           commandCallback callback, void* context)
+{
+    packetBuffer command;
+    ERRORCODE    retCode;
 
-    free(command);
+    retCode = buildTransferCommand(COMMAND_WRITE_FLASH, address, data, dataLength, &command);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
 
-    return retCode;
+    return submitCommand(queue, &command, &writeFlashPolicy, false, callback, context);
 }
 
 /*
@@ -222,8 +610,9 @@ ERRORCODE writeFlash (sessionDetails* session, uint32_t address, uint8_t* data,
  */
 ERRORCODE eraseFlash (sessionDetails* session, uint8_t sector, bool override)
 {
-    ERRORCODE       retCode;
-    uint8_t         command[2];
+    ERRORCODE    retCode;
+    uint8_t      storage[PACKET_ROOM(2)];
+    packetBuffer command;
 
     if (sector > 35)
     {
@@ -237,14 +626,38 @@ ERRORCODE eraseFlash (sessionDetails* session, uint8_t sector, bool override)
         return ERR_BAD_SECTOR;
     }
 
-    command[0] =  COMMAND_ERASE_FLASH;
-    command[1] =  sector;
+    initPacket(&command, storage, sizeof(storage), 2);
+    command.data[0] =  COMMAND_ERASE_FLASH;
+    command.data[1] =  sector;
 
-    retCode = sendCommandAndReceiveResponse(session, command, 2, NULL, NULL);
+    retCode = issueCommand(session, &command, NULL, NULL, &idempotentPolicy);
 
     return retCode;
 }
 
+ERRORCODE eraseFlashAsync (commandQueue* queue, uint8_t sector, bool override, commandCallback callback, void* context)
+{
+    packetBuffer command;
+    ERRORCODE    retCode;
+
+    if ((sector > 35) || ((sector == 35) && (override != true)))
+    {
+        debug("Refusing to erase sector %u\n", sector);
+        return ERR_BAD_SECTOR;
+    }
+
+    retCode = allocPacket(&command, 2);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    command.data[0] =  COMMAND_ERASE_FLASH;
+    command.data[1] =  sector;
+
+    return submitCommand(queue, &command, &idempotentPolicy, false, callback, context);
+}
+
 /*
  * blankCheckFlash
  *
@@ -256,12 +669,14 @@ ERRORCODE eraseFlash (sessionDetails* session, uint8_t sector, bool override)
  */
 ERRORCODE blankCheckFlash (sessionDetails* session)
 {
-    uint8_t   command;
-    ERRORCODE retCode;
+    uint8_t      storage[PACKET_ROOM(1)];
+    packetBuffer command;
+    ERRORCODE    retCode;
 
-    command = COMMAND_BLANK_CHECK_FLASH;
+    initPacket(&command, storage, sizeof(storage), 1);
+    command.data[0] = COMMAND_BLANK_CHECK_FLASH;
 
-    retCode = sendCommandAndReceiveResponse(session, &command, 1, NULL, NULL);
+    retCode = issueCommand(session, &command, NULL, NULL, &idempotentPolicy);
 
     return retCode;
 }
@@ -273,8 +688,9 @@ ERRORCODE blankCheckFlash (sessionDetails* session)
  */
 ERRORCODE lockFlash (sessionDetails* session, uint8_t sector, bool override)
 {
-    ERRORCODE       retCode;
-    uint8_t         command[2];
+    ERRORCODE    retCode;
+    uint8_t      storage[PACKET_ROOM(2)];
+    packetBuffer command;
 
     if (sector > 35)
     {
@@ -288,10 +704,11 @@ ERRORCODE lockFlash (sessionDetails* session, uint8_t sector, bool override)
         return ERR_BAD_SECTOR;
     }
 
-    command[0] =  COMMAND_LOCK_FLASH;
-    command[1] =  sector;
+    initPacket(&command, storage, sizeof(storage), 2);
+    command.data[0] =  COMMAND_LOCK_FLASH;
+    command.data[1] =  sector;
 
-    retCode = sendCommandAndReceiveResponse(session, command, 2, NULL, NULL);
+    retCode = issueCommand(session, &command, NULL, NULL, &idempotentPolicy);
 
     return retCode;
 }
@@ -305,33 +722,33 @@ ERRORCODE lockFlash (sessionDetails* session, uint8_t sector, bool override)
  */
 ERRORCODE verifyFlash (sessionDetails* session, uint32_t address, uint8_t* data, uint16_t dataLength)
 {
-    uint8_t*  command;
-    ERRORCODE retCode;
-    uint32_t  fullLength = dataLength + 7;
+    packetBuffer command;
+    ERRORCODE    retCode;
 
-    if (fullLength > MAX_COMMAND_LENGTH )
+    retCode = buildTransferCommand(COMMAND_VERIFY_FLASH, address, data, dataLength, &command);
+    if (retCode != SUCCESS)
     {
-        return ERR_COMMAND_LENGTH;
+        return retCode;
     }
 
-    command = (uint8_t*)malloc(fullLength);
-    if (!command)
+    retCode = issueCommand(session, &command, NULL, NULL, &idempotentPolicy);
+    freePacket(&command);
+    return retCode;
+}
+
+ERRORCODE verifyFlashAsync (commandQueue* queue, uint32_t address, uint8_t* data, uint16_t dataLength,
+                            commandCallback callback, void* context)
+{
+    packetBuffer command;
+    ERRORCODE    retCode;
+
+    retCode = buildTransferCommand(COMMAND_VERIFY_FLASH, address, data, dataLength, &command);
+    if (retCode != SUCCESS)
     {
-        return ERR_NO_MEM;
+        return retCode;
     }
 
-    command[0] = COMMAND_VERIFY_FLASH;
-    command[1] = (address >> 24) & 0xFF;
-    command[2] = (address >> 16) & 0xFF;
-    command[3] = (address >> 8) & 0xFF;
-    command[4] = address & 0xFF;
-    command[5] = (dataLength >> 8) & 0xFF;
-    command[6] = dataLength & 0xFF;
-    memcpy(command + 7, data, dataLength);
-
-    retCode = sendCommandAndReceiveResponse(session, command, fullLength, NULL, NULL);
-    free(command);
-    return retCode;
+    return submitCommand(queue, &command, &idempotentPolicy, false, callback, context);
 }
 
 /*
@@ -346,12 +763,8 @@ ERRORCODE verifyFlash (sessionDetails* session, uint32_t address, uint8_t* data,
  *
  * Signature is a 16 byte output buffer
  */
-ERRORCODE signCheckFlash (sessionDetails* session, uint32_t address, uint32_t length, bool otp, uint8_t** signature)
+static void buildSignCheckCommand (uint8_t* command, uint32_t address, uint32_t length, bool otp)
 {
-    uint8_t   command[9];
-    ERRORCODE retCode;
-    uint16_t  sigLength;
-
     command[0] = COMMAND_SIGN_CHECK_FLASH;
     if (otp == true)
     {
@@ -372,8 +785,22 @@ ERRORCODE signCheckFlash (sessionDetails* session, uint32_t address, uint32_t le
     command[6] = (length >> 16) & 0xFF;
     command[7] = (length >> 8) & 0xFF;
     command[8] = length & 0xFF;
+}
+
+ERRORCODE signCheckFlash (sessionDetails* session, uint32_t address, uint32_t length, bool otp, uint8_t** signature)
+{
+    uint8_t      storage[PACKET_ROOM(9)];
+    packetBuffer command;
+    ERRORCODE    retCode;
+    uint16_t     sigLength;
 
-    retCode = sendCommandAndReceiveResponse(session, command, 9, signature, &sigLength);
+    *signature = NULL;
+    sigLength  = 0;
+
+    initPacket(&command, storage, sizeof(storage), 9);
+    buildSignCheckCommand(command.data, address, length, otp);
+
+    retCode = issueCommand(session, &command, signature, &sigLength, &idempotentPolicy);
 
     if (retCode == SUCCESS)
     {
@@ -398,6 +825,29 @@ ERRORCODE signCheckFlash (sessionDetails* session, uint32_t address, uint32_t le
     return retCode;
 }
 
+/*
+ * signCheckFlashAsync
+ *
+ * The callback gets the raw response, SIGN followed by SSIGN, and
+ * should check it is 32 bytes long
+ */
+ERRORCODE signCheckFlashAsync (commandQueue* queue, uint32_t address, uint32_t length, bool otp,
+                               commandCallback callback, void* context)
+{
+    packetBuffer command;
+    ERRORCODE    retCode;
+
+    retCode = allocPacket(&command, 9);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    buildSignCheckCommand(command.data, address, length, otp);
+
+    return submitCommand(queue, &command, &idempotentPolicy, true, callback, context);
+}
+
 /*
  * writeProcedure
  *
@@ -407,32 +857,17 @@ ERRORCODE signCheckFlash (sessionDetails* session, uint32_t address, uint32_t le
  */
 ERRORCODE writeProcedure (sessionDetails* session, uint32_t address, uint8_t* data, uint16_t dataLength)
 {
-    uint8_t*  command;
-    ERRORCODE retCode;
-    uint32_t  fullLength = dataLength + 7;
-
-    if (fullLength > MAX_COMMAND_LENGTH )
-    {
-        return ERR_COMMAND_LENGTH;
-    }
+    packetBuffer command;
+    ERRORCODE    retCode;
 
-    command = (uint8_t*)malloc(fullLength);
-    if (!command)
+    retCode = buildTransferCommand(COMMAND_WRITE_PROCEDURE, address, data, dataLength, &command);
+    if (retCode != SUCCESS)
     {
-        return ERR_NO_MEM;
+        return retCode;
     }
 
-    command[0] = COMMAND_WRITE_PROCEDURE;
-    command[1] = (address >> 24) & 0xFF;
-    command[2] = (address >> 16) & 0xFF;
-    command[3] = (address >> 8) & 0xFF;
-    command[4] = address & 0xFF;
-    command[5] = (dataLength >> 8) & 0xFF;
-    command[6] = dataLength & 0xFF;
-    memcpy(command + 7, data, dataLength);
-
-    retCode = sendCommandAndReceiveResponse(session, command, fullLength, NULL, NULL);
-    free(command);
+    retCode = issueCommand(session, &command, NULL, NULL, &idempotentPolicy);
+    freePacket(&command);
     return retCode;
 }
 
@@ -445,8 +880,9 @@ ERRORCODE writeProcedure (sessionDetails* session, uint32_t address, uint8_t* da
  */
 ERRORCODE registerProcedure (sessionDetails* session, uint8_t opCode, uint32_t address)
 {
-    uint8_t   command[6];
-    ERRORCODE retCode;
+    uint8_t      storage[PACKET_ROOM(6)];
+    packetBuffer command;
+    ERRORCODE    retCode;
 
     switch (opCode)
     {
@@ -468,14 +904,15 @@ ERRORCODE registerProcedure (sessionDetails* session, uint8_t opCode, uint32_t a
         break;
     }
 
-    command[0] = COMMAND_REGISTER_PROCEDURE;
-    command[1] = opCode;
-    command[2] = (address >> 24) & 0xFF;
-    command[3] = (address >> 16) & 0xFF;
-    command[4] = (address >> 8) & 0xFF;
-    command[5] = address & 0xFF;
+    initPacket(&command, storage, sizeof(storage), 6);
+    command.data[0] = COMMAND_REGISTER_PROCEDURE;
+    command.data[1] = opCode;
+    command.data[2] = (address >> 24) & 0xFF;
+    command.data[3] = (address >> 16) & 0xFF;
+    command.data[4] = (address >> 8) & 0xFF;
+    command.data[5] = address & 0xFF;
 
-    retCode = sendCommandAndReceiveResponse(session, command, 6, NULL, NULL);
+    retCode = issueCommand(session, &command, NULL, NULL, &idempotentPolicy);
 
     return retCode;
 }
@@ -483,32 +920,58 @@ ERRORCODE registerProcedure (sessionDetails* session, uint8_t opCode, uint32_t a
 /*
  * callCustomProcedure
  *
- * Call a previously registered RCS
+ * Call a previously registered RCS. Only the caller knows whether the
+ * procedure can safely be run twice, so it says how a call whose reply
+ * goes missing is treated.
  */
 ERRORCODE callCustomProcedure (sessionDetails* session,  uint8_t   commandID, uint8_t* data, uint16_t dataLength,
-                               uint8_t**       respData, uint16_t* respLength)
+                               uint8_t**       respData, uint16_t* respLength, const commandPolicy* policy)
 {
-    uint8_t*  command;
-    ERRORCODE retCode;
-    uint32_t  fullLength = dataLength + 1;
+    packetBuffer command;
+    ERRORCODE    retCode;
+    uint32_t     fullLength = dataLength + 1;
 
     if (fullLength > MAX_COMMAND_LENGTH )
     {
         return ERR_COMMAND_LENGTH;
     }
 
-    command = (uint8_t*)malloc(fullLength);
-    if (!command)
+    retCode = allocPacket(&command, fullLength);
+    if (retCode != SUCCESS)
     {
-        return ERR_NO_MEM;
+        return retCode;
     }
 
-    command[0] = commandID;
-    memcpy(command + 1, data, dataLength);
+    command.data[0] = commandID;
+    memcpy(command.data + 1, data, dataLength);
 
     debug("*respData 0x%x\n", *respData);
-    retCode = sendCommandAndReceiveResponse(session, command, fullLength, respData, respLength);
-    free(command);
+    retCode = issueCommand(session, &command, respData, respLength, policy);
+    freePacket(&command);
     debug("*respData 0x%x\n", *respData);
     return retCode;
 }
+
+ERRORCODE callCustomProcedureAsync (commandQueue* queue, uint8_t commandID, uint8_t* data, uint16_t dataLength,
+                                    const commandPolicy* policy, commandCallback callback, void* context)
+{
+    packetBuffer command;
+    ERRORCODE    retCode;
+    uint32_t     fullLength = dataLength + 1;
+
+    if (fullLength > MAX_COMMAND_LENGTH )
+    {
+        return ERR_COMMAND_LENGTH;
+    }
+
+    retCode = allocPacket(&command, fullLength);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    command.data[0] = commandID;
+    memcpy(command.data + 1, data, dataLength);
+
+    return submitCommand(queue, &command, policy, true, callback, context);
+}
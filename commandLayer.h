@@ -8,6 +8,9 @@
 #ifndef COMMANDLAYER_H_
 #define COMMANDLAYER_H_
 
+#include "commandQueue.h"
+#include "cmac.h"
+
 #define KEY_SCOPE_TESTING               0x03
 #define KEY_SCOPE_PRE_PERSONALISATION   0x04
 #define KEY_SCOPE_PERSONALISTAION       0x05
@@ -29,11 +32,23 @@
 #define COMMAND_WRITE_PROCEDURE         0x73
 #define COMMAND_REGISTER_PROCEDURE      0x75
 #define COMMAND_RCS_ONE                 0x01
+#define COMMAND_RCS_LZ4                 0x02
+#define COMMAND_RCS_CRC32               0x03
+#define COMMAND_RCS_READBACK            0x04
+
+/*
+ * How a command is treated when its reply goes missing
+ */
+typedef struct _commandPolicy commandPolicy;
+
+extern const commandPolicy idempotentPolicy;  // sent again - it does the same thing however many times it arrives
+extern const commandPolicy onceOnlyPolicy;    // never sent again, the caller has to find out what happened
 
 ERRORCODE updateLifeCycle     (sessionDetails* session);
 ERRORCODE writeTimeout        (sessionDetails* session,  uint16_t  timeout);
 ERRORCODE writeKey            (sessionDetails* session,  uint8_t   scope,     uint8_t  usage,   uint8_t* key);
-ERRORCODE writeFlash          (sessionDetails* session,  uint32_t  address,   uint8_t* data,    uint16_t dataLength);
+ERRORCODE writeFlash          (sessionDetails* session,  uint32_t  address,   uint8_t* data,    uint16_t dataLength,
+                               const uint8_t*  checksums);
 ERRORCODE verifyFlash         (sessionDetails* session,  uint32_t  address,   uint8_t* data,    uint16_t dataLength);
 ERRORCODE signCheckFlash      (sessionDetails* session,  uint32_t  address,   uint32_t length,  bool     otp,        uint8_t** signature);
 ERRORCODE eraseFlash          (sessionDetails* session,  uint8_t   sector,    bool     override);
@@ -42,6 +57,50 @@ ERRORCODE blankCheckFlash     (sessionDetails* session);
 ERRORCODE writeProcedure      (sessionDetails* session,  uint32_t  address,   uint8_t* data,    uint16_t dataLength);
 ERRORCODE registerProcedure   (sessionDetails* session,  uint8_t   opCode,    uint32_t address);
 ERRORCODE callCustomProcedure (sessionDetails* session,  uint8_t   commandID, uint8_t* data, uint16_t dataLength,
-                               uint8_t**       respData, uint16_t* respLength);
+                               uint8_t**       respData, uint16_t* respLength, const commandPolicy* policy);
+
+/*
+ * writeFlash in two steps, to keep the link busy on protected sessions:
+ * prepare the next write before sending the current one, and it is
+ * encrypted while the current one is on the wire. A prepared write is
+ * freed by sending it, or by dropping it.
+ */
+ERRORCODE prepareWriteFlash   (sessionDetails* session,  uint32_t  address,   uint8_t* data,    uint16_t dataLength,
+                               const uint8_t*  checksums, const uint8_t* sealed, packetBuffer* command);
+ERRORCODE sendWriteFlash      (sessionDetails* session,  packetBuffer* command);
+void      dropWriteFlash      (sessionDetails* session,  packetBuffer* command);
+
+/*
+ * Precompute the checksums of a write for every transID, so sending it
+ * again and again costs no checksumming
+ */
+ERRORCODE writeFlashChecksums (uint32_t address, uint8_t* data, uint16_t dataLength, uint8_t* checksums);
+
+/*
+ * Seal a write for one unit ahead of its session, into sealedWriteSize
+ * bytes, for prepareWriteFlash
+ */
+uint32_t  sealedWriteSize     (uint16_t dataLength);
+ERRORCODE sealWriteFlash      (const cmacKey* cipher, uint32_t address, uint8_t* data, uint16_t dataLength, uint8_t* sealed);
+
+/*
+ * Queued versions - these return once the command is submitted and the
+ * callback is run from processCompletions with the outcome
+ */
+ERRORCODE writeFlashAsync          (commandQueue* queue, uint32_t address,   uint8_t* data, uint16_t dataLength,
+                                    commandCallback callback, void* context);
+ERRORCODE verifyFlashAsync         (commandQueue* queue, uint32_t address,   uint8_t* data, uint16_t dataLength,
+                                    commandCallback callback, void* context);
+ERRORCODE eraseFlashAsync          (commandQueue* queue, uint8_t  sector,    bool     override,
+                                    commandCallback callback, void* context);
+ERRORCODE signCheckFlashAsync      (commandQueue* queue, uint32_t address,   uint32_t length, bool otp,
+                                    commandCallback callback, void* context);
+ERRORCODE callCustomProcedureAsync (commandQueue* queue, uint8_t  commandID, uint8_t* data, uint16_t dataLength,
+                                    const commandPolicy* policy, commandCallback callback, void* context);
+
+/*
+ * run a queued request, used by the queue worker
+ */
+ERRORCODE executeCommand           (sessionDetails* session, commandRequest* request);
 
 #endif /* COMMANDLAYER_H_ */
@@ -0,0 +1,347 @@
+/*
+ * commandQueue.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Submission/completion queue in front of the command layer. A worker
+ * thread owns the session and runs commands in order, so the caller can
+ * get on with preparing the next one while the current one is on the wire.
+ */
+
+#include "shunt.h"
+#include "sessionLayer.h"
+#include "commandQueue.h"
+#include "commandLayer.h"
+
+struct _commandQueue
+{
+    sessionDetails* session;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;        // signalled when a command is queued or on shutdown
+    pthread_cond_t  finished;    // signalled whenever a command completes
+    commandRequest* head;
+    commandRequest* tail;
+    commandRequest* completeHead;
+    commandRequest* completeTail;
+    uint32_t        outstanding; // submitted but not yet through the worker
+    int             notify[2];   // non-blocking pipe, a byte written per async completion
+    bool            stopping;
+    shuntEnv*       env;         // of the thread that created the queue, for the worker
+};
+
+/*
+ * appendRequest
+ *
+ * add a request to the end of a singly linked list
+ */
+static void appendRequest(commandRequest** head, commandRequest** tail, commandRequest* request)
+{
+    request->next = NULL;
+    if (*tail)
+    {
+        (*tail)->next = request;
+    }
+    else
+    {
+        *head = request;
+    }
+    *tail = request;
+}
+
+/*
+ * commandWorker
+ *
+ * Main function for the thread that runs queued commands
+ */
+static void* commandWorker(commandQueue* queue)
+{
+    commandRequest* request;
+    uint8_t         token = 0;
+    bool            signal;
+
+    useShuntEnv(queue->env);
+    pthread_mutex_lock(&(queue->lock));
+    while (1)
+    {
+        while (!queue->head && !queue->stopping)
+        {
+            pthread_cond_wait(&(queue->work), &(queue->lock));
+        }
+        if (!queue->head)
+        {
+            break;
+        }
+
+        request = queue->head;
+        queue->head = request->next;
+        if (!queue->head)
+        {
+            queue->tail = NULL;
+        }
+        pthread_mutex_unlock(&(queue->lock));
+
+        executeCommand(queue->session, request);
+
+        pthread_mutex_lock(&(queue->lock));
+        signal = (request->callback != NULL);
+        if (signal)
+        {
+            appendRequest(&(queue->completeHead), &(queue->completeTail), request);
+        }
+        else
+        {
+            request->done = true;
+        }
+        queue->outstanding--;
+        pthread_cond_broadcast(&(queue->finished));
+        pthread_mutex_unlock(&(queue->lock));
+
+        // outside the lock - a full pipe already has the reader's attention, so EAGAIN is fine
+        if (signal && (write(queue->notify[1], &token, 1) != 1) && (errno != EAGAIN))
+        {
+            debug("Failed to signal completion %d\n", errno);
+        }
+
+        pthread_mutex_lock(&(queue->lock));
+    }
+    pthread_mutex_unlock(&(queue->lock));
+
+    return NULL;
+}
+
+/*
+ * queueRequest
+ *
+ * hand a request to the worker
+ */
+static ERRORCODE queueRequest(commandQueue* queue, commandRequest* request)
+{
+    if (pthread_mutex_lock(&(queue->lock)) != 0)
+    {
+        return ERR_LOCK_FAIL;
+    }
+    appendRequest(&(queue->head), &(queue->tail), request);
+    queue->outstanding++;
+    pthread_cond_signal(&(queue->work));
+    pthread_mutex_unlock(&(queue->lock));
+
+    return SUCCESS;
+}
+
+/*
+ * submitCommand
+ *
+ * queue a command to run asynchronously. The queue takes ownership of
+ * the command buffer, success or failure.
+ */
+ERRORCODE submitCommand(commandQueue* queue, packetBuffer* command, const struct _commandPolicy* policy,
+                        bool wantResponse, commandCallback callback, void* context)
+{
+    commandRequest* request;
+    ERRORCODE       retCode;
+
+    request = (commandRequest*)calloc(1, sizeof(commandRequest));
+    if (!request)
+    {
+        freePacket(command);
+        return ERR_NO_MEM;
+    }
+
+    request->command       = *command;
+    request->policy        = policy;
+    request->wantResponse  = wantResponse;
+    request->callback      = callback;
+    request->context       = context;
+
+    retCode = queueRequest(queue, request);
+    if (retCode != SUCCESS)
+    {
+        freePacket(&(request->command));
+        free(request);
+    }
+    return retCode;
+}
+
+/*
+ * runRequest
+ *
+ * queue a request and wait for it - the synchronous commands come
+ * through here when a queue is attached to their session
+ */
+ERRORCODE runRequest(commandQueue* queue, commandRequest* request)
+{
+    ERRORCODE retCode;
+
+    request->callback = NULL;
+    request->done     = false;
+
+    retCode = queueRequest(queue, request);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    pthread_mutex_lock(&(queue->lock));
+    while (request->done == false)
+    {
+        pthread_cond_wait(&(queue->finished), &(queue->lock));
+    }
+    pthread_mutex_unlock(&(queue->lock));
+
+    return request->result;
+}
+
+/*
+ * processCompletions
+ *
+ * run the callbacks for every completed asynchronous command, in the
+ * order they were submitted. Call this when commandQueueFd is readable.
+ *
+ * Returns: the number of callbacks run
+ */
+uint32_t processCompletions(commandQueue* queue)
+{
+    commandRequest* request;
+    uint8_t         drain[64];
+    uint32_t        completed = 0;
+
+    while (read(queue->notify[0], drain, sizeof(drain)) > 0);
+
+    while (1)
+    {
+        pthread_mutex_lock(&(queue->lock));
+        request = queue->completeHead;
+        if (request)
+        {
+            queue->completeHead = request->next;
+            if (!queue->completeHead)
+            {
+                queue->completeTail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&(queue->lock));
+
+        if (!request)
+        {
+            break;
+        }
+
+        request->callback(request->context, request->result, request->respData, request->respLength);
+        completed++;
+
+        if (request->respData)
+        {
+            free(request->respData);
+        }
+        freePacket(&(request->command));
+        free(request);
+    }
+
+    return completed;
+}
+
+/*
+ * waitForCompletions
+ *
+ * block until everything submitted so far has finished, then run
+ * the outstanding callbacks
+ */
+void waitForCompletions(commandQueue* queue)
+{
+    pthread_mutex_lock(&(queue->lock));
+    while (queue->outstanding)
+    {
+        pthread_cond_wait(&(queue->finished), &(queue->lock));
+    }
+    pthread_mutex_unlock(&(queue->lock));
+
+    processCompletions(queue);
+}
+
+int commandQueueFd(commandQueue* queue)
+{
+    return queue->notify[0];
+}
+
+/*
+ * createCommandQueue
+ *
+ * Allocate a queue, start its worker and attach it to the session
+ */
+ERRORCODE createCommandQueue(sessionDetails* session, commandQueue** queue)
+{
+    commandQueue* newQueue;
+
+    newQueue = (commandQueue*)calloc(1, sizeof(commandQueue));
+    if (!newQueue)
+    {
+        return ERR_NO_MEM;
+    }
+    newQueue->session = session;
+    newQueue->env = currentEnv();
+
+    if (pipe(newQueue->notify) != 0)
+    {
+        debug("Failed to create notify pipe %d\n", errno);
+        free(newQueue);
+        return ERR_CREATE_MUTEX;
+    }
+    fcntl(newQueue->notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(newQueue->notify[1], F_SETFL, O_NONBLOCK);
+
+    if ((pthread_mutex_init(&(newQueue->lock), NULL) != 0) ||
+        (pthread_cond_init(&(newQueue->work), NULL) != 0) ||
+        (pthread_cond_init(&(newQueue->finished), NULL) != 0))
+    {
+        debug("Failed to create queue locks %d\n", errno);
+        close(newQueue->notify[0]);
+        close(newQueue->notify[1]);
+        free(newQueue);
+        return ERR_CREATE_MUTEX;
+    }
+
+    if (pthread_create(&(newQueue->thread), NULL, (pthreadFunc)commandWorker, newQueue) != 0)
+    {
+        debug("Failed to start queue thread %d\n", errno);
+        pthread_cond_destroy(&(newQueue->finished));
+        pthread_cond_destroy(&(newQueue->work));
+        pthread_mutex_destroy(&(newQueue->lock));
+        close(newQueue->notify[0]);
+        close(newQueue->notify[1]);
+        free(newQueue);
+        return ERR_CREATE_THREAD;
+    }
+
+    setSessionQueue(session, newQueue);
+    *queue = newQueue;
+
+    return SUCCESS;
+}
+
+/*
+ * destroyCommandQueue
+ *
+ * finish everything queued, run the last callbacks, detach from the
+ * session and free the queue
+ */
+void destroyCommandQueue(commandQueue* queue)
+{
+    pthread_mutex_lock(&(queue->lock));
+    queue->stopping = true;
+    pthread_cond_signal(&(queue->work));
+    pthread_mutex_unlock(&(queue->lock));
+
+    pthread_join(queue->thread, NULL);
+    processCompletions(queue);
+
+    setSessionQueue(queue->session, NULL);
+
+    pthread_cond_destroy(&(queue->finished));
+    pthread_cond_destroy(&(queue->work));
+    pthread_mutex_destroy(&(queue->lock));
+    close(queue->notify[0]);
+    close(queue->notify[1]);
+    free(queue);
+}
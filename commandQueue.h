@@ -0,0 +1,56 @@
+/*
+ * commandQueue.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef COMMANDQUEUE_H_
+#define COMMANDQUEUE_H_
+
+#include "sessionLayer.h"
+
+struct _commandPolicy;
+
+/*
+ * Called from processCompletions for each finished asynchronous command.
+ * respData (if any) is only valid for the duration of the callback.
+ */
+typedef void (*commandCallback)(void* context, ERRORCODE result, uint8_t* respData, uint16_t respLength);
+
+typedef struct _commandRequest
+{
+    packetBuffer                 command;
+    const struct _commandPolicy* policy;
+    bool                         wantResponse;
+    uint8_t*                     respData;
+    uint16_t                     respLength;
+    ERRORCODE                    result;
+    commandCallback              callback;  // NULL for a synchronous caller waiting on the request
+    void*                        context;
+    bool                         done;
+    struct _commandRequest*      next;
+} commandRequest;
+
+/*
+ * A queue owns all traffic on its session while it exists. The synchronous
+ * commands still work, they just wait their turn behind queued ones.
+ */
+ERRORCODE createCommandQueue  (sessionDetails* session, commandQueue** queue);
+void      destroyCommandQueue (commandQueue* queue);
+
+/*
+ * readable whenever completions are waiting for processCompletions
+ */
+int       commandQueueFd      (commandQueue* queue);
+uint32_t  processCompletions  (commandQueue* queue);
+void      waitForCompletions  (commandQueue* queue);
+
+/*
+ * used by the command layer
+ */
+ERRORCODE submitCommand       (commandQueue* queue, packetBuffer* command, const struct _commandPolicy* policy,
+                               bool wantResponse, commandCallback callback, void* context);
+ERRORCODE runRequest          (commandQueue* queue, commandRequest* request);
+
+#endif /* COMMANDQUEUE_H_ */
@@ -0,0 +1,164 @@
+/*
+ * compress.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Host side compression for images sent to the decompressing RCS
+ */
+
+#include "shunt.h"
+#include "compress.h"
+
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5  // the last 5 bytes of a block are always literals
+#define LZ4_MF_LIMIT      12 // and the last match starts at least 12 bytes from the end
+#define LZ4_MAX_OFFSET    0xFFFF
+#define LZ4_HASH_BITS     12
+
+static uint32_t read32 (const uint8_t* src)
+{
+    uint32_t value;
+
+    memcpy(&value, src, sizeof(value));
+    return value;
+}
+
+static uint32_t lz4Hash (uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/*
+ * writeLength
+ *
+ * write the extra bytes of a literal or match length that didn't
+ * fit in its token nibble
+ */
+static uint8_t* writeLength (uint8_t* dest, uint32_t length)
+{
+    while (length >= 255)
+    {
+        *dest++ = 255;
+        length -= 255;
+    }
+    *dest++ = length;
+
+    return dest;
+}
+
+/*
+ * writeSequence
+ *
+ * write one LZ4 sequence - a token, literals and optionally a match
+ *
+ * Returns: the new end of the output, or NULL if it would overflow
+ */
+static uint8_t* writeSequence (uint8_t* dest, uint8_t* destEnd, const uint8_t* literals, uint32_t litLength, uint16_t offset, uint32_t matchLength)
+{
+    uint8_t* token;
+    uint32_t matchCode = 0;
+
+    if (offset)
+    {
+        matchCode = matchLength - LZ4_MIN_MATCH;
+    }
+
+    if (dest + 1 + (litLength / 255) + 1 + litLength + 2 + (matchCode / 255) + 1 > destEnd)
+    {
+        return NULL;
+    }
+
+    token = dest++;
+    *token = ((litLength < 15 ? litLength : 15) << 4) | (matchCode < 15 ? matchCode : 15);
+
+    if (litLength >= 15)
+    {
+        dest = writeLength(dest, litLength - 15);
+    }
+    memcpy(dest, literals, litLength);
+    dest += litLength;
+
+    if (offset)
+    {
+        *dest++ = offset & 0xFF;
+        *dest++ = offset >> 8;
+        if (matchCode >= 15)
+        {
+            dest = writeLength(dest, matchCode - 15);
+        }
+    }
+
+    return dest;
+}
+
+/*
+ * lz4CompressBlock
+ *
+ * compress a buffer into a single LZ4 block (no frame header), which
+ * is what the decompressing RCS expects. Greedy single-probe matching,
+ * firmware compresses well enough without anything cleverer.
+ *
+ * Arguments:
+ * src          - data to compress
+ * srcLen       - length of the data
+ * dest         - output buffer
+ * destCapacity - size of dest, LZ4_COMPRESS_BOUND(srcLen) always fits
+ * destLen      - output, compressed length
+ *
+ * Returns:
+ *      error code, SUCCESS on success
+ */
+ERRORCODE lz4CompressBlock (const uint8_t* src, uint32_t srcLen, uint8_t* dest, uint32_t destCapacity, uint32_t* destLen)
+{
+    uint32_t hashTable[1 << LZ4_HASH_BITS];
+    uint32_t anchor = 0;
+    uint32_t ip = 0;
+    uint32_t ref;
+    uint32_t hash;
+    uint32_t matchLength;
+    uint32_t matchLimit;
+    uint8_t* out = dest;
+    uint8_t* outEnd = dest + destCapacity;
+
+    memset(hashTable, 0, sizeof(hashTable));
+    matchLimit = (srcLen > LZ4_LAST_LITERALS) ? srcLen - LZ4_LAST_LITERALS : 0;
+
+    while (ip + LZ4_MF_LIMIT <= srcLen)
+    {
+        hash = lz4Hash(read32(src + ip));
+        ref  = hashTable[hash];
+        hashTable[hash] = ip;
+
+        if ((ref >= ip) || (ip - ref > LZ4_MAX_OFFSET) || (read32(src + ref) != read32(src + ip)))
+        {
+            ip++;
+            continue;
+        }
+
+        matchLength = LZ4_MIN_MATCH;
+        while ((ip + matchLength < matchLimit) && (src[ref + matchLength] == src[ip + matchLength]))
+        {
+            matchLength++;
+        }
+
+        out = writeSequence(out, outEnd, src + anchor, ip - anchor, ip - ref, matchLength);
+        if (!out)
+        {
+            return ERR_TOO_BIG;
+        }
+
+        ip += matchLength;
+        anchor = ip;
+    }
+
+    out = writeSequence(out, outEnd, src + anchor, srcLen - anchor, 0, 0);
+    if (!out)
+    {
+        return ERR_TOO_BIG;
+    }
+
+    *destLen = out - dest;
+
+    return SUCCESS;
+}
@@ -0,0 +1,20 @@
+/*
+ * compress.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include "shunt.h"
+
+/*
+ * Worst case size of an LZ4 block for a given input length
+ */
+#define LZ4_COMPRESS_BOUND(x) ((x) + ((x) / 255) + 16)
+
+ERRORCODE lz4CompressBlock (const uint8_t* src, uint32_t srcLen, uint8_t* dest, uint32_t destCapacity, uint32_t* destLen);
+
+#endif /* COMPRESS_H_ */
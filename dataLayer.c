@@ -8,9 +8,11 @@
 #include "shunt.h"
 #include "serial.h"
 #include "utils.h"
+#include "packetBuffer.h"
 #include "dataLayer.h"
 
 #define PACKET_READ_TIMEOUT 2 * RETRANSMISSION_TIMEOUT
+#define SERIAL_WAIT_SLICE   100   // ms to sleep waiting for bytes before checking the deadline
 
 #define SYNC_BYTE1 0xBE
 #define SYNC_BYTE2 0xEF
@@ -28,14 +30,6 @@ typedef struct __attribute__((packed)) _dataLayerHeader
     uint8_t checksum;
 } dataLayerHeader;
 
-typedef struct _dataLayerPacket
-{
-    dataLayerHeader header;
-    uint8_t*        data;
-    uint16_t        dataLength;
-    uint8_t         checksum[4];
-} dataLayerPacket;
-
 /*
  * calcChecksum
  *
@@ -68,7 +62,7 @@ static uint8_t calcHeaderChecksum (uint8_t* header)
  *
  * Returns: None
  */
-static void calcDataChecksum (uint8_t* data, uint16_t dataLength, uint8_t* checksum)
+void calcDataChecksum (const uint8_t* data, uint16_t dataLength, uint8_t* checksum)
 {
     uint8_t output[16];
 
@@ -128,45 +122,20 @@ static void clearIncoming(serialSession* session)
 /*
  * sendPacket
  *
- * send a data packet over the wire
+ * send a framed packet over the wire
  *
  * Arguments:
  * serialPort - file descriptor for open serial device
- * packet     - the packet to send
+ * frame      - header, data and checksum, ready to go
+ * length     - length of the frame
  *
  *
  */
-static ERRORCODE sendPacket (serialSession* serialPort, dataLayerPacket* packet)
+static ERRORCODE sendPacket (serialSession* serialPort, uint8_t* frame, uint16_t length)
 {
-    ERRORCODE retCode;
-    uint16_t sendLength;
-    uint8_t* sendBuffer;
-
-    sendLength = sizeof(dataLayerHeader);
-    if ((packet->data != NULL) &&(packet->dataLength != 0))
-    {
-        sendLength += packet->dataLength + 4;
-    }
-
-    sendBuffer = (uint8_t*)malloc(sendLength);
-    if (!sendBuffer)
-    {
-        return ERR_NO_MEM;
-    }
-
-    memcpy(sendBuffer, (uint8_t*)&(packet->header), sizeof(dataLayerHeader));
-    if(packet->data != NULL)
-    {
-        memcpy(sendBuffer + sizeof(dataLayerHeader), packet->data, packet->dataLength);
-        memcpy(sendBuffer + sizeof(dataLayerHeader) + packet->dataLength, packet->checksum, 4);
-    }
-
     clearIncoming(serialPort);
 
-    retCode = serialWrite (serialPort, sendBuffer, sendLength);
-    free(sendBuffer);
-
-    return retCode;
+    return serialWrite (serialPort, frame, length);
 }
 
 
@@ -198,10 +167,15 @@ static ERRORCODE traverseSyncBytes (serialSession* serialPort, dataLayerHeader*
     while ((syncptr < syncbytes + 3) && (time(NULL) <= deadLine))
     {
         retCode = serialRead(serialPort, headerptr, 1, &readBytes);
-        if (retCode != SUCCESS)
+        if (retCode == ERR_SERIAL_NO_DATA)
         {
+            serialWait(serialPort, SERIAL_WAIT_SLICE);
             continue;
         }
+        if (retCode != SUCCESS)
+        {
+            break;
+        }
 
         if (*headerptr == *syncptr)
         {
@@ -254,20 +228,16 @@ static ERRORCODE readUntil (serialSession* serialPort, uint8_t* buffer,  uint16_
     uint8_t  retCode = ERR_SERIAL_TIMEOUT;
     uint8_t* bufferptr;
     int16_t  readBytes;
-    struct   timespec tinySleep;
 
     bufferptr = buffer;
 
     while ((time(NULL) <= deadLine))
     {
-        tinySleep.tv_nsec = 10000;
-        tinySleep.tv_sec  = 0;
-
         retCode = serialRead(serialPort, bufferptr, remainingBytes, &readBytes);
 
         if (retCode == ERR_SERIAL_NO_DATA)
         {
-            nanosleep(&tinySleep, NULL);
+            serialWait(serialPort, SERIAL_WAIT_SLICE);
             continue;
         }
 
@@ -277,7 +247,6 @@ static ERRORCODE readUntil (serialSession* serialPort, uint8_t* buffer,  uint16_
             {
                 remainingBytes -= readBytes;
                 bufferptr += readBytes;
-                nanosleep(&tinySleep, NULL);
                 continue;
             }
             else
@@ -357,60 +326,91 @@ static ERRORCODE getBody (serialSession* serialPort, uint8_t* dataBody, uint16_t
 /*
  * sendDataLayerPacket
  *
- * construct and send a data layer packet
+ * construct and send a data layer packet. The header goes in the
+ * packet's headroom and the checksum in its tailroom, and the packet is
+ * left as it was found so it can be sent again.
  *
  * Arguments:
  * serialPort - file descriptor for open serial device
  * protocol   - protocol byte
  * id         - id nibble
  * seq        - sequence number nibble
- * data       - the data to send
- * dataLength - length of the data for this packet
+ * packet     - the data to send, NULL for none
  *
  * Returns:
  *      error code, SUCCESS on success;
  */
-ERRORCODE sendDataLayerPacket (serialSession* serialPort, uint8_t protocol, uint8_t id, uint8_t sequence, uint8_t* data, uint16_t dataLength)
+ERRORCODE sendDataLayerPacket (serialSession* serialPort, uint8_t protocol, uint8_t id, uint8_t sequence, packetBuffer* packet)
 {
-    dataLayerPacket packet;
-    ERRORCODE       retCode;
+    dataLayerHeader  header;
+    dataLayerHeader* frameHeader;
+    uint8_t*         checksum;
+    uint32_t         dataLength;
+    ERRORCODE        retCode;
+
+    dataLength = packet ? packet->length : 0;
+    if (dataLength == 0)
+    {
+        prepareHeader(&header, protocol, id, sequence, 0);
+        return sendPacket(serialPort, (uint8_t*)&header, sizeof(dataLayerHeader));
+    }
 
+    checksum = packetPut(packet, DATA_LAYER_TAILROOM);
+    frameHeader = (dataLayerHeader*)packetPush(packet, DATA_LAYER_HEADROOM);
+    if (!checksum || !frameHeader)
+    {
+        debug("No room to frame a packet of %u bytes\n", dataLength);
+        if (frameHeader)
+        {
+            packetPull(packet, DATA_LAYER_HEADROOM);
+        }
+        packetTrim(packet, dataLength);
+        return ERR_PACKET_ROOM;
+    }
 
-    prepareHeader(&(packet.header), protocol, id, sequence, dataLength);
+    if (packet->checksum)
+    {
+        memcpy(checksum, packet->checksum, DATA_LAYER_TAILROOM);
+    }
+    else
+    {
+        calcDataChecksum(packet->data + DATA_LAYER_HEADROOM, dataLength, checksum);
+    }
+    prepareHeader(frameHeader, protocol, id, sequence, dataLength);
 
-    packet.data       = data;
-    packet.dataLength = dataLength;
-    calcDataChecksum(packet.data, packet.dataLength, packet.checksum);
+    retCode = sendPacket(serialPort, packet->data, packet->length);
 
-    retCode = sendPacket(serialPort, &packet);
+    packetPull(packet, DATA_LAYER_HEADROOM);
+    packetTrim(packet, dataLength);
 
     return retCode;
 }
 
 /*
- * sendDataLayerPacket
+ * receiveDataLayerPacket
  *
- * construct and send a data layer packet
+ * receive and check a data layer packet
  *
  * Arguments:
  * serialPort - file descriptor for open serial device
  * protocol   - protocol byte
  * id         - id nibble
  * seq        - sequence number nibble
- * data       - the data to send
- * dataLength - length of the data for this packet
+ * packet     - filled with the data, which is freed with freePacket. Left
+ *              empty if there is none, or on failure
+ * timeout    - seconds to wait
  *
  * Returns:
  *      error code, SUCCESS on success;
  */
-ERRORCODE receiveDataLayerPacket (serialSession* serialPort, uint8_t* protocol, uint8_t* id, uint8_t* sequence, uint8_t** data, uint16_t* dataLength, uint8_t timeout)
+ERRORCODE receiveDataLayerPacket (serialSession* serialPort, uint8_t* protocol, uint8_t* id, uint8_t* sequence, packetBuffer* packet, uint8_t timeout)
 {
     int             retCode;
     dataLayerHeader header;
     time_t          deadLine;
     uint16_t        expLength;
-    uint8_t*        dataBody;
 
+    allocPacketRoom(packet, 0, 0, 0);
     deadLine = time(NULL) + timeout;
 
     retCode = traverseSyncBytes(serialPort, &header, deadLine);
@@ -453,28 +453,26 @@ ERRORCODE receiveDataLayerPacket (serialSession* serialPort, uint8_t* protocol,
     if (expLength > 0)
     {
         deadLine = time(NULL) + timeout;
-        dataBody = (uint8_t*) malloc(expLength);
+        retCode = allocPacketRoom(packet, 0, expLength, 0);
+        if (retCode != SUCCESS)
+        {
+            return retCode;
+        }
 
-        retCode = getBody(serialPort, dataBody, expLength, deadLine);
+        retCode = getBody(serialPort, packet->data, expLength, deadLine);
         if (retCode != SUCCESS)
         {
             debug("Failed to get body\n");
-            free(dataBody);
+            freePacket(packet);
             return retCode;
         }
         debug("Got Data - \n");
-        hexDebug(dataBody, expLength);
-    }
-    else
-    {
-        dataBody = NULL;
+        hexDebug(packet->data, expLength);
     }
 
     *protocol   = header.control;
     *id         = (header.idSeq >> 4) & 0xF;
     *sequence   = header.idSeq & 0x0F;
-    *data       = dataBody;
-    *dataLength = expLength;
 
     return SUCCESS;
 }
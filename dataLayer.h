@@ -8,7 +8,14 @@
 #ifndef DATALAYER_H_
 #define DATALAYER_H_
 
-ERRORCODE sendDataLayerPacket    (serialSession* serialPort, uint8_t  protocol, uint8_t  id, uint8_t  sequence, uint8_t*  data, uint16_t  dataLength);
-ERRORCODE receiveDataLayerPacket (serialSession* serialPort, uint8_t* protocol, uint8_t* id, uint8_t* sequence, uint8_t** data, uint16_t* dataLength, uint8_t timeout);
+#include "packetBuffer.h"
+
+/*
+ * The 4 byte checksum that follows the data of a frame
+ */
+void      calcDataChecksum       (const uint8_t* data, uint16_t dataLength, uint8_t* checksum);
+
+ERRORCODE sendDataLayerPacket    (serialSession* serialPort, uint8_t  protocol, uint8_t  id, uint8_t  sequence, packetBuffer* packet);
+ERRORCODE receiveDataLayerPacket (serialSession* serialPort, uint8_t* protocol, uint8_t* id, uint8_t* sequence, packetBuffer* packet, uint8_t timeout);
 
 #endif /* DATALAYER_H_ */
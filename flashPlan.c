@@ -0,0 +1,622 @@
+/*
+ * flashPlan.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Work out, once, what it takes to flash an image - which sectors to
+ * erase and every write with its address and length - so that flashing
+ * a device is just a matter of sending it. Plans can be saved and
+ * loaded, so the work can even be done once for a whole batch of runs.
+ */
+
+#include "shunt.h"
+#include "utils.h"
+#include "flashPlan.h"
+#include "frameCache.h"
+
+#include <openssl/sha.h>
+
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
+#define PLAN_MAGIC          "SHNTPLAN"
+#define PLAN_VERSION        1
+#define PLAN_FLAG_COMPRESS  0x01
+#define PLAN_FLAG_OVERRIDE  0x02
+#define PLAN_HEADER_WORDS   6
+#define PLAN_SECTOR_WORDS   7
+#define PLAN_WRITE_WORDS    2
+#define PLAN_SEGMENT_WORDS  2
+
+/*
+ * Map of sector number to size in K
+ */
+uint8_t sectorMap[FLASH_SECTORS] = {
+                          32, 32, 32, 32,  4,  4,  4,  4,
+                           4,  4,  4,  4,  4,  4,  4,  4,
+                           4,  4,  4,  4,  4,  4,  4,  4,
+                           4,  4,  4,  4,  4,  4,  4,  4,
+                           4,  4,  4,  4
+                      };
+
+uint32_t calcOffsetAddress(uint8_t startSect)
+{
+    uint32_t offset = 0;
+
+    while (startSect)
+    {
+        startSect--;
+        offset += sectorMap[startSect] * 1024;
+    }
+    return offset;
+}
+
+uint8_t findSectorForAddr(uint32_t addr)
+{
+    uint32_t offset = 0;
+    uint8_t  sectorNum = 0;
+
+    while ((offset < addr) && (sectorNum < FLASH_SECTORS))
+    {
+        offset += sectorMap[sectorNum] * 1024;
+        if (addr < offset)
+        {
+            break;
+        }
+        sectorNum++;
+    }
+    return sectorNum;
+}
+
+/*
+ * addWrite
+ *
+ * append a write to the plan, growing the list as needed
+ */
+static ERRORCODE addWrite(flashPlan* plan, uint32_t* capacity, uint32_t address, uint16_t length)
+{
+    planWrite* writes;
+
+    if (plan->writeCount == *capacity)
+    {
+        *capacity = (*capacity) ? (*capacity) * 2 : 64;
+        writes = (planWrite*)realloc(plan->writes, (*capacity) * sizeof(planWrite));
+        if (!writes)
+        {
+            return ERR_NO_MEM;
+        }
+        plan->writes = writes;
+    }
+
+    plan->writes[plan->writeCount].address = address;
+    plan->writes[plan->writeCount].length = length;
+    plan->writeCount++;
+
+    return SUCCESS;
+}
+
+/*
+ * planSectors
+ *
+ * split the image's segments up by sector, and each piece into chunks
+ */
+static ERRORCODE planSectors(flashPlan* plan)
+{
+    sparseImage*  image = &(plan->image);
+    imageSegment* segment;
+    planSector*   current;
+    uint32_t      capacity = 0;
+    uint32_t      index;
+    uint32_t      address;
+    uint32_t      endAddr;
+    uint32_t      sectorEnd;
+    uint16_t      length;
+    uint8_t       sector;
+    ERRORCODE     retCode;
+
+    plan->sectors = (planSector*)calloc(FLASH_SECTORS, sizeof(planSector));
+    if (!plan->sectors)
+    {
+        return ERR_NO_MEM;
+    }
+
+    for (index = 0; index < image->segmentCount; index++)
+    {
+        segment = &(image->segments[index]);
+        address = segment->address;
+
+        while (address < segment->address + segment->length)
+        {
+            sector = findSectorForAddr(address);
+            sectorEnd = calcOffsetAddress(sector) + sectorMap[sector] * 1024;
+            endAddr = segment->address + segment->length;
+            if (endAddr > sectorEnd)
+            {
+                endAddr = sectorEnd;
+            }
+
+            current = plan->sectorCount ? &(plan->sectors[plan->sectorCount - 1]) : NULL;
+            if (!current || (current->sector != sector))
+            {
+                current = &(plan->sectors[plan->sectorCount++]);
+                current->sector     = sector;
+                current->address    = calcOffsetAddress(sector);
+                current->size       = sectorMap[sector] * 1024;
+                current->dataStart  = address;
+                current->firstWrite = plan->writeCount;
+            }
+            current->dataEnd = endAddr;
+
+            for (; address < endAddr; address += length)
+            {
+                length = (endAddr - address > plan->chunkSize) ? plan->chunkSize : endAddr - address;
+                retCode = addWrite(plan, &capacity, address, length);
+                if (retCode != SUCCESS)
+                {
+                    return retCode;
+                }
+                current->writeCount++;
+            }
+        }
+    }
+
+    return SUCCESS;
+}
+
+static void putWord(uint8_t** position, uint32_t value)
+{
+    (*position)[0] = (value >> 24) & 0xFF;
+    (*position)[1] = (value >> 16) & 0xFF;
+    (*position)[2] = (value >> 8) & 0xFF;
+    (*position)[3] = value & 0xFF;
+    *position += 4;
+}
+
+static uint32_t getWord(const uint8_t** position)
+{
+    uint32_t value = ((*position)[0] << 24) | ((*position)[1] << 16) | ((*position)[2] << 8) | (*position)[3];
+
+    *position += 4;
+    return value;
+}
+
+/*
+ * saveFlashPlan
+ *
+ * write a plan out. Everything is big endian:
+ *   "SHNTPLAN", version, flags, chunk size, segment/sector/write counts
+ *   segments  - address, length
+ *   sectors   - sector, address, size, data start, data end, first write, write count
+ *   writes    - address, length
+ *   the image data for each segment in turn
+ *   CRC32 of all of the above
+ */
+ERRORCODE saveFlashPlan(flashPlan* plan, char* planFile)
+{
+    uint8_t*  buffer;
+    uint8_t*  position;
+    uint32_t  dataLength = 0;
+    uint32_t  size;
+    uint32_t  index;
+    int       planStream;
+    ERRORCODE retCode = SUCCESS;
+
+    for (index = 0; index < plan->image.segmentCount; index++)
+    {
+        dataLength += plan->image.segments[index].length;
+    }
+
+    size = strlen(PLAN_MAGIC) + 4 * (PLAN_HEADER_WORDS + PLAN_SEGMENT_WORDS * plan->image.segmentCount +
+           PLAN_SECTOR_WORDS * plan->sectorCount + PLAN_WRITE_WORDS * plan->writeCount) + dataLength + 4;
+
+    buffer = (uint8_t*)malloc(size);
+    if (!buffer)
+    {
+        return ERR_NO_MEM;
+    }
+
+    position = buffer;
+    memcpy(position, PLAN_MAGIC, strlen(PLAN_MAGIC));
+    position += strlen(PLAN_MAGIC);
+    putWord(&position, PLAN_VERSION);
+    putWord(&position, (plan->compressed ? PLAN_FLAG_COMPRESS : 0) | (plan->override ? PLAN_FLAG_OVERRIDE : 0));
+    putWord(&position, plan->chunkSize);
+    putWord(&position, plan->image.segmentCount);
+    putWord(&position, plan->sectorCount);
+    putWord(&position, plan->writeCount);
+
+    for (index = 0; index < plan->image.segmentCount; index++)
+    {
+        putWord(&position, plan->image.segments[index].address);
+        putWord(&position, plan->image.segments[index].length);
+    }
+    for (index = 0; index < plan->sectorCount; index++)
+    {
+        putWord(&position, plan->sectors[index].sector);
+        putWord(&position, plan->sectors[index].address);
+        putWord(&position, plan->sectors[index].size);
+        putWord(&position, plan->sectors[index].dataStart);
+        putWord(&position, plan->sectors[index].dataEnd);
+        putWord(&position, plan->sectors[index].firstWrite);
+        putWord(&position, plan->sectors[index].writeCount);
+    }
+    for (index = 0; index < plan->writeCount; index++)
+    {
+        putWord(&position, plan->writes[index].address);
+        putWord(&position, plan->writes[index].length);
+    }
+    for (index = 0; index < plan->image.segmentCount; index++)
+    {
+        memcpy(position, plan->image.flash + plan->image.segments[index].address, plan->image.segments[index].length);
+        position += plan->image.segments[index].length;
+    }
+    putWord(&position, generateCrc32(0, buffer, size - 4));
+
+    planStream = open(planFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (planStream == -1)
+    {
+        output("Unable to open file %s, %d\n", planFile, errno);
+        retCode = ERR_FILE_OPEN;
+    }
+    else
+    {
+        if (write(planStream, buffer, size) != (ssize_t)size)
+        {
+            output("Failed to write plan file - %s\n", strerror(errno));
+            retCode = ERR_FILE_WRITE;
+        }
+        if ((close(planStream) != 0) && (retCode == SUCCESS))
+        {
+            retCode = ERR_FILE_WRITE;
+        }
+    }
+    free(buffer);
+
+    return retCode;
+}
+
+/*
+ * checkPlan
+ *
+ * make sure a loaded plan only does things a built one could
+ */
+static ERRORCODE checkPlan(flashPlan* plan)
+{
+    planSector* sector;
+    planWrite*  write;
+    uint32_t    index;
+    uint32_t    writeIndex;
+
+    if ((plan->chunkSize == 0) || (plan->chunkSize > RCS_CHUNK_SIZE))
+    {
+        return ERR_BAD_IMAGE;
+    }
+
+    for (index = 0; index < plan->sectorCount; index++)
+    {
+        sector = &(plan->sectors[index]);
+        if ((sector->sector >= FLASH_SECTORS) || (sector->address != calcOffsetAddress(sector->sector)) ||
+            (sector->size != sectorMap[sector->sector] * 1024u) || (sector->writeCount == 0) ||
+            (sector->firstWrite > plan->writeCount) || (sector->writeCount > plan->writeCount - sector->firstWrite) ||
+            (sector->dataStart < sector->address) || (sector->dataEnd > sector->address + sector->size) ||
+            (sector->dataStart >= sector->dataEnd) || ((sector->sector == FLASH_SECTORS - 1) && !plan->override))
+        {
+            debug("Bad plan sector %u\n", index);
+            return ERR_BAD_IMAGE;
+        }
+
+        for (writeIndex = sector->firstWrite; writeIndex < sector->firstWrite + sector->writeCount; writeIndex++)
+        {
+            write = &(plan->writes[writeIndex]);
+            if ((write->length == 0) || (write->length > plan->chunkSize) ||
+                (write->address < sector->dataStart) || (write->address + write->length > sector->dataEnd))
+            {
+                debug("Bad plan write %u\n", writeIndex);
+                return ERR_BAD_IMAGE;
+            }
+        }
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * loadFlashPlan
+ *
+ * read back a plan written by saveFlashPlan
+ */
+static ERRORCODE loadFlashPlan(const uint8_t* buffer, size_t size, flashPlan* plan)
+{
+    const uint8_t* position = buffer + strlen(PLAN_MAGIC);
+    imageSegment*  segments;
+    uint32_t       segmentCount;
+    uint32_t       flags;
+    uint32_t       index;
+    const uint8_t* crcPosition = buffer + size - 4;
+    uint64_t       needed;
+    ERRORCODE      retCode;
+
+    if ((size < strlen(PLAN_MAGIC) + 4 * PLAN_HEADER_WORDS + 4) || (generateCrc32(0, buffer, size - 4) != getWord(&crcPosition)))
+    {
+        output("Plan file is corrupt\n");
+        return ERR_BAD_IMAGE;
+    }
+
+    if (getWord(&position) != PLAN_VERSION)
+    {
+        output("Plan file is from a different version of shunt\n");
+        return ERR_BAD_IMAGE;
+    }
+    flags                = getWord(&position);
+    plan->chunkSize      = getWord(&position);
+    segmentCount         = getWord(&position);
+    plan->sectorCount    = getWord(&position);
+    plan->writeCount     = getWord(&position);
+    plan->compressed     = (flags & PLAN_FLAG_COMPRESS) != 0;
+    plan->override       = (flags & PLAN_FLAG_OVERRIDE) != 0;
+
+    needed = (uint64_t)4 * (PLAN_SEGMENT_WORDS * (uint64_t)segmentCount + PLAN_SECTOR_WORDS * (uint64_t)plan->sectorCount +
+             PLAN_WRITE_WORDS * (uint64_t)plan->writeCount) + 4;
+    if ((segmentCount > FLASH_SIZE) || (plan->sectorCount > FLASH_SECTORS) || (needed > size - (position - buffer)))
+    {
+        output("Plan file is corrupt\n");
+        return ERR_BAD_IMAGE;
+    }
+
+    segments      = (imageSegment*)malloc((segmentCount ? segmentCount : 1) * sizeof(imageSegment));
+    plan->sectors = (planSector*)calloc(FLASH_SECTORS, sizeof(planSector));
+    plan->writes  = (planWrite*)malloc((plan->writeCount ? plan->writeCount : 1) * sizeof(planWrite));
+    if (!segments || !plan->sectors || !plan->writes)
+    {
+        if (segments)
+        {
+            free(segments);
+        }
+        return ERR_NO_MEM;
+    }
+
+    needed = 0;
+    for (index = 0; index < segmentCount; index++)
+    {
+        segments[index].address = getWord(&position);
+        segments[index].length  = getWord(&position);
+        needed += segments[index].length;
+    }
+    for (index = 0; index < plan->sectorCount; index++)
+    {
+        plan->sectors[index].sector     = getWord(&position);
+        plan->sectors[index].address    = getWord(&position);
+        plan->sectors[index].size       = getWord(&position);
+        plan->sectors[index].dataStart  = getWord(&position);
+        plan->sectors[index].dataEnd    = getWord(&position);
+        plan->sectors[index].firstWrite = getWord(&position);
+        plan->sectors[index].writeCount = getWord(&position);
+    }
+    for (index = 0; index < plan->writeCount; index++)
+    {
+        plan->writes[index].address = getWord(&position);
+        plan->writes[index].length  = getWord(&position);
+    }
+
+    if (needed != size - 4 - (position - buffer))
+    {
+        output("Plan file is corrupt\n");
+        free(segments);
+        return ERR_BAD_IMAGE;
+    }
+
+    retCode = buildSparseImage(&(plan->image), segments, segmentCount, position);
+    if (retCode == SUCCESS)
+    {
+        retCode = checkPlan(plan);
+    }
+    if (retCode == ERR_BAD_IMAGE)
+    {
+        output("Plan file is corrupt\n");
+    }
+
+    return retCode;
+}
+
+/*
+ * readPlanFile
+ *
+ * If a file is a saved plan, load it. *isPlan says whether it was one.
+ */
+static ERRORCODE readPlanFile(char* planFile, flashPlan* plan, bool* isPlan)
+{
+    struct stat info;
+    int         planStream;
+    uint8_t*    buffer;
+    char        magic[sizeof(PLAN_MAGIC) - 1];
+    ERRORCODE   retCode;
+
+    *isPlan = false;
+
+    planStream = open(planFile, O_RDONLY);
+    if (planStream == -1)
+    {
+        output("Unable to open file %s, %d\n", planFile, errno);
+        return ERR_FILE_OPEN;
+    }
+
+    if ((read(planStream, magic, sizeof(magic)) != sizeof(magic)) || (memcmp(magic, PLAN_MAGIC, sizeof(magic)) != 0))
+    {
+        close(planStream);
+        return SUCCESS;
+    }
+    *isPlan = true;
+
+    if (fstat(planStream, &info) != 0)
+    {
+        output("Error getting plan file details %d\n", errno);
+        close(planStream);
+        return ERR_STAT;
+    }
+
+    buffer = (uint8_t*)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, planStream, 0);
+    close(planStream);
+    if (buffer == MAP_FAILED)
+    {
+        output("Unable to map plan file %s, %d\n", planFile, errno);
+        return ERR_FILE_READ;
+    }
+
+    retCode = loadFlashPlan(buffer, info.st_size, plan);
+    munmap(buffer, info.st_size);
+
+    return retCode;
+}
+
+/*
+ * hashPlan
+ *
+ * SHA-256 over what the plan would write and how, so a journal left by an
+ * interrupted run is only trusted for the same image and options. Each
+ * sector also gets a CRC of its contents, for the provisioning history.
+ */
+static void hashPlan(flashPlan* plan)
+{
+    SHA256_CTX    context;
+    uint8_t       fields[8];
+    uint8_t*      position;
+    imageSegment* segment;
+    uint32_t      index;
+
+    SHA256_Init(&context);
+    fields[0] = plan->compressed;
+    fields[1] = plan->override;
+    fields[2] = (plan->chunkSize >> 8) & 0xFF;
+    fields[3] = plan->chunkSize & 0xFF;
+    SHA256_Update(&context, fields, 4);
+
+    for (index = 0; index < plan->image.segmentCount; index++)
+    {
+        segment = &(plan->image.segments[index]);
+        position = fields;
+        putWord(&position, segment->address);
+        putWord(&position, segment->length);
+        SHA256_Update(&context, fields, 8);
+        SHA256_Update(&context, plan->image.flash + segment->address, segment->length);
+    }
+    for (index = 0; index < plan->writeCount; index++)
+    {
+        position = fields;
+        putWord(&position, plan->writes[index].address);
+        putWord(&position, plan->writes[index].length);
+        SHA256_Update(&context, fields, 8);
+    }
+    SHA256_Final(plan->hash, &context);
+
+    for (index = 0; index < plan->sectorCount; index++)
+    {
+        plan->sectors[index].crc = generateCrc32(0, plan->image.flash + plan->sectors[index].address, plan->sectors[index].size);
+    }
+}
+
+/*
+ * useFrameCache
+ *
+ * pick up the precomputed write checksums if they were asked for. They
+ * are only any use for plain writes, and flashing goes on without them.
+ */
+static void useFrameCache(flashPlan* plan, flashOptions* options)
+{
+    if ((options->frameCache == true) && (plan->compressed == false) && (options->dryrun == false) &&
+        (openFrameCache(plan) != SUCCESS))
+    {
+        output("Continuing without a frame cache\n");
+    }
+}
+
+/*
+ * buildFlashPlan
+ *
+ * make a plan for an image file, or load it if it's a saved plan
+ */
+ERRORCODE buildFlashPlan(char* imageFile, flashOptions* options, flashPlan* plan)
+{
+    uint32_t  totalFlashSize;
+    bool      isPlan;
+    ERRORCODE retCode;
+
+    memset(plan, 0, sizeof(flashPlan));
+
+    retCode = readPlanFile(imageFile, plan, &isPlan);
+    if (isPlan == true)
+    {
+        if ((retCode == SUCCESS) && plan->override && (options->override == false))
+        {
+            output("Plan writes sector 35, refusing without override\n");
+            retCode = ERR_TOO_BIG;
+        }
+        if (retCode != SUCCESS)
+        {
+            freeFlashPlan(plan);
+        }
+        else
+        {
+            hashPlan(plan);
+            useFrameCache(plan, options);
+        }
+        return retCode;
+    }
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    retCode = readSparseImage(imageFile, calcOffsetAddress(options->offsetSect), &(plan->image));
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    totalFlashSize = FLASH_SIZE;
+    if (options->override == false)
+    {
+        totalFlashSize -= 4 * 1024;
+    }
+    if (plan->image.end > totalFlashSize)
+    {
+        output("Refusing to set sector 35\n");
+        freeFlashPlan(plan);
+        return ERR_TOO_BIG;
+    }
+
+    plan->compressed = options->compressed;
+    plan->chunkSize  = options->compressed ? RCS_CHUNK_SIZE : CHUNK_SIZE;
+    plan->override   = (plan->image.end > FLASH_SIZE - 4 * 1024);
+
+    retCode = planSectors(plan);
+    if (retCode != SUCCESS)
+    {
+        freeFlashPlan(plan);
+        return retCode;
+    }
+
+    hashPlan(plan);
+    useFrameCache(plan, options);
+
+    debug("Plan - %u segments, %u sectors, %u writes\n", plan->image.segmentCount, plan->sectorCount, plan->writeCount);
+
+    return SUCCESS;
+}
+
+void freeFlashPlan(flashPlan* plan)
+{
+    freeSparseImage(&(plan->image));
+    if (plan->sectors)
+    {
+        free(plan->sectors);
+    }
+    if (plan->writes)
+    {
+        free(plan->writes);
+    }
+    if (plan->frameChecksums)
+    {
+        free(plan->frameChecksums);
+    }
+    memset(plan, 0, sizeof(flashPlan));
+}
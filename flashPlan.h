@@ -0,0 +1,73 @@
+/*
+ * flashPlan.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef FLASHPLAN_H_
+#define FLASHPLAN_H_
+
+#include "shunt.h"
+#include "serial.h"
+#include "appLayer.h"
+#include "imageFormat.h"
+
+#define FLASH_SECTORS 36
+
+/*
+ * One write command's worth of image. The payload is
+ * image.flash + address.
+ */
+typedef struct _planWrite
+{
+    uint32_t address;
+    uint16_t length;
+} planWrite;
+
+/*
+ * A sector the image has data in, and the writes that fill it
+ */
+typedef struct _planSector
+{
+    uint8_t  sector;
+    uint32_t address;
+    uint32_t size;
+    uint32_t dataStart;  // first byte of image data in the sector
+    uint32_t dataEnd;    // just after the last
+    uint32_t firstWrite;
+    uint32_t writeCount;
+    uint32_t crc;        // of the whole sector as the plan leaves it
+} planSector;
+
+/*
+ * Everything needed to flash an image, worked out once. A plan is not
+ * changed once built, so one can be run against any number of devices.
+ */
+typedef struct _flashPlan
+{
+    sparseImage image;
+    planSector* sectors;
+    uint32_t    sectorCount;
+    planWrite*  writes;
+    uint32_t    writeCount;
+    uint16_t    chunkSize;
+    bool        compressed;
+    bool        override;   // the plan touches sector 35
+    uint8_t     hash[32];   // identifies the plan for resume journals
+    uint8_t*    frameChecksums;  // FRAME_CHECKSUMS_SIZE per write from the frame cache, NULL if none
+} flashPlan;
+
+extern uint8_t sectorMap[FLASH_SECTORS];
+
+uint32_t  calcOffsetAddress (uint8_t startSect);
+uint8_t   findSectorForAddr (uint32_t addr);
+
+/*
+ * Build a plan from an image file, or load one saved by saveFlashPlan
+ */
+ERRORCODE buildFlashPlan    (char* imageFile, flashOptions* options, flashPlan* plan);
+ERRORCODE saveFlashPlan     (flashPlan* plan, char* planFile);
+void      freeFlashPlan     (flashPlan* plan);
+
+#endif /* FLASHPLAN_H_ */
@@ -0,0 +1,215 @@
+/*
+ * frameCache.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Sent in the clear, a write frame is the same every time the same image
+ * is flashed, apart from the data layer header and the transID in the
+ * session header. The data checksum covers the transID, but there are
+ * only 256 of those, so for each write of a plan the checksum is worked
+ * out under every one of them and kept on disk. Flashing the same image
+ * board after board then costs no checksumming beyond the 8 byte headers.
+ *
+ * The file is big endian:
+ *   "SHNTFRMS", version, flash base address, write count, plan hash
+ *   FRAME_CHECKSUMS_SIZE bytes of checksums for each write in turn
+ *   CRC32 of all of the above
+ */
+
+#include "shunt.h"
+#include "utils.h"
+#include "sessionLayer.h"
+#include "commandLayer.h"
+#include "frameCache.h"
+
+#define CACHE_MAGIC        "SHNTFRMS"
+#define CACHE_MAGIC_SIZE   8
+#define CACHE_VERSION      1
+#define CACHE_HEADER_SIZE  (CACHE_MAGIC_SIZE + 12 + sizeof(((flashPlan*)0)->hash))
+
+static void putWord(uint8_t* position, uint32_t value)
+{
+    position[0] = (value >> 24) & 0xFF;
+    position[1] = (value >> 16) & 0xFF;
+    position[2] = (value >> 8) & 0xFF;
+    position[3] = value & 0xFF;
+}
+
+static uint32_t getWord(const uint8_t* position)
+{
+    return (position[0] << 24) | (position[1] << 16) | (position[2] << 8) | position[3];
+}
+
+/*
+ * fillHeader
+ *
+ * the header a cache for this plan starts with
+ */
+static void fillHeader(flashPlan* plan, uint8_t* header)
+{
+    memcpy(header, CACHE_MAGIC, CACHE_MAGIC_SIZE);
+    putWord(header + CACHE_MAGIC_SIZE, CACHE_VERSION);
+    putWord(header + CACHE_MAGIC_SIZE + 4, FLASH_BASE_ADDRESS);
+    putWord(header + CACHE_MAGIC_SIZE + 8, plan->writeCount);
+    memcpy(header + CACHE_MAGIC_SIZE + 12, plan->hash, sizeof(plan->hash));
+}
+
+/*
+ * readFrameCache
+ *
+ * load the cache file, if there is one and it is for this plan
+ */
+static ERRORCODE readFrameCache(flashPlan* plan, char* path, uint8_t* buffer, uint32_t size)
+{
+    uint8_t   header[CACHE_HEADER_SIZE];
+    int       cacheStream;
+    ssize_t   readBytes;
+    ERRORCODE retCode = SUCCESS;
+
+    cacheStream = open(path, O_RDONLY);
+    if (cacheStream == -1)
+    {
+        return ERR_FILE_OPEN;
+    }
+
+    readBytes = read(cacheStream, buffer, size);
+    if ((readBytes != (ssize_t)size) || (read(cacheStream, header, 1) != 0))
+    {
+        debug("Frame cache %s is the wrong size\n", path);
+        retCode = ERR_FILE_READ;
+    }
+    close(cacheStream);
+
+    if (retCode == SUCCESS)
+    {
+        fillHeader(plan, header);
+        if ((memcmp(buffer, header, CACHE_HEADER_SIZE) != 0) ||
+            (getWord(buffer + size - 4) != generateCrc32(0, buffer, size - 4)))
+        {
+            debug("Frame cache %s doesn't match the plan\n", path);
+            retCode = ERR_FILE_READ;
+        }
+    }
+
+    return retCode;
+}
+
+/*
+ * writeFrameCache
+ *
+ * save the cache by way of a temporary file, so another shunt starting on
+ * the same image never sees half of one
+ */
+static ERRORCODE writeFrameCache(char* path, uint8_t* buffer, uint32_t size)
+{
+    char      tempPath[80];
+    int       cacheStream;
+    ERRORCODE retCode = SUCCESS;
+
+    snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", path);
+    cacheStream = mkstemp(tempPath);
+    if (cacheStream == -1)
+    {
+        output("Unable to create frame cache %s, %d\n", path, errno);
+        return ERR_FILE_OPEN;
+    }
+    fchmod(cacheStream, 0644);
+
+    if (write(cacheStream, buffer, size) != (ssize_t)size)
+    {
+        output("Failed to write frame cache - %s\n", strerror(errno));
+        retCode = ERR_FILE_WRITE;
+    }
+    if ((close(cacheStream) != 0) && (retCode == SUCCESS))
+    {
+        retCode = ERR_FILE_WRITE;
+    }
+
+    if ((retCode == SUCCESS) && (rename(tempPath, path) != 0))
+    {
+        output("Failed to save frame cache %s, %d\n", path, errno);
+        retCode = ERR_FILE_WRITE;
+    }
+    if (retCode != SUCCESS)
+    {
+        unlink(tempPath);
+    }
+
+    return retCode;
+}
+
+/*
+ * buildFrameCache
+ *
+ * work out the checksums of every write in the plan
+ */
+static ERRORCODE buildFrameCache(flashPlan* plan, uint8_t* buffer, uint32_t size)
+{
+    uint8_t*  checksums;
+    uint32_t  index;
+    ERRORCODE retCode = SUCCESS;
+
+    fillHeader(plan, buffer);
+    checksums = buffer + CACHE_HEADER_SIZE;
+
+    for (index = 0; (index < plan->writeCount) && (retCode == SUCCESS); index++)
+    {
+        retCode = writeFlashChecksums(plan->writes[index].address + FLASH_BASE_ADDRESS,
+                                      plan->image.flash + plan->writes[index].address,
+                                      plan->writes[index].length, checksums);
+        checksums += FRAME_CHECKSUMS_SIZE;
+    }
+
+    putWord(buffer + size - 4, generateCrc32(0, buffer, size - 4));
+
+    return retCode;
+}
+
+ERRORCODE openFrameCache(flashPlan* plan)
+{
+    char      path[64];
+    uint8_t*  buffer;
+    uint32_t  size;
+    uint32_t  length;
+    uint8_t   index;
+    ERRORCODE retCode;
+
+    length = snprintf(path, sizeof(path), "./shunt-");
+    for (index = 0; index < 8; index++)
+    {
+        length += snprintf(path + length, sizeof(path) - length, "%2.2x", plan->hash[index]);
+    }
+    snprintf(path + length, sizeof(path) - length, ".frames");
+
+    size = CACHE_HEADER_SIZE + (plan->writeCount * FRAME_CHECKSUMS_SIZE) + 4;
+    buffer = (uint8_t*)malloc(size);
+    if (!buffer)
+    {
+        return ERR_NO_MEM;
+    }
+
+    retCode = readFrameCache(plan, path, buffer, size);
+    if (retCode != SUCCESS)
+    {
+        output("Building frame cache %s\n", path);
+        retCode = buildFrameCache(plan, buffer, size);
+        if (retCode == SUCCESS)
+        {
+            // a cache that can't be saved still does for this run
+            writeFrameCache(path, buffer, size);
+        }
+    }
+
+    if (retCode != SUCCESS)
+    {
+        free(buffer);
+        return retCode;
+    }
+
+    memmove(buffer, buffer + CACHE_HEADER_SIZE, plan->writeCount * FRAME_CHECKSUMS_SIZE);
+    plan->frameChecksums = buffer;
+    debug("Frame cache %s - %u writes\n", path, plan->writeCount);
+
+    return SUCCESS;
+}
@@ -0,0 +1,21 @@
+/*
+ * frameCache.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef FRAMECACHE_H_
+#define FRAMECACHE_H_
+
+#include "shunt.h"
+#include "flashPlan.h"
+
+/*
+ * Give a plan the checksums of its write frames, from a file named by
+ * the plan's hash. If there isn't one yet (the first flash of an image)
+ * they are worked out and saved for the next run.
+ */
+ERRORCODE openFrameCache (flashPlan* plan);
+
+#endif /* FRAMECACHE_H_ */
@@ -0,0 +1,700 @@
+/*
+ * imageFormat.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Turn an image file into the flash contents it describes. Build
+ * systems tend to produce ELF or HEX files with gaps in, so rather than
+ * padding those out to a bin, the gaps are kept and only the parts of
+ * flash that actually get data are erased and written.
+ */
+
+#include "shunt.h"
+#include "serial.h"
+#include "appLayer.h"
+#include "imageFormat.h"
+
+/*
+ * Gaps shorter than this are sent as 0xFF rather than starting another
+ * write - a write costs a full round trip, a few hundred bytes don't
+ */
+#define SEGMENT_MERGE_GAP    256
+
+#define MAX_RECORD_BYTES     260
+
+#define IHEX_DATA            0x00
+#define IHEX_EOF             0x01
+#define IHEX_SEGMENT_ADDRESS 0x02
+#define IHEX_LINEAR_ADDRESS  0x04
+
+#define ELF_HEADER_SIZE      52
+#define ELF_PHDR_SIZE        32
+#define ELF_CLASS_32         1
+#define ELF_DATA_MSB         2
+#define ELF_PT_LOAD          1
+
+typedef struct _imageBuilder
+{
+    sparseImage* image;
+    uint8_t*     used;   // one flag per byte of flash
+} imageBuilder;
+
+/*
+ * storeBytes
+ *
+ * put some image data into place. Addresses may be kseg0, kseg1 or
+ * physical flash addresses, or offsets into flash
+ */
+static ERRORCODE storeBytes(imageBuilder* builder, uint32_t address, const uint8_t* data, uint32_t length)
+{
+    uint32_t physical = address & 0x1FFFFFFF;
+    uint32_t flashPhysical = FLASH_BASE_ADDRESS & 0x1FFFFFFF;
+    uint32_t offset;
+
+    if (length == 0)
+    {
+        return SUCCESS;
+    }
+
+    if ((physical >= flashPhysical) && (physical < flashPhysical + FLASH_SIZE))
+    {
+        offset = physical - flashPhysical;
+    }
+    else if (address < FLASH_SIZE)
+    {
+        offset = address;
+    }
+    else
+    {
+        output("Image data at 0x%x is outside flash\n", address);
+        return ERR_TOO_BIG;
+    }
+
+    if (length > FLASH_SIZE - offset)
+    {
+        output("Image data at 0x%x, length %u runs off the end of flash\n", address, length);
+        return ERR_TOO_BIG;
+    }
+
+    memcpy(builder->image->flash + offset, data, length);
+    memset(builder->used + offset, 1, length);
+
+    return SUCCESS;
+}
+
+/*
+ * nextLine
+ *
+ * step through a text file a line at a time, skipping blank lines
+ */
+static bool nextLine(const char* text, size_t size, size_t* position, const char** line, size_t* lineLength)
+{
+    size_t end;
+
+    while ((*position < size) && isspace((unsigned char)text[*position]))
+    {
+        (*position)++;
+    }
+    if (*position >= size)
+    {
+        return false;
+    }
+
+    end = *position;
+    while ((end < size) && (text[end] != '\n') && (text[end] != '\r'))
+    {
+        end++;
+    }
+
+    *line = text + *position;
+    *lineLength = end - *position;
+    *position = end;
+
+    return true;
+}
+
+/*
+ * decodeRecord
+ *
+ * turn the hex digits of a record into bytes
+ */
+static bool decodeRecord(const char* text, size_t textLength, uint8_t* record, uint32_t* recordLength)
+{
+    char     digits[3];
+    char*    end;
+    uint32_t index;
+
+    if ((textLength % 2) || (textLength / 2 > MAX_RECORD_BYTES))
+    {
+        return false;
+    }
+
+    digits[2] = '\0';
+    for (index = 0; index < textLength / 2; index++)
+    {
+        digits[0] = text[2 * index];
+        digits[1] = text[2 * index + 1];
+        if (!isxdigit((unsigned char)digits[0]) || !isxdigit((unsigned char)digits[1]))
+        {
+            return false;
+        }
+        record[index] = strtoul(digits, &end, 16);
+    }
+    *recordLength = textLength / 2;
+
+    return true;
+}
+
+/*
+ * parseIntelHex
+ */
+static ERRORCODE parseIntelHex(imageBuilder* builder, const char* text, size_t size)
+{
+    const char* line;
+    size_t      lineLength;
+    size_t      position = 0;
+    uint8_t     record[MAX_RECORD_BYTES];
+    uint32_t    recordLength;
+    uint32_t    lineNumber = 0;
+    uint32_t    base = 0;
+    uint32_t    index;
+    uint8_t     sum;
+    ERRORCODE   retCode;
+
+    while (nextLine(text, size, &position, &line, &lineLength))
+    {
+        lineNumber++;
+        if ((line[0] != ':') || !decodeRecord(line + 1, lineLength - 1, record, &recordLength) ||
+            (recordLength < 5) || (recordLength != record[0] + 5u))
+        {
+            output("Bad Intel HEX record, line %u\n", lineNumber);
+            return ERR_BAD_IMAGE;
+        }
+
+        sum = 0;
+        for (index = 0; index < recordLength; index++)
+        {
+            sum += record[index];
+        }
+        if (sum != 0)
+        {
+            output("Intel HEX checksum error, line %u\n", lineNumber);
+            return ERR_BAD_IMAGE;
+        }
+
+        switch (record[3])
+        {
+        case IHEX_DATA:
+            retCode = storeBytes(builder, base + ((record[1] << 8) | record[2]), record + 4, record[0]);
+            if (retCode != SUCCESS)
+            {
+                return retCode;
+            }
+            break;
+
+        case IHEX_EOF:
+            return SUCCESS;
+
+        case IHEX_SEGMENT_ADDRESS:
+            base = ((record[4] << 8) | record[5]) << 4;
+            break;
+
+        case IHEX_LINEAR_ADDRESS:
+            base = ((record[4] << 8) | record[5]) << 16;
+            break;
+
+        default:
+            // start addresses mean nothing to flash
+            break;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * parseSRecord
+ */
+static ERRORCODE parseSRecord(imageBuilder* builder, const char* text, size_t size)
+{
+    const char* line;
+    size_t      lineLength;
+    size_t      position = 0;
+    uint8_t     record[MAX_RECORD_BYTES];
+    uint32_t    recordLength;
+    uint32_t    lineNumber = 0;
+    uint32_t    addressLength;
+    uint32_t    address;
+    uint32_t    index;
+    uint8_t     sum;
+    ERRORCODE   retCode;
+
+    while (nextLine(text, size, &position, &line, &lineLength))
+    {
+        lineNumber++;
+        if ((lineLength < 2) || (line[0] != 'S') || !decodeRecord(line + 2, lineLength - 2, record, &recordLength) ||
+            (recordLength < 3) || (recordLength != record[0] + 1u))
+        {
+            output("Bad S-record, line %u\n", lineNumber);
+            return ERR_BAD_IMAGE;
+        }
+
+        sum = 0;
+        for (index = 0; index < recordLength; index++)
+        {
+            sum += record[index];
+        }
+        if (sum != 0xFF)
+        {
+            output("S-record checksum error, line %u\n", lineNumber);
+            return ERR_BAD_IMAGE;
+        }
+
+        switch (line[1])
+        {
+        case '1':
+        case '2':
+        case '3':
+            addressLength = line[1] - '0' + 1;
+            if (record[0] < addressLength + 1)
+            {
+                output("Bad S-record, line %u\n", lineNumber);
+                return ERR_BAD_IMAGE;
+            }
+            address = 0;
+            for (index = 1; index <= addressLength; index++)
+            {
+                address = (address << 8) | record[index];
+            }
+            retCode = storeBytes(builder, address, record + 1 + addressLength, record[0] - addressLength - 1);
+            if (retCode != SUCCESS)
+            {
+                return retCode;
+            }
+            break;
+
+        case '7':
+        case '8':
+        case '9':
+            return SUCCESS;
+
+        default:
+            // header and record counts
+            break;
+        }
+    }
+
+    return SUCCESS;
+}
+
+static uint32_t elfWord(const uint8_t* data, bool bigEndian)
+{
+    if (bigEndian)
+    {
+        return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+    }
+    return (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
+}
+
+static uint16_t elfHalf(const uint8_t* data, bool bigEndian)
+{
+    if (bigEndian)
+    {
+        return (data[0] << 8) | data[1];
+    }
+    return (data[1] << 8) | data[0];
+}
+
+/*
+ * parseElf
+ *
+ * load the file contents of every PT_LOAD program header at its
+ * physical (load) address, so initialised data lands where the startup
+ * code copies it from
+ */
+static ERRORCODE parseElf(imageBuilder* builder, const uint8_t* file, size_t size)
+{
+    bool           bigEndian;
+    uint32_t       headerOffset;
+    uint16_t       headerSize;
+    uint16_t       headerCount;
+    uint16_t       index;
+    const uint8_t* header;
+    uint32_t       fileOffset;
+    uint32_t       fileSize;
+    ERRORCODE      retCode;
+
+    if ((size < ELF_HEADER_SIZE) || (file[4] != ELF_CLASS_32))
+    {
+        output("Only 32-bit ELF images are supported\n");
+        return ERR_BAD_IMAGE;
+    }
+    bigEndian = (file[5] == ELF_DATA_MSB);
+
+    headerOffset = elfWord(file + 28, bigEndian);
+    headerSize   = elfHalf(file + 42, bigEndian);
+    headerCount  = elfHalf(file + 44, bigEndian);
+
+    if ((headerSize < ELF_PHDR_SIZE) || (headerOffset > size) || ((size_t)headerCount * headerSize > size - headerOffset))
+    {
+        output("Bad ELF program headers\n");
+        return ERR_BAD_IMAGE;
+    }
+
+    for (index = 0; index < headerCount; index++)
+    {
+        header = file + headerOffset + index * headerSize;
+        fileOffset = elfWord(header + 4, bigEndian);
+        fileSize   = elfWord(header + 16, bigEndian);
+
+        if ((elfWord(header, bigEndian) != ELF_PT_LOAD) || (fileSize == 0))
+        {
+            continue;
+        }
+        if ((fileOffset > size) || (fileSize > size - fileOffset))
+        {
+            output("ELF segment %u is truncated\n", index);
+            return ERR_BAD_IMAGE;
+        }
+
+        retCode = storeBytes(builder, elfWord(header + 12, bigEndian), file + fileOffset, fileSize);
+        if (retCode != SUCCESS)
+        {
+            return retCode;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * looksLikeRecords
+ *
+ * whether a file starts with a line of hex records with the given lead
+ * character. A raw binary could start with ':' or 'S' by chance, but
+ * not with a whole line of hex digits.
+ */
+static bool looksLikeRecords(const uint8_t* file, size_t size, char lead)
+{
+    size_t position = 0;
+    size_t digits = 0;
+
+    while ((position < size) && isspace(file[position]))
+    {
+        position++;
+    }
+    if ((position >= size) || (file[position] != lead))
+    {
+        return false;
+    }
+
+    for (position++; (position < size) && (file[position] != '\n') && (file[position] != '\r'); position++)
+    {
+        if (!isxdigit(file[position]))
+        {
+            return false;
+        }
+        digits++;
+    }
+
+    return digits >= 8;
+}
+
+/*
+ * buildSegments
+ *
+ * find the runs of flash the image uses, joining ones that are close
+ */
+static ERRORCODE buildSegments(sparseImage* image, const uint8_t* used)
+{
+    uint32_t offset;
+    uint32_t runStart;
+    uint32_t lastEnd = 0;
+    uint32_t count = 0;
+    uint8_t  pass;
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        count = 0;
+        offset = 0;
+        while (1)
+        {
+            while ((offset < FLASH_SIZE) && !used[offset])
+            {
+                offset++;
+            }
+            if (offset == FLASH_SIZE)
+            {
+                break;
+            }
+            runStart = offset;
+            while ((offset < FLASH_SIZE) && used[offset])
+            {
+                offset++;
+            }
+
+            if (count && (runStart - lastEnd < SEGMENT_MERGE_GAP))
+            {
+                if (pass)
+                {
+                    image->segments[count - 1].length = offset - image->segments[count - 1].address;
+                }
+            }
+            else
+            {
+                if (pass)
+                {
+                    image->segments[count].address = runStart;
+                    image->segments[count].length = offset - runStart;
+                }
+                count++;
+            }
+            lastEnd = offset;
+        }
+
+        if (count == 0)
+        {
+            output("Image has no data in it\n");
+            return ERR_BAD_IMAGE;
+        }
+
+        if (pass == 0)
+        {
+            image->segments = (imageSegment*)malloc(count * sizeof(imageSegment));
+            if (!image->segments)
+            {
+                return ERR_NO_MEM;
+            }
+        }
+    }
+
+    image->segmentCount = count;
+    image->start = image->segments[0].address;
+    image->end = image->segments[count - 1].address + image->segments[count - 1].length;
+
+    return SUCCESS;
+}
+
+/*
+ * allocFlash
+ *
+ * The flash contents go in a shared mapping of their own, made read
+ * only once built, so one copy can be used by any number of device
+ * sessions - threads or forked children - at once
+ */
+static ERRORCODE allocFlash(sparseImage* image)
+{
+    image->flash = (uint8_t*)mmap(NULL, FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (image->flash == MAP_FAILED)
+    {
+        image->flash = NULL;
+        return ERR_NO_MEM;
+    }
+    memset(image->flash, 0xFF, FLASH_SIZE);
+
+    return SUCCESS;
+}
+
+/*
+ * mapImageFile
+ *
+ * get the contents of an image file into memory. A regular file is
+ * mapped, with the kernel told it will be read straight through so it
+ * can read ahead while the parser runs; anything else is read in.
+ */
+static ERRORCODE mapImageFile(int imageStream, size_t size, uint8_t** file, bool* mapped)
+{
+    ssize_t readLength;
+
+    *file = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, imageStream, 0);
+    if (*file != MAP_FAILED)
+    {
+        madvise(*file, size, MADV_SEQUENTIAL);
+        madvise(*file, size, MADV_WILLNEED);
+        *mapped = true;
+        return SUCCESS;
+    }
+
+    debug("Can't map image (%d), reading it instead\n", errno);
+    *mapped = false;
+    *file = (uint8_t*)malloc(size);
+    if (!(*file))
+    {
+        return ERR_NO_MEM;
+    }
+
+    readLength = read(imageStream, *file, size);
+    if (readLength != (ssize_t)size)
+    {
+        output("Unable to read %zu bytes from file! Only got %ld\n", size, (long)readLength);
+        free(*file);
+        return ERR_FILE_READ;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * readSparseImage
+ *
+ * read an image file and lay it out over flash
+ */
+ERRORCODE readSparseImage(char* imageFile, uint32_t binOffset, sparseImage* image)
+{
+    struct stat  info;
+    int          imageStream;
+    uint8_t*     file;
+    bool         mapped;
+    imageBuilder builder;
+    ERRORCODE    retCode;
+
+    memset(image, 0, sizeof(sparseImage));
+
+    imageStream = open(imageFile, O_RDONLY);
+    if (imageStream == -1)
+    {
+        output("Unable to open file %s, %d\n", imageFile, errno);
+        return ERR_FILE_OPEN;
+    }
+
+    if (fstat(imageStream, &info) != 0)
+    {
+        output("Error getting image file details %d\n", errno);
+        close(imageStream);
+        return ERR_STAT;
+    }
+
+    if (info.st_size == 0)
+    {
+        output("Image file %s is empty\n", imageFile);
+        close(imageStream);
+        return ERR_BAD_IMAGE;
+    }
+
+    retCode = mapImageFile(imageStream, info.st_size, &file, &mapped);
+    close(imageStream);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    builder.image = image;
+    builder.used  = (uint8_t*)calloc(FLASH_SIZE, 1);
+    if (!builder.used || (allocFlash(image) != SUCCESS))
+    {
+        retCode = ERR_NO_MEM;
+    }
+    else
+    {
+        if ((info.st_size >= 4) && (memcmp(file, "\x7f" "ELF", 4) == 0))
+        {
+            debug("ELF image\n");
+            retCode = parseElf(&builder, file, info.st_size);
+        }
+        else if (looksLikeRecords(file, info.st_size, ':'))
+        {
+            debug("Intel HEX image\n");
+            retCode = parseIntelHex(&builder, (const char*)file, info.st_size);
+        }
+        else if (looksLikeRecords(file, info.st_size, 'S'))
+        {
+            debug("S-record image\n");
+            retCode = parseSRecord(&builder, (const char*)file, info.st_size);
+        }
+        else
+        {
+            debug("Raw binary image\n");
+            retCode = storeBytes(&builder, binOffset, file, info.st_size);
+        }
+
+        if (retCode == SUCCESS)
+        {
+            retCode = buildSegments(image, builder.used);
+        }
+        if (retCode == SUCCESS)
+        {
+            mprotect(image->flash, FLASH_SIZE, PROT_READ);
+        }
+    }
+
+    if (mapped == true)
+    {
+        munmap(file, info.st_size);
+    }
+    else
+    {
+        free(file);
+    }
+    if (builder.used)
+    {
+        free(builder.used);
+    }
+    if (retCode != SUCCESS)
+    {
+        freeSparseImage(image);
+    }
+
+    return retCode;
+}
+
+/*
+ * buildSparseImage
+ *
+ * put together an image from a segment list and the data for each
+ * segment, one after the other. Takes the segment list over.
+ */
+ERRORCODE buildSparseImage(sparseImage* image, imageSegment* segments, uint32_t segmentCount, const uint8_t* data)
+{
+    uint32_t  index;
+    ERRORCODE retCode;
+
+    memset(image, 0, sizeof(sparseImage));
+    image->segments = segments;
+    image->segmentCount = segmentCount;
+
+    if (segmentCount == 0)
+    {
+        freeSparseImage(image);
+        return ERR_BAD_IMAGE;
+    }
+
+    retCode = allocFlash(image);
+    if (retCode != SUCCESS)
+    {
+        freeSparseImage(image);
+        return retCode;
+    }
+
+    for (index = 0; index < segmentCount; index++)
+    {
+        if ((segments[index].address > FLASH_SIZE) || (segments[index].length > FLASH_SIZE - segments[index].address) ||
+            ((index > 0) && (segments[index].address < segments[index - 1].address + segments[index - 1].length)))
+        {
+            debug("Bad segment %u\n", index);
+            freeSparseImage(image);
+            return ERR_BAD_IMAGE;
+        }
+        memcpy(image->flash + segments[index].address, data, segments[index].length);
+        data += segments[index].length;
+    }
+
+    image->start = segments[0].address;
+    image->end = segments[segmentCount - 1].address + segments[segmentCount - 1].length;
+    mprotect(image->flash, FLASH_SIZE, PROT_READ);
+
+    return SUCCESS;
+}
+
+void freeSparseImage(sparseImage* image)
+{
+    if (image->flash)
+    {
+        munmap(image->flash, FLASH_SIZE);
+    }
+    if (image->segments)
+    {
+        free(image->segments);
+    }
+    memset(image, 0, sizeof(sparseImage));
+}
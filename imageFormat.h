@@ -0,0 +1,50 @@
+/*
+ * imageFormat.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef IMAGEFORMAT_H_
+#define IMAGEFORMAT_H_
+
+#include "shunt.h"
+
+/*
+ * A run of flash that the image puts data in. Addresses are offsets
+ * from the start of flash.
+ */
+typedef struct _imageSegment
+{
+    uint32_t address;
+    uint32_t length;
+} imageSegment;
+
+/*
+ * An image laid out over the whole of flash. Bytes outside the segments
+ * are 0xFF, what an erased sector reads back as.
+ */
+typedef struct _sparseImage
+{
+    uint8_t*      flash;        // FLASH_SIZE bytes
+    imageSegment* segments;     // in address order, close ones coalesced
+    uint32_t      segmentCount;
+    uint32_t      start;        // offset of the first byte of data
+    uint32_t      end;          // offset just after the last
+} sparseImage;
+
+/*
+ * Read an Intel HEX, Motorola S-record, ELF or raw binary image. The
+ * format is worked out from the contents. Only a raw binary uses
+ * binOffset, the others carry their own addresses.
+ */
+ERRORCODE readSparseImage  (char* imageFile, uint32_t binOffset, sparseImage* image);
+void      freeSparseImage  (sparseImage* image);
+
+/*
+ * Put an image back together from its segments and their data, packed
+ * one after another
+ */
+ERRORCODE buildSparseImage (sparseImage* image, imageSegment* segments, uint32_t segmentCount, const uint8_t* data);
+
+#endif /* IMAGEFORMAT_H_ */
@@ -0,0 +1,208 @@
+/*
+ * journal.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * A small on-disk record of how far a flash got, so a run that dies
+ * part way (cable bump, USB reset, Ctrl-C) can pick up where it left off
+ * rather than erasing everything and starting again.
+ *
+ * The file is a header followed by fixed size records, appended as
+ * things happen. A torn last record is just ignored.
+ */
+
+#include "shunt.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC       "SHNTJRNL"
+#define JOURNAL_MAGIC_SIZE  8
+#define JOURNAL_HEADER_SIZE (JOURNAL_MAGIC_SIZE + 16 + JOURNAL_HASH_SIZE)
+#define JOURNAL_RECORD_SIZE 8
+#define JOURNAL_MAX_SECTORS 64
+
+#define RECORD_ERASED       0x01
+#define RECORD_ACKED        0x02
+#define RECORD_DONE         0x03
+
+/*
+ * replayJournal
+ *
+ * work out where an earlier run got to from its records
+ */
+static void replayJournal(flashJournal* journal)
+{
+    uint8_t  record[JOURNAL_RECORD_SIZE];
+    uint16_t sectorIndex;
+    uint32_t value;
+
+    while (read(journal->fd, record, JOURNAL_RECORD_SIZE) == JOURNAL_RECORD_SIZE)
+    {
+        sectorIndex = (record[2] << 8) | record[3];
+        value = (record[4] << 24) | (record[5] << 16) | (record[6] << 8) | record[7];
+        if (sectorIndex >= JOURNAL_MAX_SECTORS)
+        {
+            continue;
+        }
+
+        switch (record[0])
+        {
+        case RECORD_ERASED:
+            journal->doneSectors &= ~(1ULL << sectorIndex);
+            journal->partialSector = sectorIndex;
+            journal->ackedWrites = 0;
+            break;
+
+        case RECORD_ACKED:
+            if (journal->partialSector == sectorIndex)
+            {
+                journal->ackedWrites = value;
+            }
+            break;
+
+        case RECORD_DONE:
+            journal->doneSectors |= (1ULL << sectorIndex);
+            if (journal->partialSector == sectorIndex)
+            {
+                journal->partialSector = -1;
+                journal->ackedWrites = 0;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+ERRORCODE openJournal(flashJournal* journal, const uint8_t* usn, const uint8_t* imageHash)
+{
+    uint8_t  header[JOURNAL_HEADER_SIZE];
+    uint8_t  existing[JOURNAL_HEADER_SIZE];
+    uint32_t index;
+    int      length;
+
+    journal->doneSectors   = 0;
+    journal->partialSector = -1;
+    journal->ackedWrites   = 0;
+
+    length = snprintf(journal->path, sizeof(journal->path), "./shunt-");
+    for (index = 0; index < 16; index++)
+    {
+        length += snprintf(journal->path + length, sizeof(journal->path) - length, "%2.2x", usn[index]);
+    }
+    snprintf(journal->path + length, sizeof(journal->path) - length, ".journal");
+
+    memcpy(header, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE);
+    memcpy(header + JOURNAL_MAGIC_SIZE, usn, 16);
+    memcpy(header + JOURNAL_MAGIC_SIZE + 16, imageHash, JOURNAL_HASH_SIZE);
+
+    journal->fd = open(journal->path, O_RDWR | O_CREAT, 0644);
+    if (journal->fd == -1)
+    {
+        output("Unable to open journal %s, %d\n", journal->path, errno);
+        return ERR_FILE_OPEN;
+    }
+
+    if ((read(journal->fd, existing, JOURNAL_HEADER_SIZE) == JOURNAL_HEADER_SIZE) &&
+        (memcmp(existing, header, JOURNAL_HEADER_SIZE) == 0))
+    {
+        replayJournal(journal);
+        debug("Resuming from journal, partial sector %d, %u writes acked\n", journal->partialSector, journal->ackedWrites);
+        // drop any torn record so new ones line up
+        lseek(journal->fd, 0, SEEK_END);
+        index = lseek(journal->fd, 0, SEEK_CUR);
+        if ((index - JOURNAL_HEADER_SIZE) % JOURNAL_RECORD_SIZE)
+        {
+            index -= (index - JOURNAL_HEADER_SIZE) % JOURNAL_RECORD_SIZE;
+            if ((ftruncate(journal->fd, index) != 0) || (lseek(journal->fd, index, SEEK_SET) != (off_t)index))
+            {
+                debug("Failed to trim journal %d\n", errno);
+            }
+        }
+        return SUCCESS;
+    }
+
+    if ((ftruncate(journal->fd, 0) != 0) || (lseek(journal->fd, 0, SEEK_SET) != 0) ||
+        (write(journal->fd, header, JOURNAL_HEADER_SIZE) != JOURNAL_HEADER_SIZE))
+    {
+        output("Unable to start journal %s, %d\n", journal->path, errno);
+        close(journal->fd);
+        journal->fd = -1;
+        return ERR_FILE_WRITE;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * addRecord
+ *
+ * append a record. The page cache is enough to survive the process
+ * dying; a failed write just means less to resume from.
+ */
+static void addRecord(flashJournal* journal, uint8_t type, uint32_t sectorIndex, uint32_t value)
+{
+    uint8_t record[JOURNAL_RECORD_SIZE];
+
+    if (journal->fd == -1)
+    {
+        return;
+    }
+
+    record[0] = type;
+    record[1] = 0;
+    record[2] = (sectorIndex >> 8) & 0xFF;
+    record[3] = sectorIndex & 0xFF;
+    record[4] = (value >> 24) & 0xFF;
+    record[5] = (value >> 16) & 0xFF;
+    record[6] = (value >> 8) & 0xFF;
+    record[7] = value & 0xFF;
+
+    if (write(journal->fd, record, JOURNAL_RECORD_SIZE) != JOURNAL_RECORD_SIZE)
+    {
+        debug("Journal write failed %d\n", errno);
+    }
+}
+
+void journalErased(flashJournal* journal, uint32_t sectorIndex)
+{
+    journal->doneSectors &= ~(1ULL << sectorIndex);
+    journal->partialSector = sectorIndex;
+    journal->ackedWrites = 0;
+    addRecord(journal, RECORD_ERASED, sectorIndex, 0);
+}
+
+void journalAcked(flashJournal* journal, uint32_t sectorIndex, uint32_t writesDone)
+{
+    journal->ackedWrites = writesDone;
+    addRecord(journal, RECORD_ACKED, sectorIndex, writesDone);
+}
+
+void journalDone(flashJournal* journal, uint32_t sectorIndex)
+{
+    journal->doneSectors |= (1ULL << sectorIndex);
+    journal->partialSector = -1;
+    journal->ackedWrites = 0;
+    addRecord(journal, RECORD_DONE, sectorIndex, 0);
+    if ((journal->fd != -1) && (fsync(journal->fd) != 0))
+    {
+        debug("Journal sync failed %d\n", errno);
+    }
+}
+
+void closeJournal(flashJournal* journal, bool complete)
+{
+    if (journal->fd == -1)
+    {
+        return;
+    }
+
+    close(journal->fd);
+    journal->fd = -1;
+
+    if (complete == true)
+    {
+        unlink(journal->path);
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ * journal.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include "shunt.h"
+
+#define JOURNAL_HASH_SIZE 32
+
+/*
+ * Progress of one plan on one device, as far as an earlier, interrupted
+ * run got with it. Sector numbers here are indexes into the plan's
+ * sector list.
+ */
+typedef struct _flashJournal
+{
+    int      fd;
+    char     path[64];
+    uint64_t doneSectors;    // bit per plan sector, written and synced
+    int32_t  partialSector;  // erased but not finished, -1 if none
+    uint32_t ackedWrites;    // writes into partialSector the USIP acknowledged
+} flashJournal;
+
+/*
+ * Open the journal for a device. If it holds progress for the same
+ * image that is loaded, otherwise it is started afresh.
+ */
+ERRORCODE openJournal    (flashJournal* journal, const uint8_t* usn, const uint8_t* imageHash);
+
+/*
+ * Record progress. Only journalDone syncs, so a sector costs one fsync.
+ * The in-memory state follows along, even with no file open.
+ */
+void      journalErased  (flashJournal* journal, uint32_t sectorIndex);
+void      journalAcked   (flashJournal* journal, uint32_t sectorIndex, uint32_t writesDone);
+void      journalDone    (flashJournal* journal, uint32_t sectorIndex);
+
+/*
+ * Close the journal, removing it if the flash completed
+ */
+void      closeJournal   (flashJournal* journal, bool complete);
+
+#endif /* JOURNAL_H_ */
@@ -0,0 +1,302 @@
+/*
+ * keyStore.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Every production unit has its own communication key. Rather than asking
+ * a database before each board, the keys are exported into a local file:
+ *
+ *   "SHNTKEYS" | version (4) | count (4) | count x { usn (16) | key (16) }
+ *
+ * with the records sorted by USN, big endian throughout. The file is
+ * mapped and binary searched, so a lookup in a few million units is a
+ * couple of dozen compares, and only the pages they touch are read.
+ */
+
+#include "shunt.h"
+#include "utils.h"
+#include "keyStore.h"
+
+#define KEYSTORE_MAGIC       "SHNTKEYS"
+#define KEYSTORE_MAGIC_SIZE  8
+#define KEYSTORE_VERSION     1
+#define KEYSTORE_HEADER_SIZE 16
+#define KEYSTORE_LINE_SIZE   256
+
+ERRORCODE openKeyStore(char* storeFile, keyStore* store)
+{
+    struct stat info;
+    uint8_t*    header;
+    int         fd;
+
+    memset(store, 0, sizeof(keyStore));
+
+    fd = open(storeFile, O_RDONLY);
+    if (fd == -1)
+    {
+        output("Unable to open key store %s, %d\n", storeFile, errno);
+        return ERR_FILE_OPEN;
+    }
+
+    if (fstat(fd, &info) != 0)
+    {
+        output("Error getting key store details %d\n", errno);
+        close(fd);
+        return ERR_STAT;
+    }
+
+    if (info.st_size < KEYSTORE_HEADER_SIZE)
+    {
+        output("Key store %s is too short\n", storeFile);
+        close(fd);
+        return ERR_FILE_READ;
+    }
+
+    store->map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (store->map == MAP_FAILED)
+    {
+        output("Unable to map key store %s, %d\n", storeFile, errno);
+        store->map = NULL;
+        return ERR_FILE_READ;
+    }
+    store->mapLength = info.st_size;
+    madvise(store->map, store->mapLength, MADV_RANDOM);
+
+    header = store->map;
+    store->count = (header[12] << 24) | (header[13] << 16) | (header[14] << 8) | header[15];
+    store->records = header + KEYSTORE_HEADER_SIZE;
+
+    if ((memcmp(header, KEYSTORE_MAGIC, KEYSTORE_MAGIC_SIZE) != 0) ||
+        (((header[8] << 24) | (header[9] << 16) | (header[10] << 8) | header[11]) != KEYSTORE_VERSION) ||
+        (store->mapLength != KEYSTORE_HEADER_SIZE + ((size_t)store->count * KEYSTORE_RECORD_SIZE)))
+    {
+        output("%s isn't a usable key store\n", storeFile);
+        closeKeyStore(store);
+        return ERR_FILE_READ;
+    }
+
+    debug("Key store %s - %u keys\n", storeFile, store->count);
+
+    return SUCCESS;
+}
+
+void closeKeyStore(keyStore* store)
+{
+    if (store->map)
+    {
+        munmap(store->map, store->mapLength);
+    }
+    memset(store, 0, sizeof(keyStore));
+}
+
+ERRORCODE findDeviceKey(keyStore* store, const uint8_t* usn, uint8_t* key)
+{
+    uint32_t low = 0;
+    uint32_t high = store->count;
+    uint32_t middle;
+    uint8_t* record;
+    int      order;
+
+    while (low < high)
+    {
+        middle = low + ((high - low) / 2);
+        record = store->records + ((size_t)middle * KEYSTORE_RECORD_SIZE);
+
+        order = memcmp(usn, record, 16);
+        if (order == 0)
+        {
+            memcpy(key, record + 16, 16);
+            return SUCCESS;
+        }
+        if (order < 0)
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+
+    return ERR_NO_KEY;
+}
+
+/*
+ * compareRecords
+ *
+ * qsort order for store records - by USN
+ */
+static int compareRecords(const void* first, const void* second)
+{
+    return memcmp(first, second, 16);
+}
+
+/*
+ * readKeyText
+ *
+ * read "<usn> <key>" lines into an array of records. Blank lines and
+ * lines starting with # are skipped.
+ */
+ERRORCODE readKeyText(char* textFile, uint8_t** records, uint32_t* count)
+{
+    FILE*     stream;
+    char      line[KEYSTORE_LINE_SIZE];
+    char*     usnText;
+    char*     keyText;
+    char*     position;
+    uint8_t*  grown;
+    uint32_t  allocated = 0;
+    uint32_t  lineNumber = 0;
+    ERRORCODE retCode = SUCCESS;
+
+    *records = NULL;
+    *count = 0;
+
+    stream = fopen(textFile, "r");
+    if (stream == NULL)
+    {
+        output("Unable to open file %s, %d\n", textFile, errno);
+        return ERR_FILE_OPEN;
+    }
+
+    while (fgets(line, sizeof(line), stream))
+    {
+        lineNumber++;
+        usnText = strtok_r(line, " \t\r\n,", &position);
+        if ((usnText == NULL) || (usnText[0] == '#'))
+        {
+            continue;
+        }
+        keyText = strtok_r(NULL, " \t\r\n,", &position);
+
+        if (*count == allocated)
+        {
+            allocated = allocated ? allocated * 2 : 1024;
+            grown = (uint8_t*)realloc(*records, (size_t)allocated * KEYSTORE_RECORD_SIZE);
+            if (!grown)
+            {
+                retCode = ERR_NO_MEM;
+                break;
+            }
+            *records = grown;
+        }
+
+        if ((keyText == NULL) ||
+            (parseHex(*records + ((size_t)*count * KEYSTORE_RECORD_SIZE), usnText, 16) != SUCCESS) ||
+            (parseHex(*records + ((size_t)*count * KEYSTORE_RECORD_SIZE) + 16, keyText, 16) != SUCCESS))
+        {
+            output("%s line %u - expected a 32 digit hex USN and key\n", textFile, lineNumber);
+            retCode = ERR_VALIDATION;
+            break;
+        }
+        (*count)++;
+    }
+    fclose(stream);
+
+    if (retCode != SUCCESS)
+    {
+        free(*records);
+        *records = NULL;
+    }
+
+    return retCode;
+}
+
+ERRORCODE buildKeyStore(char* textFile, char* storeFile)
+{
+    uint8_t   header[KEYSTORE_HEADER_SIZE];
+    uint8_t*  records;
+    uint32_t  count;
+    uint32_t  index;
+    size_t    length;
+    char*     tempFile;
+    FILE*     stream = NULL;
+    int       fd;
+    ERRORCODE retCode;
+
+    retCode = readKeyText(textFile, &records, &count);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    qsort(records, count, KEYSTORE_RECORD_SIZE, compareRecords);
+    for (index = 1; index < count; index++)
+    {
+        if (memcmp(records + ((size_t)(index - 1) * KEYSTORE_RECORD_SIZE), records + ((size_t)index * KEYSTORE_RECORD_SIZE), 16) == 0)
+        {
+            output("USN listed twice in %s -\n", textFile);
+            hexDump(records + ((size_t)index * KEYSTORE_RECORD_SIZE), 16);
+            free(records);
+            return ERR_VALIDATION;
+        }
+    }
+
+    memcpy(header, KEYSTORE_MAGIC, KEYSTORE_MAGIC_SIZE);
+    header[8]  = (KEYSTORE_VERSION >> 24) & 0xFF;
+    header[9]  = (KEYSTORE_VERSION >> 16) & 0xFF;
+    header[10] = (KEYSTORE_VERSION >> 8) & 0xFF;
+    header[11] = KEYSTORE_VERSION & 0xFF;
+    header[12] = (count >> 24) & 0xFF;
+    header[13] = (count >> 16) & 0xFF;
+    header[14] = (count >> 8) & 0xFF;
+    header[15] = count & 0xFF;
+
+    length = strlen(storeFile) + 5;
+    tempFile = (char*)malloc(length);
+    if (!tempFile)
+    {
+        free(records);
+        return ERR_NO_MEM;
+    }
+    snprintf(tempFile, length, "%s.new", storeFile);
+
+    // keys - only the owner gets to read them
+    fd = open(tempFile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd != -1)
+    {
+        stream = fdopen(fd, "w");
+        if (stream == NULL)
+        {
+            close(fd);
+        }
+    }
+    if (stream == NULL)
+    {
+        output("Unable to open file %s, %d\n", tempFile, errno);
+        retCode = ERR_FILE_OPEN;
+    }
+    else
+    {
+        if ((fwrite(header, KEYSTORE_HEADER_SIZE, 1, stream) != 1) ||
+            ((count > 0) && (fwrite(records, (size_t)count * KEYSTORE_RECORD_SIZE, 1, stream) != 1)) ||
+            (fflush(stream) != 0) || (fsync(fileno(stream)) != 0))
+        {
+            output("Unable to write key store %s, %d\n", tempFile, errno);
+            retCode = ERR_FILE_WRITE;
+        }
+        fclose(stream);
+
+        if ((retCode == SUCCESS) && (rename(tempFile, storeFile) != 0))
+        {
+            output("Unable to replace %s, %d\n", storeFile, errno);
+            retCode = ERR_FILE_WRITE;
+        }
+        if (retCode != SUCCESS)
+        {
+            unlink(tempFile);
+        }
+    }
+
+    if (retCode == SUCCESS)
+    {
+        output("%u keys written to %s\n", count, storeFile);
+    }
+
+    free(tempFile);
+    free(records);
+
+    return retCode;
+}
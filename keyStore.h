@@ -0,0 +1,47 @@
+/*
+ * keyStore.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef KEYSTORE_H_
+#define KEYSTORE_H_
+
+#include "shunt.h"
+
+#define KEYSTORE_RECORD_SIZE 32  // usn (16) | key (16)
+
+/*
+ * A file of per-device keys, sorted by USN and mapped read only
+ */
+typedef struct _keyStore
+{
+    uint8_t* map;
+    size_t   mapLength;
+    uint32_t count;
+    uint8_t* records;
+} keyStore;
+
+ERRORCODE openKeyStore  (char* storeFile, keyStore* store);
+void      closeKeyStore (keyStore* store);
+
+/*
+ * Look up the key for a USN, ERR_NO_KEY if the store doesn't have one
+ */
+ERRORCODE findDeviceKey (keyStore* store, const uint8_t* usn, uint8_t* key);
+
+/*
+ * Build a store from a text file of "<usn hex> <key hex>" lines. The new
+ * store replaces any old one in a single rename, so a running station
+ * never sees half a file.
+ */
+ERRORCODE buildKeyStore (char* textFile, char* storeFile);
+
+/*
+ * Read such a text file into KEYSTORE_RECORD_SIZE records, in file order,
+ * for the caller to free()
+ */
+ERRORCODE readKeyText   (char* textFile, uint8_t** records, uint32_t* count);
+
+#endif /* KEYSTORE_H_ */
@@ -0,0 +1,578 @@
+/*
+ * libshunt.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#include "shunt.h"
+#include "serial.h"
+#include "sessionLayer.h"
+#include "commandLayer.h"
+#include "appLayer.h"
+#include "flashPlan.h"
+#include "keyStore.h"
+#include "provisionIndex.h"
+#include "telemetry.h"
+#include "libshunt.h"
+
+// the public codes are shunt.h's own, so results pass straight through
+#if (SHUNT_SUCCESS != SUCCESS) || \
+    (SHUNT_ERR_DIRECTORY != ERR_DIRECTORY) || \
+    (SHUNT_ERR_NO_DEVICE != ERR_NO_DEVICE) || \
+    (SHUNT_ERR_TOO_MANY != ERR_TOO_MANY) || \
+    (SHUNT_ERR_OPEN_TTY != ERR_OPEN_TTY) || \
+    (SHUNT_ERR_CONFIG_TTY != ERR_CONFIG_TTY) || \
+    (SHUNT_ERR_SERIAL_WRITE != ERR_SERIAL_WRITE) || \
+    (SHUNT_ERR_SERIAL_READ != ERR_SERIAL_READ) || \
+    (SHUNT_ERR_SERIAL_TIMEOUT != ERR_SERIAL_TIMEOUT) || \
+    (SHUNT_ERR_VALIDATION != ERR_VALIDATION) || \
+    (SHUNT_ERR_TRANSPORT_SEND != ERR_TRANSPORT_SEND) || \
+    (SHUNT_ERR_CONREP != ERR_CONREP) || \
+    (SHUNT_ERR_SERIAL_NO_DATA != ERR_SERIAL_NO_DATA) || \
+    (SHUNT_ERR_NO_MEM != ERR_NO_MEM) || \
+    (SHUNT_ERR_CREATE_MUTEX != ERR_CREATE_MUTEX) || \
+    (SHUNT_ERR_CREATE_THREAD != ERR_CREATE_THREAD) || \
+    (SHUNT_ERR_LOCK_FAIL != ERR_LOCK_FAIL) || \
+    (SHUNT_ERR_OPENSSL_KEY != ERR_OPENSSL_KEY) || \
+    (SHUNT_ERR_CHALLENGE_FAIL != ERR_CHALLENGE_FAIL) || \
+    (SHUNT_ERR_COMMAND_INVAL != ERR_COMMAND_INVAL) || \
+    (SHUNT_ERR_COMMAND_ALREADY != ERR_COMMAND_ALREADY) || \
+    (SHUNT_ERR_COMMAND_UNK != ERR_COMMAND_UNK) || \
+    (SHUNT_ERR_COMMAND_LENGTH != ERR_COMMAND_LENGTH) || \
+    (SHUNT_ERR_BAD_SECTOR != ERR_BAD_SECTOR) || \
+    (SHUNT_ERR_SIG_LENGTH != ERR_SIG_LENGTH) || \
+    (SHUNT_ERR_BAD_OPCODE != ERR_BAD_OPCODE) || \
+    (SHUNT_ERR_STAT != ERR_STAT) || \
+    (SHUNT_ERR_TOO_BIG != ERR_TOO_BIG) || \
+    (SHUNT_ERR_FILE_OPEN != ERR_FILE_OPEN) || \
+    (SHUNT_ERR_FILE_READ != ERR_FILE_READ) || \
+    (SHUNT_ERR_AGAIN != ERR_AGAIN) || \
+    (SHUNT_ERR_VERIFY != ERR_VERIFY) || \
+    (SHUNT_ERR_FILE_WRITE != ERR_FILE_WRITE) || \
+    (SHUNT_ERR_LINK_DOWN != ERR_LINK_DOWN) || \
+    (SHUNT_ERR_BAD_IMAGE != ERR_BAD_IMAGE) || \
+    (SHUNT_ERR_NO_KEY != ERR_NO_KEY) || \
+    (SHUNT_ERR_NO_HISTORY != ERR_NO_HISTORY) || \
+    (SHUNT_ERR_PACKET_ROOM != ERR_PACKET_ROOM)
+#error libshunt.h error codes differ from shunt.h
+#endif
+
+struct _shuntDevice
+{
+    serialSession*  port;
+    bool            ownsPort;     // opened by shuntOpen, rather than attached
+    uint8_t         key[16];
+    shuntEnv        env;          // the callbacks, key store and telemetry of this device
+    keyStore        keys;
+    bool            haveKeys;
+    provisionIndex  history;
+    bool            haveHistory;
+    sessionDetails* session;      // between shuntStartSession and shuntEndSession
+    commandQueue*   queue;        // once the session has had a shuntCommandAsync
+};
+
+/*
+ * enterDevice
+ *
+ * Work for a device on this thread until leaveDevice
+ */
+static shuntEnv* enterDevice(shuntDevice* device)
+{
+    return useShuntEnv(&(device->env));
+}
+
+static void leaveDevice(shuntEnv* previous)
+{
+    useShuntEnv(previous);
+}
+
+/*
+ * deviceOptions
+ *
+ * The options for a call, with the device's history
+ */
+static void deviceOptions(shuntDevice* device, const shuntFlashOptions* options, flashOptions* deviceOpts)
+{
+    memset(deviceOpts, 0, sizeof(flashOptions));
+    if (options)
+    {
+        deviceOpts->offsetSect    = options->offsetSect;
+        deviceOpts->override      = options->override;
+        deviceOpts->differential  = options->differential;
+        deviceOpts->verifySectors = options->verifySectors;
+        deviceOpts->compressed    = options->compressed;
+        deviceOpts->frameCache    = options->frameCache;
+        deviceOpts->sealedDir     = (char*)options->sealedDir;
+    }
+
+    if (device->haveHistory)
+    {
+        deviceOpts->history = &(device->history);
+    }
+}
+
+/*
+ * copyHello
+ *
+ * the public part of a unit's hello response
+ */
+static void copyHello(const struct helloResp* from, shuntHello* to)
+{
+    to->lifeCycle        = from->lifeCycle;
+    to->usipMajorVersion = from->usipMajorVersion;
+    to->usipMinorVersion = from->usipMinorVersion;
+    to->sblMajorVersion  = from->sblMajorVersion;
+    to->sblMinorVersion  = from->sblMinorVersion;
+    to->halMajorVersion  = from->halMajorVersion;
+    to->halMinorVersion  = from->halMinorVersion;
+    memcpy(to->usn, from->usn, sizeof(to->usn));
+}
+
+uint32_t shuntVersion(void)
+{
+    return LIBSHUNT_VERSION;
+}
+
+shuntResult shuntAttach(shuntPort* port, const uint8_t* key, const shuntCallbacks* callbacks, shuntDevice** retDevice)
+{
+    shuntDevice* newDevice;
+
+    newDevice = (shuntDevice*)calloc(1, sizeof(shuntDevice));
+    if (!newDevice)
+    {
+        return ERR_NO_MEM;
+    }
+
+    newDevice->port = port;
+    memcpy(newDevice->key, key, sizeof(newDevice->key));
+    if (callbacks)
+    {
+        newDevice->env.outputFunc   = callbacks->outputFunc;
+        newDevice->env.debugFunc    = callbacks->debugFunc;
+        newDevice->env.hexDebugFunc = callbacks->hexDebugFunc;
+        newDevice->env.progressFunc = callbacks->progressFunc;
+        newDevice->env.user         = callbacks->user;
+    }
+
+    *retDevice = newDevice;
+    return SUCCESS;
+}
+
+shuntResult shuntOpenPort(const char* device, shuntPort** port)
+{
+    return serialInit((char*)device, port);
+}
+
+shuntResult shuntPipePair(shuntPort** host, shuntPort** device)
+{
+    return serialPipePair(host, device);
+}
+
+shuntResult shuntPortRead(shuntPort* port, uint8_t* data, uint16_t length, int16_t* readBytes)
+{
+    return serialRead(port, data, length, readBytes);
+}
+
+shuntResult shuntPortWrite(shuntPort* port, const uint8_t* data, uint16_t length)
+{
+    return serialWrite(port, (uint8_t*)data, length);
+}
+
+shuntResult shuntPortWait(shuntPort* port, uint32_t timeoutMs)
+{
+    return serialWait(port, timeoutMs);
+}
+
+void shuntClosePort(shuntPort* port)
+{
+    if (port)
+    {
+        destroySession(port);
+    }
+}
+
+shuntResult shuntOpen(const char* device, const uint8_t* key, const shuntCallbacks* callbacks, shuntDevice** retDevice)
+{
+    shuntDevice* newDevice;
+    shuntEnv*    previous;
+    ERRORCODE    retCode;
+
+    retCode = shuntAttach(NULL, key, callbacks, &newDevice);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    // the port's reader thread takes on the environment it is opened in
+    previous = enterDevice(newDevice);
+    retCode = serialInit((char*)device, &(newDevice->port));
+    leaveDevice(previous);
+
+    if (retCode != SUCCESS)
+    {
+        free(newDevice);
+        return retCode;
+    }
+
+    newDevice->ownsPort = true;
+    *retDevice = newDevice;
+    return SUCCESS;
+}
+
+void shuntClose(shuntDevice* device)
+{
+    shuntEnv* previous;
+
+    if (!device)
+    {
+        return;
+    }
+
+    previous = enterDevice(device);
+    shuntEndSession(device);
+    if (device->ownsPort)
+    {
+        destroySession(device->port);
+    }
+    if (device->haveKeys)
+    {
+        closeKeyStore(&(device->keys));
+    }
+    if (device->haveHistory)
+    {
+        closeProvisionIndex(&(device->history));
+    }
+    closeTelemetry(device->env.telemetry, SUCCESS);
+    leaveDevice(previous);
+
+    free(device);
+}
+
+shuntResult shuntUseKeyStore(shuntDevice* device, const char* storeFile)
+{
+    shuntEnv* previous;
+    ERRORCODE retCode;
+
+    if (device->haveKeys)
+    {
+        device->env.keys = NULL;
+        closeKeyStore(&(device->keys));
+        device->haveKeys = false;
+    }
+
+    previous = enterDevice(device);
+    retCode = openKeyStore((char*)storeFile, &(device->keys));
+    leaveDevice(previous);
+
+    if (retCode == SUCCESS)
+    {
+        device->haveKeys = true;
+        device->env.keys = &(device->keys);
+    }
+    return retCode;
+}
+
+shuntResult shuntUseHistory(shuntDevice* device, const char* indexFile)
+{
+    shuntEnv* previous;
+    ERRORCODE retCode;
+
+    if (device->haveHistory)
+    {
+        closeProvisionIndex(&(device->history));
+        device->haveHistory = false;
+    }
+
+    previous = enterDevice(device);
+    retCode = openProvisionIndex((char*)indexFile, &(device->history));
+    leaveDevice(previous);
+
+    device->haveHistory = (retCode == SUCCESS);
+    return retCode;
+}
+
+shuntResult shuntUseTelemetry(shuntDevice* device, const char* path)
+{
+    shuntEnv* previous;
+    ERRORCODE retCode;
+
+    previous = enterDevice(device);
+    closeTelemetry(device->env.telemetry, SUCCESS);
+    device->env.telemetry = NULL;
+    retCode = openTelemetry((char*)path, &(device->env.telemetry));
+    leaveDevice(previous);
+
+    return retCode;
+}
+
+shuntResult shuntUseProtection(shuntDevice* device, const char* protection)
+{
+    return parseProtection(protection, &(device->env.protection));
+}
+
+shuntResult shuntIdentify(shuntDevice* device, shuntHello* hello)
+{
+    shuntEnv*       previous;
+    sessionDetails* details;
+    uint8_t*        respData = NULL;
+    uint16_t        respLen = 0;
+    ERRORCODE       retCode;
+
+    if (device->session)
+    {
+        return ERR_AGAIN;
+    }
+
+    previous = enterDevice(device);
+    retCode = initSession(device->port, &respData, &respLen, device->key, &details);
+    if (retCode == SUCCESS)
+    {
+        copyHello(getSessionHello(details), hello);
+        endSession(details);
+    }
+    free(respData);
+    leaveDevice(previous);
+
+    return retCode;
+}
+
+shuntResult shuntErase(shuntDevice* device, uint8_t startSect, uint8_t endSect, bool override)
+{
+    shuntEnv* previous;
+    ERRORCODE retCode;
+
+    if (device->session)
+    {
+        return ERR_AGAIN;
+    }
+
+    previous = enterDevice(device);
+    retCode = eraseSectors(device->port, device->key, startSect, endSect, override);
+    leaveDevice(previous);
+
+    return retCode;
+}
+
+shuntResult shuntFlash(shuntDevice* device, const char* imageFile, const shuntFlashOptions* options, shuntFlashReport* report)
+{
+    shuntEnv*    previous;
+    flashOptions deviceOpts;
+    flashReport  runReport;
+    flashPlan    plan;
+    ERRORCODE    retCode;
+
+    if (device->session)
+    {
+        return ERR_AGAIN;
+    }
+
+    // as with shunt -Y, sealed writes only mean something on a protected session
+    if (options && options->sealedDir && (device->env.protection == PROTECTION_CLEAR_UNSIGNED))
+    {
+        return ERR_COMMAND_INVAL;
+    }
+
+    previous = enterDevice(device);
+    deviceOptions(device, options, &deviceOpts);
+    memset(&runReport, 0, sizeof(runReport));
+
+    retCode = buildFlashPlan((char*)imageFile, &deviceOpts, &plan);
+    if (retCode == SUCCESS)
+    {
+        retCode = runFlashPlan(device->port, device->key, &plan, &deviceOpts, &runReport);
+        freeFlashPlan(&plan);
+    }
+    if (report)
+    {
+        memset(report, 0, sizeof(shuntFlashReport));
+        report->identified = runReport.identified;
+        if (runReport.identified)
+        {
+            copyHello(&(runReport.hello), &(report->hello));
+        }
+        report->seconds    = runReport.seconds;
+        report->wireBytes  = runReport.wireBytes;
+        report->recoveries = runReport.recoveries;
+    }
+    leaveDevice(previous);
+
+    return retCode;
+}
+
+shuntResult shuntVerify(shuntDevice* device, const char* imageFile, const shuntFlashOptions* options)
+{
+    shuntEnv*    previous;
+    flashOptions deviceOpts;
+    ERRORCODE    retCode;
+
+    if (device->session)
+    {
+        return ERR_AGAIN;
+    }
+
+    previous = enterDevice(device);
+    deviceOptions(device, options, &deviceOpts);
+    retCode = verifyImage(device->port, device->key, (char*)imageFile, &deviceOpts);
+    leaveDevice(previous);
+
+    return retCode;
+}
+
+shuntResult shuntBackup(shuntDevice* device, const char* backupFile, bool override)
+{
+    shuntEnv* previous;
+    ERRORCODE retCode;
+
+    if (device->session)
+    {
+        return ERR_AGAIN;
+    }
+
+    previous = enterDevice(device);
+    retCode = backupFlash(device->port, device->key, (char*)backupFile, override);
+    leaveDevice(previous);
+
+    return retCode;
+}
+
+shuntResult shuntRestore(shuntDevice* device, const char* backupFile, const shuntFlashOptions* options)
+{
+    shuntEnv*    previous;
+    flashOptions deviceOpts;
+    ERRORCODE    retCode;
+
+    if (device->session)
+    {
+        return ERR_AGAIN;
+    }
+
+    previous = enterDevice(device);
+    deviceOptions(device, options, &deviceOpts);
+    retCode = restoreFlash(device->port, device->key, (char*)backupFile, &deviceOpts);
+    leaveDevice(previous);
+
+    return retCode;
+}
+
+shuntResult shuntStartSession(shuntDevice* device)
+{
+    shuntEnv* previous;
+    ERRORCODE retCode;
+
+    if (device->session)
+    {
+        return ERR_AGAIN;
+    }
+
+    previous = enterDevice(device);
+    retCode = startSessionLayer(device->port, device->key, device->env.protection, &(device->session));
+    if (retCode != SUCCESS)
+    {
+        device->session = NULL;
+    }
+    leaveDevice(previous);
+
+    return retCode;
+}
+
+shuntResult shuntCommand(shuntDevice* device, uint8_t commandID, const uint8_t* data, uint16_t dataLength,
+                       uint8_t** respData, uint16_t* respLength)
+{
+    shuntEnv* previous;
+    ERRORCODE retCode;
+
+    if (!device->session)
+    {
+        return ERR_COMMAND_INVAL;
+    }
+
+    *respData = NULL;
+    *respLength = 0;
+
+    previous = enterDevice(device);
+    // an RCS may do anything, so a call is never repeated behind the caller's back
+    retCode = callCustomProcedure(device->session, commandID, (uint8_t*)data, dataLength, respData, respLength, &onceOnlyPolicy);
+    leaveDevice(previous);
+
+    return retCode;
+}
+
+void shuntEndSession(shuntDevice* device)
+{
+    shuntEnv* previous;
+
+    if (!device->session)
+    {
+        return;
+    }
+
+    previous = enterDevice(device);
+    if (device->queue)
+    {
+        destroyCommandQueue(device->queue);
+        device->queue = NULL;
+    }
+    endSession(device->session);
+    device->session = NULL;
+    leaveDevice(previous);
+}
+
+shuntResult shuntCommandAsync(shuntDevice* device, uint8_t commandID, const uint8_t* data, uint16_t dataLength,
+                            shuntCompletionCallback callback, void* context)
+{
+    shuntEnv* previous;
+    ERRORCODE retCode = SUCCESS;
+
+    if (!device->session || !callback)
+    {
+        return ERR_COMMAND_INVAL;
+    }
+
+    // the queue's worker takes on the environment the queue is made in
+    previous = enterDevice(device);
+    if (!device->queue)
+    {
+        retCode = createCommandQueue(device->session, &(device->queue));
+    }
+    if (retCode == SUCCESS)
+    {
+        retCode = callCustomProcedureAsync(device->queue, commandID, (uint8_t*)data, dataLength, &onceOnlyPolicy,
+                                           callback, context);
+    }
+    leaveDevice(previous);
+
+    return retCode;
+}
+
+int shuntCompletionFd(shuntDevice* device)
+{
+    return device->queue ? commandQueueFd(device->queue) : -1;
+}
+
+uint32_t shuntProcessCompletions(shuntDevice* device)
+{
+    shuntEnv* previous;
+    uint32_t  completed = 0;
+
+    if (device->queue)
+    {
+        previous = enterDevice(device);
+        completed = processCompletions(device->queue);
+        leaveDevice(previous);
+    }
+
+    return completed;
+}
+
+void shuntWaitCompletions(shuntDevice* device)
+{
+    shuntEnv* previous;
+
+    if (device->queue)
+    {
+        previous = enterDevice(device);
+        waitForCompletions(device->queue);
+        leaveDevice(previous);
+    }
+}
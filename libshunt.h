@@ -0,0 +1,235 @@
+/*
+ * libshunt.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * shunt as a library, for test executives that drive many devices from
+ * one process instead of running shunt once per board. Everything a
+ * device needs - the port, its key, the caller's callbacks, key store,
+ * telemetry and provisioning history - hangs off its shuntDevice, so
+ * there is no global state: different devices can be driven from
+ * different threads at the same time. Calls on any one device must not
+ * overlap.
+ *
+ * Every call returns a shuntResult, SHUNT_SUCCESS or one of the
+ * SHUNT_ERR_ codes below. Messages that shunt would print, debug trace
+ * and progress go to the callbacks given to shuntOpen, on the calling
+ * thread or on a thread shunt started for the device.
+ *
+ * This header stands alone - nothing of shunt's own headers is needed,
+ * or exposed, to use it.
+ */
+
+#ifndef LIBSHUNT_H_
+#define LIBSHUNT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LIBSHUNT_VERSION 6  // bumped whenever this interface changes
+
+#define SHUNT_API __attribute__((visibility("default")))
+
+typedef uint16_t shuntResult;
+
+#define SHUNT_SUCCESS             0
+#define SHUNT_ERR_DIRECTORY       1
+#define SHUNT_ERR_NO_DEVICE       2
+#define SHUNT_ERR_TOO_MANY        3
+#define SHUNT_ERR_OPEN_TTY        4
+#define SHUNT_ERR_CONFIG_TTY      5
+#define SHUNT_ERR_SERIAL_WRITE    6
+#define SHUNT_ERR_SERIAL_READ     7
+#define SHUNT_ERR_SERIAL_TIMEOUT  8
+#define SHUNT_ERR_VALIDATION      9
+#define SHUNT_ERR_TRANSPORT_SEND  10
+#define SHUNT_ERR_CONREP          11
+#define SHUNT_ERR_SERIAL_NO_DATA  12
+#define SHUNT_ERR_NO_MEM          13
+#define SHUNT_ERR_CREATE_MUTEX    14
+#define SHUNT_ERR_CREATE_THREAD   15
+#define SHUNT_ERR_LOCK_FAIL       16
+#define SHUNT_ERR_OPENSSL_KEY     17
+#define SHUNT_ERR_CHALLENGE_FAIL  18
+#define SHUNT_ERR_COMMAND_INVAL   19
+#define SHUNT_ERR_COMMAND_ALREADY 20
+#define SHUNT_ERR_COMMAND_UNK     21
+#define SHUNT_ERR_COMMAND_LENGTH  22
+#define SHUNT_ERR_BAD_SECTOR      23
+#define SHUNT_ERR_SIG_LENGTH      24
+#define SHUNT_ERR_BAD_OPCODE      25
+#define SHUNT_ERR_STAT            26
+#define SHUNT_ERR_TOO_BIG         27
+#define SHUNT_ERR_FILE_OPEN       28
+#define SHUNT_ERR_FILE_READ       29
+#define SHUNT_ERR_AGAIN           30
+#define SHUNT_ERR_VERIFY          31
+#define SHUNT_ERR_FILE_WRITE      32
+#define SHUNT_ERR_LINK_DOWN       33
+#define SHUNT_ERR_BAD_IMAGE       34
+#define SHUNT_ERR_NO_KEY          35
+#define SHUNT_ERR_NO_HISTORY      36
+#define SHUNT_ERR_PACKET_ROOM     37
+
+typedef struct _shuntDevice   shuntDevice;
+typedef struct _serialSession shuntPort;
+
+typedef void (*shuntLogCallback)      (void* user, const char* message);
+typedef void (*shuntHexCallback)      (void* user, const uint8_t* data, uint32_t length);
+typedef void (*shuntProgressCallback) (void* user, uint32_t done, uint32_t total);
+
+/*
+ * Where a device's messages go. Any of these can be NULL.
+ */
+typedef struct _shuntCallbacks
+{
+    shuntLogCallback      outputFunc;    // what the shunt tool would print
+    shuntLogCallback      debugFunc;     // debug trace, as with shunt -v
+    shuntHexCallback      hexDebugFunc;
+    shuntProgressCallback progressFunc;  // bytes done of a flash or backup
+    void*                 user;          // passed to each callback
+} shuntCallbacks;
+
+/*
+ * What the unit says about itself when a session starts
+ */
+typedef struct _shuntHello
+{
+    uint8_t lifeCycle;
+    uint8_t usipMajorVersion;
+    uint8_t usipMinorVersion;
+    uint8_t sblMajorVersion;
+    uint8_t sblMinorVersion;
+    uint8_t halMajorVersion;
+    uint8_t halMinorVersion;
+    uint8_t usn[16];
+} shuntHello;
+
+/*
+ * How to flash, verify or restore, as with the shunt options of the same
+ * names. NULL options are all off. The provisioning history is set for
+ * the device with shuntUseHistory.
+ */
+typedef struct _shuntFlashOptions
+{
+    uint8_t     offsetSect;    // -o
+    bool        override;      // -O, sector 35 may be written
+    bool        differential;  // -i
+    bool        verifySectors; // -w
+    bool        compressed;    // -z
+    bool        frameCache;    // -F
+    const char* sealedDir;     // -Y, NULL for none - needs shuntUseProtection other than clear
+} shuntFlashOptions;
+
+/*
+ * How a shuntFlash went
+ */
+typedef struct _shuntFlashReport
+{
+    bool       identified;  // the unit answered hello, and hello is filled in
+    shuntHello hello;
+    double     seconds;
+    uint32_t   wireBytes;
+    uint8_t    recoveries;  // times the link was lost and got back
+} shuntFlashReport;
+
+/*
+ * The LIBSHUNT_VERSION the library was built with
+ */
+SHUNT_API uint32_t    shuntVersion      (void);
+
+/*
+ * Open a device - a tty path, "pty:" or "tcp:host:port", as with
+ * shunt -l - and the 16 byte key to use with it
+ */
+SHUNT_API shuntResult shuntOpen         (const char* device, const uint8_t* key, const shuntCallbacks* callbacks, shuntDevice** retDevice);
+
+/*
+ * Drive a serial session the caller already has, such as one end of a
+ * shuntPipePair. The caller still owns it, and destroys it with
+ * shuntClosePort after shuntClose.
+ */
+SHUNT_API shuntResult shuntAttach       (shuntPort* port, const uint8_t* key, const shuntCallbacks* callbacks, shuntDevice** retDevice);
+
+/*
+ * Ports for shuntAttach - one opened the way shuntOpen opens a device,
+ * or an in-memory pipe pair, the far end of which the caller plays the
+ * unit on with shuntPortRead, shuntPortWrite and shuntPortWait. Each is
+ * destroyed with shuntClosePort.
+ */
+SHUNT_API shuntResult shuntOpenPort     (const char* device, shuntPort** port);
+SHUNT_API shuntResult shuntPipePair     (shuntPort** host, shuntPort** device);
+SHUNT_API shuntResult shuntPortRead     (shuntPort* port, uint8_t* data, uint16_t length, int16_t* readBytes);
+SHUNT_API shuntResult shuntPortWrite    (shuntPort* port, const uint8_t* data, uint16_t length);
+SHUNT_API shuntResult shuntPortWait     (shuntPort* port, uint32_t timeoutMs);
+SHUNT_API void        shuntClosePort    (shuntPort* port);
+
+/*
+ * End any session, close everything the device opened and free it
+ */
+SHUNT_API void        shuntClose        (shuntDevice* device);
+
+/*
+ * Take the device's key from a key store (shunt -S) by the unit's USN
+ */
+SHUNT_API shuntResult shuntUseKeyStore  (shuntDevice* device, const char* storeFile);
+
+/*
+ * Keep a provisioning history, as with shunt -H, for this device's
+ * flash and restore calls
+ */
+SHUNT_API shuntResult shuntUseHistory   (shuntDevice* device, const char* indexFile);
+
+/*
+ * Append JSON lines telemetry for this device's calls to a file
+ */
+SHUNT_API shuntResult shuntUseTelemetry (shuntDevice* device, const char* path);
+
+/*
+ * Protect this device's sessions, as with shunt -A - clear, rmac,
+ * aes-rmac, cmac or aes-cmac
+ */
+SHUNT_API shuntResult shuntUseProtection (shuntDevice* device, const char* protection);
+
+/*
+ * Operations on the unit. Each runs a session of its own, so none of
+ * them can be used between shuntStartSession and shuntEndSession.
+ */
+SHUNT_API shuntResult shuntIdentify     (shuntDevice* device, shuntHello* hello);
+SHUNT_API shuntResult shuntErase        (shuntDevice* device, uint8_t startSect, uint8_t endSect, bool override);
+SHUNT_API shuntResult shuntFlash        (shuntDevice* device, const char* imageFile, const shuntFlashOptions* options, shuntFlashReport* report);
+SHUNT_API shuntResult shuntVerify       (shuntDevice* device, const char* imageFile, const shuntFlashOptions* options);
+SHUNT_API shuntResult shuntBackup       (shuntDevice* device, const char* backupFile, bool override);
+SHUNT_API shuntResult shuntRestore      (shuntDevice* device, const char* backupFile, const shuntFlashOptions* options);
+
+/*
+ * Raw commands. Start a session, send commands in it and end it. A
+ * response is allocated for the caller, who frees it with free(). A
+ * command whose reply goes missing isn't sent again, as it may already
+ * have been done - the caller has to find out and decide.
+ */
+SHUNT_API shuntResult shuntStartSession (shuntDevice* device);
+SHUNT_API shuntResult shuntCommand      (shuntDevice* device, uint8_t commandID, const uint8_t* data, uint16_t dataLength,
+                                         uint8_t** respData, uint16_t* respLength);
+SHUNT_API void        shuntEndSession   (shuntDevice* device);
+
+/*
+ * Queued raw commands, for callers with other work to do while a command
+ * is on the wire. shuntCommandAsync returns once the command is queued
+ * on the session; commands run in the order queued, and shuntCommand
+ * calls wait their turn behind them. Each callback is run, on the
+ * calling thread, by shuntProcessCompletions - call it whenever
+ * shuntCompletionFd is readable - or by shuntWaitCompletions, which
+ * waits for everything queued first. respData is only valid during the
+ * callback. shuntEndSession waits for the queue and runs what is left.
+ */
+typedef void (*shuntCompletionCallback)(void* context, shuntResult result, uint8_t* respData, uint16_t respLength);
+
+SHUNT_API shuntResult shuntCommandAsync      (shuntDevice* device, uint8_t commandID, const uint8_t* data, uint16_t dataLength,
+                                              shuntCompletionCallback callback, void* context);
+SHUNT_API int         shuntCompletionFd      (shuntDevice* device);
+SHUNT_API uint32_t    shuntProcessCompletions(shuntDevice* device);
+SHUNT_API void        shuntWaitCompletions   (shuntDevice* device);
+
+#endif /* LIBSHUNT_H_ */
@@ -0,0 +1,156 @@
+/*
+ * packetBuffer.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#include "shunt.h"
+#include "packetBuffer.h"
+
+ERRORCODE allocPacketRoom(packetBuffer* packet, uint32_t headroom, uint32_t length, uint32_t tailroom)
+{
+    packet->size      = headroom + length + tailroom;
+    packet->length    = length;
+    packet->checksums = NULL;
+    packet->checksum  = NULL;
+    packet->sealed    = NULL;
+
+    if (packet->size == 0)
+    {
+        packet->storage   = NULL;
+        packet->data      = NULL;
+        packet->allocated = false;
+        return SUCCESS;
+    }
+
+    packet->storage = (uint8_t*)malloc(packet->size);
+    if (!packet->storage)
+    {
+        debug("Failed to allocate packet of %u bytes\n", packet->size);
+        packet->data      = NULL;
+        packet->size      = 0;
+        packet->length    = 0;
+        packet->allocated = false;
+        return ERR_NO_MEM;
+    }
+
+    packet->data      = packet->storage + headroom;
+    packet->allocated = true;
+    return SUCCESS;
+}
+
+ERRORCODE allocPacket(packetBuffer* packet, uint32_t length)
+{
+    return allocPacketRoom(packet, PACKET_HEADROOM, length, PACKET_TAILROOM);
+}
+
+void initPacket(packetBuffer* packet, uint8_t* storage, uint32_t size, uint32_t length)
+{
+    packet->storage   = storage;
+    packet->size      = size;
+    packet->data      = storage + PACKET_HEADROOM;
+    packet->length    = length;
+    packet->allocated = false;
+    packet->checksums = NULL;
+    packet->checksum  = NULL;
+    packet->sealed    = NULL;
+}
+
+void freePacket(packetBuffer* packet)
+{
+    if (packet->sealed)
+    {
+        freePacket(packet->sealed);
+        free(packet->sealed);
+    }
+    if (packet->allocated)
+    {
+        free(packet->storage);
+    }
+    packet->storage   = NULL;
+    packet->data      = NULL;
+    packet->size      = 0;
+    packet->length    = 0;
+    packet->allocated = false;
+    packet->checksums = NULL;
+    packet->checksum  = NULL;
+    packet->sealed    = NULL;
+}
+
+uint8_t* packetPush(packetBuffer* packet, uint32_t length)
+{
+    if ((uint32_t)(packet->data - packet->storage) < length)
+    {
+        return NULL;
+    }
+
+    packet->data   -= length;
+    packet->length += length;
+    return packet->data;
+}
+
+uint8_t* packetPull(packetBuffer* packet, uint32_t length)
+{
+    if (packet->length < length)
+    {
+        return NULL;
+    }
+
+    packet->data   += length;
+    packet->length -= length;
+    return packet->data;
+}
+
+uint8_t* packetPut(packetBuffer* packet, uint32_t length)
+{
+    uint8_t* tail = packet->data + packet->length;
+
+    if ((uint32_t)(packet->storage + packet->size - tail) < length)
+    {
+        return NULL;
+    }
+
+    packet->length += length;
+    return tail;
+}
+
+void packetTrim(packetBuffer* packet, uint32_t length)
+{
+    if (length < packet->length)
+    {
+        packet->length = length;
+    }
+}
+
+uint8_t* packetRelease(packetBuffer* packet)
+{
+    uint8_t* contents;
+
+    if (packet->length == 0)
+    {
+        freePacket(packet);
+        return NULL;
+    }
+
+    if (packet->allocated)
+    {
+        if (packet->data != packet->storage)
+        {
+            memmove(packet->storage, packet->data, packet->length);
+        }
+        contents = packet->storage;
+        packet->allocated = false;
+    }
+    else
+    {
+        contents = (uint8_t*)malloc(packet->length);
+        if (contents)
+        {
+            memcpy(contents, packet->data, packet->length);
+        }
+    }
+
+    freePacket(packet);
+    return contents;
+}
@@ -0,0 +1,85 @@
+/*
+ * packetBuffer.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * A buffer with room reserved in front of and behind its contents, so
+ * each layer on the way down can add its header and trailer where they
+ * are, and each layer on the way up can strip them by moving the ends.
+ *
+ *   storage                                          storage + size
+ *   |  headroom  |  data ... data + length  |  tailroom  |
+ */
+
+#ifndef PACKETBUFFER_H_
+#define PACKETBUFFER_H_
+
+#include "shunt.h"
+
+#define DATA_LAYER_HEADROOM  8   // sync bytes, control, length, id/seq and header checksum
+#define DATA_LAYER_TAILROOM  4   // data checksum
+#define SESSION_HEADROOM     4   // command/protection, transID and length
+#define SESSION_TAILROOM     32  // padding out to the AES block, and the CMAC
+
+#define PACKET_HEADROOM      (DATA_LAYER_HEADROOM + SESSION_HEADROOM)
+#define PACKET_TAILROOM      (SESSION_TAILROOM + DATA_LAYER_TAILROOM)
+
+#define PACKET_ROOM(length)  (PACKET_HEADROOM + (length) + PACKET_TAILROOM)
+
+typedef struct _packetBuffer
+{
+    uint8_t*              storage;
+    uint32_t              size;
+    uint8_t*              data;
+    uint32_t              length;
+    bool                  allocated;  // storage is ours to free
+    const uint8_t*        checksums;  // precomputed data layer checksums of the contents sent in
+                                      // the clear, one per session transID - NULL to calculate them
+    const uint8_t*        checksum;   // the one for the packet as it is framed right now
+    struct _packetBuffer* sealed;     // the contents encrypted and MACed ahead of sending (see
+                                      // sealAhead), freed with the packet
+} packetBuffer;
+
+/*
+ * Allocate a buffer for length bytes of contents, with the headroom and
+ * tailroom to send them through every layer
+ */
+ERRORCODE allocPacket     (packetBuffer* packet, uint32_t length);
+
+/*
+ * With the room given - received packets only ever get smaller
+ */
+ERRORCODE allocPacketRoom (packetBuffer* packet, uint32_t headroom, uint32_t length, uint32_t tailroom);
+
+/*
+ * The same over caller storage - PACKET_ROOM(length) bytes of it - for
+ * short commands built on the stack
+ */
+void      initPacket      (packetBuffer* packet, uint8_t* storage, uint32_t size, uint32_t length);
+
+void      freePacket      (packetBuffer* packet);
+
+/*
+ * Add length bytes in front of the contents and return where they start,
+ * or take them off the front and return the new start. NULL if there
+ * isn't the room or the contents.
+ */
+uint8_t*  packetPush      (packetBuffer* packet, uint32_t length);
+uint8_t*  packetPull      (packetBuffer* packet, uint32_t length);
+
+/*
+ * Add length bytes after the contents and return where they start, or
+ * cut the contents down to length bytes
+ */
+uint8_t*  packetPut       (packetBuffer* packet, uint32_t length);
+void      packetTrim      (packetBuffer* packet, uint32_t length);
+
+/*
+ * Hand the contents over as a plain malloc'd buffer for the caller to
+ * free(), emptying the packet. The contents are moved to the front of
+ * the storage first if anything was pulled off them.
+ */
+uint8_t*  packetRelease   (packetBuffer* packet);
+
+#endif /* PACKETBUFFER_H_ */
@@ -0,0 +1,517 @@
+/*
+ * provisionIndex.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Which image, sector by sector, each unit was last flashed with, so a
+ * unit presented again is only sent the sectors that changed - or
+ * nothing at all - without asking it anything beyond its hello.
+ *
+ * The index is a hash table of fixed size slots in a mapped file:
+ *
+ *   header - "SHNTHIST" | version (4) | slot count (4) | used (4) | pad (12)
+ *   slot   - usn (16) | image hash (32) | time (8) | sector mask (8) |
+ *            sector CRCs (4 x FLASH_SECTORS)
+ *
+ * big endian throughout, a time of 0 marking an empty slot. Slots are
+ * found by FNV-1a of the USN and linear probing; when the table gets
+ * three quarters full it is rebuilt at twice the size and renamed over
+ * the old one.
+ *
+ * Stations share the index, so every lookup holds a shared flock and
+ * every store an exclusive one. The lock is on <path>.lock rather than
+ * the index itself, which is replaced when it grows; having taken it, a
+ * process that finds the index was replaced maps the new one first.
+ */
+
+#include "shunt.h"
+#include "provisionIndex.h"
+
+#include <sys/file.h>
+
+#define INDEX_MAGIC       "SHNTHIST"
+#define INDEX_MAGIC_SIZE  8
+#define INDEX_VERSION     1
+#define INDEX_HEADER_SIZE 32
+#define INDEX_SLOT_SIZE   (16 + 32 + 8 + 8 + (4 * FLASH_SECTORS))
+#define INDEX_FIRST_SLOTS 1024
+
+#define SLOT_HASH         16
+#define SLOT_TIME         48
+#define SLOT_MASK         56
+#define SLOT_CRCS         64
+
+static void putWord(uint8_t* position, uint32_t value)
+{
+    position[0] = (value >> 24) & 0xFF;
+    position[1] = (value >> 16) & 0xFF;
+    position[2] = (value >> 8) & 0xFF;
+    position[3] = value & 0xFF;
+}
+
+static uint32_t getWord(const uint8_t* position)
+{
+    return (position[0] << 24) | (position[1] << 16) | (position[2] << 8) | position[3];
+}
+
+static void putLong(uint8_t* position, uint64_t value)
+{
+    putWord(position, value >> 32);
+    putWord(position + 4, value & 0xFFFFFFFF);
+}
+
+static uint64_t getLong(const uint8_t* position)
+{
+    return ((uint64_t)getWord(position) << 32) | getWord(position + 4);
+}
+
+/*
+ * hashUsn
+ *
+ * FNV-1a - USNs are serial numbers, so the low bytes alone would cluster
+ */
+static uint32_t hashUsn(const uint8_t* usn)
+{
+    uint32_t hash = 2166136261u;
+    uint8_t  index;
+
+    for (index = 0; index < 16; index++)
+    {
+        hash = (hash ^ usn[index]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * mapIndex
+ *
+ * map an open index file and check its header
+ */
+static ERRORCODE mapIndex(provisionIndex* index, int fd)
+{
+    struct stat info;
+
+    if (fstat(fd, &info) != 0)
+    {
+        output("Error getting index details %d\n", errno);
+        return ERR_STAT;
+    }
+
+    index->map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (index->map == MAP_FAILED)
+    {
+        output("Unable to map index %s, %d\n", index->path, errno);
+        index->map = NULL;
+        return ERR_FILE_READ;
+    }
+    index->mapLength = info.st_size;
+    index->slotCount = getWord(index->map + 12);
+    index->device    = info.st_dev;
+    index->inode     = info.st_ino;
+
+    if ((index->mapLength < INDEX_HEADER_SIZE) ||
+        (memcmp(index->map, INDEX_MAGIC, INDEX_MAGIC_SIZE) != 0) ||
+        (getWord(index->map + 8) != INDEX_VERSION) ||
+        (index->slotCount == 0) || (index->slotCount & (index->slotCount - 1)) ||
+        (index->mapLength != INDEX_HEADER_SIZE + ((size_t)index->slotCount * INDEX_SLOT_SIZE)))
+    {
+        output("%s isn't a usable provisioning index\n", index->path);
+        munmap(index->map, index->mapLength);
+        index->map = NULL;
+        return ERR_FILE_READ;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * createIndex
+ *
+ * make an empty index file with a number of slots, returning it open
+ */
+static ERRORCODE createIndex(char* path, uint32_t slotCount, int* fd)
+{
+    uint8_t header[INDEX_HEADER_SIZE];
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, INDEX_MAGIC, INDEX_MAGIC_SIZE);
+    putWord(header + 8, INDEX_VERSION);
+    putWord(header + 12, slotCount);
+
+    *fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (*fd == -1)
+    {
+        output("Unable to create index %s, %d\n", path, errno);
+        return ERR_FILE_OPEN;
+    }
+
+    if ((write(*fd, header, INDEX_HEADER_SIZE) != INDEX_HEADER_SIZE) ||
+        (ftruncate(*fd, INDEX_HEADER_SIZE + ((off_t)slotCount * INDEX_SLOT_SIZE)) != 0))
+    {
+        output("Unable to write index %s, %d\n", path, errno);
+        close(*fd);
+        unlink(path);
+        return ERR_FILE_WRITE;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * openLock
+ *
+ * open the lock file that goes with an index
+ */
+static ERRORCODE openLock(provisionIndex* index)
+{
+    size_t length;
+    char*  lockFile;
+
+    length = strlen(index->path) + 6;
+    lockFile = (char*)malloc(length);
+    if (!lockFile)
+    {
+        return ERR_NO_MEM;
+    }
+    snprintf(lockFile, length, "%s.lock", index->path);
+
+    index->lockFd = open(lockFile, O_RDWR | O_CREAT, 0644);
+    if (index->lockFd == -1)
+    {
+        output("Unable to open index lock %s, %d\n", lockFile, errno);
+        free(lockFile);
+        return ERR_FILE_OPEN;
+    }
+    free(lockFile);
+
+    return SUCCESS;
+}
+
+/*
+ * lockIndex
+ *
+ * take the lock - LOCK_SH to read, LOCK_EX to change the index - and
+ * map the index afresh if another process has replaced it since
+ */
+static ERRORCODE lockIndex(provisionIndex* index, int operation)
+{
+    provisionIndex current;
+    struct stat    info;
+    ERRORCODE      retCode;
+    int            fd;
+
+    while (flock(index->lockFd, operation) != 0)
+    {
+        if (errno != EINTR)
+        {
+            output("Unable to lock index %s, %d\n", index->path, errno);
+            return ERR_LOCK_FAIL;
+        }
+    }
+
+    if ((stat(index->path, &info) == 0) && (info.st_dev == index->device) && (info.st_ino == index->inode))
+    {
+        return SUCCESS;
+    }
+
+    debug("Provisioning index %s was replaced, mapping it again\n", index->path);
+    fd = open(index->path, O_RDWR);
+    if (fd == -1)
+    {
+        output("Unable to open index %s, %d\n", index->path, errno);
+        flock(index->lockFd, LOCK_UN);
+        return ERR_FILE_OPEN;
+    }
+
+    current = *index;
+    retCode = mapIndex(&current, fd);
+    close(fd);
+    if (retCode != SUCCESS)
+    {
+        flock(index->lockFd, LOCK_UN);
+        return retCode;
+    }
+
+    munmap(index->map, index->mapLength);
+    *index = current;
+
+    return SUCCESS;
+}
+
+static void unlockIndex(provisionIndex* index)
+{
+    flock(index->lockFd, LOCK_UN);
+}
+
+ERRORCODE openProvisionIndex(char* indexFile, provisionIndex* index)
+{
+    ERRORCODE retCode;
+    int       fd;
+
+    memset(index, 0, sizeof(provisionIndex));
+    index->path = indexFile;
+    index->lockFd = -1;
+
+    retCode = openLock(index);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    // held while the index is created, so two stations can't both create it
+    if (flock(index->lockFd, LOCK_EX) != 0)
+    {
+        output("Unable to lock index %s, %d\n", indexFile, errno);
+        close(index->lockFd);
+        return ERR_LOCK_FAIL;
+    }
+
+    fd = open(indexFile, O_RDWR);
+    if ((fd == -1) && (errno == ENOENT))
+    {
+        retCode = createIndex(indexFile, INDEX_FIRST_SLOTS, &fd);
+    }
+    else if (fd == -1)
+    {
+        output("Unable to open index %s, %d\n", indexFile, errno);
+        retCode = ERR_FILE_OPEN;
+    }
+    else
+    {
+        retCode = SUCCESS;
+    }
+
+    if (retCode == SUCCESS)
+    {
+        retCode = mapIndex(index, fd);
+        close(fd);
+    }
+
+    if (retCode == SUCCESS)
+    {
+        debug("Provisioning index %s - %u of %u slots used\n", indexFile, getWord(index->map + 16), index->slotCount);
+        unlockIndex(index);
+    }
+    else
+    {
+        close(index->lockFd);
+        index->lockFd = -1;
+    }
+
+    return retCode;
+}
+
+void closeProvisionIndex(provisionIndex* index)
+{
+    if (index->map)
+    {
+        munmap(index->map, index->mapLength);
+    }
+    index->map = NULL;
+    if (index->lockFd != -1)
+    {
+        close(index->lockFd);
+    }
+    index->lockFd = -1;
+}
+
+/*
+ * findSlot
+ *
+ * the slot holding a USN, or the empty one it would go in
+ */
+static uint8_t* findSlot(provisionIndex* index, const uint8_t* usn)
+{
+    uint32_t mask = index->slotCount - 1;
+    uint32_t position;
+    uint8_t* slot;
+
+    position = hashUsn(usn) & mask;
+    while (1)
+    {
+        slot = index->map + INDEX_HEADER_SIZE + ((size_t)position * INDEX_SLOT_SIZE);
+        if ((getLong(slot + SLOT_TIME) == 0) || (memcmp(slot, usn, 16) == 0))
+        {
+            return slot;
+        }
+        position = (position + 1) & mask;
+    }
+}
+
+/*
+ * syncRange
+ *
+ * flush part of the map to disk - msync wants whole pages
+ */
+static ERRORCODE syncRange(provisionIndex* index, uint8_t* start, size_t length)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t)start & ~(page - 1);
+
+    if (msync((void*)first, ((uintptr_t)start + length) - first, MS_SYNC) != 0)
+    {
+        output("Unable to sync index %s, %d\n", index->path, errno);
+        return ERR_FILE_WRITE;
+    }
+    return SUCCESS;
+}
+
+/*
+ * growIndex
+ *
+ * rebuild the table at twice the size and swap it in - with the index
+ * locked exclusively, so there is only ever one <path>.new
+ */
+static ERRORCODE growIndex(provisionIndex* index)
+{
+    provisionIndex bigger;
+    uint8_t*       slot;
+    uint32_t       position;
+    uint32_t       used = 0;
+    size_t         length;
+    char*          tempFile;
+    int            fd;
+    ERRORCODE      retCode;
+
+    length = strlen(index->path) + 5;
+    tempFile = (char*)malloc(length);
+    if (!tempFile)
+    {
+        return ERR_NO_MEM;
+    }
+    snprintf(tempFile, length, "%s.new", index->path);
+
+    memset(&bigger, 0, sizeof(bigger));
+    bigger.path = tempFile;
+    bigger.lockFd = -1;
+
+    retCode = createIndex(tempFile, index->slotCount * 2, &fd);
+    if (retCode == SUCCESS)
+    {
+        retCode = mapIndex(&bigger, fd);
+        close(fd);
+    }
+
+    if (retCode == SUCCESS)
+    {
+        for (position = 0; position < index->slotCount; position++)
+        {
+            slot = index->map + INDEX_HEADER_SIZE + ((size_t)position * INDEX_SLOT_SIZE);
+            if (getLong(slot + SLOT_TIME) != 0)
+            {
+                memcpy(findSlot(&bigger, slot), slot, INDEX_SLOT_SIZE);
+                used++;
+            }
+        }
+        putWord(bigger.map + 16, used);
+
+        retCode = syncRange(&bigger, bigger.map, bigger.mapLength);
+        if ((retCode == SUCCESS) && (rename(tempFile, index->path) != 0))
+        {
+            output("Unable to replace %s, %d\n", index->path, errno);
+            retCode = ERR_FILE_WRITE;
+        }
+    }
+
+    if (retCode == SUCCESS)
+    {
+        debug("Provisioning index grown to %u slots\n", bigger.slotCount);
+        munmap(index->map, index->mapLength);
+        index->map       = bigger.map;
+        index->mapLength = bigger.mapLength;
+        index->slotCount = bigger.slotCount;
+        index->device    = bigger.device;
+        index->inode     = bigger.inode;
+    }
+    else
+    {
+        closeProvisionIndex(&bigger);
+        unlink(tempFile);
+    }
+    free(tempFile);
+
+    return retCode;
+}
+
+ERRORCODE findUnitHistory(provisionIndex* index, const uint8_t* usn, unitHistory* history)
+{
+    uint8_t*  slot;
+    uint8_t   sector;
+    ERRORCODE retCode;
+
+    retCode = lockIndex(index, LOCK_SH);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    slot = findSlot(index, usn);
+    if (getLong(slot + SLOT_TIME) == 0)
+    {
+        unlockIndex(index);
+        return ERR_NO_HISTORY;
+    }
+
+    memcpy(history->imageHash, slot + SLOT_HASH, 32);
+    history->time = getLong(slot + SLOT_TIME);
+    history->sectorMask = getLong(slot + SLOT_MASK);
+    for (sector = 0; sector < FLASH_SECTORS; sector++)
+    {
+        history->sectorCrc[sector] = getWord(slot + SLOT_CRCS + (sector * 4));
+    }
+    unlockIndex(index);
+
+    return SUCCESS;
+}
+
+ERRORCODE storeUnitHistory(provisionIndex* index, const uint8_t* usn, const unitHistory* history)
+{
+    uint8_t*  slot;
+    uint8_t   sector;
+    uint32_t  used;
+    ERRORCODE retCode;
+
+    retCode = lockIndex(index, LOCK_EX);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    slot = findSlot(index, usn);
+    if (getLong(slot + SLOT_TIME) == 0)
+    {
+        used = getWord(index->map + 16);
+        if ((used + 1) * 4 > index->slotCount * 3)
+        {
+            retCode = growIndex(index);
+            if (retCode != SUCCESS)
+            {
+                unlockIndex(index);
+                return retCode;
+            }
+            slot = findSlot(index, usn);
+        }
+        putWord(index->map + 16, used + 1);
+        retCode = syncRange(index, index->map, INDEX_HEADER_SIZE);
+        if (retCode != SUCCESS)
+        {
+            unlockIndex(index);
+            return retCode;
+        }
+    }
+
+    memcpy(slot, usn, 16);
+    memcpy(slot + SLOT_HASH, history->imageHash, 32);
+    putLong(slot + SLOT_MASK, history->sectorMask);
+    for (sector = 0; sector < FLASH_SECTORS; sector++)
+    {
+        putWord(slot + SLOT_CRCS + (sector * 4), history->sectorCrc[sector]);
+    }
+    putLong(slot + SLOT_TIME, (history->time != 0) ? (uint64_t)history->time : 1);
+
+    retCode = syncRange(index, slot, INDEX_SLOT_SIZE);
+    unlockIndex(index);
+
+    return retCode;
+}
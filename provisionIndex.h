@@ -0,0 +1,56 @@
+/*
+ * provisionIndex.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef PROVISIONINDEX_H_
+#define PROVISIONINDEX_H_
+
+#include "shunt.h"
+#include "flashPlan.h"
+
+/*
+ * What a unit was last successfully flashed with
+ */
+typedef struct _unitHistory
+{
+    uint8_t  imageHash[32];
+    time_t   time;
+    uint64_t sectorMask;               // sectors whose contents are known
+    uint32_t sectorCrc[FLASH_SECTORS];
+} unitHistory;
+
+/*
+ * USN -> unitHistory, an open addressed hash table in a mapped file that
+ * any number of processes can share
+ */
+typedef struct _provisionIndex
+{
+    char*    path;
+    uint8_t* map;
+    size_t   mapLength;
+    uint32_t slotCount;
+    dev_t    device;     // of the file mapped, to notice it being replaced
+    ino_t    inode;
+    int      lockFd;     // <path>.lock, flock'd around every look at the map
+} provisionIndex;
+
+/*
+ * Open an index, creating an empty one if the file doesn't exist
+ */
+ERRORCODE openProvisionIndex  (char* indexFile, provisionIndex* index);
+void      closeProvisionIndex (provisionIndex* index);
+
+/*
+ * ERR_NO_HISTORY if the unit isn't in the index
+ */
+ERRORCODE findUnitHistory     (provisionIndex* index, const uint8_t* usn, unitHistory* history);
+
+/*
+ * Add or replace a unit's entry. It is on disk when this returns.
+ */
+ERRORCODE storeUnitHistory    (provisionIndex* index, const uint8_t* usn, const unitHistory* history);
+
+#endif /* PROVISIONINDEX_H_ */
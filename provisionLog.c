@@ -0,0 +1,82 @@
+/*
+ * provisionLog.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Append-only record of every board a batch run has seen. Lines are only
+ * ever added, never rewritten, so the log can be tailed or shipped off the
+ * station while a run is going.
+ */
+
+#include "shunt.h"
+#include "provisionLog.h"
+
+#define RECORD_LINE_SIZE 512
+
+/*
+ * hexString
+ *
+ * lower case hex of a buffer, the way USNs are printed elsewhere
+ */
+static void hexString(char* dest, const uint8_t* src, uint32_t length)
+{
+    uint32_t index;
+
+    for (index = 0; index < length; index++)
+    {
+        sprintf(dest + (index * 2), "%2.2x", src[index]);
+    }
+    dest[length * 2] = 0;
+}
+
+ERRORCODE appendProvisionRecord(char* logFile, provisionRecord* record)
+{
+    char      line[RECORD_LINE_SIZE];
+    char      usn[33];
+    char      hash[65];
+    char      stamp[32];
+    struct tm utc;
+    int       length;
+    int       fd;
+    ERRORCODE retCode = SUCCESS;
+
+    gmtime_r(&(record->time), &utc);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    hexString(hash, record->imageHash, 32);
+
+    if (record->identified == true)
+    {
+        hexString(usn, record->hello.usn, 16);
+        length = snprintf(line, sizeof(line),
+                          "{\"time\":\"%s\",\"usn\":\"%s\",\"lifecycle\":%u,\"usip\":\"%u.%u\",\"sbl\":\"%u.%u\",\"hal\":\"%u.%u\","
+                          "\"image\":\"%s\",\"wait\":%.1f,\"flash\":%.2f,\"result\":%d}\n",
+                          stamp, usn, record->hello.lifeCycle,
+                          record->hello.usipMajorVersion, record->hello.usipMinorVersion,
+                          record->hello.sblMajorVersion, record->hello.sblMinorVersion,
+                          record->hello.halMajorVersion, record->hello.halMinorVersion,
+                          hash, record->waitSeconds, record->flashSeconds, record->result);
+    }
+    else
+    {
+        length = snprintf(line, sizeof(line),
+                          "{\"time\":\"%s\",\"usn\":null,\"image\":\"%s\",\"wait\":%.1f,\"flash\":%.2f,\"result\":%d}\n",
+                          stamp, hash, record->waitSeconds, record->flashSeconds, record->result);
+    }
+
+    fd = open(logFile, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1)
+    {
+        output("Unable to open log %s, %d\n", logFile, errno);
+        return ERR_FILE_OPEN;
+    }
+
+    if ((write(fd, line, length) != length) || (fsync(fd) != 0))
+    {
+        output("Unable to write log %s, %d\n", logFile, errno);
+        retCode = ERR_FILE_WRITE;
+    }
+    close(fd);
+
+    return retCode;
+}
@@ -0,0 +1,33 @@
+/*
+ * provisionLog.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef PROVISIONLOG_H_
+#define PROVISIONLOG_H_
+
+#include "shunt.h"
+
+/*
+ * What happened to one board on the line
+ */
+typedef struct _provisionRecord
+{
+    time_t           time;         // when the board finished
+    bool             identified;   // hello got far enough for the unit data
+    struct helloResp hello;
+    uint8_t          imageHash[32];
+    double           waitSeconds;  // from the last board leaving to this one answering
+    double           flashSeconds;
+    ERRORCODE        result;
+} provisionRecord;
+
+/*
+ * Append a record to the log, one JSON object per line, synced before
+ * returning so a record is never lost to a crash of the station
+ */
+ERRORCODE appendProvisionRecord (char* logFile, provisionRecord* record);
+
+#endif /* PROVISIONLOG_H_ */
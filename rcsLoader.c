@@ -0,0 +1,288 @@
+/*
+ * rcsLoader.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Get RCS procedures onto the USIP. Files are streamed up in large
+ * frames rather than read whole, so there is no 64KB limit, and the
+ * CRC32 helper is used to spot a procedure that is already in RAM from
+ * an earlier run, in which case it is only registered again. The helper
+ * is only believed once it has given the right CRC for fresh random data
+ * the host wrote, so it never vouches for itself.
+ */
+
+#include "shunt.h"
+#include "utils.h"
+#include "sessionLayer.h"
+#include "commandLayer.h"
+#include "rcsLoader.h"
+
+#include <openssl/rand.h>
+
+#define RCS_UPLOAD_SIZE (32 * 1024)
+#define RCS_PROBE_SIZE  256
+
+const rcsProcedure rcsEcho     = { COMMAND_RCS_ONE,      "./RCS/RCS_release.bin",  RCS_BASE_ADDRESS };
+const rcsProcedure rcsCrc32    = { COMMAND_RCS_CRC32,    "./RCS/RCS_crc32.bin",    RCS_HELPER_ADDRESS };
+const rcsProcedure rcsLz4      = { COMMAND_RCS_LZ4,      "./RCS/RCS_lz4flash.bin", RCS_HELPER_ADDRESS + RCS_HELPER_SLOT };
+const rcsProcedure rcsReadback = { COMMAND_RCS_READBACK, "./RCS/RCS_readback.bin", RCS_HELPER_ADDRESS + 2 * RCS_HELPER_SLOT };
+
+/*
+ * openProcedure
+ *
+ * open a procedure file, check it fits where it's going and work out
+ * its CRC32. The stream is left at the start of the file.
+ */
+static ERRORCODE openProcedure(const rcsProcedure* procedure, int* stream, uint32_t* size, uint32_t* crc)
+{
+    struct stat info;
+    uint8_t*    buffer;
+    ssize_t     readLength;
+    uint32_t    limit;
+    ERRORCODE   retCode = SUCCESS;
+
+    *stream = open(procedure->file, O_RDONLY);
+    if (*stream == -1)
+    {
+        output("Unable to open file %s, %d\n", procedure->file, errno);
+        return ERR_FILE_OPEN;
+    }
+
+    if (fstat(*stream, &info) != 0)
+    {
+        output("Error getting rcs file details %d\n", errno);
+        close(*stream);
+        return ERR_STAT;
+    }
+
+    limit = (procedure->address < RCS_HELPER_ADDRESS) ? RCS_HELPER_ADDRESS - procedure->address : RCS_HELPER_SLOT;
+    if ((info.st_size == 0) || (info.st_size > limit))
+    {
+        output("RCS %s is %ld bytes, room for %u\n", procedure->file, (long)info.st_size, limit);
+        close(*stream);
+        return ERR_TOO_BIG;
+    }
+    *size = info.st_size;
+
+    buffer = (uint8_t*)malloc(RCS_UPLOAD_SIZE);
+    if (!buffer)
+    {
+        close(*stream);
+        return ERR_NO_MEM;
+    }
+
+    *crc = 0;
+    while ((readLength = read(*stream, buffer, RCS_UPLOAD_SIZE)) > 0)
+    {
+        *crc = generateCrc32(*crc, buffer, readLength);
+    }
+    free(buffer);
+
+    if ((readLength < 0) || (lseek(*stream, 0, SEEK_SET) != 0))
+    {
+        output("Unable to read file %s, %d\n", procedure->file, errno);
+        retCode = ERR_FILE_READ;
+        close(*stream);
+    }
+
+    return retCode;
+}
+
+/*
+ * deviceCrc
+ *
+ * ask the CRC32 helper for the CRC of a range of USIP memory
+ */
+static ERRORCODE deviceCrc(sessionDetails* details, uint32_t address, uint32_t length, uint32_t* crc)
+{
+    uint8_t   command[8];
+    uint8_t*  resp = NULL;
+    uint16_t  respLen;
+    ERRORCODE retCode;
+
+    command[0] = (address >> 24) & 0xFF;
+    command[1] = (address >> 16) & 0xFF;
+    command[2] = (address >> 8) & 0xFF;
+    command[3] = address & 0xFF;
+    command[4] = (length >> 24) & 0xFF;
+    command[5] = (length >> 16) & 0xFF;
+    command[6] = (length >> 8) & 0xFF;
+    command[7] = length & 0xFF;
+
+    retCode = callCustomProcedure(details, COMMAND_RCS_CRC32, command, 8, &resp, &respLen, &idempotentPolicy);
+    if ((retCode == SUCCESS) && ((resp == NULL) || (respLen != 4)))
+    {
+        retCode = ERR_COMMAND_LENGTH;
+    }
+    if (retCode == SUCCESS)
+    {
+        *crc = (resp[0] << 24) | (resp[1] << 16) | (resp[2] << 8) | resp[3];
+    }
+    if (resp)
+    {
+        free(resp);
+    }
+
+    return retCode;
+}
+
+/*
+ * crcHelperWorks
+ *
+ * write random bytes to scratch RAM and see whether the registered CRC
+ * helper gets their CRC right - a missing, stale or damaged helper
+ * can't, since it has never seen the data before
+ */
+static bool crcHelperWorks(sessionDetails* details)
+{
+    uint8_t  probe[RCS_PROBE_SIZE];
+    uint32_t crc;
+
+    if (RAND_bytes(probe, sizeof(probe)) != 1)
+    {
+        debug("No random data to check the CRC helper with\n");
+        return false;
+    }
+
+    if ((writeProcedure(details, RCS_SCRATCH_ADDRESS, probe, sizeof(probe)) != SUCCESS) ||
+        (deviceCrc(details, RCS_SCRATCH_ADDRESS, sizeof(probe), &crc) != SUCCESS))
+    {
+        return false;
+    }
+
+    return (crc == generateCrc32(0, probe, sizeof(probe)));
+}
+
+/*
+ * uploadProcedure
+ *
+ * stream a procedure file into USIP RAM
+ */
+static ERRORCODE uploadProcedure(sessionDetails* details, const rcsProcedure* procedure, int stream, uint32_t size)
+{
+    uint8_t*  buffer;
+    uint32_t  offset;
+    ssize_t   readLength;
+    ERRORCODE retCode = SUCCESS;
+
+    buffer = (uint8_t*)malloc(RCS_UPLOAD_SIZE);
+    if (!buffer)
+    {
+        return ERR_NO_MEM;
+    }
+
+    for (offset = 0; (offset < size) && (retCode == SUCCESS); offset += readLength)
+    {
+        readLength = read(stream, buffer, RCS_UPLOAD_SIZE);
+        if (readLength <= 0)
+        {
+            output("Unable to read file %s, %d\n", procedure->file, errno);
+            retCode = ERR_FILE_READ;
+            break;
+        }
+        retCode = writeProcedure(details, procedure->address + offset, buffer, readLength);
+    }
+    free(buffer);
+
+    return retCode;
+}
+
+/*
+ * loadProcedure
+ *
+ * upload a procedure unless the CRC helper (when it has been checked)
+ * says an identical copy is already there, then register it
+ */
+static ERRORCODE loadProcedure(sessionDetails* details, const rcsProcedure* procedure, bool crcUsable)
+{
+    int       stream;
+    uint32_t  size;
+    uint32_t  crc;
+    uint32_t  residentCrc;
+    ERRORCODE retCode;
+
+    retCode = openProcedure(procedure, &stream, &size, &crc);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    if (crcUsable && (deviceCrc(details, procedure->address, size, &residentCrc) == SUCCESS) && (residentCrc == crc))
+    {
+        debug("RCS %s already resident at 0x%x\n", procedure->file, procedure->address);
+    }
+    else
+    {
+        retCode = uploadProcedure(details, procedure, stream, size);
+        if ((retCode == SUCCESS) && crcUsable)
+        {
+            retCode = deviceCrc(details, procedure->address, size, &residentCrc);
+            if ((retCode == SUCCESS) && (residentCrc != crc))
+            {
+                debug("RCS %s corrupted on upload\n", procedure->file);
+                retCode = ERR_VERIFY;
+            }
+        }
+    }
+    close(stream);
+
+    if (retCode != SUCCESS)
+    {
+        debug("RCS write failed\n");
+        return retCode;
+    }
+    debug("RCS written successfully\n");
+
+    retCode = registerProcedure(details, procedure->opCode, procedure->address);
+    if (retCode != SUCCESS)
+    {
+        debug("RCS registration failed\n");
+        return retCode;
+    }
+    debug("RCS registered successfully\n");
+
+    return SUCCESS;
+}
+
+/*
+ * loadProcedures
+ *
+ * The CRC helper goes first. If one still registered from an earlier
+ * session passes crcHelperWorks, it is trusted to say whether it is the
+ * right one; otherwise it is uploaded, registered and checked again. A
+ * helper that can't be loaded or fails the check isn't used, and
+ * everything is simply uploaded.
+ */
+ERRORCODE loadProcedures(sessionDetails* details, const rcsProcedure* procedures, uint8_t count)
+{
+    bool      crcUsable;
+    uint8_t   index;
+    ERRORCODE retCode;
+
+    crcUsable = crcHelperWorks(details);
+    if (crcUsable == false)
+    {
+        debug("No working CRC helper registered\n");
+    }
+    crcUsable = (loadProcedure(details, &rcsCrc32, crcUsable) == SUCCESS) && crcHelperWorks(details);
+    if (crcUsable == false)
+    {
+        debug("No CRC helper, uploading procedures without checking\n");
+    }
+
+    for (index = 0; index < count; index++)
+    {
+        if ((procedures[index].opCode == rcsCrc32.opCode) && (procedures[index].address == rcsCrc32.address) && crcUsable)
+        {
+            continue;
+        }
+        retCode = loadProcedure(details, &procedures[index], crcUsable);
+        if (retCode != SUCCESS)
+        {
+            return retCode;
+        }
+    }
+
+    return SUCCESS;
+}
@@ -0,0 +1,42 @@
+/*
+ * rcsLoader.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef RCSLOADER_H_
+#define RCSLOADER_H_
+
+#include "shunt.h"
+#include "sessionLayer.h"
+
+/*
+ * RAM layout for procedures. User procedures (like the echo RCS) are
+ * linked at RCS_BASE_ADDRESS and may run up to RCS_HELPER_ADDRESS, the
+ * helpers shunt uses itself each get a fixed slot above that so several
+ * can be registered at once. Each .bin must be linked for its address.
+ */
+#define RCS_BASE_ADDRESS   0xa0008000
+#define RCS_HELPER_ADDRESS 0xa0030000
+#define RCS_HELPER_SLOT    0x4000
+#define RCS_SCRATCH_ADDRESS (RCS_HELPER_ADDRESS + 3 * RCS_HELPER_SLOT)  // test data for the CRC helper
+
+typedef struct _rcsProcedure
+{
+    uint8_t     opCode;
+    const char* file;
+    uint32_t    address;
+} rcsProcedure;
+
+extern const rcsProcedure rcsEcho;
+extern const rcsProcedure rcsCrc32;
+extern const rcsProcedure rcsLz4;
+extern const rcsProcedure rcsReadback;
+
+/*
+ * Upload (if not already resident) and register a set of procedures
+ */
+ERRORCODE loadProcedures (sessionDetails* details, const rcsProcedure* procedures, uint8_t count);
+
+#endif /* RCSLOADER_H_ */
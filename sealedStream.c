@@ -0,0 +1,430 @@
+/*
+ * sealedStream.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * On a protected session every write is encrypted and MACed under the
+ * unit's own key, which is most of the work of flashing it. None of that
+ * depends on the session - the transID and checksum go on outside it - so
+ * for a batch whose keys are known up front each unit's writes can be
+ * sealed before its board is even on the fixture, a unit per processor,
+ * and the station only reads them back.
+ *
+ * One file per unit, named by its USN, big endian:
+ *   "SHNTSEAL", version, write count, plan hash, USN
+ *   CMAC of the plan hash under the unit's key, to check the key by
+ *   sealedWriteSize bytes for each write in turn
+ *   CRC32 of all of the above
+ */
+
+#include "shunt.h"
+#include "utils.h"
+#include "cmac.h"
+#include "keyStore.h"
+#include "sessionLayer.h"
+#include "commandLayer.h"
+#include "sealedStream.h"
+
+#define STREAM_MAGIC        "SHNTSEAL"
+#define STREAM_MAGIC_SIZE   8
+#define STREAM_VERSION      1
+#define STREAM_HEADER_SIZE  (STREAM_MAGIC_SIZE + 8 + sizeof(((flashPlan*)0)->hash) + 16 + CMAC_LENGTH)
+#define STREAM_PATH_SIZE    256
+
+/*
+ * What the sealing threads share
+ */
+typedef struct _sealBatch
+{
+    flashPlan*      plan;
+    char*           streamDir;
+    uint8_t*        records;    // KEYSTORE_RECORD_SIZE per unit
+    uint32_t        count;
+    uint32_t        next;       // the next unit to seal
+    uint32_t        failed;
+    uint32_t        streamSize;
+    pthread_mutex_t lock;
+    shuntEnv*       env;
+} sealBatch;
+
+static void putWord(uint8_t* position, uint32_t value)
+{
+    position[0] = (value >> 24) & 0xFF;
+    position[1] = (value >> 16) & 0xFF;
+    position[2] = (value >> 8) & 0xFF;
+    position[3] = value & 0xFF;
+}
+
+static uint32_t getWord(const uint8_t* position)
+{
+    return (position[0] << 24) | (position[1] << 16) | (position[2] << 8) | position[3];
+}
+
+/*
+ * streamPath
+ *
+ * where the stream for a USN lives
+ */
+static void streamPath(char* streamDir, const uint8_t* usn, char* path)
+{
+    uint32_t length;
+    uint8_t  index;
+
+    length = snprintf(path, STREAM_PATH_SIZE, "%s/", streamDir);
+    for (index = 0; (index < 16) && (length < STREAM_PATH_SIZE); index++)
+    {
+        length += snprintf(path + length, STREAM_PATH_SIZE - length, "%2.2x", usn[index]);
+    }
+    if (length < STREAM_PATH_SIZE)
+    {
+        snprintf(path + length, STREAM_PATH_SIZE - length, ".sealed");
+    }
+}
+
+/*
+ * streamSize
+ *
+ * the length of a stream for this plan, header and CRC included
+ */
+static uint32_t streamSize(flashPlan* plan)
+{
+    uint32_t size = STREAM_HEADER_SIZE + 4;
+    uint32_t index;
+
+    for (index = 0; index < plan->writeCount; index++)
+    {
+        size += sealedWriteSize(plan->writes[index].length);
+    }
+
+    return size;
+}
+
+/*
+ * fillHeader
+ *
+ * the header a stream for this plan and unit starts with, up to the key check
+ */
+static void fillHeader(flashPlan* plan, const uint8_t* usn, uint8_t* header)
+{
+    memcpy(header, STREAM_MAGIC, STREAM_MAGIC_SIZE);
+    putWord(header + STREAM_MAGIC_SIZE, STREAM_VERSION);
+    putWord(header + STREAM_MAGIC_SIZE + 4, plan->writeCount);
+    memcpy(header + STREAM_MAGIC_SIZE + 8, plan->hash, sizeof(plan->hash));
+    memcpy(header + STREAM_MAGIC_SIZE + 8 + sizeof(plan->hash), usn, 16);
+}
+
+/*
+ * writeStream
+ *
+ * save a stream by way of a temporary file, so a station starting on
+ * the unit never sees half of one
+ */
+static ERRORCODE writeStream(char* path, uint8_t* buffer, uint32_t size)
+{
+    char      tempPath[STREAM_PATH_SIZE + 8];
+    int       streamFile;
+    ERRORCODE retCode = SUCCESS;
+
+    snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", path);
+    streamFile = mkstemp(tempPath);
+    if (streamFile == -1)
+    {
+        output("Unable to create sealed stream %s, %d\n", path, errno);
+        return ERR_FILE_OPEN;
+    }
+    fchmod(streamFile, 0600);
+
+    if (write(streamFile, buffer, size) != (ssize_t)size)
+    {
+        output("Failed to write sealed stream - %s\n", strerror(errno));
+        retCode = ERR_FILE_WRITE;
+    }
+    if ((close(streamFile) != 0) && (retCode == SUCCESS))
+    {
+        retCode = ERR_FILE_WRITE;
+    }
+
+    if ((retCode == SUCCESS) && (rename(tempPath, path) != 0))
+    {
+        output("Failed to save sealed stream %s, %d\n", path, errno);
+        retCode = ERR_FILE_WRITE;
+    }
+    if (retCode != SUCCESS)
+    {
+        unlink(tempPath);
+    }
+
+    return retCode;
+}
+
+/*
+ * sealUnit
+ *
+ * seal every write in the plan under one unit's key and save them
+ */
+static ERRORCODE sealUnit(sealBatch* batch, const uint8_t* record, uint8_t* buffer)
+{
+    flashPlan* plan = batch->plan;
+    cmacKey    cipher;
+    char       path[STREAM_PATH_SIZE];
+    uint8_t*   position;
+    uint32_t   index;
+    ERRORCODE  retCode;
+
+    retCode = initCMacKey(&cipher, record + 16);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    fillHeader(plan, record, buffer);
+    encryptAndMac(&cipher, plan->hash, sizeof(plan->hash), NULL, buffer + STREAM_HEADER_SIZE - CMAC_LENGTH);
+
+    position = buffer + STREAM_HEADER_SIZE;
+    for (index = 0; (index < plan->writeCount) && (retCode == SUCCESS); index++)
+    {
+        retCode = sealWriteFlash(&cipher, plan->writes[index].address + FLASH_BASE_ADDRESS,
+                                 plan->image.flash + plan->writes[index].address,
+                                 plan->writes[index].length, position);
+        position += sealedWriteSize(plan->writes[index].length);
+    }
+    memset(&cipher, 0, sizeof(cipher));
+
+    if (retCode == SUCCESS)
+    {
+        putWord(position, generateCrc32(0, buffer, batch->streamSize - 4));
+        streamPath(batch->streamDir, record, path);
+        retCode = writeStream(path, buffer, batch->streamSize);
+    }
+
+    return retCode;
+}
+
+/*
+ * sealThread
+ *
+ * Main function for the threads that seal units, taking them in turn
+ * until there are none left
+ */
+static void* sealThread(sealBatch* batch)
+{
+    uint8_t* buffer;
+    uint32_t unit;
+
+    useShuntEnv(batch->env);
+
+    buffer = (uint8_t*)malloc(batch->streamSize);
+
+    while (1)
+    {
+        pthread_mutex_lock(&(batch->lock));
+        unit = batch->next++;
+        pthread_mutex_unlock(&(batch->lock));
+        if (unit >= batch->count)
+        {
+            break;
+        }
+
+        if (!buffer || (sealUnit(batch, batch->records + ((size_t)unit * KEYSTORE_RECORD_SIZE), buffer) != SUCCESS))
+        {
+            output("Failed to seal the image for unit -\n");
+            hexDump(batch->records + ((size_t)unit * KEYSTORE_RECORD_SIZE), 16);
+            pthread_mutex_lock(&(batch->lock));
+            batch->failed++;
+            pthread_mutex_unlock(&(batch->lock));
+        }
+    }
+
+    if (buffer)
+    {
+        free(buffer);
+    }
+
+    return NULL;
+}
+
+ERRORCODE prepareSealedStreams(flashPlan* plan, char* keyFile, char* streamDir)
+{
+    sealBatch       batch;
+    pthread_t*      threads;
+    long            processors;
+    uint32_t        threadCount;
+    uint32_t        started;
+    uint32_t        index;
+    struct timespec startTime;
+    struct timespec endTime;
+    ERRORCODE       retCode;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.plan = plan;
+    batch.streamDir = streamDir;
+    batch.streamSize = streamSize(plan);
+    batch.env = currentEnv();
+
+    retCode = readKeyText(keyFile, &(batch.records), &(batch.count));
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+    if (batch.count == 0)
+    {
+        output("No keys in %s\n", keyFile);
+        free(batch.records);
+        return ERR_VALIDATION;
+    }
+
+    processors = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = (processors > 0) ? (uint32_t)processors : 1;
+    if (threadCount > batch.count)
+    {
+        threadCount = batch.count;
+    }
+
+    threads = (pthread_t*)malloc(threadCount * sizeof(pthread_t));
+    if (!threads || (pthread_mutex_init(&(batch.lock), NULL) != 0))
+    {
+        if (threads)
+        {
+            free(threads);
+        }
+        memset(batch.records, 0, (size_t)batch.count * KEYSTORE_RECORD_SIZE);
+        free(batch.records);
+        return threads ? ERR_CREATE_MUTEX : ERR_NO_MEM;
+    }
+
+    output("Sealing %u writes for %u units on %u threads\n", plan->writeCount, batch.count, threadCount);
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    // if no thread will start, this one does the lot
+    for (started = 0; started < threadCount; started++)
+    {
+        if (pthread_create(&(threads[started]), NULL, (pthreadFunc)sealThread, &batch) != 0)
+        {
+            debug("Failed to start sealing thread %d\n", errno);
+            break;
+        }
+    }
+    if (started == 0)
+    {
+        sealThread(&batch);
+    }
+    for (index = 0; index < started; index++)
+    {
+        pthread_join(threads[index], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    output("Sealed %u of %u units in %.2f s\n", batch.count - batch.failed, batch.count,
+           (endTime.tv_sec - startTime.tv_sec) + ((endTime.tv_nsec - startTime.tv_nsec) / 1e9));
+
+    pthread_mutex_destroy(&(batch.lock));
+    free(threads);
+    memset(batch.records, 0, (size_t)batch.count * KEYSTORE_RECORD_SIZE);
+    free(batch.records);
+
+    return (batch.failed == 0) ? SUCCESS : ERR_FILE_WRITE;
+}
+
+ERRORCODE openSealedStream(flashPlan* plan, char* streamDir, sessionDetails* session, sealedStream* stream)
+{
+    char      path[STREAM_PATH_SIZE];
+    uint8_t   header[STREAM_HEADER_SIZE];
+    uint8_t*  buffer;
+    uint32_t* offsets;
+    uint32_t  size;
+    uint32_t  offset;
+    uint32_t  index;
+    int       streamFile;
+    ssize_t   readBytes;
+    ERRORCODE retCode = SUCCESS;
+
+    memset(stream, 0, sizeof(sealedStream));
+
+    streamPath(streamDir, getSessionUsn(session), path);
+    streamFile = open(path, O_RDONLY);
+    if (streamFile == -1)
+    {
+        return ERR_FILE_OPEN;
+    }
+
+    size = streamSize(plan);
+    buffer = (uint8_t*)malloc(size);
+    offsets = (uint32_t*)malloc((plan->writeCount ? plan->writeCount : 1) * sizeof(uint32_t));
+    if (!buffer || !offsets)
+    {
+        retCode = ERR_NO_MEM;
+    }
+    else
+    {
+        readBytes = read(streamFile, buffer, size);
+        if ((readBytes != (ssize_t)size) || (read(streamFile, header, 1) != 0))
+        {
+            debug("Sealed stream %s is the wrong size\n", path);
+            retCode = ERR_FILE_READ;
+        }
+    }
+    close(streamFile);
+
+    if (retCode == SUCCESS)
+    {
+        fillHeader(plan, getSessionUsn(session), header);
+        sessionCMac(session, plan->hash, sizeof(plan->hash), header + STREAM_HEADER_SIZE - CMAC_LENGTH);
+        if ((memcmp(buffer, header, STREAM_HEADER_SIZE) != 0) ||
+            (getWord(buffer + size - 4) != generateCrc32(0, buffer, size - 4)))
+        {
+            output("Sealed stream %s isn't for this image and key\n", path);
+            retCode = ERR_FILE_READ;
+        }
+    }
+
+    if (retCode != SUCCESS)
+    {
+        if (buffer)
+        {
+            free(buffer);
+        }
+        if (offsets)
+        {
+            free(offsets);
+        }
+        return retCode;
+    }
+
+    offset = STREAM_HEADER_SIZE;
+    for (index = 0; index < plan->writeCount; index++)
+    {
+        offsets[index] = offset;
+        offset += sealedWriteSize(plan->writes[index].length);
+    }
+
+    stream->buffer = buffer;
+    stream->offsets = offsets;
+    stream->writeCount = plan->writeCount;
+    debug("Sealed stream %s - %u writes\n", path, plan->writeCount);
+
+    return SUCCESS;
+}
+
+void closeSealedStream(sealedStream* stream)
+{
+    if (stream->buffer)
+    {
+        free(stream->buffer);
+    }
+    if (stream->offsets)
+    {
+        free(stream->offsets);
+    }
+    memset(stream, 0, sizeof(sealedStream));
+}
+
+const uint8_t* sealedWrite(sealedStream* stream, uint32_t index)
+{
+    if (!stream->buffer || (index >= stream->writeCount))
+    {
+        return NULL;
+    }
+
+    return stream->buffer + stream->offsets[index];
+}
@@ -0,0 +1,44 @@
+/*
+ * sealedStream.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SEALEDSTREAM_H_
+#define SEALEDSTREAM_H_
+
+#include "shunt.h"
+#include "sessionLayer.h"
+#include "flashPlan.h"
+
+/*
+ * A plan's writes sealed under one unit's key, loaded for its session
+ */
+typedef struct _sealedStream
+{
+    uint8_t*  buffer;
+    uint32_t* offsets;     // of each write's record in buffer
+    uint32_t  writeCount;
+} sealedStream;
+
+/*
+ * Seal every write of a plan for every unit in a text key file, one file
+ * per unit in streamDir, spread over a thread per processor
+ */
+ERRORCODE prepareSealedStreams (flashPlan* plan, char* keyFile, char* streamDir);
+
+/*
+ * Load the stream for the unit on the other end of a session. It has to
+ * be for this plan and under the key the session is using.
+ */
+ERRORCODE openSealedStream     (flashPlan* plan, char* streamDir, sessionDetails* session, sealedStream* stream);
+void      closeSealedStream    (sealedStream* stream);
+
+/*
+ * The sealed record for a write, for prepareWriteFlash - NULL if the
+ * stream isn't open
+ */
+const uint8_t* sealedWrite     (sealedStream* stream, uint32_t index);
+
+#endif /* SEALEDSTREAM_H_ */
@@ -5,42 +5,44 @@
  *      Author: dhicks
  */
 #include "shunt.h"
+#include "serialBackend.h"
 #include "serial.h"
 
 #define SERIAL_BUFFER_SIZE 4096
+#define READER_CHUNK       256
+#define READER_WAIT        100   // ms the reader thread waits before checking it should stop
 
 struct _serialSession
 {
-    uint8_t         buffer[SERIAL_BUFFER_SIZE];
-    uint16_t        in;
-    uint16_t        out;
-    pthread_mutex_t bufferLock;
-    int             fildes;
-    char*           devName;
-    pthread_t       thread;
+    uint8_t              buffer[SERIAL_BUFFER_SIZE];
+    uint16_t             in;
+    uint16_t             out;
+    pthread_mutex_t      bufferLock;
+    pthread_cond_t       arrived;
+    pthread_cond_t       drained;      // serialRead has made room in the buffer
+    const serialBackend* backend;
+    void*                handle;
+    char*                devName;
+    pthread_t            thread;
+    bool                 threadStarted;
+    volatile bool        stopping;
+    ERRORCODE            readError;    // why the reader thread stopped, SUCCESS while it runs
+    shuntEnv*            env;          // of the thread that opened the session, for the reader
 };
 
 /*
  * writewrap
  *
- * wrap unixy write calls and take account of errors and retries
+ * hand a buffer to the backend to send
  */
 ERRORCODE serialWrite (serialSession* session, uint8_t* data, uint16_t length)
 {
-    int     retCode;
-    uint8_t retries;
-
-    retries = 5;
-
-    do
-    {
-        retCode = write(session->fildes, (void*)data, length);
-    } while ( (retCode != length) && ((errno == EAGAIN) || (errno == EINTR)) && (--retries));
+    ERRORCODE retCode;
 
-    if(retCode != length)
+    retCode = session->backend->write(session->handle, data, length);
+    if (retCode != SUCCESS)
     {
-        debug("Write error - %s\n", strerror(errno));
-        return ERR_SERIAL_WRITE;
+        return retCode;
     }
 
     debug("Wrote buffer - \n");
@@ -50,196 +52,92 @@ ERRORCODE serialWrite (serialSession* session, uint8_t* data, uint16_t length)
 }
 
 /*
- * readwrap
+ * deadlineAfter
  *
- * wrap unixy write calls and take account of errors and retries
+ * the CLOCK_MONOTONIC time a number of ms from now, for the condition variables
  */
-static ERRORCODE readwrap (int port, uint8_t* data, uint16_t length, int16_t* readBytes)
+static void deadlineAfter(uint32_t timeoutMs, struct timespec* deadline)
 {
-    int     retCode;
-    uint8_t retries;
-
-    retries = 5;
-
-    do
-    {
-        retCode = read(port, (void*)data, length);
-    } while (((errno == EAGAIN) || (errno == EINTR)) && (--retries));
-
-    *readBytes = retCode;
-
-    if(retCode != length)
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeoutMs / 1000;
+    deadline->tv_nsec += (timeoutMs % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000)
     {
-        if (retCode == 0)
-        {
-            return ERR_SERIAL_NO_DATA;
-        }
-        return ERR_SERIAL_READ;
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
     }
-
-    return SUCCESS;
 }
 
-
-/*
- * openSerial
- *
- * open the serial port and return descriptor
- */
-ERRORCODE openSerial(char* devName, int* fildes)
-{
-    struct termios theTermios;
-    ERRORCODE      errorCode;
-    int            returnCode;
-
-    returnCode = open(devName, O_RDWR| O_NONBLOCK | O_NDELAY);
-
-    if (returnCode != -1)
-    {
-        *fildes = returnCode;
-        memset(&theTermios, 0, sizeof(struct termios));
-
-        cfmakeraw(&theTermios);
-        cfsetspeed(&theTermios, 115200);
-
-        theTermios.c_cflag = CREAD | CLOCAL;     // turn on READ
-        theTermios.c_cflag |= CS8;
-        theTermios.c_cc[VMIN] = 0;
-        theTermios.c_cc[VTIME] = 10;     // 1 sec timeout
-        returnCode = ioctl(*fildes, TIOCSETA, &theTermios);
-
-        if (returnCode != -1)
-        {
-            errorCode = SUCCESS;
-        }
-        else
-        {
-            errorCode = ERR_CONFIG_TTY;
-            close(*fildes);
-        }
-    }
-    else
-    {
-        errorCode = ERR_OPEN_TTY;
-    }
-    return errorCode;
-}
-/*
- * Different settings
- * Non functional
- */
-/*
-ERRORCODE openSerial2(char* devName, int* fildes)
-{
-    struct termios theTermios;
-    ERRORCODE      errorCode;
-    int            returnCode;
-
-    returnCode = open(devName, O_RDWR| O_NONBLOCK | O_NDELAY);
-
-    if (returnCode != -1)
-    {
-        *fildes = returnCode;
-        memset(&theTermios, 0, sizeof(struct termios));
-
-        tcgetattr(returnCode, &theTermios);
-        cfmakeraw(&theTermios);
-        cfsetspeed(&theTermios, 115200);
-
-        theTermios.c_iflag &= ~(IGNBRK | BRKINT | ICRNL | INLCR | PARMRK | INPCK | ISTRIP | IXON);
-        theTermios.c_oflag = 0;
-        theTermios.c_lflag &= ~(ECHO | ECHONL | ICANON | IEXTEN | ISIG);
-
-        theTermios.c_cflag &= ~(CSIZE | PARENB);
-        theTermios.c_cflag |= CS8;
-        theTermios.c_cc[VMIN]  = 1;
-        theTermios.c_cc[VTIME] = 0;
-        returnCode = tcsetattr(returnCode, TCSAFLUSH, &theTermios);
-
-        if (returnCode != -1)
-        {
-            errorCode = SUCCESS;
-        }
-        else
-        {
-            errorCode = ERR_CONFIG_TTY;
-            close(*fildes);
-        }
-    }
-    else
-    {
-        errorCode = ERR_OPEN_TTY;
-    }
-    return errorCode;
-}
-*/
-
 /*
  * serialReadThread
  *
  * Main function for a thread that reads serial
  * data into a buffer
  */
-ERRORCODE serialReadThread(serialSession* session)
+static void* serialReadThread(serialSession* session)
 {
-    uint8_t   incoming;
-    ERRORCODE retCode;
-    int       sysRet;
+    uint8_t   incoming[READER_CHUNK];
+    ERRORCODE retCode = SUCCESS;
     int16_t   actual;
+    int16_t   index;
+    uint16_t  room;
+    struct timespec deadline;
 
-    struct   timespec tinySleep;
-
-    while(1)
+    useShuntEnv(session->env);
+    while (session->stopping == false)
     {
-        retCode = readwrap(session->fildes, &incoming, 1, &actual);
-
-        if(retCode == ERR_SERIAL_NO_DATA)
+        // only take what the buffer has room for, the rest waits with the backend
+        pthread_mutex_lock(&(session->bufferLock));
+        room = SERIAL_BUFFER_SIZE - 1 - (MOD_SUBTRACT(session->in, session->out, SERIAL_BUFFER_SIZE));
+        if (room == 0)
         {
-            tinySleep.tv_nsec = 10000;
-            tinySleep.tv_sec  = 0;
-            nanosleep(&tinySleep, NULL);
+            deadlineAfter(READER_WAIT, &deadline);
+            pthread_cond_timedwait(&(session->drained), &(session->bufferLock), &deadline);
+            pthread_mutex_unlock(&(session->bufferLock));
             continue;
         }
+        pthread_mutex_unlock(&(session->bufferLock));
 
-        if ((retCode != SUCCESS) || (actual != 1))
+        retCode = session->backend->wait(session->handle, READER_WAIT);
+        if (retCode == SUCCESS)
         {
-            debug("Read failed, thread exit %d\n", retCode);
-            break;
+            retCode = session->backend->read(session->handle, incoming, (room < READER_CHUNK) ? room : READER_CHUNK, &actual);
         }
-
-
-        sysRet = pthread_mutex_lock(&(session->bufferLock));
-        if (sysRet != 0)
+        if (retCode == ERR_SERIAL_NO_DATA)
+        {
+            continue;
+        }
+        if (retCode != SUCCESS)
         {
-            debug("Failed to lock buffer %d\n", errno);
+            debug("Read failed, thread exit %d\n", retCode);
             break;
         }
 
-        //debug("Thread got char - 0x%x\n", incoming);
-
-        session->buffer[session->in] = incoming;
-        MOD_INCREMENT(session->in, SERIAL_BUFFER_SIZE);
+        pthread_mutex_lock(&(session->bufferLock));
 
-        if (session->in == session->out)
+        for (index = 0; index < actual; index++)
         {
-            debug("Buffer overflow!\n");
-            MOD_INCREMENT(session->out, SERIAL_BUFFER_SIZE);
+            session->buffer[session->in] = incoming[index];
+            MOD_INCREMENT(session->in, SERIAL_BUFFER_SIZE);
         }
 
-        sysRet = pthread_mutex_unlock(&(session->bufferLock));
-        if (sysRet != 0)
-        {
-            debug("Failed to unlock buffer %d\n", errno);
-            break;
-        }
+        pthread_cond_broadcast(&(session->arrived));
+        pthread_mutex_unlock(&(session->bufferLock));
     }
-    return SUCCESS;
+
+    pthread_mutex_lock(&(session->bufferLock));
+    session->readError = (session->stopping == true) ? ERR_SERIAL_READ : retCode;
+    pthread_cond_broadcast(&(session->arrived));
+    pthread_mutex_unlock(&(session->bufferLock));
+
+    return NULL;
 }
 
 /*
  * serialRead
  *
- * read data out of the buffer/cache
+ * read data out of the buffer/cache. Once the buffer is empty and the
+ * reader thread has stopped, the line is gone and it says so.
  */
 ERRORCODE serialRead(serialSession* session, uint8_t* data, uint16_t length, int16_t* readBytes)
 {
@@ -260,11 +158,12 @@ ERRORCODE serialRead(serialSession* session, uint8_t* data, uint16_t length, int
         *readBytes = availableBytes>length?length:availableBytes;
         MOD_MEMCPY(data, session->buffer, *readBytes, session->out, SERIAL_BUFFER_SIZE);
         MOD_ADD(session->out, *readBytes, SERIAL_BUFFER_SIZE);
+        pthread_cond_signal(&(session->drained));
         retCode = SUCCESS;
     }
     else
     {
-        retCode = ERR_SERIAL_NO_DATA;
+        retCode = (session->readError != SUCCESS) ? session->readError : ERR_SERIAL_NO_DATA;
     }
 
     sysRet = pthread_mutex_unlock(&(session->bufferLock));
@@ -277,35 +176,68 @@ ERRORCODE serialRead(serialSession* session, uint8_t* data, uint16_t length, int
     return retCode;
 }
 
+/*
+ * serialWait
+ *
+ * sleep until there is data to read, the line goes or the time is up
+ */
+ERRORCODE serialWait(serialSession* session, uint32_t timeoutMs)
+{
+    struct timespec deadline;
+    ERRORCODE       retCode = SUCCESS;
+
+    deadlineAfter(timeoutMs, &deadline);
+
+    pthread_mutex_lock(&(session->bufferLock));
+    while (session->in == session->out)
+    {
+        if (session->readError != SUCCESS)
+        {
+            retCode = session->readError;
+            break;
+        }
+        if (pthread_cond_timedwait(&(session->arrived), &(session->bufferLock), &deadline) != 0)
+        {
+            retCode = ERR_SERIAL_NO_DATA;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(session->bufferLock));
+
+    return retCode;
+}
+
+ERRORCODE serialSetSpeed(serialSession* session, uint32_t baud)
+{
+    return session->backend->setSpeed(session->handle, baud);
+}
+
 /*
  * createSession
  *
  * Allocate and initialise a session structure
  */
-ERRORCODE createSession(char* devName, serialSession** session)
+static ERRORCODE createSession(char* devName, serialSession** session)
 {
-    int sysRet;
+    pthread_condattr_t attributes;
+    int                sysRet;
 
-    *session = (serialSession*)malloc(sizeof(struct _serialSession));
+    *session = (serialSession*)calloc(1, sizeof(struct _serialSession));
     if (!(*session))
     {
         debug("Failed to allocate session %d\n", errno);
         return ERR_NO_MEM;
     }
 
-    (*session)->in = 0;
-    (*session)->out = 0;
-    (*session)->fildes = 0;
-    (*session)->thread = 0;
-
     (*session)->devName = (char*)calloc(sizeof(char), strlen(devName) + 1);
-    if (!(*session))
+    if (!(*session)->devName)
     {
         debug("Failed to allocate device Buffer %d\n", errno);
         free(*session);
         return ERR_NO_MEM;
     }
     strcpy((*session)->devName, devName);
+    (*session)->env = currentEnv();
 
     sysRet = pthread_mutex_init(&((*session)->bufferLock), NULL);
     if (sysRet != 0)
@@ -316,6 +248,12 @@ ERRORCODE createSession(char* devName, serialSession** session)
         return ERR_CREATE_MUTEX;
     }
 
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&((*session)->arrived), &attributes);
+    pthread_cond_init(&((*session)->drained), &attributes);
+    pthread_condattr_destroy(&attributes);
+
     return SUCCESS;
 }
 
@@ -326,23 +264,25 @@ ERRORCODE createSession(char* devName, serialSession** session)
  */
 void destroySession(serialSession* session)
 {
-    /*
-     * should this kill the thread?
-     */
-    pthread_cancel(session->thread);
+    if (session->threadStarted)
+    {
+        session->stopping = true;
+        pthread_join(session->thread, NULL);
+    }
+    if (session->handle) session->backend->close(session->handle);
+    pthread_cond_destroy(&(session->arrived));
+    pthread_cond_destroy(&(session->drained));
     pthread_mutex_destroy(&(session->bufferLock));
-    if (session->thread) pthread_cancel(session->thread);
-    if (session->fildes) close(session->fildes);
     if (session->devName) free(session->devName);
-    if (session) free(session);
+    free(session);
 }
 
 /*
- * serialInit
+ * startSession
  *
- * Open the serial port, start the reader thread, exit
+ * attach an open backend to a new session and start its reader thread
  */
-ERRORCODE serialInit(char* devName, serialSession** session)
+static ERRORCODE startSession(char* devName, const serialBackend* backend, void* handle, serialSession** session)
 {
     ERRORCODE retCode;
     int       sysRet;
@@ -350,16 +290,11 @@ ERRORCODE serialInit(char* devName, serialSession** session)
     retCode = createSession(devName, session);
     if (retCode != SUCCESS)
     {
+        backend->close(handle);
         return retCode;
     }
-
-    retCode = openSerial((*session)->devName, &((*session)->fildes));
-    if (retCode != SUCCESS)
-    {
-        debug("Failed to open serial port\n");
-        destroySession(*session);
-        return retCode;
-    }
+    (*session)->backend = backend;
+    (*session)->handle = handle;
 
     sysRet = pthread_create(&((*session)->thread), NULL, (pthreadFunc)serialReadThread, *session);
     if (sysRet != 0)
@@ -368,6 +303,93 @@ ERRORCODE serialInit(char* devName, serialSession** session)
         destroySession(*session);
         return ERR_CREATE_THREAD;
     }
+    (*session)->threadStarted = true;
 
     return SUCCESS;
 }
+
+/*
+ * chooseBackend
+ *
+ * "tcp:host:port", "pty:" or a tty device path
+ */
+static const serialBackend* chooseBackend(char* devName, const char** address)
+{
+    if (strncmp(devName, "tcp:", 4) == 0)
+    {
+        *address = devName + 4;
+        return &tcpBackend;
+    }
+    if (strncmp(devName, "pty:", 4) == 0)
+    {
+        *address = devName + 4;
+        return &ptyBackend;
+    }
+    *address = devName;
+    return &ttyBackend;
+}
+
+/*
+ * serialInit
+ *
+ * Open the serial port, start the reader thread, exit
+ */
+ERRORCODE serialInit(char* devName, serialSession** session)
+{
+    const serialBackend* backend;
+    const char*          address;
+    void*                handle;
+    ERRORCODE            retCode;
+
+    backend = chooseBackend(devName, &address);
+
+    retCode = backend->open(address, &handle);
+    if (retCode != SUCCESS)
+    {
+        debug("Failed to open %s port %s\n", backend->name, address);
+        return retCode;
+    }
+
+    return startSession(devName, backend, handle, session);
+}
+
+ERRORCODE serialPipePair(serialSession** host, serialSession** device)
+{
+    void*     hostEnd;
+    void*     deviceEnd;
+    ERRORCODE retCode;
+
+    retCode = openPipePair(&hostEnd, &deviceEnd);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
+
+    retCode = startSession("pipe:host", &pipeBackend, hostEnd, host);
+    if (retCode != SUCCESS)
+    {
+        pipeBackend.close(deviceEnd);
+        return retCode;
+    }
+
+    retCode = startSession("pipe:device", &pipeBackend, deviceEnd, device);
+    if (retCode != SUCCESS)
+    {
+        destroySession(*host);
+    }
+    return retCode;
+}
+
+bool serialPresent(char* devName)
+{
+    struct stat          info;
+    const serialBackend* backend;
+    const char*          address;
+
+    backend = chooseBackend(devName, &address);
+    if (backend != &ttyBackend)
+    {
+        return true;
+    }
+    return (stat(address, &info) == 0);
+}
@@ -10,10 +10,27 @@
 
 typedef struct _serialSession serialSession;
 
+/*
+ * devName is a tty device path, "tcp:<host>:<port>" for a port server or
+ * simulator on the network, or "pty:" to make a pseudo terminal
+ */
 ERRORCODE serialInit(char* devName, serialSession** session);
 
+/*
+ * Two sessions joined by an in-memory line - one for the host stack, one
+ * for whatever plays the USIP
+ */
+ERRORCODE serialPipePair(serialSession** host, serialSession** device);
+
 ERRORCODE serialRead(serialSession* session, uint8_t* data, uint16_t length, int16_t* readBytes);
 ERRORCODE serialWrite(serialSession* session, uint8_t* data, uint16_t length);
+ERRORCODE serialWait(serialSession* session, uint32_t timeoutMs);
+ERRORCODE serialSetSpeed(serialSession* session, uint32_t baud);
+
+/*
+ * Whether the device could be opened - false once a tty node has gone
+ */
+bool      serialPresent(char* devName);
 
 void      destroySession(serialSession* session);
 
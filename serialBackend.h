@@ -0,0 +1,52 @@
+/*
+ * serialBackend.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERIALBACKEND_H_
+#define SERIALBACKEND_H_
+
+#include "shunt.h"
+
+/*
+ * What the serial session needs from whatever carries the bytes. Reads
+ * never block - ERR_SERIAL_NO_DATA if there's nothing yet - and wait is
+ * how the reader thread sleeps until there is.
+ */
+typedef struct _serialBackend
+{
+    const char* name;
+    ERRORCODE (*open)     (const char* address, void** handle);
+    ERRORCODE (*read)     (void* handle, uint8_t* data, uint16_t length, int16_t* readBytes);
+    ERRORCODE (*write)    (void* handle, const uint8_t* data, uint16_t length);
+    ERRORCODE (*wait)     (void* handle, uint32_t timeoutMs);
+    ERRORCODE (*setSpeed) (void* handle, uint32_t baud);
+    void      (*close)    (void* handle);
+} serialBackend;
+
+extern const serialBackend ttyBackend;
+extern const serialBackend ptyBackend;
+extern const serialBackend tcpBackend;
+extern const serialBackend pipeBackend;
+
+/*
+ * Anything that is just a file descriptor can share these
+ */
+typedef struct _fdHandle
+{
+    int fd;
+    int spare;   // backend specific - the pty keeps its slave side open in here
+} fdHandle;
+
+ERRORCODE fdWrite (void* handle, const uint8_t* data, uint16_t length);
+ERRORCODE fdWait  (void* handle, uint32_t timeoutMs);
+void      fdClose (void* handle);
+
+/*
+ * Make the two ends of an in-memory pipe - what one writes the other reads
+ */
+ERRORCODE openPipePair (void** first, void** second);
+
+#endif /* SERIALBACKEND_H_ */
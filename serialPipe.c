@@ -0,0 +1,252 @@
+/*
+ * serialPipe.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * An in-memory serial line between two sessions in the same process, so
+ * the protocol stack can be run against a simulated USIP at memory speed
+ * and its own overhead measured apart from the wire.
+ */
+#include "shunt.h"
+#include "serialBackend.h"
+
+#define PIPE_SIZE  65536
+#define WRITE_WAIT 1000   // ms to wait for room before a write gives up
+
+/*
+ * One direction of the line
+ */
+typedef struct _pipeBuffer
+{
+    uint8_t  data[PIPE_SIZE];
+    uint32_t in;
+    uint32_t out;
+} pipeBuffer;
+
+/*
+ * Both directions, shared by the two ends
+ */
+typedef struct _pipePair
+{
+    pipeBuffer      direction[2];
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    uint8_t         ends;     // still open
+} pipePair;
+
+typedef struct _pipeEnd
+{
+    pipePair* pair;
+    uint8_t   side;       // reads direction[side], writes the other
+} pipeEnd;
+
+/*
+ * contiguous
+ *
+ * how much of a transfer can be done in one go from a ring position,
+ * before the end of the buffer wraps it back to the start
+ */
+static uint32_t contiguous(uint32_t position, uint32_t wanted)
+{
+    uint32_t toEnd = PIPE_SIZE - (position % PIPE_SIZE);
+
+    return (wanted > toEnd) ? toEnd : wanted;
+}
+
+/*
+ * deadlineIn
+ *
+ * an absolute CLOCK_MONOTONIC time some milliseconds from now
+ */
+static void deadlineIn(struct timespec* deadline, uint32_t timeoutMs)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeoutMs / 1000;
+    deadline->tv_nsec += (timeoutMs % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static ERRORCODE pipeRead (void* handle, uint8_t* data, uint16_t length, int16_t* readBytes)
+{
+    pipeEnd*    end = (pipeEnd*)handle;
+    pipeBuffer* buffer = &(end->pair->direction[end->side]);
+    uint32_t    available;
+    uint32_t    chunk;
+    uint32_t    done;
+    ERRORCODE   retCode = SUCCESS;
+
+    pthread_mutex_lock(&(end->pair->lock));
+    available = buffer->in - buffer->out;
+    if (available == 0)
+    {
+        retCode = (end->pair->ends == 2) ? ERR_SERIAL_NO_DATA : ERR_SERIAL_READ;
+        *readBytes = 0;
+    }
+    else
+    {
+        *readBytes = (available > length) ? length : available;
+        for (done = 0; done < (uint32_t)*readBytes; done += chunk)
+        {
+            chunk = contiguous(buffer->out, *readBytes - done);
+            memcpy(data + done, buffer->data + (buffer->out % PIPE_SIZE), chunk);
+            buffer->out += chunk;
+        }
+        pthread_cond_broadcast(&(end->pair->changed));
+    }
+    pthread_mutex_unlock(&(end->pair->lock));
+
+    return retCode;
+}
+
+static ERRORCODE pipeWrite (void* handle, const uint8_t* data, uint16_t length)
+{
+    pipeEnd*        end = (pipeEnd*)handle;
+    pipeBuffer*     buffer = &(end->pair->direction[end->side ^ 1]);
+    struct timespec deadline;
+    uint32_t        chunk;
+    ERRORCODE       retCode = SUCCESS;
+
+    deadlineIn(&deadline, WRITE_WAIT);
+
+    pthread_mutex_lock(&(end->pair->lock));
+    while (length)
+    {
+        if (end->pair->ends != 2)
+        {
+            retCode = ERR_SERIAL_WRITE;
+            break;
+        }
+        if (buffer->in - buffer->out == PIPE_SIZE)
+        {
+            // let the reader at what is already in while waiting for room
+            pthread_cond_broadcast(&(end->pair->changed));
+            if (pthread_cond_timedwait(&(end->pair->changed), &(end->pair->lock), &deadline) != 0)
+            {
+                retCode = ERR_SERIAL_WRITE;
+                break;
+            }
+            continue;
+        }
+        chunk = contiguous(buffer->in, length);
+        if (chunk > PIPE_SIZE - (buffer->in - buffer->out))
+        {
+            chunk = PIPE_SIZE - (buffer->in - buffer->out);
+        }
+        memcpy(buffer->data + (buffer->in % PIPE_SIZE), data, chunk);
+        buffer->in += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+    pthread_cond_broadcast(&(end->pair->changed));
+    pthread_mutex_unlock(&(end->pair->lock));
+
+    return retCode;
+}
+
+static ERRORCODE pipeWait (void* handle, uint32_t timeoutMs)
+{
+    pipeEnd*        end = (pipeEnd*)handle;
+    pipeBuffer*     buffer = &(end->pair->direction[end->side]);
+    struct timespec deadline;
+    ERRORCODE       retCode = SUCCESS;
+
+    deadlineIn(&deadline, timeoutMs);
+
+    pthread_mutex_lock(&(end->pair->lock));
+    while (buffer->in == buffer->out)
+    {
+        if (end->pair->ends != 2)
+        {
+            retCode = ERR_SERIAL_READ;
+            break;
+        }
+        if (pthread_cond_timedwait(&(end->pair->changed), &(end->pair->lock), &deadline) != 0)
+        {
+            retCode = ERR_SERIAL_NO_DATA;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(end->pair->lock));
+
+    return retCode;
+}
+
+static ERRORCODE pipeSetSpeed (__attribute__((unused)) void* handle, __attribute__((unused)) uint32_t baud)
+{
+    return SUCCESS;
+}
+
+/*
+ * pipeClose
+ *
+ * close one end; the other sees the line go down, the last frees it
+ */
+static void pipeClose (void* handle)
+{
+    pipeEnd*  end = (pipeEnd*)handle;
+    pipePair* pair = end->pair;
+    uint8_t   ends;
+
+    pthread_mutex_lock(&(pair->lock));
+    ends = --(pair->ends);
+    pthread_cond_broadcast(&(pair->changed));
+    pthread_mutex_unlock(&(pair->lock));
+
+    if (ends == 0)
+    {
+        pthread_cond_destroy(&(pair->changed));
+        pthread_mutex_destroy(&(pair->lock));
+        free(pair);
+    }
+    free(end);
+}
+
+ERRORCODE openPipePair (void** first, void** second)
+{
+    pthread_condattr_t attributes;
+    pipePair*          pair;
+    pipeEnd*           ends[2];
+
+    pair = (pipePair*)calloc(1, sizeof(pipePair));
+    ends[0] = (pipeEnd*)malloc(sizeof(pipeEnd));
+    ends[1] = (pipeEnd*)malloc(sizeof(pipeEnd));
+    if (!pair || !ends[0] || !ends[1])
+    {
+        free(pair);
+        free(ends[0]);
+        free(ends[1]);
+        return ERR_NO_MEM;
+    }
+
+    pthread_mutex_init(&(pair->lock), NULL);
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&(pair->changed), &attributes);
+    pthread_condattr_destroy(&attributes);
+    pair->ends = 2;
+
+    ends[0]->pair = pair;
+    ends[0]->side = 0;
+    ends[1]->pair = pair;
+    ends[1]->side = 1;
+
+    *first = ends[0];
+    *second = ends[1];
+    return SUCCESS;
+}
+
+const serialBackend pipeBackend =
+{
+    "pipe",
+    NULL,       // only made in pairs, by openPipePair
+    pipeRead,
+    pipeWrite,
+    pipeWait,
+    pipeSetSpeed,
+    pipeClose
+};
@@ -0,0 +1,145 @@
+/*
+ * serialTcp.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Serial over a TCP connection - a ser2net style port server, or a
+ * simulated USIP listening on loopback. Addresses are "host:port".
+ */
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "shunt.h"
+#include "serialBackend.h"
+
+#define TCP_ADDRESS_SIZE 256
+
+/*
+ * tcpRead
+ *
+ * take whatever is waiting - here a read of 0 means the far end closed
+ */
+static ERRORCODE tcpRead (void* handle, uint8_t* data, uint16_t length, int16_t* readBytes)
+{
+    fdHandle* port = (fdHandle*)handle;
+    ssize_t   retCode;
+
+    retCode = recv(port->fd, (void*)data, length, 0);
+    if (retCode > 0)
+    {
+        *readBytes = retCode;
+        return SUCCESS;
+    }
+
+    *readBytes = 0;
+    if ((retCode == -1) && ((errno == EAGAIN) || (errno == EINTR)))
+    {
+        return ERR_SERIAL_NO_DATA;
+    }
+    debug("Connection closed - %d\n", errno);
+    return ERR_SERIAL_READ;
+}
+
+/*
+ * tcpSetSpeed
+ *
+ * the port server owns the line speed
+ */
+static ERRORCODE tcpSetSpeed (__attribute__((unused)) void* handle, __attribute__((unused)) uint32_t baud)
+{
+    return SUCCESS;
+}
+
+/*
+ * tcpOpen
+ *
+ * connect to host:port with Nagle off, so short packets go straight out
+ */
+static ERRORCODE tcpOpen (const char* address, void** handle)
+{
+    struct addrinfo  hints;
+    struct addrinfo* results;
+    struct addrinfo* result;
+    char             host[TCP_ADDRESS_SIZE];
+    char*            port;
+    fdHandle*        connection;
+    int              noDelay = 1;
+    int              fd = -1;
+
+    if (strlen(address) >= sizeof(host))
+    {
+        return ERR_OPEN_TTY;
+    }
+    strcpy(host, address);
+    port = strrchr(host, ':');
+    if (port == NULL)
+    {
+        output("TCP address %s needs a port\n", address);
+        return ERR_OPEN_TTY;
+    }
+    *port++ = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &results) != 0)
+    {
+        debug("Can't resolve %s\n", address);
+        return ERR_OPEN_TTY;
+    }
+
+    for (result = results; result; result = result->ai_next)
+    {
+        fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        if (connect(fd, result->ai_addr, result->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(results);
+
+    if (fd == -1)
+    {
+        debug("Can't connect to %s - %d\n", address, errno);
+        return ERR_OPEN_TTY;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+    {
+        close(fd);
+        return ERR_CONFIG_TTY;
+    }
+
+    connection = (fdHandle*)malloc(sizeof(fdHandle));
+    if (!connection)
+    {
+        close(fd);
+        return ERR_NO_MEM;
+    }
+    connection->fd = fd;
+    connection->spare = -1;
+
+    *handle = connection;
+    return SUCCESS;
+}
+
+const serialBackend tcpBackend =
+{
+    "tcp",
+    tcpOpen,
+    tcpRead,
+    fdWrite,
+    fdWait,
+    tcpSetSpeed,
+    fdClose
+};
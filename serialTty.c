@@ -0,0 +1,275 @@
+/*
+ * serialTty.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Serial backends on file descriptors - a real tty, and a pseudo
+ * terminal for running against a simulated USIP on the same machine.
+ * Split out of serial.c.
+ */
+#define _GNU_SOURCE   // posix_openpt and friends
+
+#include "shunt.h"
+#include "serialBackend.h"
+
+#define WRITE_WAIT 1000   // ms to wait for room before a write gives up
+
+/*
+ * fdWrite
+ *
+ * write all of a buffer, waiting for room if the descriptor is full
+ */
+ERRORCODE fdWrite (void* handle, const uint8_t* data, uint16_t length)
+{
+    fdHandle*     port = (fdHandle*)handle;
+    struct pollfd ready;
+    ssize_t       written;
+
+    while (length)
+    {
+        written = write(port->fd, (void*)data, length);
+        if (written > 0)
+        {
+            data += written;
+            length -= written;
+            continue;
+        }
+
+        if ((written == -1) && (errno == EINTR))
+        {
+            continue;
+        }
+        if ((written == -1) && (errno == EAGAIN))
+        {
+            ready.fd = port->fd;
+            ready.events = POLLOUT;
+            if (poll(&ready, 1, WRITE_WAIT) > 0)
+            {
+                continue;
+            }
+        }
+
+        debug("Write error - %s\n", strerror(errno));
+        return ERR_SERIAL_WRITE;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * fdWait
+ *
+ * wait until there's something to read
+ */
+ERRORCODE fdWait (void* handle, uint32_t timeoutMs)
+{
+    fdHandle*     port = (fdHandle*)handle;
+    struct pollfd ready;
+    int           sysRet;
+
+    ready.fd = port->fd;
+    ready.events = POLLIN;
+    ready.revents = 0;
+
+    sysRet = poll(&ready, 1, timeoutMs);
+    if ((sysRet == 0) || ((sysRet == -1) && (errno == EINTR)))
+    {
+        return ERR_SERIAL_NO_DATA;
+    }
+    if ((sysRet == -1) || (ready.revents & (POLLERR | POLLNVAL)) ||
+        ((ready.revents & POLLHUP) && !(ready.revents & POLLIN)))
+    {
+        debug("Wait error - %d, 0x%x\n", errno, ready.revents);
+        return ERR_SERIAL_READ;
+    }
+
+    return SUCCESS;
+}
+
+void fdClose (void* handle)
+{
+    fdHandle* port = (fdHandle*)handle;
+
+    close(port->fd);
+    if (port->spare != -1)
+    {
+        close(port->spare);
+    }
+    free(port);
+}
+
+/*
+ * ttyRead
+ *
+ * take whatever is waiting. A tty with VMIN 0 gives back 0 rather than
+ * EAGAIN on some systems when it has nothing.
+ */
+static ERRORCODE ttyRead (void* handle, uint8_t* data, uint16_t length, int16_t* readBytes)
+{
+    fdHandle* port = (fdHandle*)handle;
+    ssize_t   retCode;
+
+    retCode = read(port->fd, (void*)data, length);
+    if (retCode > 0)
+    {
+        *readBytes = retCode;
+        return SUCCESS;
+    }
+
+    *readBytes = 0;
+    if ((retCode == 0) || (errno == EAGAIN) || (errno == EINTR))
+    {
+        return ERR_SERIAL_NO_DATA;
+    }
+    return ERR_SERIAL_READ;
+}
+
+/*
+ * ttySetSpeed
+ *
+ * change the line speed of an open tty
+ */
+static ERRORCODE ttySetSpeed (void* handle, uint32_t baud)
+{
+    fdHandle*      port = (fdHandle*)handle;
+    struct termios theTermios;
+
+    if ((tcgetattr(port->fd, &theTermios) != 0) ||
+        (cfsetspeed(&theTermios, baud) != 0) ||
+        (tcsetattr(port->fd, TCSANOW, &theTermios) != 0))
+    {
+        debug("Failed to set speed %u - %d\n", baud, errno);
+        return ERR_CONFIG_TTY;
+    }
+    return SUCCESS;
+}
+
+/*
+ * configureTty
+ *
+ * raw 8 bit, 115200, reads not blocking
+ */
+static ERRORCODE configureTty (int fildes)
+{
+    struct termios theTermios;
+
+    memset(&theTermios, 0, sizeof(struct termios));
+
+    cfmakeraw(&theTermios);
+    cfsetspeed(&theTermios, 115200);
+
+    theTermios.c_cflag = CREAD | CLOCAL;     // turn on READ
+    theTermios.c_cflag |= CS8;
+    theTermios.c_cc[VMIN] = 0;
+    theTermios.c_cc[VTIME] = 10;     // 1 sec timeout
+
+    if (ioctl(fildes, TIOCSETA, &theTermios) == -1)
+    {
+        return ERR_CONFIG_TTY;
+    }
+    return SUCCESS;
+}
+
+/*
+ * ttyOpen
+ *
+ * open the serial port
+ */
+static ERRORCODE ttyOpen (const char* address, void** handle)
+{
+    fdHandle* port;
+    ERRORCODE errorCode;
+
+    port = (fdHandle*)malloc(sizeof(fdHandle));
+    if (!port)
+    {
+        return ERR_NO_MEM;
+    }
+    port->spare = -1;
+
+    port->fd = open(address, O_RDWR | O_NONBLOCK | O_NOCTTY);
+    if (port->fd == -1)
+    {
+        free(port);
+        return ERR_OPEN_TTY;
+    }
+
+    errorCode = configureTty(port->fd);
+    if (errorCode != SUCCESS)
+    {
+        close(port->fd);
+        free(port);
+        return errorCode;
+    }
+
+    *handle = port;
+    return SUCCESS;
+}
+
+/*
+ * ptyOpen
+ *
+ * make a new pseudo terminal and print the name of its slave side, for a
+ * simulator to open. The slave is held open here as well, so the master
+ * doesn't see a hang up before the simulator arrives or between runs.
+ */
+static ERRORCODE ptyOpen (__attribute__((unused)) const char* address, void** handle)
+{
+    fdHandle* port;
+    char*     slaveName;
+
+    port = (fdHandle*)malloc(sizeof(fdHandle));
+    if (!port)
+    {
+        return ERR_NO_MEM;
+    }
+
+    port->fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (port->fd == -1)
+    {
+        free(port);
+        return ERR_OPEN_TTY;
+    }
+
+    if ((grantpt(port->fd) != 0) || (unlockpt(port->fd) != 0) || ((slaveName = ptsname(port->fd)) == NULL) ||
+        ((port->spare = open(slaveName, O_RDWR | O_NOCTTY)) == -1))
+    {
+        close(port->fd);
+        free(port);
+        return ERR_OPEN_TTY;
+    }
+
+    if ((configureTty(port->spare) != SUCCESS) || (fcntl(port->fd, F_SETFL, O_NONBLOCK) == -1))
+    {
+        fdClose(port);
+        return ERR_CONFIG_TTY;
+    }
+
+    output("Serial pty is %s\n", slaveName);
+
+    *handle = port;
+    return SUCCESS;
+}
+
+const serialBackend ttyBackend =
+{
+    "tty",
+    ttyOpen,
+    ttyRead,
+    fdWrite,
+    fdWait,
+    ttySetSpeed,
+    fdClose
+};
+
+const serialBackend ptyBackend =
+{
+    "pty",
+    ptyOpen,
+    ttyRead,
+    fdWrite,
+    fdWait,
+    ttySetSpeed,
+    fdClose
+};
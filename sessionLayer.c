@@ -9,14 +9,11 @@
 #include "cmac.h"
 #include "utils.h"
 #include "transportLayer.h"
+#include "dataLayer.h"
+#include "telemetry.h"
+#include "keyStore.h"
 #include "sessionLayer.h"
 
-#define PROTECTION_CLEAR_UNSIGNED 0x00
-#define PROTECTION_CLEAR_RMAC     0x01
-#define PROTECTION_AES_RMAC       0x02
-#define PROTECTION_CLEAR_CMAC     0x05
-#define PROTECTION_AES_CMAC       0x06
-
 #define COMMAND_HELLO     0x01 // Hello-Request
 #define COMMAND_HELLO_REP 0x02 // Hello-Reply
 #define COMMAND_CHALLENGE 0x07 // Challenge-Request
@@ -24,12 +21,26 @@
 #define COMMAND_FAILURE   0x04 // Operation failed
 #define COMMAND_DATA      0x05 // Data Transfer
 
+#define STALE_RESPONSE_LIMIT 3
+
 struct _sessionDetails
 {
     transportConnection connection;
     uint8_t             protection;
     uint8_t             transID;
+    uint8_t             lastTransID;   // transID of the last DATA packet sent
+    bool                transIDEchoed; // responses have been seen carrying our transID
     uint8_t             key[16];
+    struct helloResp    hello;         // unit data from the hello response
+    commandQueue*       queue;
+    cmacKey             cipher;        // key ready for sealing commands
+    bool                sealRunning;   // the sealing thread has been started
+    bool                sealStopping;
+    pthread_t           sealThread;
+    pthread_mutex_t     sealLock;
+    pthread_cond_t      sealSignal;    // signalled when a job is handed over or done
+    packetBuffer*       sealJob;       // being sealed, NULL when the thread is idle
+    shuntEnv*           env;           // of the thread that started sealing, for the sealer
 };
 
 /*
@@ -41,9 +52,12 @@ struct _sessionDetails
 ERRORCODE initSession(serialSession* serialPort, uint8_t** respData, uint16_t* respLen, uint8_t* key, sessionDetails** retDetails)
 {
     ERRORCODE         errorCode;
-    uint8_t           command[12];
+    uint8_t           storage[PACKET_ROOM(12)];
+    packetBuffer      command;
+    packetBuffer      reply;
     sessionDetails*   details;
     struct helloResp* rsp;
+    struct timespec   mark;
 
     details = (struct _sessionDetails*)malloc(sizeof(struct _sessionDetails));
     if(!details)
@@ -55,24 +69,36 @@ ERRORCODE initSession(serialSession* serialPort, uint8_t** respData, uint16_t* r
 
     details->protection = PROTECTION_CLEAR_UNSIGNED;
     details->transID = 0;
+    details->lastTransID = 0;
+    details->transIDEchoed = false;
+    details->queue = NULL;
+    details->sealRunning = false;
+    memset(&(details->hello), 0, sizeof(struct helloResp));
 
+    telemetryMark(&mark);
     errorCode = connectTransportLayer(serialPort, &(details->connection));
+    telemetryEvent("connect", "\"ms\":%.1f,\"code\":%d", telemetrySince(&mark), errorCode);
     if(errorCode != SUCCESS)
     {
         free(details);
         return errorCode;
     }
 
-    command[0] = (COMMAND_HELLO << 4);
-    command[1] = 0;
-    command[2] = 0;
-    command[3] = 8;
-    memcpy(command + 4, "HI-USIP", 8);
+    initPacket(&command, storage, sizeof(storage), 12);
+    command.data[0] = (COMMAND_HELLO << 4);
+    command.data[1] = 0;
+    command.data[2] = 0;
+    command.data[3] = 8;
+    memcpy(command.data + 4, "HI-USIP", 8);
 
-    errorCode = sendTransportData(&(details->connection), command, 12);
+    telemetryMark(&mark);
+    errorCode = sendTransportData(&(details->connection), &command);
     if (errorCode == SUCCESS)
     {
-        errorCode = receiveTransportData(&(details->connection), respData, respLen);
+        errorCode = receiveTransportData(&(details->connection), &reply);
+        *respLen  = reply.length;
+        *respData = packetRelease(&reply);
+        telemetryEvent("hello", "\"ms\":%.1f,\"code\":%d", telemetrySince(&mark), errorCode);
         if (errorCode == SUCCESS)
         {
             if (respData && (*respLen > 0))
@@ -82,6 +108,7 @@ ERRORCODE initSession(serialSession* serialPort, uint8_t** respData, uint16_t* r
                 *retDetails = details;
 
                 rsp = (struct helloResp*)(*respData);
+                memcpy(&(details->hello), rsp, (*respLen < sizeof(struct helloResp)) ? *respLen : sizeof(struct helloResp));
                 debug("----------------------------------------------------\n");
                 debug("Unit Data:\n");
                 debug("Lifecycle stage - %d\n", rsp->lifeCycle);
@@ -123,38 +150,39 @@ ERRORCODE initSession(serialSession* serialPort, uint8_t** respData, uint16_t* r
  */
 ERRORCODE challengeSequence(sessionDetails* session, uint8_t* challengeData)
 {
-    uint8_t   command[20];
-    uint8_t   cache[16];
-    ERRORCODE retCode;
-    uint8_t*  respData;
-    uint16_t  respLength;
-
-    command[0] = (COMMAND_CHALLENGE << 4) | session->protection;
-    command[1] = 0x00;
-    command[2] = 0x00;
-    command[3] = 0x10;
+    uint8_t      storage[PACKET_ROOM(20)];
+    packetBuffer command;
+    packetBuffer reply;
+    uint8_t      cache[16];
+    ERRORCODE    retCode;
+
+    initPacket(&command, storage, sizeof(storage), 20);
+    command.data[0] = (COMMAND_CHALLENGE << 4) | session->protection;
+    command.data[1] = 0x00;
+    command.data[2] = 0x00;
+    command.data[3] = 0x10;
 
     memcpy(cache, challengeData, 16);
     hexDebug(challengeData, 16);
     cache[0] ^= session->protection;
 
-    retCode = aesEncrypt(command + 4, cache, session->key);
+    retCode = aesEncrypt(command.data + 4, cache, session->key);
     if (retCode != SUCCESS)
     {
         return retCode;
     }
 
-    retCode = sendTransportData(&(session->connection), command, 20);
+    retCode = sendTransportData(&(session->connection), &command);
     if (retCode == SUCCESS)
     {
-        retCode = receiveTransportData(&(session->connection), &respData, &respLength);
+        retCode = receiveTransportData(&(session->connection), &reply);
         if (retCode == SUCCESS)
         {
             debug("Received message -\n");
-            hexDebug(respData, respLength);
-            if (respLength == 4)
+            hexDebug(reply.data, reply.length);
+            if (reply.length == 4)
             {
-                if (((respData[0]) >> 4) == COMMAND_SUCCESS)
+                if (((reply.data[0]) >> 4) == COMMAND_SUCCESS)
                 {
                     debug("Challenge Success!\n");
                     retCode = SUCCESS;
@@ -167,9 +195,9 @@ ERRORCODE challengeSequence(sessionDetails* session, uint8_t* challengeData)
             }
             else
             {
-                debug("Bad length - %u\n", respLength);
+                debug("Bad length - %u\n", reply.length);
             }
-            if(respData) free(respData);
+            freePacket(&reply);
         }
         else
         {
@@ -186,13 +214,14 @@ ERRORCODE challengeSequence(sessionDetails* session, uint8_t* challengeData)
 /*
  * startSessionlayer
  *
- * Connect a new session
+ * Connect a new session, protected as asked
  */
-ERRORCODE startSessionLayer(serialSession* serialPort, uint8_t* key, sessionDetails** retDetails)
+ERRORCODE startSessionLayer(serialSession* serialPort, uint8_t* key, uint8_t protection, sessionDetails** retDetails)
 {
-    ERRORCODE retCode;
-    uint8_t*  respData;
-    uint16_t  respLength;
+    ERRORCODE       retCode;
+    uint8_t*        respData;
+    uint16_t        respLength;
+    struct timespec mark;
 
     retCode = initSession(serialPort, &respData, &respLength, key, retDetails);
     if (retCode != SUCCESS)
@@ -201,13 +230,41 @@ ERRORCODE startSessionLayer(serialSession* serialPort, uint8_t* key, sessionDeta
         return retCode;
     }
 
+    if (currentEnv() && currentEnv()->keys)
+    {
+        retCode = findDeviceKey(currentEnv()->keys, (*retDetails)->hello.usn, (*retDetails)->key);
+        if (retCode != SUCCESS)
+        {
+            output("No key for this unit in the key store\n");
+            free(respData);
+            endSession(*retDetails);
+            *retDetails = NULL;
+            return retCode;
+        }
+    }
+
+    retCode = initCMacKey(&((*retDetails)->cipher), (*retDetails)->key);
+    if (retCode != SUCCESS)
+    {
+        free(respData);
+        endSession(*retDetails);
+        *retDetails = NULL;
+        return retCode;
+    }
+
+    // the challenge tells the unit how the rest of the session is protected
+    (*retDetails)->protection = protection;
+
+    telemetryMark(&mark);
     retCode = challengeSequence(*retDetails, respData + 34);
+    telemetryEvent("challenge", "\"ms\":%.1f,\"code\":%d", telemetrySince(&mark), retCode);
     free(respData);
 
     if (retCode != SUCCESS)
     {
         debug("Challenge process failed\n");
-        free(*retDetails);
+        endSession(*retDetails);
+        *retDetails = NULL;
     }
     else
     {
@@ -217,88 +274,449 @@ ERRORCODE startSessionLayer(serialSession* serialPort, uint8_t* key, sessionDeta
 }
 
 /*
- * sendSessionData
+ * fillSessionHeader
  *
- * format, encrypt and send a session-layer data packet
+ * the 4 byte header of a session DATA packet
  */
-ERRORCODE sendSessionData (sessionDetails* session, uint8_t* data, uint16_t length)
+static void fillSessionHeader(uint8_t* header, uint8_t protection, uint8_t transID, uint16_t dataLength)
 {
+    header[0] = (COMMAND_DATA << 4) | protection;
+    header[1] = transID;
+    header[2] = dataLength >> 8;
+    header[3] = dataLength &0xFF;
+}
+
+/*
+ * sealPacket
+ *
+ * encrypt and/or MAC a packet, as the session's protection says, into a
+ * packet of its own. The plaintext has to survive for a resend.
+ */
+static ERRORCODE sealPacket(sessionDetails* session, packetBuffer* packet, packetBuffer* sealed)
+{
+    uint32_t  cipherLength;
+    uint32_t  sealedLength;
     ERRORCODE retCode;
-    uint8_t*  commandBody;
-    uint16_t  commandLength;
-    uint16_t  dataLength;
 
+    cipherLength = (session->protection & PROTECTION_AES) ? PADDED_LENGTH(packet->length) : packet->length;
+    sealedLength = cipherLength + ((session->protection & PROTECTION_CMAC) ? CMAC_LENGTH : 0);
 
-    debug("Data length %d\n", length);
+    retCode = allocPacket(sealed, sealedLength);
+    if (retCode != SUCCESS)
+    {
+        return retCode;
+    }
 
-    if (session->protection == PROTECTION_CLEAR_UNSIGNED)
+    if (session->protection & PROTECTION_AES)
     {
-        commandLength = length + 4;
-        dataLength = length;
+        encryptAndMac(&(session->cipher), packet->data, packet->length, sealed->data,
+                      (session->protection & PROTECTION_CMAC) ? sealed->data + cipherLength : NULL);
     }
     else
     {
-        commandLength = length + (16 - (length % 16)) + 4 + 16;
-        dataLength = commandLength - 4;
+        memcpy(sealed->data, packet->data, packet->length);
+        encryptAndMac(&(session->cipher), packet->data, packet->length, NULL, sealed->data + cipherLength);
     }
 
-    commandBody = (uint8_t*)malloc(commandLength);
+    return SUCCESS;
+}
 
-    debug("Command length %d\n", commandLength);
+/*
+ * sealThread
+ *
+ * Main function for the thread that seals packets handed to sealAhead
+ */
+static void* sealThread(sessionDetails* session)
+{
+    packetBuffer* packet;
+    packetBuffer* sealed;
 
-    commandBody[0] = (COMMAND_DATA << 4) | session->protection;
-    commandBody[1] = (session->transID)++;
-    commandBody[2] = dataLength >> 8;
-    commandBody[3] = dataLength &0xFF;
+    useShuntEnv(session->env);
+    pthread_mutex_lock(&(session->sealLock));
+    while (1)
+    {
+        while (!session->sealJob && !session->sealStopping)
+        {
+            pthread_cond_wait(&(session->sealSignal), &(session->sealLock));
+        }
+        if (!session->sealJob)
+        {
+            break;
+        }
+        packet = session->sealJob;
+        pthread_mutex_unlock(&(session->sealLock));
 
-    if (session->protection == PROTECTION_CLEAR_UNSIGNED)
+        // on failure the packet is left unsealed, and sendSessionData has another go
+        sealed = (packetBuffer*)malloc(sizeof(packetBuffer));
+        if (sealed && (sealPacket(session, packet, sealed) != SUCCESS))
+        {
+            free(sealed);
+            sealed = NULL;
+        }
+
+        pthread_mutex_lock(&(session->sealLock));
+        packet->sealed = sealed;
+        session->sealJob = NULL;
+        pthread_cond_broadcast(&(session->sealSignal));
+    }
+    pthread_mutex_unlock(&(session->sealLock));
+
+    return NULL;
+}
+
+/*
+ * startSealer
+ *
+ * start the session's sealing thread, the first time it's wanted
+ */
+static ERRORCODE startSealer(sessionDetails* session)
+{
+    if ((pthread_mutex_init(&(session->sealLock), NULL) != 0) ||
+        (pthread_cond_init(&(session->sealSignal), NULL) != 0))
+    {
+        debug("Failed to create seal locks %d\n", errno);
+        return ERR_CREATE_MUTEX;
+    }
+
+    session->env = currentEnv();
+    session->sealJob = NULL;
+    session->sealStopping = false;
+    if (pthread_create(&(session->sealThread), NULL, (pthreadFunc)sealThread, session) != 0)
+    {
+        debug("Failed to start seal thread %d\n", errno);
+        pthread_cond_destroy(&(session->sealSignal));
+        pthread_mutex_destroy(&(session->sealLock));
+        return ERR_CREATE_THREAD;
+    }
+    session->sealRunning = true;
+
+    return SUCCESS;
+}
+
+ERRORCODE useSealed (sessionDetails* session, packetBuffer* packet, const uint8_t* record)
+{
+    packetBuffer* sealed;
+    uint32_t      cipherLength;
+    ERRORCODE     retCode;
+
+    if (!sessionProtected(session) || packet->sealed)
+    {
+        return SUCCESS;
+    }
+
+    cipherLength = (session->protection & PROTECTION_AES) ? PADDED_LENGTH(packet->length) : packet->length;
+
+    sealed = (packetBuffer*)malloc(sizeof(packetBuffer));
+    if (!sealed)
+    {
+        return ERR_NO_MEM;
+    }
+    retCode = allocPacket(sealed, cipherLength + ((session->protection & PROTECTION_CMAC) ? CMAC_LENGTH : 0));
+    if (retCode != SUCCESS)
+    {
+        free(sealed);
+        return retCode;
+    }
+
+    memcpy(sealed->data, (session->protection & PROTECTION_AES) ? record : packet->data, cipherLength);
+    if (session->protection & PROTECTION_CMAC)
+    {
+        memcpy(sealed->data + cipherLength, record + PADDED_LENGTH(packet->length), CMAC_LENGTH);
+    }
+    packet->sealed = sealed;
+
+    return SUCCESS;
+}
+
+ERRORCODE parseProtection (const char* name, uint8_t* protection)
+{
+    static const struct
+    {
+        const char* name;
+        uint8_t     protection;
+    } protections[] =
+    {
+        { "clear",    PROTECTION_CLEAR_UNSIGNED },
+        { "rmac",     PROTECTION_CLEAR_RMAC },
+        { "aes-rmac", PROTECTION_AES_RMAC },
+        { "cmac",     PROTECTION_CLEAR_CMAC },
+        { "aes-cmac", PROTECTION_AES_CMAC },
+    };
+    uint8_t index;
+
+    for (index = 0; index < sizeof(protections) / sizeof(protections[0]); index++)
+    {
+        if (strcmp(name, protections[index].name) == 0)
+        {
+            *protection = protections[index].protection;
+            return SUCCESS;
+        }
+    }
+
+    return ERR_VALIDATION;
+}
+
+bool sessionProtected (sessionDetails* session)
+{
+    return (session->protection & (PROTECTION_AES | PROTECTION_CMAC)) != 0;
+}
+
+void sessionCMac (sessionDetails* session, const uint8_t* data, uint32_t dataLength, uint8_t* mac)
+{
+    encryptAndMac(&(session->cipher), data, dataLength, NULL, mac);
+}
+
+void sealAhead (sessionDetails* session, packetBuffer* packet)
+{
+    if (!sessionProtected(session) || packet->sealed)
+    {
+        return;
+    }
+    if (!session->sealRunning && (startSealer(session) != SUCCESS))
+    {
+        return;
+    }
+
+    // one packet at a time - this one waits for the last to be done
+    pthread_mutex_lock(&(session->sealLock));
+    while (session->sealJob)
+    {
+        pthread_cond_wait(&(session->sealSignal), &(session->sealLock));
+    }
+    session->sealJob = packet;
+    pthread_cond_broadcast(&(session->sealSignal));
+    pthread_mutex_unlock(&(session->sealLock));
+}
+
+void sealWait (sessionDetails* session, packetBuffer* packet)
+{
+    if (!session->sealRunning)
     {
-        memcpy(commandBody + 4, data, length);
+        return;
+    }
+
+    pthread_mutex_lock(&(session->sealLock));
+    while (session->sealJob == packet)
+    {
+        pthread_cond_wait(&(session->sealSignal), &(session->sealLock));
+    }
+    pthread_mutex_unlock(&(session->sealLock));
+}
+
+/*
+ * sendSessionData
+ *
+ * format, encrypt and send a session-layer data packet
+ */
+ERRORCODE sendSessionData (sessionDetails* session, packetBuffer* packet)
+{
+    ERRORCODE     retCode;
+    packetBuffer  sealed;
+    packetBuffer* wire;
+    uint8_t*      header;
+
+    debug("Data length %d\n", packet->length);
+
+    sealWait(session, packet);
+    if (!sessionProtected(session))
+    {
+        wire = packet;
+    }
+    else if (packet->sealed)
+    {
+        wire = packet->sealed;
     }
     else
     {
-        retCode = aesPadAndEncryptEcb(commandBody + 4, data, length, session->key);
+        retCode = sealPacket(session, packet, &sealed);
         if (retCode != SUCCESS)
         {
-            debug("Failed to encrypt command %d", retCode);
-            free(commandBody);
             return retCode;
         }
+        wire = &sealed;
+    }
 
-        generateCMac(data, length, session->key, commandBody + commandLength - 16);
+    header = packetPush(wire, SESSION_HEADROOM);
+    if (!header)
+    {
+        debug("No headroom for the session header\n");
+        if (wire == &sealed)
+        {
+            freePacket(&sealed);
+        }
+        return ERR_PACKET_ROOM;
     }
 
-    retCode = sendTransportData(&(session->connection), commandBody, commandLength);
-    free(commandBody);
+    debug("Command length %d\n", wire->length);
+
+    session->lastTransID = session->transID;
+    fillSessionHeader(header, session->protection, (session->transID)++, wire->length - SESSION_HEADROOM);
+
+    // the precomputed checksums are for packets sent unsigned
+    if ((session->protection == PROTECTION_CLEAR_UNSIGNED) && packet->checksums)
+    {
+        packet->checksum = packet->checksums + (session->lastTransID * DATA_LAYER_TAILROOM);
+    }
+
+    retCode = sendTransportData(&(session->connection), wire);
+
+    packet->checksum = NULL;
+    if (wire == &sealed)
+    {
+        freePacket(&sealed);
+    }
+    else
+    {
+        packetPull(wire, SESSION_HEADROOM);
+    }
 
     return retCode;
 }
 
+/*
+ * precomputeChecksums
+ *
+ * The checksums only change with the transID in the session header, so
+ * a packet sent often (the same image to board after board) can have
+ * them worked out once for every transID and looked up when it's sent.
+ */
+ERRORCODE precomputeChecksums(packetBuffer* packet, uint8_t* checksums)
+{
+    uint8_t* header;
+    uint16_t dataLength;
+    uint16_t transID;
+
+    dataLength = packet->length;
+    header = packetPush(packet, SESSION_HEADROOM);
+    if (!header)
+    {
+        return ERR_PACKET_ROOM;
+    }
+
+    for (transID = 0; transID < FRAME_CHECKSUMS; transID++)
+    {
+        fillSessionHeader(header, PROTECTION_CLEAR_UNSIGNED, transID, dataLength);
+        calcDataChecksum(packet->data, packet->length, checksums + (transID * DATA_LAYER_TAILROOM));
+    }
+
+    packetPull(packet, SESSION_HEADROOM);
+    return SUCCESS;
+}
+
+/*
+ * isStaleResponse
+ *
+ * Once the device has been seen echoing our transID, a response carrying
+ * a different one belongs to an earlier command (e.g. a late reply to a
+ * retried request) and must not be handed to the current one
+ */
+static bool isStaleResponse(sessionDetails* session, packetBuffer* response)
+{
+    if (response->length < 2)
+    {
+        return false;
+    }
+    if (response->data[1] == session->lastTransID)
+    {
+        session->transIDEchoed = true;
+        return false;
+    }
+    return session->transIDEchoed;
+}
+
+/*
+ * openResponse
+ *
+ * On a protected session a response's body is followed by its RMAC, and
+ * with AES it is encrypted and padded too. Decrypt it in place, check
+ * the RMAC and cut the packet down to the plain body.
+ *
+ * Every mode but CLEAR_UNSIGNED is taken to carry a 16 byte RMAC: the
+ * CMAC modes are the RMAC modes with the command CMAC bit added (0x01 and
+ * 0x02 with 0x04), and that bit only changes what commands carry. So
+ * CLEAR_RMAC and CLEAR_CMAC responses are plain bodies followed by an
+ * RMAC, with no padding. This follows from the mode numbering and hasn't
+ * been checked against a unit in the clear modes - a unit that sends no
+ * RMAC there fails every response here as a runt or a bad RMAC.
+ */
+static ERRORCODE openResponse(sessionDetails* session, packetBuffer* packet)
+{
+    uint32_t  bodyLength;
+    uint32_t  plainLength;
+    ERRORCODE retCode;
+
+    if ((packet->data[0] & 0x0F) != session->protection)
+    {
+        debug("Response protection 0x%x, session 0x%x\n", packet->data[0] & 0x0F, session->protection);
+        return ERR_VALIDATION;
+    }
+    packetPull(packet, 2);
+
+    if (session->protection == PROTECTION_CLEAR_UNSIGNED)
+    {
+        return SUCCESS;
+    }
+
+    if (packet->length < CMAC_LENGTH + 2)
+    {
+        debug("Runt protected DATA packet, length %u\n", packet->length);
+        return ERR_VALIDATION;
+    }
+    bodyLength = packet->length - CMAC_LENGTH;
+
+    retCode = decryptAndCheckMac(&(session->cipher), packet->data, bodyLength, (session->protection & PROTECTION_AES) != 0,
+                                 packet->data + bodyLength, &plainLength);
+    if (retCode != SUCCESS)
+    {
+        debug("Response failed its RMAC check\n");
+        return retCode;
+    }
+    packetTrim(packet, plainLength);
+
+    return SUCCESS;
+}
+
 /*
  * receiveSessionData
  *
- * get a session level DATA packet
- * Only supports zero encryption for now
+ * get a session level DATA packet, opened as the session's protection
+ * says - the packet is left holding just the plain response body
  */
-ERRORCODE receiveSessionData (sessionDetails* session, uint8_t** data, uint16_t* length)
+ERRORCODE receiveSessionData (sessionDetails* session, packetBuffer* packet)
 {
     ERRORCODE retCode;
-    uint8_t*  respBody;
-    uint16_t  respLength;
+    uint8_t   stale = 0;
 
-    retCode = receiveTransportData(&(session->connection), &respBody, &respLength);
+    retCode = receiveTransportData(&(session->connection), packet);
+
+    while ((retCode == SUCCESS) && isStaleResponse(session, packet))
+    {
+        debug("Discarding response for transID %u, expecting %u\n", packet->data[1], session->lastTransID);
+        freePacket(packet);
+        if (++stale >= STALE_RESPONSE_LIMIT)
+        {
+            retCode = ERR_VALIDATION;
+            break;
+        }
+        retCode = receiveTransportData(&(session->connection), packet);
+    }
 
     if (retCode == SUCCESS)
     {
         debug("Received DATA packet\n");
-        /* Do some validation here? */
 
-        if (respLength > 2)
+        if (packet->length <= 2)
+        {
+            debug("Runt DATA packet, length %u\n", packet->length);
+            retCode = ERR_VALIDATION;
+        }
+        else
         {
-            *length = respLength - 2;
-            *data = (uint8_t*)malloc(*length);
-            memcpy(*data, respBody + 2, *length);
-            free(respBody);
+            retCode = openResponse(session, packet);
+        }
+        if (retCode != SUCCESS)
+        {
+            freePacket(packet);
         }
     }
     else
@@ -315,6 +733,43 @@ ERRORCODE receiveSessionData (sessionDetails* session, uint8_t** data, uint16_t*
  */
 void endSession (sessionDetails* session)
 {
-    disconnectTransportLayer(&(session->connection));
+    struct timespec mark;
+    ERRORCODE       retCode;
+
+    telemetryMark(&mark);
+    retCode = disconnectTransportLayer(&(session->connection));
+    telemetryEvent("disconnect", "\"ms\":%.1f,\"code\":%d", telemetrySince(&mark), retCode);
+
+    if (session->sealRunning)
+    {
+        pthread_mutex_lock(&(session->sealLock));
+        session->sealStopping = true;
+        pthread_cond_broadcast(&(session->sealSignal));
+        pthread_mutex_unlock(&(session->sealLock));
+
+        pthread_join(session->sealThread, NULL);
+        pthread_cond_destroy(&(session->sealSignal));
+        pthread_mutex_destroy(&(session->sealLock));
+    }
     free(session);
 }
+
+void setSessionQueue (sessionDetails* session, commandQueue* queue)
+{
+    session->queue = queue;
+}
+
+commandQueue* getSessionQueue (sessionDetails* session)
+{
+    return session->queue;
+}
+
+const uint8_t* getSessionUsn(sessionDetails* session)
+{
+    return session->hello.usn;
+}
+
+const struct helloResp* getSessionHello(sessionDetails* session)
+{
+    return &(session->hello);
+}
@@ -9,8 +9,26 @@
 #define SESSIONLAYER_H_
 
 #include "serial.h"
+#include "packetBuffer.h"
+
+/*
+ * How a session's DATA packets are protected, agreed in the challenge.
+ * Responses of every protected session carry an RMAC.
+ */
+#define PROTECTION_CLEAR_UNSIGNED 0x00
+#define PROTECTION_CLEAR_RMAC     0x01
+#define PROTECTION_AES_RMAC       0x02
+#define PROTECTION_CLEAR_CMAC     0x05
+#define PROTECTION_AES_CMAC       0x06
+
+#define PROTECTION_AES            0x02 // commands and responses are encrypted
+#define PROTECTION_CMAC           0x04 // commands carry a CMAC
+
+#define FRAME_CHECKSUMS      256  // one per transID
+#define FRAME_CHECKSUMS_SIZE (FRAME_CHECKSUMS * DATA_LAYER_TAILROOM)
 
 typedef struct _sessionDetails sessionDetails;
+typedef struct _commandQueue   commandQueue;
 
 /*
  * Exposed as a way to do only the 'HI-USIP' sequence
@@ -18,23 +36,78 @@ typedef struct _sessionDetails sessionDetails;
 ERRORCODE initSession(serialSession* serialPort, uint8_t** respData, uint16_t* respLen, uint8_t* key, sessionDetails** retDetails);
 
 /*
- * real way to start a full session
+ * real way to start a full session. When the thread's environment has a
+ * key store the unit's key comes from it, by the USN in its hello
+ * response, instead of key. protection (PROTECTION_) is what the
+ * challenge asks the unit for.
+ */
+ERRORCODE startSessionLayer(serialSession* serialPort, uint8_t* key, uint8_t protection, sessionDetails** retDetails);
+
+/*
+ * send commands from application layer. The session header goes in the
+ * packet's headroom, and it is left as it was found.
  */
-ERRORCODE startSessionLayer(serialSession* serialPort, uint8_t* key, sessionDetails** retDetails);
+ERRORCODE sendSessionData(sessionDetails* session, packetBuffer* packet);
 
 /*
- * send commands from application layer
+ * Work out the data layer checksum of a packet sent in the clear under
+ * each of the FRAME_CHECKSUMS transIDs, for packet->checksums
  */
-ERRORCODE sendSessionData(sessionDetails* session, uint8_t* data, uint16_t length);
+ERRORCODE precomputeChecksums(packetBuffer* packet, uint8_t* checksums);
 
 /*
- * receive a command at the session layer
+ * On a protected session, encrypt and MAC a packet on the session's
+ * sealing thread, so it's ready by the time sendSessionData gets to it
+ * and the caller can send the one before it meanwhile. sealWait must be
+ * called before the packet is sent from a copy, changed or freed. In
+ * the clear neither does anything.
  */
-ERRORCODE receiveSessionData (sessionDetails* session, uint8_t** data, uint16_t* length);
+void      sealAhead (sessionDetails* session, packetBuffer* packet);
+void      sealWait  (sessionDetails* session, packetBuffer* packet);
+
+/*
+ * Give a packet the sealed form worked out for it earlier: its contents
+ * encrypted (PADDED_LENGTH bytes) then their CMAC, under this session's
+ * key. Only what the session's protection sends is used.
+ */
+ERRORCODE useSealed (sessionDetails* session, packetBuffer* packet, const uint8_t* record);
+
+/*
+ * A protection by name - clear, rmac, aes-rmac, cmac or aes-cmac
+ */
+ERRORCODE parseProtection (const char* name, uint8_t* protection);
+
+/*
+ * Whether commands are sealed at all, and a CMAC under the session key
+ */
+bool      sessionProtected (sessionDetails* session);
+void      sessionCMac      (sessionDetails* session, const uint8_t* data, uint32_t dataLength, uint8_t* mac);
+
+/*
+ * receive a command at the session layer, with the session header
+ * stripped off
+ */
+ERRORCODE receiveSessionData (sessionDetails* session, packetBuffer* packet);
 
 /*
  * Send a disconnection and free the session
  */
 void endSession (sessionDetails* session);
 
+/*
+ * the command queue (if any) that owns this session's traffic
+ */
+void          setSessionQueue (sessionDetails* session, commandQueue* queue);
+commandQueue* getSessionQueue (sessionDetails* session);
+
+/*
+ * The USN the device reported in its hello response
+ */
+const uint8_t* getSessionUsn  (sessionDetails* session);
+
+/*
+ * All the unit data from the hello response
+ */
+const struct helloResp* getSessionHello (sessionDetails* session);
+
 #endif /* SESSIONLAYER_H_ */
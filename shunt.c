@@ -9,6 +9,10 @@
 #include "utils.h"
 #include "serial.h"
 #include "appLayer.h"
+#include "telemetry.h"
+#include "keyStore.h"
+#include "provisionIndex.h"
+#include "sessionLayer.h"
 
 /*
  * presentChoices
@@ -130,65 +134,140 @@ ERRORCODE findDevice(char* deviceName)
 void printHelp(char* name)
 {
     printf("\n");
-    printf("%s [-l <tty device>] [-f <image file> [-o <offset>] [-D] | -d [-s <sector>] [-e <sector>] | -u | -p | -t | -r] [-O] [-k key] [-v]\n", name);
+    printf("%s [-l <tty device>] [-f <image file> [-o <offset>] [-D] [-i] [-w] [-z] [-F] | -d [-s <sector>] [-e <sector>] | -V | -b <file> | -R <file> | -P <plan> | -B <log> | -G <keys> | -u | -p | -t | -r] [-O] [-k key | -K <store>] [-A <protection>] [-Y <dir>] [-H <index>] [-j <file>] [-v]\n", name);
     printf("%s -h|-?\n\n", name);
-    printf("\t-l <tty>    Specify the tty device to use (default - autodetect)\n");
+    printf("\t-l <tty>    Specify the tty device to use (default - autodetect). tcp:<host>:<port>\n");
+    printf("\t            connects to a serial port server, pty: makes a pseudo terminal\n");
     printf("Flash Mode:\n");
-    printf("\t-f <image>  Specify the image to flash\n");
-    printf("\t-o <offset> offset sector for flashing (default 0)\n");
+    printf("\t-f <image>  Specify the image to flash (bin, Intel HEX, S-record or ELF)\n");
+    printf("\t-o <offset> offset sector for flashing a bin (default 0)\n");
     printf("\t-D          dry-run (do not actually flash)\n");
+    printf("\t-i          incremental - only erase and flash sectors that changed\n");
+    printf("\t-w          verify each sector as it is written, rewrite it on failure\n");
+    printf("\t-z          send the image compressed, via the decompressing RCS\n");
+    printf("\t-F          keep the image's frame checksums in a cache file, so flashing it\n");
+    printf("\t            again doesn't work them out again\n");
+    printf("\t-P <plan>   save the flash plan for the image (-f, -o, -z) instead of flashing.\n");
+    printf("\t            A saved plan can be flashed with -f like any other image\n");
+    printf("\t-B <log>    batch - flash board after board on the -l tty with the image (-f, -o, -z, -i,\n");
+    printf("\t            -w, -F), appending each board's USN, versions and result to a log\n");
+    printf("\t-G <keys>   seal the image (-f, -o) ahead for every unit in a text file of\n");
+    printf("\t            '<usn hex> <key hex>' lines, one file per unit in the -Y directory\n");
+    printf("\t-Y <dir>    take a unit's writes ready sealed from here (needs -A other than clear)\n");
     printf("Erase Mode:\n");
     printf("\t-d          Erase flash (default - erase sectors 0-34)\n");
     printf("\t-s <sector> Start sector for erase (default 0)\n");
     printf("\t-e <sector> End sector for erase (default 34)\n");
+    printf("Backup Mode:\n");
+    printf("\t-b <file>   Read flash back into a file, via the readback RCS\n");
+    printf("\t-R <file>   Restore a backup, rewriting only the sectors that changed\n");
     printf("Other Modes:\n");
     printf("\t-u          Just retrieve USN and other unit details\n");
     printf("\t-p          Ping the USIP bootloader (at transport layer)\n");
     printf("\t-t          Test the session layer connection only\n");
     printf("\t-r          Test the RCS installation and echo\n");
+    printf("\t-V          Verify an image (-f, -o) against flash with the hashing RCS\n");
     printf("Other Options:\n");
     printf("\t-O          Override sector 35 protection\n");
-    printf("\t-k <key>    Communication key for use with USIP bootloader, 16 bytes (default 0x61...)\n");
+    printf("\t-k <key>    Communication key for use with USIP bootloader, 32 hex digits (default 0x61...)\n");
+    printf("\t-K <store>  Take each unit's key from a key store, by USN\n");
+    printf("\t-S <keys>   Build the -K key store from a text file of '<usn hex> <key hex>' lines\n");
+    printf("\t-A <prot>   Protect sessions - clear (default), rmac, aes-rmac, cmac or aes-cmac\n");
+    printf("\t-H <index>  Keep a provisioning history; units are only sent sectors it doesn't\n");
+    printf("\t            already show them holding (flash, restore and batch modes)\n");
+    printf("\t-j <file>   Append JSON lines telemetry (phase timings, progress, result) to a file\n");
     printf("\t-v          Verbose (debug) output\n");
     printf("\t-h          Print this help and exit\n\n");
 }
 
+/*
+ * cliOutput
+ *
+ * messages and debug go straight to the terminal
+ */
+static void cliOutput(__attribute__((unused)) void* user, const char* message)
+{
+    fputs(message, stdout);
+    fflush(stdout);
+}
+
+static void cliHexDebug(__attribute__((unused)) void* user, const uint8_t* data, uint32_t length)
+{
+    hexDump(data, length);
+}
+
+/*
+ * closeAll
+ *
+ * close the key store, history and telemetry main opened, whichever it got to
+ */
+static void closeAll(shuntEnv* env, flashOptions* flashOpts, ERRORCODE errorCode)
+{
+    if (env->keys)
+    {
+        closeKeyStore(env->keys);
+        env->keys = NULL;
+    }
+    if (flashOpts->history)
+    {
+        closeProvisionIndex(flashOpts->history);
+        flashOpts->history = NULL;
+    }
+    closeTelemetry(env->telemetry, errorCode);
+}
+
 int main (int argc, char** argv)
 {
     int            opt;
     char*          device;
     char*          defaultImageFile = "usip.complete.bin";
     uint8_t        key[16];
-    char           keyInt[3];
     char*          imageFile;
+    char*          backupFile;
+    char*          planFile;
+    char*          telemetryFile;
+    char*          batchLog;
+    char*          keyStoreFile;
+    char*          keyTextFile;
+    char*          sealKeyFile;
+    keyStore       keys;
+    char*          historyFile;
+    provisionIndex history;
     char           deviceBuffer[100];
     serialSession* serialPort;
     ERRORCODE      errorCode;
     uint8_t        mode;
     uint8_t        startSect;
     uint8_t        endSect;
-    uint8_t        offsetSect;
     struct stat    statStruct;
-    uint8_t        keyCounter;
     bool           override;
-    bool           dryrun;
+    flashOptions   flashOpts;
+    shuntEnv       env;
 
     mode = MODE_FLASH;
     device = NULL;
     startSect = 0;
     endSect = 34;
-    offsetSect = 0;
     memset(deviceBuffer, 0, sizeof(deviceBuffer));
     memset(key, 0x61, sizeof(key));
     override = false;
-    dryrun   = false;
+    memset(&flashOpts, 0, sizeof(flashOpts));
     
-    debugFunc = debugFake;
-    hexDebugFunc = hexFake;
+    memset(&env, 0, sizeof(env));
+    env.outputFunc = cliOutput;
+    useShuntEnv(&env);
 
     imageFile = defaultImageFile;
+    backupFile = NULL;
+    planFile = NULL;
+    telemetryFile = NULL;
+    batchLog = NULL;
+    keyStoreFile = NULL;
+    keyTextFile = NULL;
+    sealKeyFile = NULL;
+    historyFile = NULL;
 
-    while ((opt = getopt(argc, argv, ":l:f:o:Dds:e:utOpvrh?")) != -1)
+    while ((opt = getopt(argc, argv, ":l:f:o:DiwzFds:e:b:R:P:B:G:Y:k:K:S:A:H:utOpvrVj:h?")) != -1)
     {
         switch(opt)
         {
@@ -199,16 +278,28 @@ int main (int argc, char** argv)
             imageFile = optarg;
             break;
         case 'o':
-            offsetSect = atoi(optarg);
-            if (offsetSect > 35)
+            flashOpts.offsetSect = atoi(optarg);
+            if (flashOpts.offsetSect > 35)
             {
-                debug("offset sector value too large - %d (max 35)\n", offsetSect);
+                debug("offset sector value too large - %d (max 35)\n", flashOpts.offsetSect);
                 printHelp(argv[0]);
                 exit(1);
             }
             break;
         case 'D':
-            dryrun = true;
+            flashOpts.dryrun = true;
+            break;
+        case 'i':
+            flashOpts.differential = true;
+            break;
+        case 'w':
+            flashOpts.verifySectors = true;
+            break;
+        case 'z':
+            flashOpts.compressed = true;
+            break;
+        case 'F':
+            flashOpts.frameCache = true;
             break;
         case 'd':
             mode = MODE_ERASE;
@@ -232,22 +323,38 @@ int main (int argc, char** argv)
             }
             break;
         case 'k':
-            if (strlen(optarg) != 32)
+            if (parseHex(key, optarg, 16) != SUCCESS)
             {
-                debug("Key too length wrong - %lu, expected 32\n", strlen(optarg));
+                printf("Key must be 32 hex digits\n");
                 printHelp(argv[0]);
                 exit(1);
             }
-            keyCounter = 0;
-            while(keyCounter < 16)
+            break;
+        case 'K':
+            keyStoreFile = optarg;
+            break;
+        case 'S':
+            mode = MODE_KEYSTORE;
+            keyTextFile = optarg;
+            break;
+        case 'H':
+            historyFile = optarg;
+            break;
+        case 'A':
+            if (parseProtection(optarg, &(env.protection)) != SUCCESS)
             {
-                keyInt[0] = optarg[2*keyCounter];
-                keyInt[1] = optarg[(2*keyCounter) + 1];
-                keyInt[2] = 0;
-                key[keyCounter] = atoi(keyInt);
-                keyCounter++;
+                printf("Unknown protection - %s\n", optarg);
+                printHelp(argv[0]);
+                exit(1);
             }
             break;
+        case 'G':
+            mode = MODE_SEAL;
+            sealKeyFile = optarg;
+            break;
+        case 'Y':
+            flashOpts.sealedDir = optarg;
+            break;
         case 'u':
             mode = MODE_USN;
             break;
@@ -260,12 +367,34 @@ int main (int argc, char** argv)
         case 'r':
             mode = MODE_RCS_TEST;
             break;
+        case 'V':
+            mode = MODE_VERIFY;
+            break;
+        case 'b':
+            mode = MODE_BACKUP;
+            backupFile = optarg;
+            break;
+        case 'R':
+            mode = MODE_RESTORE;
+            backupFile = optarg;
+            break;
+        case 'P':
+            mode = MODE_PLAN;
+            planFile = optarg;
+            break;
+        case 'B':
+            mode = MODE_BATCH;
+            batchLog = optarg;
+            break;
         case 'O':
             override = true;
             break;
+        case 'j':
+            telemetryFile = optarg;
+            break;
         case 'v':
-            debugFunc = printf;
-            hexDebugFunc = hexDump;
+            env.debugFunc = cliOutput;
+            env.hexDebugFunc = cliHexDebug;
             break;
         case 'h':
         case '?':
@@ -282,13 +411,28 @@ int main (int argc, char** argv)
         }
     }
     
-    if ((mode == MODE_FLASH) && (stat(imageFile, &statStruct) == -1))
+    if (((mode == MODE_FLASH) || (mode == MODE_VERIFY) || (mode == MODE_PLAN) || (mode == MODE_BATCH) ||
+         (mode == MODE_SEAL)) && (stat(imageFile, &statStruct) == -1))
     {
         printf("Image file %s can't be accessed - %s\n", imageFile, strerror(errno));
         printHelp(argv[0]);
         exit(1);
     }
 
+    if ((mode == MODE_RESTORE) && (stat(backupFile, &statStruct) == -1))
+    {
+        printf("Backup file %s can't be accessed - %s\n", backupFile, strerror(errno));
+        printHelp(argv[0]);
+        exit(1);
+    }
+
+    if (flashOpts.sealedDir && (mode != MODE_SEAL) && (env.protection == PROTECTION_CLEAR_UNSIGNED))
+    {
+        printf("Sealed writes (-Y) are only used on protected sessions - give -A\n");
+        printHelp(argv[0]);
+        exit(1);
+    }
+
     if (startSect > endSect)
     {
         printf("Start sector (%d) must be less than end sector (%d)!\n",startSect, endSect);
@@ -296,18 +440,119 @@ int main (int argc, char** argv)
         exit(1);
     }
 
+    if (telemetryFile && (openTelemetry(telemetryFile, &env.telemetry) != SUCCESS))
+    {
+        exit(1);
+    }
+    telemetryEvent("mode", "\"mode\":%u", mode);
+
+    if (mode == MODE_KEYSTORE)
+    {
+        if (keyStoreFile == NULL)
+        {
+            printf("Building a key store needs -K <store>\n");
+            printHelp(argv[0]);
+            exit(1);
+        }
+        errorCode = buildKeyStore(keyTextFile, keyStoreFile);
+        if (errorCode == SUCCESS)
+        {
+            printf("Operation completed successfully\n");
+        }
+        else
+        {
+            printf("Operation FAILED, code %d\n", errorCode);
+        }
+        closeAll(&env, &flashOpts, errorCode);
+        return 0;
+    }
+
+    if (keyStoreFile)
+    {
+        if (openKeyStore(keyStoreFile, &keys) != SUCCESS)
+        {
+            closeAll(&env, &flashOpts, ERR_FILE_OPEN);
+            exit(1);
+        }
+        env.keys = &keys;
+    }
+
+    if (historyFile)
+    {
+        if (openProvisionIndex(historyFile, &history) != SUCCESS)
+        {
+            closeAll(&env, &flashOpts, ERR_FILE_OPEN);
+            exit(1);
+        }
+        flashOpts.history = &history;
+    }
+
+    if (mode == MODE_PLAN)
+    {
+        printf("Planning image %s at offset %d into %s\n", imageFile, flashOpts.offsetSect, planFile);
+        flashOpts.override = override;
+        errorCode = writeFlashPlan(imageFile, planFile, &flashOpts);
+        if (errorCode == SUCCESS)
+        {
+            printf("Operation completed successfully\n");
+        }
+        else
+        {
+            printf("Operation FAILED, code %d\n", errorCode);
+        }
+        closeAll(&env, &flashOpts, errorCode);
+        return 0;
+    }
+
+    if (mode == MODE_SEAL)
+    {
+        if (flashOpts.sealedDir == NULL)
+        {
+            printf("Sealing an image needs -Y <dir>\n");
+            printHelp(argv[0]);
+            closeAll(&env, &flashOpts, ERR_DIRECTORY);
+            exit(1);
+        }
+        printf("Sealing image %s at offset %d into %s\n", imageFile, flashOpts.offsetSect, flashOpts.sealedDir);
+        flashOpts.override = override;
+        errorCode = writeSealedStreams(imageFile, sealKeyFile, &flashOpts);
+        if (errorCode == SUCCESS)
+        {
+            printf("Operation completed successfully\n");
+        }
+        else
+        {
+            printf("Operation FAILED, code %d\n", errorCode);
+        }
+        closeAll(&env, &flashOpts, errorCode);
+        return 0;
+    }
+
     if (device == NULL)
     {
         errorCode = findDevice(deviceBuffer);
         if (errorCode != SUCCESS)
         {
             printf("Failed to find a device\n");
+            closeAll(&env, &flashOpts, errorCode);
             exit(1);
         }
         device = deviceBuffer;
         
     }
 
+    if (mode == MODE_BATCH)
+    {
+        flashOpts.override = override;
+        errorCode = batchFlash(device, key, imageFile, batchLog, &flashOpts);
+        if (errorCode != SUCCESS)
+        {
+            printf("Operation FAILED, code %d\n", errorCode);
+        }
+        closeAll(&env, &flashOpts, errorCode);
+        return 0;
+    }
+
     printf("%s running in mode - ", argv[0]);
 
     switch (mode)
@@ -318,7 +563,7 @@ int main (int argc, char** argv)
         break;
     case MODE_FLASH:
         printf("FLASH\n");
-        printf("Flashing image %s at offset %d\n", imageFile, offsetSect);
+        printf("Flashing image %s at offset %d\n", imageFile, flashOpts.offsetSect);
         break;
     case MODE_USN:
         printf("USN\n");
@@ -332,6 +577,18 @@ int main (int argc, char** argv)
     case MODE_RCS_TEST:
         printf("RCS TEST\n");
         break;
+    case MODE_VERIFY:
+        printf("VERIFY\n");
+        printf("Verifying image %s at offset %d\n", imageFile, flashOpts.offsetSect);
+        break;
+    case MODE_BACKUP:
+        printf("BACKUP\n");
+        printf("Backing up flash to %s\n", backupFile);
+        break;
+    case MODE_RESTORE:
+        printf("RESTORE\n");
+        printf("Restoring flash from %s\n", backupFile);
+        break;
     }
 
     debug("Comms key - \n");
@@ -339,10 +596,11 @@ int main (int argc, char** argv)
 
     debug("Opening %s ... \n", device);
 
-    errorCode = serialInit(deviceBuffer, &serialPort);
+    errorCode = serialInit(device, &serialPort);
     if (errorCode != SUCCESS)
     {
         printf("Failed to open serial port - %s\n", strerror(errno));
+        closeAll(&env, &flashOpts, errorCode);
         exit(1);
     }
     debug("Port open\n");
@@ -353,7 +611,8 @@ int main (int argc, char** argv)
         errorCode = eraseSectors(serialPort, key, startSect, endSect, override);
         break;
     case MODE_FLASH:
-        errorCode = flashProgram(serialPort, key, offsetSect, imageFile, override, dryrun);
+        flashOpts.override = override;
+        errorCode = flashProgram(serialPort, key, imageFile, &flashOpts);
         break;
     case MODE_USN:
         errorCode = getUSN(serialPort, key);
@@ -367,6 +626,17 @@ int main (int argc, char** argv)
     case MODE_RCS_TEST:
         errorCode = echoRCS(serialPort, key);
         break;
+    case MODE_VERIFY:
+        flashOpts.override = override;
+        errorCode = verifyImage(serialPort, key, imageFile, &flashOpts);
+        break;
+    case MODE_BACKUP:
+        errorCode = backupFlash(serialPort, key, backupFile, override);
+        break;
+    case MODE_RESTORE:
+        flashOpts.override = override;
+        errorCode = restoreFlash(serialPort, key, backupFile, &flashOpts);
+        break;
     }
 
     debug("Completed with code - %u\n", errorCode);
@@ -381,5 +651,6 @@ int main (int argc, char** argv)
     }
 
     destroySession(serialPort);
+    closeAll(&env, &flashOpts, errorCode);
     return 0;
 }
@@ -22,7 +22,9 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 
 #define MAX_CANDIDATES         9
@@ -61,6 +63,13 @@ typedef uint16_t ERRORCODE;
 #define ERR_FILE_OPEN       28
 #define ERR_FILE_READ       29
 #define ERR_AGAIN           30
+#define ERR_VERIFY          31
+#define ERR_FILE_WRITE      32
+#define ERR_LINK_DOWN       33
+#define ERR_BAD_IMAGE       34
+#define ERR_NO_KEY          35
+#define ERR_NO_HISTORY      36
+#define ERR_PACKET_ROOM     37
 
 #define MODE_FLASH    0
 #define MODE_ERASE    1
@@ -68,6 +77,13 @@ typedef uint16_t ERRORCODE;
 #define MODE_PING     3
 #define MODE_TEST     4
 #define MODE_RCS_TEST 5
+#define MODE_VERIFY   6
+#define MODE_BACKUP   7
+#define MODE_RESTORE  8
+#define MODE_PLAN     9
+#define MODE_BATCH    10
+#define MODE_KEYSTORE 11
+#define MODE_SEAL     12
 
 #define MOD_ADD(x,y,mod)        (x)+=(y); (x) = (x) % (mod)
 #define MOD_INCREMENT(x,mod)    MOD_ADD(x,1,mod)
@@ -75,7 +91,7 @@ typedef uint16_t ERRORCODE;
 
 #define MOD_MEMCPY(destination, buffer, size, offset, mod) if ((offset) + (size) > mod) { \
                                                                memcpy(destination, (buffer) + (offset), mod - (offset)); \
-                                                               memcpy(destination, buffer, (size) - (mod - (offset))); \
+                                                               memcpy((destination) + (mod - (offset)), buffer, (size) - (mod - (offset))); \
                                                            } \
                                                            else memcpy(destination, (buffer) + (offset), size);
 
@@ -99,11 +115,37 @@ struct __attribute__((packed)) helloResp
 
 typedef void* (*pthreadFunc)(void*);
 
-#define debug(string, ...) (debugFunc)("%s:(%d):%s:"string,__FILE__, __LINE__, __func__, ##__VA_ARGS__)
-#define debug_raw(string)  debugFunc(string)
-#define hexDebug(x,y)      hexDebugFunc(x,y)
+typedef void (*shuntLogFunc)      (void* user, const char* message);
+typedef void (*shuntHexFunc)      (void* user, const uint8_t* data, uint32_t length);
+typedef void (*shuntProgressFunc) (void* user, uint32_t done, uint32_t total);
 
-int  (*debugFunc)(const char* fmt, ...);
-void (*hexDebugFunc)(uint8_t* buf, uint32_t length);
+/*
+ * Where a caller wants messages, debug and progress to go, and the state
+ * the layers share on its behalf. Each thread works for one environment
+ * at a time (useShuntEnv), and threads the layers start take on the
+ * environment of the thread that started them. Any callback can be NULL.
+ */
+typedef struct _shuntEnv
+{
+    shuntLogFunc        outputFunc;    // messages for the user
+    shuntLogFunc        debugFunc;     // debug trace
+    shuntHexFunc        hexDebugFunc;
+    shuntProgressFunc   progressFunc;  // bytes done of a flash or backup
+    void*               user;          // passed to each callback
+    struct _keyStore*   keys;          // per-unit keys by USN, NULL to use the key given
+    struct _telemetry*  telemetry;     // JSON lines run telemetry, NULL for none
+    uint8_t             protection;    // PROTECTION_ for new sessions, 0 for the clear
+} shuntEnv;
+
+shuntEnv* useShuntEnv   (shuntEnv* env);  // returns the one it replaces
+shuntEnv* currentEnv    (void);
+void      shuntOutput   (const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void      shuntDebug    (const char* fmt, ...);
+void      shuntHexDebug (const uint8_t* data, uint32_t length);
+void      shuntProgress (uint32_t done, uint32_t total);
+
+#define output(string, ...) shuntOutput(string, ##__VA_ARGS__)
+#define debug(string, ...)  shuntDebug("%s:(%d):%s:"string,__FILE__, __LINE__, __func__, ##__VA_ARGS__)
+#define hexDebug(x,y)       shuntHexDebug(x,y)
 
 #endif /* SHUNT_H_ */
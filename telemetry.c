@@ -0,0 +1,187 @@
+/*
+ * telemetry.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ *
+ * Machine readable record of a run, one JSON object per line, for
+ * station dashboards to work out which fixtures and phases are slow.
+ * Every line carries "t" (seconds since the run started) and "time"
+ * (wall clock), and is written with a single write() so lines from
+ * the command queue's thread don't interleave. Each caller's environment
+ * has its own telemetry file, or none.
+ */
+
+#include <stdarg.h>
+
+#include "shunt.h"
+#include "telemetry.h"
+
+#define TELEMETRY_LINE_SIZE 512
+
+static void telemetryWrite(telemetry* record, const char* event, const char* fields, ...);
+
+struct _telemetry
+{
+    int             fd;
+    struct timespec start;
+    uint32_t        retries;
+    pthread_mutex_t lock;
+};
+
+/*
+ * The telemetry of the environment this thread works for, if any
+ */
+static telemetry* envTelemetry(void)
+{
+    shuntEnv* env = currentEnv();
+
+    return env ? env->telemetry : NULL;
+}
+
+ERRORCODE openTelemetry(char* path, telemetry** retTelemetry)
+{
+    telemetry* newTelemetry;
+
+    newTelemetry = (telemetry*)malloc(sizeof(telemetry));
+    if (!newTelemetry)
+    {
+        return ERR_NO_MEM;
+    }
+
+    newTelemetry->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (newTelemetry->fd == -1)
+    {
+        output("Unable to open telemetry file %s, %d\n", path, errno);
+        free(newTelemetry);
+        return ERR_FILE_OPEN;
+    }
+
+    pthread_mutex_init(&(newTelemetry->lock), NULL);
+    telemetryMark(&(newTelemetry->start));
+    newTelemetry->retries = 0;
+    *retTelemetry = newTelemetry;
+
+    telemetryWrite(newTelemetry, "start", "\"pid\":%d", getpid());
+
+    return SUCCESS;
+}
+
+void closeTelemetry(telemetry* record, ERRORCODE result)
+{
+    if (!record)
+    {
+        return;
+    }
+
+    telemetryWrite(record, "result", "\"code\":%d,\"retries\":%u,\"elapsed\":%.3f", result, record->retries, telemetrySince(&(record->start)) / 1000);
+    close(record->fd);
+    pthread_mutex_destroy(&(record->lock));
+    free(record);
+}
+
+/*
+ * telemetryLine
+ *
+ * Format and write one line to a telemetry file
+ */
+static void telemetryLine(telemetry* record, const char* event, const char* fields, va_list args)
+{
+    char            line[TELEMETRY_LINE_SIZE];
+    struct timespec wall;
+    int             length;
+
+    clock_gettime(CLOCK_REALTIME, &wall);
+    length = snprintf(line, sizeof(line), "{\"t\":%.3f,\"time\":%ld.%03ld,\"event\":\"%s\"",
+                      telemetrySince(&(record->start)) / 1000, (long)wall.tv_sec, wall.tv_nsec / 1000000, event);
+
+    if (fields && (length < (int)sizeof(line)))
+    {
+        line[length++] = ',';
+        length += vsnprintf(line + length, sizeof(line) - length, fields, args);
+    }
+    if (length > (int)sizeof(line) - 3)
+    {
+        debug("Telemetry line for %s too long\n", event);
+        return;
+    }
+    line[length++] = '}';
+    line[length++] = '\n';
+
+    pthread_mutex_lock(&(record->lock));
+    if (write(record->fd, line, length) != length)
+    {
+        debug("Telemetry write failed %d\n", errno);
+    }
+    pthread_mutex_unlock(&(record->lock));
+}
+
+static void telemetryWrite(telemetry* record, const char* event, const char* fields, ...)
+{
+    va_list args;
+
+    va_start(args, fields);
+    telemetryLine(record, event, fields, args);
+    va_end(args);
+}
+
+void telemetryEvent(const char* event, const char* fields, ...)
+{
+    telemetry* record = envTelemetry();
+    va_list    args;
+
+    if (!record)
+    {
+        return;
+    }
+
+    va_start(args, fields);
+    telemetryLine(record, event, fields, args);
+    va_end(args);
+}
+
+void telemetryMark(struct timespec* mark)
+{
+    clock_gettime(CLOCK_MONOTONIC, mark);
+}
+
+double telemetrySince(const struct timespec* mark)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - mark->tv_sec) * 1000.0) + ((now.tv_nsec - mark->tv_nsec) / 1e6);
+}
+
+void telemetryRetry(uint8_t command, const char* reason)
+{
+    telemetry* record = envTelemetry();
+
+    if (!record)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&(record->lock));
+    record->retries++;
+    pthread_mutex_unlock(&(record->lock));
+
+    telemetryEvent("retry", "\"command\":%u,\"reason\":\"%s\"", command, reason);
+}
+
+void telemetryProgress(const struct timespec* start, uint32_t done, uint32_t total)
+{
+    double elapsed;
+    double rate;
+
+    if (!envTelemetry())
+    {
+        return;
+    }
+
+    elapsed = telemetrySince(start) / 1000;
+    rate = (elapsed > 0) ? done / elapsed : 0;
+
+    telemetryEvent("progress", "\"done\":%u,\"total\":%u,\"bps\":%.0f,\"eta\":%.1f",
+                   done, total, rate, (rate > 0) ? (total - done) / rate : -1.0);
+}
@@ -0,0 +1,49 @@
+/*
+ * telemetry.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include "shunt.h"
+
+typedef struct _telemetry telemetry;
+
+/*
+ * Start writing JSON lines telemetry to a file (appended to, so a fifo or
+ * /dev/fd/N work too). Events go to the telemetry of the environment the
+ * thread works for; with none every other call does nothing.
+ */
+ERRORCODE openTelemetry     (char* path, telemetry** retTelemetry);
+
+/*
+ * Write the final result line, close the file and free the telemetry
+ */
+void      closeTelemetry    (telemetry* record, ERRORCODE result);
+
+/*
+ * Write one line - {"t":..,"time":..,"event":"<event>",<fields>}
+ * fields is a printf format for extra JSON members, or NULL
+ */
+void      telemetryEvent    (const char* event, const char* fields, ...);
+
+/*
+ * Note the time now, and get the milliseconds since a note
+ */
+void      telemetryMark     (struct timespec* mark);
+double    telemetrySince    (const struct timespec* mark);
+
+/*
+ * A command being sent again, and why; counted for the result line
+ */
+void      telemetryRetry    (uint8_t command, const char* reason);
+
+/*
+ * Bytes done of a total since start, with the rate and time left
+ */
+void      telemetryProgress (const struct timespec* start, uint32_t done, uint32_t total);
+
+#endif /* TELEMETRY_H_ */
@@ -8,6 +8,7 @@
 #include "shunt.h"
 #include "serial.h"
 #include "dataLayer.h"
+#include "utils.h"
 #include "transportLayer.h"
 
 // Protocol -
@@ -36,15 +37,15 @@
 #define CHAN_ID       0x09 // Channel ID used by Maxim flashloader
 
 #define RETRANSMISSION_ATTEMPTS 5
+#define NO_RX_SEQ               0xFF
 
 ERRORCODE connectTransportLayer (serialSession* serialPort, transportConnection* con)
 {
     uint8_t   protocol;
     uint8_t   id;
-    uint8_t   seq;
-    uint8_t*  data;
-    uint16_t  dataLength;
-    uint8_t   retries;
+    uint8_t      seq;
+    packetBuffer reply;
+    uint8_t      retries;
 
     ERRORCODE errorCode;
 
@@ -53,18 +54,22 @@ ERRORCODE connectTransportLayer (serialSession* serialPort, transportConnection*
     con->chanID = CHAN_ID;
     con->lastSeq = 0;
     con->serialPort = serialPort;
+    con->lastRxSeq = NO_RX_SEQ;
+    con->lastAckSeq = 0;
+    con->lastRxLength = 0;
+    con->lastRxCrc = 0;
 
     while(retries)
     {
         //CON_REQ
-        errorCode = sendDataLayerPacket(con->serialPort, CON_REQ, con->chanID, con->lastSeq, NULL, 0);
+        errorCode = sendDataLayerPacket(con->serialPort, CON_REQ, con->chanID, con->lastSeq, NULL);
         if (errorCode != SUCCESS)
         {
             return errorCode;
         }
 
         //CON_REP
-        errorCode = receiveDataLayerPacket(con->serialPort, &protocol, &id, &seq, &data, &dataLength, 3);
+        errorCode = receiveDataLayerPacket(con->serialPort, &protocol, &id, &seq, &reply, 3);
         if (errorCode != SUCCESS)
         {
             debug("Receive failed - %d\n", errorCode);
@@ -80,18 +85,15 @@ ERRORCODE connectTransportLayer (serialSession* serialPort, transportConnection*
             }
         }
 
-        if ((protocol != CON_REP) || (dataLength != 0) || (id != con->chanID) || (seq != con->lastSeq) || (data != NULL))
+        if ((protocol != CON_REP) || (reply.length != 0) || (id != con->chanID) || (seq != con->lastSeq))
         {
-            if (data != NULL)
-            {
-                free(data);
-            }
+            freePacket(&reply);
             // something isn't right
             return ERR_CONREP;
         }
 
         //ACK
-        errorCode = sendDataLayerPacket(con->serialPort, ACK, con->chanID, con->lastSeq, NULL, 0);
+        errorCode = sendDataLayerPacket(con->serialPort, ACK, con->chanID, con->lastSeq, NULL);
         if (errorCode != SUCCESS)
         {
             return errorCode;
@@ -110,28 +112,27 @@ ERRORCODE disconnectTransportLayer (transportConnection* con)
 
     uint8_t   protocol;
     uint8_t   id;
-    uint8_t   seq;
-    uint8_t*  data;
-    uint16_t  dataLength;
+    uint8_t      seq;
+    packetBuffer reply;
 
     MOD_INCREMENT(con->lastSeq, 16);
 
-    errorCode = sendDataLayerPacket(con->serialPort, DISC_REQ, con->chanID, con->lastSeq, NULL, 0);
+    errorCode = sendDataLayerPacket(con->serialPort, DISC_REQ, con->chanID, con->lastSeq, NULL);
     if (errorCode != SUCCESS)
     {
         return errorCode;
     }
 
-    receiveDataLayerPacket(con->serialPort, &protocol, &id, &seq, &data, &dataLength, RETRANSMISSION_TIMEOUT);
+    receiveDataLayerPacket(con->serialPort, &protocol, &id, &seq, &reply, RETRANSMISSION_TIMEOUT);
+    freePacket(&reply);
 
     return SUCCESS;
 }
 
-ERRORCODE sendTransportData (transportConnection* con, uint8_t* data, uint16_t dataLength)
+ERRORCODE sendTransportData (transportConnection* con, packetBuffer* packet)
 {
-    ERRORCODE errorCode;
-    uint8_t*  respData;
-    uint16_t  respLength;
+    ERRORCODE    errorCode;
+    packetBuffer reply;
     uint8_t   protocol;
     uint8_t   id;
     uint8_t   seq;
@@ -141,19 +142,15 @@ ERRORCODE sendTransportData (transportConnection* con, uint8_t* data, uint16_t d
 
     while(retries)
     {
-        errorCode = sendDataLayerPacket(con->serialPort, DATA_TRANSFER, con->chanID, con->lastSeq, data, dataLength);
+        errorCode = sendDataLayerPacket(con->serialPort, DATA_TRANSFER, con->chanID, con->lastSeq, packet);
         if (errorCode != SUCCESS)
         {
             return errorCode;
         }
 
         // hopefully receive an ACK
-        respData = NULL;
-        errorCode = receiveDataLayerPacket(con->serialPort, &protocol, &id, &seq, &respData, &respLength, RETRANSMISSION_TIMEOUT);
-        if (respData)
-        {
-            free(respData);
-        }
+        errorCode = receiveDataLayerPacket(con->serialPort, &protocol, &id, &seq, &reply, RETRANSMISSION_TIMEOUT);
+        freePacket(&reply);
 
         if (errorCode == SUCCESS || errorCode == ERR_VALIDATION)
         {
@@ -177,25 +174,62 @@ ERRORCODE sendTransportData (transportConnection* con, uint8_t* data, uint16_t d
     return errorCode;
 }
 
-ERRORCODE receiveTransportData (transportConnection* con, uint8_t** data, uint16_t* length)
+/*
+ * isDuplicatePacket
+ *
+ * The device resends a DATA packet when our ACK for it is lost, so an
+ * identical packet with the same seq is a repeat, not a new response
+ */
+static bool isDuplicatePacket(transportConnection* con, uint8_t protocol, uint8_t seq, uint8_t* data, uint16_t length, uint32_t* crc)
+{
+    *crc = generateCrc32(0, data, length);
+
+    return (protocol == DATA_TRANSFER) && (seq == con->lastRxSeq) &&
+           (length == con->lastRxLength) && (*crc == con->lastRxCrc);
+}
+
+ERRORCODE receiveTransportData (transportConnection* con, packetBuffer* packet)
 {
     ERRORCODE errorCode;
     uint8_t   protocol;
     uint8_t   seq;
     uint8_t   id;
+    uint8_t   retries;
+    uint32_t  crc = 0;
+
+    retries = RETRANSMISSION_ATTEMPTS;
 
  //   while(1)
    // {
         //Receive a packet
-        errorCode = receiveDataLayerPacket(con->serialPort, &protocol, &id, &seq, data, length, RETRANSMISSION_TIMEOUT);
+        errorCode = receiveDataLayerPacket(con->serialPort, &protocol, &id, &seq, packet, RETRANSMISSION_TIMEOUT);
+        while ((errorCode == SUCCESS) && isDuplicatePacket(con, protocol, seq, packet->data, packet->length, &crc))
+        {
+            debug("Duplicate DATA packet seq %u, re-ACKing\n", seq);
+            freePacket(packet);
+            sendDataLayerPacket(con->serialPort, ACK, con->chanID, con->lastAckSeq, NULL);
+            if (--retries == 0)
+            {
+                errorCode = ERR_SERIAL_TIMEOUT;
+                break;
+            }
+            errorCode = receiveDataLayerPacket(con->serialPort, &protocol, &id, &seq, packet, RETRANSMISSION_TIMEOUT);
+        }
         if (errorCode != SUCCESS)
         {
             // ACK the damn thing anyway
-            sendDataLayerPacket(con->serialPort, ACK, con->chanID, con->lastSeq, NULL, 0);
+            sendDataLayerPacket(con->serialPort, ACK, con->chanID, con->lastSeq, NULL);
         }
         else
         {
-            errorCode = sendDataLayerPacket(con->serialPort, ACK, con->chanID, con->lastSeq, NULL, 0);
+            if (protocol == DATA_TRANSFER)
+            {
+                con->lastRxSeq = seq;
+                con->lastAckSeq = con->lastSeq;
+                con->lastRxLength = packet->length;
+                con->lastRxCrc = crc;
+            }
+            errorCode = sendDataLayerPacket(con->serialPort, ACK, con->chanID, con->lastSeq, NULL);
         }
  //   if (protocol != DATA_TRANSFER)
  //       {
@@ -210,31 +244,32 @@ ERRORCODE receiveTransportData (transportConnection* con, uint8_t** data, uint16
 
 ERRORCODE transportLayerPing (transportConnection* con)
 {
-    ERRORCODE errorCode;
-    uint8_t*  respData;
-    uint16_t  dataLength;
-    uint8_t   protocol;
-    uint8_t   id;
-    uint8_t   seq;
+    ERRORCODE    errorCode;
+    uint8_t      storage[PACKET_ROOM(8)];
+    packetBuffer request;
+    packetBuffer reply;
+    uint8_t      protocol;
+    uint8_t      id;
+    uint8_t      seq;
 
     MOD_INCREMENT(con->lastSeq, 16);
 
-    respData = NULL;
-    dataLength = 0;
+    initPacket(&request, storage, sizeof(storage), 8);
+    memcpy(request.data, "Banana!", 8);
 
-    errorCode = sendDataLayerPacket(con->serialPort, ECHO_REQ, con->chanID, con->lastSeq, (uint8_t*)"Banana!", 8);
+    errorCode = sendDataLayerPacket(con->serialPort, ECHO_REQ, con->chanID, con->lastSeq, &request);
     if (errorCode != SUCCESS)
     {
         return errorCode;
     }
 
     // should receive ECHO_RESP
-    errorCode = receiveDataLayerPacket(con->serialPort, &protocol, &id, &seq, &respData, &dataLength, 1);
-    if (respData)
+    errorCode = receiveDataLayerPacket(con->serialPort, &protocol, &id, &seq, &reply, 1);
+    if (reply.length > 0)
     {
-        debug("Ping response - %s\n", respData);
-        free(respData);
+        debug("Ping response - %.*s\n", (int)reply.length, reply.data);
     }
+    freePacket(&reply);
 
     if (errorCode != SUCCESS)
     {
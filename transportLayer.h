@@ -9,19 +9,24 @@
 #define TRANSPORTLAYER_H_
 
 #include "serial.h"
+#include "packetBuffer.h"
 
 typedef struct _transportConnection
 {
     uint8_t        lastSeq;
     uint8_t        chanID;
     serialSession* serialPort;
+    uint8_t        lastRxSeq;    // seq of the last DATA packet received, 0xFF if none
+    uint8_t        lastAckSeq;   // seq we ACKed it with
+    uint16_t       lastRxLength;
+    uint32_t       lastRxCrc;
 } transportConnection;
 
 ERRORCODE connectTransportLayer    (serialSession*       serialPort, transportConnection* con);
 ERRORCODE transportLayerPing       (transportConnection* con);
 ERRORCODE disconnectTransportLayer (transportConnection* con);
 
-ERRORCODE sendTransportData        (transportConnection* con, uint8_t* data, uint16_t dataLength);
-ERRORCODE receiveTransportData     (transportConnection* con, uint8_t** data, uint16_t* length);
+ERRORCODE sendTransportData        (transportConnection* con, packetBuffer* packet);
+ERRORCODE receiveTransportData     (transportConnection* con, packetBuffer* packet);
 
 #endif /* TRANSPORTLAYER_H_ */
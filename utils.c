@@ -17,7 +17,9 @@
 
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 
+#define ENV_MESSAGE_SIZE 1024
 
+static __thread shuntEnv* threadEnv = NULL;
 
 /*
  * xorBuffer
@@ -70,79 +72,139 @@ ERRORCODE aesEncrypt (uint8_t* dest, const uint8_t* src, const uint8_t* key)
     }
 }
 
+static AES_KEY        nullKey;
+static pthread_once_t nullKeyOnce = PTHREAD_ONCE_INIT;
+
+static void setNullKey (void)
+{
+    uint8_t key[16];
+
+    memset(key, 0, sizeof(key));
+    AES_set_encrypt_key(key, 128, &nullKey);
+}
+
 /*
- * aesPadAndEncryptEcb
+ * generateAesCRC
  *
- * encrypt with aes in ECB mode, right padded with 0x8000....
+ * Calculate an AES-CRC, which is a CBC-MAC with null keys and IV
+ * The null key schedule is only built once, this runs over every
+ * frame
  *
  * Arguments:
- * dest - the destination buffer, at least src + (16 - (length %16)) bytes
- * src  - the source buffer
- * key  - the key to use (presumed 16 bytes)
+ * dest   - the destination buffer, 16 bytes
+ * src    - the source buffer
+ * srcLen - the length of the src buffer, should be a multiple of 16
  */
-ERRORCODE aesPadAndEncryptEcb (uint8_t* dest, const uint8_t* src, const uint16_t length, const uint8_t* key)
+void generateAesCRC (uint8_t* dest, const uint8_t* src, uint32_t srcLen)
 {
-    uint8_t   block[16];
-    uint16_t  ctr;
-    ERRORCODE retCode;
+    uint8_t buffer[16];
+
+    pthread_once(&nullKeyOnce, setNullKey);
+
+    memset(dest, 0, 16);
 
-    for (ctr = 0; ctr < length; ctr += 16)
+    while (srcLen >= 16)
     {
-        if (length - ctr < 16)
-        {
-            memset(block, 0, sizeof(block));
-            memcpy(block, src + ctr, length - ctr);
-            block[length - ctr] = 0x80;
-            retCode = aesEncrypt(dest + ctr, block, key);
-        }
-        else
-        {
-            retCode = aesEncrypt(dest + ctr, src + ctr, key);
-        }
-        if (retCode != SUCCESS)
+        xorBuffer(buffer, src, dest, 16);
+        AES_encrypt(buffer, dest, &nullKey);
+        srcLen -= 16;
+        src += 16;
+    }
+
+    if (srcLen)
+    {
+        memset(buffer, 0, 16);
+        memcpy(buffer, src, srcLen);
+        xorBuffer(buffer, buffer, dest, 16);
+        AES_encrypt(buffer, dest, &nullKey);
+    }
+}
+
+static uint32_t       crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void buildCrcTable (void)
+{
+    uint32_t crc;
+    uint16_t entry;
+    uint8_t  bit;
+
+    for (entry = 0; entry < 256; entry++)
+    {
+        crc = entry;
+        for (bit = 0; bit < 8; bit++)
         {
-            break;
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
         }
+        crcTable[entry] = crc;
     }
-    return retCode;
 }
 
 /*
- * generateAesCRC
+ * generateCrc32
  *
- * Calculate an AES-CRC, which is a CBC-MAC with null keys and IV
+ * Standard (IEEE 802.3) CRC32, matching the hashing RCS
  *
  * Arguments:
- * dest   - the destination buffer, 16 bytes
+ * crc    - 0 to start, or a previous result to carry on from
  * src    - the source buffer
- * srcLen - the length of the src buffer, should be a multiple of 16
+ * srcLen - the length of the src buffer
+ *
+ * Returns: the CRC
  */
-void generateAesCRC (uint8_t* dest, const uint8_t* src, uint32_t srcLen)
+uint32_t generateCrc32 (uint32_t crc, const uint8_t* src, uint32_t srcLen)
 {
-    uint8_t buffer[16];
-    uint8_t key[16];
+    pthread_once(&crcTableOnce, buildCrcTable);
 
-    memset(dest, 0, 16);
-    memset(key, 0, 16);
+    crc = ~crc;
+    while (srcLen--)
+    {
+        crc = crcTable[(crc ^ *src++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*
+ * parseHex
+ *
+ * turn a string of hex digits into bytes
+ *
+ * Arguments:
+ * dest   - destination buffer
+ * text   - the hex digits, exactly 2 * length of them
+ * length - number of bytes to produce
+ *
+ * Returns: SUCCESS or ERR_VALIDATION if text isn't length bytes of hex
+ */
+ERRORCODE parseHex (uint8_t* dest, const char* text, uint32_t length)
+{
+    uint32_t index;
+    uint8_t  nibble;
+    char     digit;
 
-    while (srcLen)
+    for (index = 0; index < length * 2; index++)
     {
-        memset(buffer, 0, 16);
-        if (srcLen < 16)
+        digit = text[index];
+        if ((digit >= '0') && (digit <= '9'))
+        {
+            nibble = digit - '0';
+        }
+        else if ((digit >= 'a') && (digit <= 'f'))
+        {
+            nibble = digit - 'a' + 10;
+        }
+        else if ((digit >= 'A') && (digit <= 'F'))
         {
-            memcpy(buffer, src, srcLen);
-            srcLen = 0;
+            nibble = digit - 'A' + 10;
         }
         else
         {
-            memcpy(buffer, src, 16);
-            srcLen -= 16;
-            src += 16;
+            return ERR_VALIDATION;
         }
-
-        xorBuffer(buffer, buffer, dest, 16);
-        aesEncrypt(dest, buffer, key);
+        dest[index / 2] = (index & 1) ? (dest[index / 2] | nibble) : (nibble << 4);
     }
+
+    return (text[index] == 0) ? SUCCESS : ERR_VALIDATION;
 }
 
 /*
@@ -150,12 +212,12 @@ void generateAesCRC (uint8_t* dest, const uint8_t* src, uint32_t srcLen)
  *
  * Dump out hex in a friendly format
  */
-void hexDump(uint8_t* buf, uint32_t length)
+void hexDump(const uint8_t* buf, uint32_t length)
 {
     uint32_t ctr = 0;
     uint32_t lctr = 0;
 
-    unsigned char hexbuf[67];
+    char hexbuf[67];
     memset(hexbuf,' ',66);
     hexbuf[66]=0;
 
@@ -169,32 +231,97 @@ void hexDump(uint8_t* buf, uint32_t length)
         if (!(ctr%8)) lctr++;
         if (!(ctr%16))
         {
-            printf("%s\n",hexbuf);
+            output("%s\n",hexbuf);
             lctr=0;
             memset(hexbuf,' ',66);
         }
         buf++;
         length--;
     }
-    if (ctr%16){printf("%s\n",hexbuf); lctr=0;}
+    if (ctr%16){output("%s\n",hexbuf); lctr=0;}
+}
+
+/*
+ * useShuntEnv
+ *
+ * Work for a different caller on this thread. Returns the environment
+ * this replaces, so a library call can put it back on the way out.
+ */
+shuntEnv* useShuntEnv(shuntEnv* env)
+{
+    shuntEnv* previous = threadEnv;
+
+    threadEnv = env;
+    return previous;
+}
+
+/*
+ * currentEnv
+ *
+ * The environment this thread is working for, NULL for none
+ */
+shuntEnv* currentEnv(void)
+{
+    return threadEnv;
 }
 
 /*
- * hexFake
+ * shuntOutput
  *
- * don't dump out anything!
+ * A message for the user, through the output callback
  */
-void hexFake(__attribute__((unused)) uint8_t* buf, __attribute__((unused)) uint32_t length)
+void shuntOutput(const char* fmt, ...)
 {
+    char    message[ENV_MESSAGE_SIZE];
+    va_list args;
+
+    if (!threadEnv || !threadEnv->outputFunc)
+    {
+        return;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
 
+    threadEnv->outputFunc(threadEnv->user, message);
 }
 
 /*
- * debugFake
+ * shuntDebug
  *
- * a fake debug routine that does nothing
+ * Debug trace, through the debug callback. Not formatted at all unless
+ * someone is listening.
  */
-int debugFake(__attribute__((unused)) const char* fmt, ...)
+void shuntDebug(const char* fmt, ...)
+{
+    char    message[ENV_MESSAGE_SIZE];
+    va_list args;
+
+    if (!threadEnv || !threadEnv->debugFunc)
+    {
+        return;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    threadEnv->debugFunc(threadEnv->user, message);
+}
+
+void shuntHexDebug(const uint8_t* data, uint32_t length)
+{
+    if (threadEnv && threadEnv->hexDebugFunc)
+    {
+        threadEnv->hexDebugFunc(threadEnv->user, data, length);
+    }
+}
+
+void shuntProgress(uint32_t done, uint32_t total)
 {
-    return 0;
+    if (threadEnv && threadEnv->progressFunc)
+    {
+        threadEnv->progressFunc(threadEnv->user, done, total);
+    }
 }